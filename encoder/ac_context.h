@@ -49,13 +49,13 @@ static constexpr uint8_t kCompactBlockContextMap[] = {
 };
 static constexpr uint8_t kBlockContextMap[] = {
     // X
-    2, 0, 0, 0, 0, 0, 3, 3, 0, 0, 0, 0, 0, 0,  //
+    2, 0, 0, 0, 0, 2, 3, 3, 0, 0, 0, 0, 0, 0,  //
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     //
     // Y
     0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0,  //
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     //
     // B
-    2, 0, 0, 0, 0, 0, 3, 3, 0, 0, 0, 0, 0, 0,  //
+    2, 0, 0, 0, 0, 2, 3, 3, 0, 0, 0, 0, 0, 0,  //
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     //
 };
 static constexpr size_t kNumAcStrategyCodes = 27;
@@ -27,8 +27,8 @@
 
 namespace jxl {
 
-static constexpr size_t kMaxCoeffDim = 2 * kBlockDim;
-static constexpr size_t kMaxCoeffArea = 2 * kDCTBlockSize;
+static constexpr size_t kMaxCoeffDim = 4 * kBlockDim;
+static constexpr size_t kMaxCoeffArea = 16 * kDCTBlockSize;
 static_assert((kMaxCoeffArea * sizeof(float)) % hwy::kMaxVectorSize == 0,
               "Coefficient area is not a multiple of vector size");
 
@@ -40,6 +40,7 @@ class AcStrategy {
     DCT = 0,
     DCT16X8 = 1,
     DCT8X16 = 2,
+    DCT32X32 = 3,
     kNumValidStrategies
   };
 
@@ -57,7 +58,7 @@ class AcStrategy {
   }
 
   JXL_INLINE uint8_t StrategyCode() const {
-    constexpr uint8_t kLut[] = {0, 6, 7};
+    constexpr uint8_t kLut[] = {0, 6, 7, 5};
     return kLut[RawStrategy()];
   }
 
@@ -79,21 +80,21 @@ class AcStrategy {
   // Number of 8x8 blocks that this strategy will cover. 0 for non-top-left
   // blocks inside a multi-block transform.
   JXL_INLINE size_t covered_blocks_x() const {
-    static constexpr uint8_t kLut[] = {1, 1, 2};
+    static constexpr uint8_t kLut[] = {1, 1, 2, 4};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
   }
 
   JXL_INLINE size_t covered_blocks_y() const {
-    static constexpr uint8_t kLut[] = {1, 2, 1};
+    static constexpr uint8_t kLut[] = {1, 2, 1, 4};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
   }
 
   JXL_INLINE size_t log2_covered_blocks() const {
-    static constexpr uint8_t kLut[] = {0, 1, 1};
+    static constexpr uint8_t kLut[] = {0, 1, 1, 4};
     static_assert(sizeof(kLut) / sizeof(*kLut) == kNumValidStrategies,
                   "Update LUT");
     return kLut[size_t(strategy_)];
@@ -139,6 +140,9 @@ class AcStrategyImage {
 
   void FillInvalid() { FillImage(INVALID, &layers_); }
 
+  // Reduces the visible size without reallocating, see PlaneBase::ShrinkTo.
+  void ShrinkTo(size_t xsize, size_t ysize) { layers_.ShrinkTo(xsize, ysize); }
+
   void Set(size_t x, size_t y, AcStrategy::Type type) {
 #if JXL_ENABLE_ASSERT
     AcStrategy acs = AcStrategy::FromRawStrategy(type);
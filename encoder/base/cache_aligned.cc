@@ -12,7 +12,18 @@
 // Disabled: slower than malloc + alignment.
 #define JXL_USE_MMAP 0
 
-#if JXL_USE_MMAP
+// Keeps freed blocks in a per-thread cache for reuse by later allocations.
+#define JXL_USE_BLOCK_CACHE 1
+
+// Backs the large allocations with huge pages if asked to, see
+// SetLargePageMode.
+#ifdef __linux__
+#define JXL_USE_HUGE_PAGES 1
+#else
+#define JXL_USE_HUGE_PAGES 0
+#endif
+
+#if JXL_USE_MMAP || JXL_USE_HUGE_PAGES
 #include <sys/mman.h>
 #endif
 
@@ -20,17 +31,30 @@
 #include <atomic>
 #include <hwy/base.h>  // kMaxVectorSize
 #include <limits>
+#include <mutex>  //NOLINT
+#include <vector>
 
+#include "encoder/base/bits.h"
 #include "encoder/base/printf_macros.h"
 #include "encoder/base/status.h"
 
 namespace jxl {
 namespace {
 
+// Where the memory of an allocation comes from.
+enum class Backing : uint8_t {
+  kMalloc,
+  // A mapping of its own, see LargePages.
+  kMapped,
+  // Pages of the preallocated region of LargePages.
+  kRegion,
+};
+
 #pragma pack(push, 1)
 struct AllocationHeader {
   void* allocated;
   size_t allocated_size;
+  Backing backing;
   uint8_t left_padding[hwy::kMaxVectorSize];
 };
 #pragma pack(pop)
@@ -38,6 +62,200 @@ struct AllocationHeader {
 std::atomic<uint64_t> num_allocations{0};
 std::atomic<uint64_t> bytes_in_use{0};
 std::atomic<uint64_t> max_bytes_in_use{0};
+// Bytes of the freed blocks in the BlockCache of all threads.
+std::atomic<uint64_t> total_cached_bytes{0};
+
+#if JXL_USE_BLOCK_CACHE
+// Freed blocks of one thread, reused by later allocations of the same thread.
+// This avoids the malloc/free and page fault cost of the large images and
+// buffers that are allocated again for every group or image. The caches of
+// all threads together hold at most kMaxCachedBytes, so that the memory kept
+// does not grow with the number of threads.
+class BlockCache {
+ public:
+  // Smaller blocks are cheap enough to get from malloc, larger ones are rare.
+  static constexpr size_t kMinSizeLog2 = 12;
+  static constexpr size_t kMaxSizeLog2 = 26;
+  // Four size classes per power of two, so that at most 25% is wasted.
+  static constexpr size_t kClassesPerLog2Bits = 2;
+  static constexpr size_t kClassesPerLog2 = size_t(1) << kClassesPerLog2Bits;
+  static constexpr size_t kNumClasses =
+      (kMaxSizeLog2 - kMinSizeLog2) * kClassesPerLog2 + 1;
+  // Of all threads together.
+  static constexpr size_t kMaxCachedBytes = size_t(1) << 27;
+
+  ~BlockCache() {
+    for (std::vector<void*>& blocks : blocks_) {
+      for (void* block : blocks) free(block);
+      blocks.clear();
+    }
+    total_cached_bytes.fetch_sub(cached_bytes_, std::memory_order_relaxed);
+    cached_bytes_ = 0;
+    destroyed_ = true;
+  }
+
+  // Returns a size class index for allocations of `size` bytes and rounds up
+  // *size to the size of the class, or returns kNumClasses if allocations of
+  // this size are not cached.
+  static size_t SizeClass(size_t* size) {
+    if (*size < (size_t(1) << kMinSizeLog2) ||
+        *size > (size_t(1) << kMaxSizeLog2)) {
+      return kNumClasses;
+    }
+    const size_t step =
+        (size_t(1) << FloorLog2Nonzero(*size)) / kClassesPerLog2;
+    *size = (*size + step - 1) / step * step;
+    const size_t size_log2 = FloorLog2Nonzero(*size);
+    const size_t sub_class =
+        (*size >> (size_log2 - kClassesPerLog2Bits)) & (kClassesPerLog2 - 1);
+    return (size_log2 - kMinSizeLog2) * kClassesPerLog2 + sub_class;
+  }
+
+  void* Take(size_t size_class, size_t size) {
+    if (destroyed_ || blocks_[size_class].empty()) return nullptr;
+    void* block = blocks_[size_class].back();
+    blocks_[size_class].pop_back();
+    cached_bytes_ -= size;
+    total_cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+    return block;
+  }
+
+  // Returns false if the block was not taken and must be freed.
+  bool Put(void* block, size_t size) {
+    size_t class_size = size;
+    const size_t size_class = SizeClass(&class_size);
+    // Only blocks allocated with the rounded up size are reusable.
+    if (destroyed_ || size_class == kNumClasses || class_size != size) {
+      return false;
+    }
+    if (total_cached_bytes.fetch_add(size, std::memory_order_relaxed) + size >
+        kMaxCachedBytes) {
+      total_cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+      return false;
+    }
+    blocks_[size_class].push_back(block);
+    cached_bytes_ += size;
+    return true;
+  }
+
+ private:
+  std::vector<void*> blocks_[kNumClasses];
+  size_t cached_bytes_ = 0;
+  bool destroyed_ = false;
+};
+
+thread_local BlockCache block_cache;
+#endif  // JXL_USE_BLOCK_CACHE
+
+#if JXL_USE_HUGE_PAGES
+// Huge page backing of the large allocations of the whole process.
+class LargePages {
+ public:
+  static constexpr size_t kPageSize = kLargeAllocationBytes;
+
+  PageMode mode() const { return mode_.load(std::memory_order_acquire); }
+
+  bool SetMode(PageMode mode, size_t region_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_used_pages_ != 0) return false;
+    if (region_ != nullptr) {
+      munmap(region_, used_pages_.size() * kPageSize);
+      region_ = nullptr;
+      used_pages_.clear();
+    }
+    mode_.store(PageMode::kDefault, std::memory_order_release);
+    if (mode == PageMode::kDefault || region_bytes == 0) {
+      mode_.store(mode, std::memory_order_release);
+      return true;
+    }
+    const size_t num_pages = (region_bytes + kPageSize - 1) / kPageSize;
+    region_ = static_cast<uint8_t*>(Map(num_pages * kPageSize, mode));
+    if (region_ == nullptr) return false;
+    // Faults in the whole region now, instead of in the first images.
+    for (size_t i = 0; i < num_pages * kPageSize; i += kSmallPageSize) {
+      region_[i] = 0;
+    }
+    used_pages_.assign(num_pages, false);
+    mode_.store(mode, std::memory_order_release);
+    return true;
+  }
+
+  // Returns null or a block of *size bytes, rounded up to whole huge pages,
+  // and where it comes from.
+  void* Allocate(size_t* size, Backing* backing) {
+    const size_t num_pages = (*size + kPageSize - 1) / kPageSize;
+    *size = num_pages * kPageSize;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // First fit, the region only holds a few large images and buffers.
+      size_t run = 0;
+      for (size_t i = 0; i < used_pages_.size(); ++i) {
+        run = used_pages_[i] ? 0 : run + 1;
+        if (run < num_pages) continue;
+        const size_t first = i + 1 - num_pages;
+        std::fill(used_pages_.begin() + first, used_pages_.begin() + i + 1,
+                  true);
+        num_used_pages_ += num_pages;
+        *backing = Backing::kRegion;
+        return region_ + first * kPageSize;
+      }
+    }
+    *backing = Backing::kMapped;
+    return Map(*size, mode());
+  }
+
+  void Free(void* block, size_t size, Backing backing) {
+    if (backing == Backing::kMapped) {
+      munmap(block, size);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t first = (static_cast<uint8_t*>(block) - region_) / kPageSize;
+    const size_t num_pages = size / kPageSize;
+    std::fill(used_pages_.begin() + first,
+              used_pages_.begin() + first + num_pages, false);
+    num_used_pages_ -= num_pages;
+  }
+
+ private:
+  static constexpr size_t kSmallPageSize = 4096;
+
+  // Returns null or a mapping of `size` bytes, a multiple of kPageSize, that
+  // is aligned to kPageSize, which transparent huge pages require.
+  static void* Map(size_t size, PageMode mode) {
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (mode == PageMode::kExplicitHugePages) {
+      void* mapped = mmap(nullptr, size, prot, flags | MAP_HUGETLB, -1, 0);
+      if (mapped != MAP_FAILED) return mapped;
+    }
+    // Maps one more huge page and unmaps the unaligned ends.
+    void* mapped = mmap(nullptr, size + kPageSize, prot, flags, -1, 0);
+    if (mapped == MAP_FAILED) return nullptr;
+    const uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+    const uintptr_t aligned = (start + kPageSize - 1) & ~(kPageSize - 1);
+    if (aligned != start) munmap(mapped, aligned - start);
+    munmap(reinterpret_cast<void*>(aligned + size),
+           start + kPageSize - aligned);
+    void* block = reinterpret_cast<void*>(aligned);
+    // Only a hint, the mapping works with regular pages if it fails.
+    madvise(block, size, MADV_HUGEPAGE);
+    return block;
+  }
+
+  std::atomic<PageMode> mode_{PageMode::kDefault};
+  std::mutex mutex_;
+  uint8_t* region_ = nullptr;
+  std::vector<bool> used_pages_;
+  size_t num_used_pages_ = 0;
+};
+
+// Never destroyed, so that it outlives the allocations of static objects.
+LargePages& GetLargePages() {
+  static LargePages* large_pages = new LargePages();
+  return *large_pages;
+}
+#endif  // JXL_USE_HUGE_PAGES
 
 }  // namespace
 
@@ -77,9 +295,27 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
       mmap(nullptr, allocated_size, PROT_READ | PROT_WRITE, flags, -1, 0);
   if (allocated == MAP_FAILED) return nullptr;
   const uintptr_t aligned = reinterpret_cast<uintptr_t>(allocated);
+  const Backing backing = Backing::kMapped;
 #else
-  const size_t allocated_size = kAlias + offset + payload_size;
-  void* allocated = malloc(allocated_size);
+  size_t allocated_size = kAlias + offset + payload_size;
+  Backing backing = Backing::kMalloc;
+  void* allocated = nullptr;
+#if JXL_USE_HUGE_PAGES
+  if (allocated_size >= kLargeAllocationBytes &&
+      GetLargePages().mode() != PageMode::kDefault) {
+    allocated = GetLargePages().Allocate(&allocated_size, &backing);
+    if (allocated == nullptr) return nullptr;
+  }
+#endif
+  if (backing == Backing::kMalloc) {
+#if JXL_USE_BLOCK_CACHE
+    const size_t size_class = BlockCache::SizeClass(&allocated_size);
+    if (size_class != BlockCache::kNumClasses) {
+      allocated = block_cache.Take(size_class, allocated_size);
+    }
+#endif
+    if (allocated == nullptr) allocated = malloc(allocated_size);
+  }
   if (allocated == nullptr) return nullptr;
   // Always round up even if already aligned - we already asked for kAlias
   // extra bytes and there's no way to give them back.
@@ -124,6 +360,7 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   AllocationHeader* header = reinterpret_cast<AllocationHeader*>(payload) - 1;
   header->allocated = allocated;
   header->allocated_size = allocated_size;
+  header->backing = backing;
 
   return JXL_ASSUME_ALIGNED(reinterpret_cast<void*>(payload), 64);
 }
@@ -144,8 +381,40 @@ void CacheAligned::Free(const void* aligned_pointer) {
 #if JXL_USE_MMAP
   munmap(header->allocated, header->allocated_size);
 #else
+#if JXL_USE_HUGE_PAGES
+  if (header->backing != Backing::kMalloc) {
+    GetLargePages().Free(header->allocated, header->allocated_size,
+                         header->backing);
+    return;
+  }
+#endif
+#if JXL_USE_BLOCK_CACHE
+  if (block_cache.Put(header->allocated, header->allocated_size)) return;
+#endif
   free(header->allocated);
 #endif
 }
 
+bool SetLargePageMode(PageMode mode, size_t region_bytes) {
+#if JXL_USE_HUGE_PAGES
+  return GetLargePages().SetMode(mode, region_bytes);
+#else
+  return mode == PageMode::kDefault;
+#endif
+}
+
+MemoryStats GetMemoryStats() {
+  MemoryStats stats;
+  stats.num_allocations = num_allocations.load(std::memory_order_relaxed);
+  stats.bytes_in_use = bytes_in_use.load(std::memory_order_acquire);
+  stats.max_bytes_in_use = max_bytes_in_use.load(std::memory_order_acquire);
+  stats.cached_bytes = total_cached_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void ResetMaxBytesInUse() {
+  max_bytes_in_use.store(bytes_in_use.load(std::memory_order_acquire),
+                         std::memory_order_release);
+}
+
 }  // namespace jxl
@@ -45,6 +45,51 @@ class CacheAligned {
   static void Free(const void* aligned_pointer);
 };
 
+// Backing of the large CacheAligned allocations, see SetLargePageMode.
+enum class PageMode {
+  // Regular pages from malloc.
+  kDefault,
+  // Transparent huge pages, i.e. mappings aligned to huge pages and advised
+  // with madvise(MADV_HUGEPAGE).
+  kTransparentHugePages,
+  // Huge pages reserved by the system (MAP_HUGETLB), or transparent huge pages
+  // if there are not enough of them.
+  kExplicitHugePages,
+};
+
+// Allocations of at least this many bytes are large, a huge page on x86.
+static constexpr size_t kLargeAllocationBytes = size_t(1) << 21;
+
+// Selects the backing of the large CacheAligned allocations that follow, for
+// the whole process, which takes one TLB entry for each huge page of the
+// large images and buffers instead of one for each 4 kB. With region_bytes,
+// they are first carved out of a region of that many bytes that is mapped
+// and faulted in once, so that the following images do not page fault at
+// all. The blocks that do not fit in the region are mapped on their own.
+// Returns false if the mode is not supported on this platform, if the region
+// could not be mapped, or if the region of a previous call still holds
+// allocations, in which case nothing changes.
+bool SetLargePageMode(PageMode mode, size_t region_bytes = 0);
+
+// Counters of the CacheAligned allocations of the whole process, which hold the
+// images and byte buffers of all encoders. The bytes include the alignment
+// padding, but not the freed blocks that are kept for reuse.
+struct MemoryStats {
+  uint64_t num_allocations;
+  uint64_t bytes_in_use;
+  // Since the start of the process or the last ResetMaxBytesInUse call.
+  uint64_t max_bytes_in_use;
+  // Freed blocks that the threads keep for reuse by their later allocations,
+  // at most 128 MB for the whole process.
+  uint64_t cached_bytes;
+};
+
+MemoryStats GetMemoryStats();
+
+// Lowers max_bytes_in_use to the current bytes_in_use, so that it measures the
+// peak of the allocations that follow.
+void ResetMaxBytesInUse();
+
 // Avoids the need for a function pointer (deleter) in CacheAlignedUniquePtr.
 struct CacheAlignedDeleter {
   void operator()(uint8_t* aligned_pointer) const {
@@ -6,7 +6,155 @@
 
 #include "encoder/base/data_parallel.h"
 
+#include <stdio.h>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 namespace jxl {
+namespace {
+
+// Number of times an idle thread polls for new work before it parks on a
+// condition variable.
+constexpr uint32_t kSpinIterations = 2000;
+
+// The runner and worker index of the current thread, if it is a worker thread.
+thread_local const ThreadParallelRunner* current_runner = nullptr;
+thread_local int current_thread = 0;
+
+inline void SpinPause() {
+#if (JXL_COMPILER_GCC || JXL_COMPILER_CLANG) && \
+    (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+#if defined(__linux__)
+// Returns the CPUs of the process, grouped by NUMA node. If the nodes are not
+// known, all CPUs are in one node.
+std::vector<std::vector<int>> CpusByNode() {
+  std::vector<std::vector<int>> nodes;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+  std::vector<bool> assigned(CPU_SETSIZE);
+  for (int node = 0;; ++node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE* f = fopen(path, "r");
+    if (!f) break;
+    // Comma-separated list of CPUs and ranges of CPUs, e.g. 0-3,8-11.
+    std::vector<int> cpus;
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+      last = first;
+      int c = fgetc(f);
+      if (c == '-') {
+        if (fscanf(f, "%d", &last) != 1) break;
+        c = fgetc(f);
+      }
+      for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+        if (cpu >= 0 && CPU_ISSET(cpu, &allowed) && !assigned[cpu]) {
+          cpus.push_back(cpu);
+          assigned[cpu] = true;
+        }
+      }
+      if (c != ',') break;
+    }
+    fclose(f);
+    if (!cpus.empty()) nodes.push_back(cpus);
+  }
+  std::vector<int> rest;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && !assigned[cpu]) rest.push_back(cpu);
+  }
+  if (!rest.empty()) nodes.push_back(rest);
+  return nodes;
+}
+
+void PinCurrentThread(const std::vector<int>& cpus) {
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) CPU_SET(cpu, &set);
+  // Best effort, e.g. a container may not allow it.
+  (void)sched_setaffinity(0, sizeof(set), &set);
+}
+#else
+std::vector<std::vector<int>> CpusByNode() { return {}; }
+void PinCurrentThread(const std::vector<int>& cpus) {}
+#endif
+
+// Returns the CPUs of each of num_workers workers with the given affinity.
+std::vector<std::vector<int>> WorkerCpus(
+    ThreadParallelRunner::Affinity affinity, uint32_t num_workers) {
+  using Affinity = ThreadParallelRunner::Affinity;
+  std::vector<std::vector<int>> worker_cpus(num_workers);
+  if (affinity == Affinity::kNone || num_workers == 0) return worker_cpus;
+  const std::vector<std::vector<int>> nodes = CpusByNode();
+  if (nodes.empty()) return worker_cpus;
+  std::vector<int> all_cpus;
+  for (const std::vector<int>& cpus : nodes) {
+    all_cpus.insert(all_cpus.end(), cpus.begin(), cpus.end());
+  }
+  for (uint32_t i = 0; i < num_workers; ++i) {
+    if (affinity == Affinity::kCores) {
+      worker_cpus[i].push_back(all_cpus[i % all_cpus.size()]);
+    } else {
+      worker_cpus[i] = nodes[static_cast<uint64_t>(i) * nodes.size() /
+                             num_workers];
+    }
+  }
+  return worker_cpus;
+}
+
+inline uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return (static_cast<uint64_t>(begin) << 32) + end;
+}
+
+// Takes the first task of *range, returns false if *range is empty.
+bool PopFront(std::atomic<uint64_t>* range, uint32_t* task) {
+  uint64_t packed = range->load(std::memory_order_acquire);
+  for (;;) {
+    const uint32_t begin = packed >> 32;
+    const uint32_t end = packed & 0xFFFFFFFF;
+    if (begin >= end) return false;
+    if (range->compare_exchange_weak(packed, PackRange(begin + 1, end),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      *task = begin;
+      return true;
+    }
+  }
+}
+
+// Takes the second half (rounded up) of *range, returns false if *range is
+// empty.
+bool StealBack(std::atomic<uint64_t>* range, uint32_t* stolen_begin,
+               uint32_t* stolen_end) {
+  uint64_t packed = range->load(std::memory_order_acquire);
+  for (;;) {
+    const uint32_t begin = packed >> 32;
+    const uint32_t end = packed & 0xFFFFFFFF;
+    if (begin >= end) return false;
+    const uint32_t mid = end - (end - begin + 1) / 2;
+    if (range->compare_exchange_weak(packed, PackRange(begin, mid),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      *stolen_begin = mid;
+      *stolen_end = end;
+      return true;
+    }
+  }
+}
+
+}  // namespace
 
 // static
 JxlParallelRetCode ThreadParallelRunner::Runner(
@@ -30,10 +178,28 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     return 0;
   }
 
+  if (current_runner == self) {
+    // Called from a data_func of an outer Run.
+    self->RunNested(func, jpegxl_opaque, start_range, end_range,
+                    current_thread);
+    return 0;
+  }
+
   if (self->depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
     return -1;  // Must not re-enter.
   }
 
+  self->data_func_ = func;
+  self->jpegxl_opaque_ = jpegxl_opaque;
+
+  if (self->schedule_ == Schedule::kWorkStealing) {
+    self->RunWorkStealing(start_range, end_range);
+    if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
+      return -1;
+    }
+    return 0;
+  }
+
   const WorkerCommand worker_command =
       (static_cast<WorkerCommand>(start_range) << 32) + end_range;
   // Ensure the inputs do not result in a reserved command.
@@ -41,8 +207,6 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   JXL_ASSERT(worker_command != kWorkerOnce);
   JXL_ASSERT(worker_command != kWorkerExit);
 
-  self->data_func_ = func;
-  self->jpegxl_opaque_ = jpegxl_opaque;
   self->num_reserved_.store(0, std::memory_order_relaxed);
 
   self->StartWorkers(worker_command);
@@ -97,9 +261,200 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
   }
 }
 
+void ThreadParallelRunner::RunWorkStealing(const uint32_t begin,
+                                           const uint32_t end) {
+  const uint32_t num_tasks = end - begin;
+  for (uint32_t i = 0; i < num_worker_threads_; ++i) {
+    const uint32_t my_begin =
+        begin + static_cast<uint64_t>(num_tasks) * i / num_worker_threads_;
+    const uint32_t my_end =
+        begin + static_cast<uint64_t>(num_tasks) * (i + 1) / num_worker_threads_;
+    ranges_[i].range.store(PackRange(my_begin, my_end),
+                           std::memory_order_relaxed);
+  }
+  num_active_.store(num_worker_threads_, std::memory_order_relaxed);
+  num_busy_.store(num_worker_threads_, std::memory_order_relaxed);
+  worker_start_command_ = PackRange(begin, end);
+
+  // Publishes the above to the workers. The parked count is read after the
+  // generation is incremented and the workers increment it before they
+  // re-check the generation, so either they see the new generation or we see
+  // that they need to be notified.
+  generation_.fetch_add(1, std::memory_order_seq_cst);
+  if (num_parked_.load(std::memory_order_seq_cst) != 0) {
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    worker_start_cv_.notify_all();
+  }
+
+  // Wait for all workers to finish, spin first because most Runs are short.
+  for (uint32_t spin = 0; spin < kSpinIterations; ++spin) {
+    if (num_active_.load(std::memory_order_acquire) == 0) return;
+    SpinPause();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  main_parked_.store(true, std::memory_order_seq_cst);
+  while (num_active_.load(std::memory_order_seq_cst) != 0) {
+    workers_ready_cv_.wait(lock);
+  }
+  main_parked_.store(false, std::memory_order_relaxed);
+}
+
+// static
+void ThreadParallelRunner::RunAndSteal(ThreadParallelRunner* self,
+                                       const int thread) {
+  std::atomic<uint64_t>* my_range = &self->ranges_[thread].range;
+  const uint32_t num_worker_threads = self->num_worker_threads_;
+  for (;;) {
+    uint32_t task;
+    while (PopFront(my_range, &task)) {
+      self->data_func_(self->jpegxl_opaque_, task, thread);
+    }
+    // Own range is empty, steal from the others starting at the next thread.
+    bool stolen = false;
+    for (uint32_t i = 1; i < num_worker_threads && !stolen; ++i) {
+      const uint32_t victim = (thread + i) % num_worker_threads;
+      uint32_t stolen_begin, stolen_end;
+      if (StealBack(&self->ranges_[victim].range, &stolen_begin,
+                    &stolen_end)) {
+        my_range->store(PackRange(stolen_begin, stolen_end),
+                        std::memory_order_release);
+        stolen = true;
+      }
+    }
+    // Tasks are never added to the ranges during a Run, so if every range was
+    // empty, the remaining tasks are all being run by other threads.
+    if (!stolen) break;
+  }
+  // Help with the nested Runs of the other workers until they are all done.
+  self->num_busy_.fetch_sub(1, std::memory_order_acq_rel);
+  for (uint32_t spin = 0;;) {
+    if (self->HelpNestedJob(thread)) {
+      spin = 0;
+      continue;
+    }
+    if (self->num_busy_.load(std::memory_order_acquire) == 0 &&
+        self->num_nested_jobs_.load(std::memory_order_acquire) == 0) {
+      return;
+    }
+    if (++spin < kSpinIterations) {
+      SpinPause();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void ThreadParallelRunner::RunNested(JxlParallelRunFunction func,
+                                     void* jpegxl_opaque, const uint32_t begin,
+                                     const uint32_t end, const int thread) {
+  if (schedule_ != Schedule::kWorkStealing) {
+    // The other workers are not looking for work, so run everything here.
+    for (uint32_t task = begin; task < end; ++task) {
+      func(jpegxl_opaque, task, thread);
+    }
+    return;
+  }
+  NestedJob job;
+  job.func = func;
+  job.jpegxl_opaque = jpegxl_opaque;
+  job.range.store(PackRange(begin, end), std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(nested_mutex_);
+    job.next = nested_jobs_;
+    nested_jobs_ = &job;
+    num_nested_jobs_.fetch_add(1, std::memory_order_release);
+  }
+  uint32_t task;
+  while (PopFront(&job.range, &task)) {
+    func(jpegxl_opaque, task, thread);
+  }
+  // Wait for the helpers to finish their tasks, then unlink the job. Helpers
+  // only join under nested_mutex_, so none can join after the last check.
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(nested_mutex_);
+      if (job.num_helpers.load(std::memory_order_acquire) == 0) {
+        NestedJob** link = &nested_jobs_;
+        while (*link != &job) link = &(*link)->next;
+        *link = job.next;
+        num_nested_jobs_.fetch_sub(1, std::memory_order_release);
+        return;
+      }
+    }
+    SpinPause();
+  }
+}
+
+bool ThreadParallelRunner::HelpNestedJob(const int thread) {
+  if (num_nested_jobs_.load(std::memory_order_acquire) == 0) return false;
+  NestedJob* job = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(nested_mutex_);
+    for (NestedJob* j = nested_jobs_; j != nullptr; j = j->next) {
+      const uint64_t packed = j->range.load(std::memory_order_acquire);
+      if ((packed >> 32) < (packed & 0xFFFFFFFF)) {
+        job = j;
+        job->num_helpers.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+    }
+  }
+  if (job == nullptr) return false;
+  uint32_t task;
+  while (PopFront(&job->range, &task)) {
+    job->func(job->jpegxl_opaque, task, thread);
+  }
+  job->num_helpers.fetch_sub(1, std::memory_order_release);
+  return true;
+}
+
+// static
+void ThreadParallelRunner::WorkStealingThreadFunc(ThreadParallelRunner* self,
+                                                  const int thread) {
+  uint64_t seen_generation = 0;
+  for (;;) {
+    // Wait for the next Run, spin first and then park.
+    uint64_t generation;
+    for (uint32_t spin = 0;; ++spin) {
+      generation = self->generation_.load(std::memory_order_acquire);
+      if (generation != seen_generation) break;
+      if (spin < kSpinIterations) {
+        SpinPause();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(self->mutex_);
+      self->num_parked_.fetch_add(1, std::memory_order_seq_cst);
+      while ((generation = self->generation_.load(
+                  std::memory_order_seq_cst)) == seen_generation) {
+        self->worker_start_cv_.wait(lock);
+      }
+      self->num_parked_.fetch_sub(1, std::memory_order_relaxed);
+      break;
+    }
+    seen_generation = generation;
+    if (self->worker_start_command_ == kWorkerExit) return;
+
+    RunAndSteal(self, thread);
+
+    // The last worker to finish wakes up the main thread if it is parked.
+    if (self->num_active_.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+        self->main_parked_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      self->workers_ready_cv_.notify_one();
+    }
+  }
+}
+
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
                                       const int thread) {
+  current_runner = self;
+  current_thread = thread;
+  PinCurrentThread(self->worker_cpus_[thread]);
+  if (self->schedule_ == Schedule::kWorkStealing) {
+    WorkStealingThreadFunc(self, thread);
+    return;
+  }
   // Until kWorkerExit command received:
   for (;;) {
     std::unique_lock<std::mutex> lock(self->mutex_);
@@ -128,10 +483,17 @@ void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
   }
 }
 
-ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
-    : num_worker_threads_(num_worker_threads),
-      num_threads_(std::max(num_worker_threads, 1)) {
+ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads,
+                                           const Schedule schedule,
+                                           const Affinity affinity)
+    : worker_cpus_(WorkerCpus(affinity, num_worker_threads)),
+      num_worker_threads_(num_worker_threads),
+      num_threads_(std::max(num_worker_threads, 1)),
+      schedule_(schedule) {
   threads_.reserve(num_worker_threads_);
+  if (schedule_ == Schedule::kWorkStealing) {
+    ranges_.reset(new WorkerRange[num_worker_threads_]);
+  }
 
   // Suppress "unused-private-field" warning.
   (void)padding1;
@@ -144,13 +506,20 @@ ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
     threads_.emplace_back(ThreadFunc, this, i);
   }
 
-  if (num_worker_threads_ != 0) {
+  if (num_worker_threads_ != 0 && schedule_ == Schedule::kGuided) {
     WorkersReadyBarrier();
   }
 }
 
 ThreadParallelRunner::~ThreadParallelRunner() {
-  if (num_worker_threads_ != 0) {
+  if (num_worker_threads_ != 0 && schedule_ == Schedule::kWorkStealing) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      worker_start_command_ = kWorkerExit;
+      generation_.fetch_add(1, std::memory_order_seq_cst);
+    }
+    worker_start_cv_.notify_all();
+  } else if (num_worker_threads_ != 0) {
     StartWorkers(kWorkerExit);
   }
 
@@ -15,6 +15,7 @@
 
 #include <atomic>
 #include <condition_variable>  //NOLINT
+#include <memory>
 #include <mutex>               //NOLINT
 #include <thread>              //NOLINT
 #include <vector>
@@ -78,11 +79,60 @@ typedef JxlParallelRetCode (*JxlParallelRunInit)(void* jpegxl_opaque,
 typedef void (*JxlParallelRunFunction)(void* jpegxl_opaque, uint32_t value,
                                        size_t thread_id);
 
+/**
+ * Parallel runner interface, which runs the data processing callback @p func
+ * for every value in [start_range, end_range), possibly in parallel, after
+ * calling @p init once.
+ *
+ * This lets the encoder run all of its parallel work on an executor of the
+ * application instead of on its own threads. It must return only after all
+ * calls of @p func have returned, and be callable again from within @p func
+ * (e.g. by running the nested range on the calling thread).
+ *
+ * @param runner_opaque the opaque pointer given to the encoder together with
+ * the runner.
+ * @param jpegxl_opaque the opaque pointer that must be passed to @p init and
+ * @p func.
+ * @return 0 on success, or the error code returned by @p init or
+ * JXL_PARALLEL_RET_RUNNER_ERROR.
+ */
+typedef JxlParallelRetCode (*JxlParallelRunner)(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
+
 namespace jxl {
 
 // Main helper class implementing the ::JxlParallelRunner interface.
 class ThreadParallelRunner {
  public:
+  // How tasks of one Run are distributed among the worker threads.
+  enum class Schedule {
+    // All workers reserve chunks of decreasing size from one shared counter
+    // and are started and stopped with a mutex/condvar barrier.
+    kGuided,
+    // Each worker starts with an equal contiguous part of the range and steals
+    // half of the remaining tasks of another worker when it runs out of work.
+    // Workers spin for a while before parking, which reduces dispatch latency
+    // for back-to-back Run calls.
+    kWorkStealing,
+  };
+
+  // Which CPUs the worker threads run on. The workers pin themselves before
+  // running any task, so that the memory that they allocate first is on their
+  // own NUMA node. Only supported on Linux, elsewhere and if pinning fails the
+  // workers run anywhere.
+  enum class Affinity {
+    // Decided by the operating system.
+    kNone,
+    // Each worker on one CPU of the process, node by node.
+    kCores,
+    // Each worker on all CPUs of one NUMA node, with consecutive workers on
+    // the same node and about as many workers on each node. With
+    // Schedule::kWorkStealing, each node then starts with a contiguous part of
+    // the tasks, e.g. of one image region.
+    kNodes,
+  };
+
   // ::JxlParallelRunner interface.
   static JxlParallelRetCode Runner(void* runner_opaque, void* jpegxl_opaque,
                                    JxlParallelRunInit init,
@@ -93,7 +143,9 @@ class ThreadParallelRunner {
   // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
   // run on the main thread.
   explicit ThreadParallelRunner(
-      int num_worker_threads = std::thread::hardware_concurrency());
+      int num_worker_threads = std::thread::hardware_concurrency(),
+      Schedule schedule = Schedule::kGuided,
+      Affinity affinity = Affinity::kNone);
 
   // Waits for all threads to exit.
   ~ThreadParallelRunner();
@@ -148,13 +200,56 @@ class ThreadParallelRunner {
 
   static void ThreadFunc(ThreadParallelRunner* self, int thread);
 
+  // Schedule::kWorkStealing implementation.
+
+  // Half-open task range [begin, end) packed as (begin << 32) | end, padded to
+  // avoid false sharing.
+  struct WorkerRange {
+    std::atomic<uint64_t> range{0};
+    uint8_t padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  // Distributes [begin, end) among the workers, wakes them up and waits until
+  // all tasks are done.
+  void RunWorkStealing(uint32_t begin, uint32_t end);
+
+  // Runs the tasks of the worker's own range, then steals from the others,
+  // until no work is left.
+  static void RunAndSteal(ThreadParallelRunner* self, int thread);
+
+  static void WorkStealingThreadFunc(ThreadParallelRunner* self, int thread);
+
+  // A Run called from within a data_func on one of the worker threads. The
+  // calling thread runs the tasks itself; with Schedule::kWorkStealing, the
+  // job is also published so that idle workers can join.
+  struct NestedJob {
+    JxlParallelRunFunction func;
+    void* jpegxl_opaque;
+    std::atomic<uint64_t> range{0};
+    std::atomic<uint32_t> num_helpers{0};  // other threads running its tasks
+    NestedJob* next = nullptr;
+  };
+
+  void RunNested(JxlParallelRunFunction func, void* jpegxl_opaque,
+                 uint32_t begin, uint32_t end, int thread);
+
+  // Runs tasks of one published nested job on behalf of its owner. Returns
+  // false if there was no nested job with tasks left.
+  bool HelpNestedJob(int thread);
+
+  // CPUs of each worker, empty if it is not pinned.
+  const std::vector<std::vector<int>> worker_cpus_;
+
   // Unmodified after ctor, but cannot be const because we call thread::join().
   std::vector<std::thread> threads_;
 
   const uint32_t num_worker_threads_;  // == threads_.size()
   const uint32_t num_threads_;
+  const Schedule schedule_;
 
-  std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
+  // Detects if Run is re-entered from a thread other than the workers (not
+  // supported).
+  std::atomic<int> depth_{0};
 
   std::mutex mutex_;  // guards both cv and their variables.
   std::condition_variable workers_ready_cv_;
@@ -170,6 +265,21 @@ class ThreadParallelRunner {
   uint8_t padding1[64];
   std::atomic<uint32_t> num_reserved_{0};
   uint8_t padding2[64];
+
+  // Schedule::kWorkStealing state. Workers start a Run when generation_
+  // changes, the command is passed in worker_start_command_.
+  std::unique_ptr<WorkerRange[]> ranges_;
+  std::atomic<uint64_t> generation_{0};
+  std::atomic<uint32_t> num_active_{0};  // workers still running tasks
+  std::atomic<uint32_t> num_busy_{0};    // workers with tasks of their own
+  std::atomic<uint32_t> num_parked_{0};  // workers waiting on worker_start_cv_
+  std::atomic<bool> main_parked_{false};  // waiting on workers_ready_cv_
+
+  // List of nested jobs that idle workers can help with, guarded by
+  // nested_mutex_.
+  std::mutex nested_mutex_;
+  NestedJob* nested_jobs_ = nullptr;
+  std::atomic<uint32_t> num_nested_jobs_{0};
 };
 
 class ThreadPool {
@@ -178,8 +288,20 @@ class ThreadPool {
   // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
   // run on the main thread.
   explicit ThreadPool(
-      int num_worker_threads = std::thread::hardware_concurrency())
-      : runner_(num_worker_threads) {}
+      int num_worker_threads = std::thread::hardware_concurrency(),
+      ThreadParallelRunner::Schedule schedule =
+          ThreadParallelRunner::Schedule::kGuided,
+      ThreadParallelRunner::Affinity affinity =
+          ThreadParallelRunner::Affinity::kNone)
+      : own_runner_(new ThreadParallelRunner(num_worker_threads, schedule,
+                                             affinity)),
+        runner_(&ThreadParallelRunner::Runner),
+        runner_opaque_(own_runner_.get()) {}
+
+  // Runs the tasks with an external runner instead of its own threads, see
+  // JxlParallelRunner. The runner_opaque must outlive the pool.
+  ThreadPool(JxlParallelRunner runner, void* runner_opaque)
+      : runner_(runner), runner_opaque_(runner_opaque) {}
 
   ThreadPool(const ThreadPool&) = delete;
   ThreadPool& operator&(const ThreadPool&) = delete;
@@ -188,7 +310,10 @@ class ThreadPool {
   // thread(s) for every task in [begin, end). init_func() must return a Status
   // indicating whether the initialization succeeded.
   // "thread" is an integer smaller than num_threads.
-  // Not thread-safe - no two calls to Run may overlap.
+  // Run may be called again from within data_func, the nested tasks are run
+  // by the calling thread (and with Schedule::kWorkStealing also by idle
+  // workers) before the nested Run returns. Apart from that, it is not
+  // thread-safe - no two top-level calls to Run may overlap.
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: begin <= end.
@@ -200,10 +325,9 @@ class ThreadPool {
     RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
-    return ThreadParallelRunner::Runner(
-               &runner_, static_cast<void*>(&call_state),
-               &call_state.CallInitFunc, &call_state.CallDataFunc, begin,
-               end) == 0;
+    return (*runner_)(runner_opaque_, static_cast<void*>(&call_state),
+                      &call_state.CallInitFunc, &call_state.CallDataFunc,
+                      begin, end) == 0;
   }
 
   // Use this as init_func when no initialization is needed.
@@ -240,7 +364,10 @@ class ThreadPool {
     const DataFunc& data_func_;
   };
 
-  ThreadParallelRunner runner_;
+  // Null with an external runner.
+  std::unique_ptr<ThreadParallelRunner> own_runner_;
+  JxlParallelRunner runner_;
+  void* runner_opaque_;
 };
 
 template <class InitFunc, class DataFunc>
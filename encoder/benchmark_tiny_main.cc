@@ -0,0 +1,465 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Encode speed benchmark: encodes each input image with each thread count a
+// number of times after some warm-up encodes, and reports the speed, the
+// density, the speedup and parallel efficiency over the first thread count,
+// the time of each encoder stage and the peak memory usage, both as tables on
+// stderr and as JSON. Fails if the output of an input is not the same for all
+// encodes and thread counts.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>  //NOLINT
+#include <memory>
+#include <string>
+#include <thread>  //NOLINT
+#include <vector>
+
+#include "encoder/base/cache_aligned.h"
+#include "encoder/base/printf_macros.h"
+#include "encoder/base/span.h"
+#include "encoder/enc_file.h"
+#include "encoder/interleaved_image.h"
+#include "encoder/read_pfm.h"
+
+namespace {
+
+struct BenchmarkArgs {
+  std::vector<const char*> files;
+  std::vector<std::pair<size_t, size_t>> synthetic_sizes;
+  // Largest size of the square synthetic images of --matrix, 0 if not set.
+  size_t matrix_max_size = 0;
+  std::vector<int> num_threads;
+  float distance = 1.0f;
+  int effort = jxl::EncoderOptions::kDefaultEffort;
+  int warmup = 1;
+  int reps = 5;
+  size_t memory_budget = 0;
+  jxl::ThreadParallelRunner::Schedule schedule =
+      jxl::ThreadParallelRunner::Schedule::kGuided;
+  jxl::ThreadParallelRunner::Affinity affinity =
+      jxl::ThreadParallelRunner::Affinity::kNone;
+  const char* json_out = "-";
+};
+
+struct Input {
+  std::string name;
+  jxl::InterleavedImage image;
+  // The pixels of synthetic inputs are only generated while they are
+  // benchmarked, so that the large ones of --matrix do not all have to fit in
+  // memory at the same time.
+  bool synthetic;
+};
+
+struct Result {
+  size_t input;
+  int num_threads;
+  double median_seconds;
+  double min_seconds;
+  size_t compressed_size;
+  // FNV-1a hash of the encoded bytes.
+  uint64_t hash;
+  // Median time of the first thread count of the input over this one.
+  double speedup;
+  // Speedup divided by the ratio of the number of threads to the first thread
+  // count, with zero worker threads counting as one.
+  double efficiency;
+  // Stage times of one encode, averaged over the timed encodes, and summed
+  // over threads.
+  jxl::StageTimes stage_times;
+  // Peak resident set size of the process so far.
+  long peak_rss_kb;
+  // Peak size of the images and buffers of the encoder during the timed
+  // encodes.
+  uint64_t peak_alloc_kb;
+};
+
+// Linear sRGB float image with smooth gradients and some noise, roughly
+// like a photograph, generated deterministically from its size.
+std::vector<float> SyntheticImage(size_t xsize, size_t ysize) {
+  std::vector<float> pixels(xsize * ysize * 3);
+  uint32_t state = 12345;
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        state = state * 1103515245u + 12345u;
+        const float noise = ((state >> 16) & 0xff) * (0.05f / 255);
+        const float gradient = c == 0   ? x * 1.0f / xsize
+                               : c == 1 ? y * 1.0f / ysize
+                                        : (x + y) * 1.0f / (xsize + ysize);
+        pixels[(y * xsize + x) * 3 + c] = 0.9f * gradient + noise;
+      }
+    }
+  }
+  return pixels;
+}
+
+uint64_t HashBytes(jxl::Span<const uint8_t> bytes, uint64_t hash) {
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+constexpr uint64_t kHashInit = 0xcbf29ce484222325ull;
+
+long PeakRssKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+  return usage.ru_maxrss;
+}
+
+bool Run(const Input& input, const BenchmarkArgs& args, int num_threads,
+         Result* result) {
+  jxl::Encoder encoder(num_threads, args.schedule, args.affinity);
+  jxl::EncoderOptions options = jxl::EncoderOptions::ForEffort(args.effort);
+  options.memory_budget = args.memory_budget;
+  options.collect_stats = true;
+  encoder.SetOptions(options);
+  size_t compressed_size = 0;
+  uint64_t hash = kHashInit;
+  const auto discard = [&](jxl::Span<const uint8_t> bytes) {
+    compressed_size += bytes.size();
+    hash = HashBytes(bytes, hash);
+    return true;
+  };
+  // Hash of the first encode, which all others have to match.
+  uint64_t first_hash = 0;
+  const auto encode = [&](size_t i) {
+    compressed_size = 0;
+    hash = kHashInit;
+    if (!encoder.Encode(input.image, args.distance, discard)) return false;
+    if (i == 0) first_hash = hash;
+    if (hash != first_hash) {
+      fprintf(stderr, "Output of %s with %d threads differs between encodes.\n",
+              input.name.c_str(), num_threads);
+      return false;
+    }
+    return true;
+  };
+  for (int i = 0; i < args.warmup; ++i) {
+    if (!encode(i)) return false;
+  }
+  std::vector<double> seconds;
+  jxl::StageTimes stage_times;
+  jxl::ResetMaxBytesInUse();
+  for (int i = 0; i < args.reps; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    if (!encode(args.warmup + i)) return false;
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    seconds.push_back(elapsed.count());
+    stage_times.Add(encoder.stats().stage_times);
+  }
+  std::sort(seconds.begin(), seconds.end());
+  for (size_t i = 0; i < jxl::kNumEncodeStages; ++i) {
+    stage_times.seconds[i] /= args.reps;
+    stage_times.calls[i] /= args.reps;
+  }
+  result->stage_times = stage_times;
+  result->num_threads = num_threads;
+  result->median_seconds = seconds[seconds.size() / 2];
+  result->min_seconds = seconds[0];
+  result->compressed_size = compressed_size;
+  result->hash = first_hash;
+  result->peak_rss_kb = PeakRssKb();
+  result->peak_alloc_kb = jxl::GetMemoryStats().max_bytes_in_use >> 10;
+  return true;
+}
+
+std::string JsonString(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+      continue;
+    }
+    out += c;
+  }
+  return out + "\"";
+}
+
+bool WriteJson(const BenchmarkArgs& args, const std::vector<Input>& inputs,
+               const std::vector<Result>& results) {
+  const bool to_stdout = !strcmp(args.json_out, "-");
+  FILE* f = to_stdout ? stdout : fopen(args.json_out, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open %s for writing\n", args.json_out);
+    return false;
+  }
+  fprintf(f, "{\n  \"distance\": %g,\n  \"effort\": %d,\n", args.distance,
+          args.effort);
+  fprintf(f, "  \"warmup\": %d,\n  \"reps\": %d,\n  \"results\": [",
+          args.warmup, args.reps);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    const Input& input = inputs[r.input];
+    const double pixels = input.image.xsize * input.image.ysize;
+    fprintf(f,
+            "%s\n    {\"input\": %s, \"xsize\": %" PRIuS ", \"ysize\": %" PRIuS
+            ", \"threads\": %d, \"median_seconds\": %.6f, "
+            "\"min_seconds\": %.6f, \"mps\": %.3f, \"bytes\": %" PRIuS
+            ", \"bpp\": %.4f, \"hash\": \"%016" PRIx64
+            "\", \"speedup\": %.3f, \"efficiency\": %.3f"
+            ", \"peak_rss_kb\": %ld, \"peak_alloc_kb\": %" PRIu64
+            ", \"stage_seconds\": {",
+            i == 0 ? "" : ",", JsonString(input.name).c_str(),
+            input.image.xsize, input.image.ysize, r.num_threads,
+            r.median_seconds, r.min_seconds, pixels * 1e-6 / r.median_seconds,
+            r.compressed_size, r.compressed_size * 8.0 / pixels, r.hash,
+            r.speedup, r.efficiency, r.peak_rss_kb, r.peak_alloc_kb);
+    for (size_t s = 0; s < jxl::kNumEncodeStages; ++s) {
+      fprintf(f, "%s\"%s\": %.6f", s == 0 ? "" : ", ",
+              jxl::EncodeStageName(s), r.stage_times.seconds[s]);
+    }
+    fprintf(f, "}}");
+  }
+  fprintf(f, "\n  ]\n}\n");
+  if (!to_stdout && fclose(f) != 0) {
+    fprintf(stderr, "Could not write to %s\n", args.json_out);
+    return false;
+  }
+  return true;
+}
+
+void PrintHelp(char* arg0) {
+  fprintf(stderr,
+          "Usage: %s [options] [<file.pfm> ...]\n\n"
+          "  -d distance: default 1.0\n"
+          "  -e effort: %d (fastest) to %d (densest), default %d\n"
+          "  --synthetic WxH: adds a generated WxH image, can be repeated,\n"
+          "      default 2048x2048 if there are no files\n"
+          "  --matrix max_size: adds generated square images from 256x256\n"
+          "      up to max_size x max_size, doubling the size each time, and\n"
+          "      makes the default thread counts the powers of two up to the\n"
+          "      number of hardware threads, and that number\n"
+          "  --threads n1,n2,...: worker thread counts, default 1 and the\n"
+          "      number of hardware threads\n"
+          "  --warmup n: untimed encodes before each measurement, default 1\n"
+          "  --reps n: timed encodes of each measurement, default 5\n"
+          "  --memory_budget MB: see EncoderOptions::memory_budget\n"
+          "  --schedule guided|stealing: task schedule of the thread pool,\n"
+          "      default guided\n"
+          "  --affinity none|cores|nodes: pins the workers to single CPUs or\n"
+          "      to NUMA nodes, default none\n"
+          "  --json file: JSON output file, default - (stdout)\n",
+          arg0, jxl::EncoderOptions::kMinEffort,
+          jxl::EncoderOptions::kMaxEffort,
+          jxl::EncoderOptions::kDefaultEffort);
+}
+
+bool ParseInt(const char* arg, int min, int max, int* value) {
+  char* end;
+  long v = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || v < min || v > max) return false;
+  *value = static_cast<int>(v);
+  return true;
+}
+
+bool ParseArgs(int argc, char** argv, BenchmarkArgs* args) {
+  for (int i = 1; i < argc; i++) {
+    const char* flag = argv[i];
+    if (flag[0] != '-') {
+      args->files.push_back(flag);
+      continue;
+    }
+    if (i + 1 == argc) {
+      fprintf(stderr, "%s requires an argument\n", flag);
+      return false;
+    }
+    const char* arg = argv[++i];
+    bool ok = true;
+    if (!strcmp(flag, "-d")) {
+      char* end;
+      args->distance = static_cast<float>(strtod(arg, &end));
+      ok = end != arg && *end == '\0';
+    } else if (!strcmp(flag, "-e")) {
+      ok = ParseInt(arg, jxl::EncoderOptions::kMinEffort,
+                    jxl::EncoderOptions::kMaxEffort, &args->effort);
+    } else if (!strcmp(flag, "--synthetic")) {
+      char* end;
+      const size_t xsize = strtoul(arg, &end, 10);
+      ok = end != arg && *end == 'x' && xsize > 0;
+      if (ok) {
+        const char* height = end + 1;
+        const size_t ysize = strtoul(height, &end, 10);
+        ok = end != height && *end == '\0' && ysize > 0;
+        if (ok) args->synthetic_sizes.emplace_back(xsize, ysize);
+      }
+    } else if (!strcmp(flag, "--matrix")) {
+      int max_size;
+      ok = ParseInt(arg, 256, 1 << 18, &max_size);
+      if (ok) args->matrix_max_size = max_size;
+    } else if (!strcmp(flag, "--threads")) {
+      for (const char* p = arg; ok && *p != '\0';) {
+        char* end;
+        long n = strtol(p, &end, 10);
+        ok = end != p && n >= 0 && n <= 1024 && (*end == ',' || *end == '\0');
+        if (ok) args->num_threads.push_back(static_cast<int>(n));
+        p = *end == ',' ? end + 1 : end;
+      }
+    } else if (!strcmp(flag, "--warmup")) {
+      ok = ParseInt(arg, 0, 1000, &args->warmup);
+    } else if (!strcmp(flag, "--reps")) {
+      ok = ParseInt(arg, 1, 1000000, &args->reps);
+    } else if (!strcmp(flag, "--memory_budget")) {
+      int megabytes;
+      ok = ParseInt(arg, 0, 1 << 30, &megabytes);
+      if (ok) args->memory_budget = static_cast<size_t>(megabytes) << 20;
+    } else if (!strcmp(flag, "--schedule")) {
+      using Schedule = jxl::ThreadParallelRunner::Schedule;
+      if (!strcmp(arg, "guided")) {
+        args->schedule = Schedule::kGuided;
+      } else if (!strcmp(arg, "stealing")) {
+        args->schedule = Schedule::kWorkStealing;
+      } else {
+        ok = false;
+      }
+    } else if (!strcmp(flag, "--affinity")) {
+      using Affinity = jxl::ThreadParallelRunner::Affinity;
+      if (!strcmp(arg, "none")) {
+        args->affinity = Affinity::kNone;
+      } else if (!strcmp(arg, "cores")) {
+        args->affinity = Affinity::kCores;
+      } else if (!strcmp(arg, "nodes")) {
+        args->affinity = Affinity::kNodes;
+      } else {
+        ok = false;
+      }
+    } else if (!strcmp(flag, "--json")) {
+      args->json_out = arg;
+    } else {
+      fprintf(stderr, "Unknown flag: %s\n", flag);
+      return false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Invalid argument of %s: %s\n", flag, arg);
+      return false;
+    }
+  }
+  for (size_t size = 256; size <= args->matrix_max_size; size *= 2) {
+    args->synthetic_sizes.emplace_back(size, size);
+  }
+  if (args->files.empty() && args->synthetic_sizes.empty()) {
+    args->synthetic_sizes.emplace_back(2048, 2048);
+  }
+  if (args->num_threads.empty()) {
+    args->num_threads.push_back(1);
+    const int hardware_threads = std::thread::hardware_concurrency();
+    if (args->matrix_max_size != 0) {
+      for (int n = 2; n < hardware_threads; n *= 2) {
+        args->num_threads.push_back(n);
+      }
+    }
+    if (hardware_threads > 1) args->num_threads.push_back(hardware_threads);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) {
+      PrintHelp(argv[0]);
+      return EXIT_SUCCESS;
+    }
+  }
+  BenchmarkArgs args;
+  if (!ParseArgs(argc, argv, &args)) return EXIT_FAILURE;
+
+  std::vector<Input> inputs;
+  std::vector<std::unique_ptr<jxl::MappedPFM>> files;
+  for (const char* fn : args.files) {
+    files.emplace_back(new jxl::MappedPFM());
+    if (!files.back()->Open(fn)) {
+      fprintf(stderr, "Error reading PFM input file %s.\n", fn);
+      return EXIT_FAILURE;
+    }
+    inputs.push_back({fn, files.back()->image(), false});
+  }
+  for (const auto& size : args.synthetic_sizes) {
+    jxl::InterleavedImage image;
+    image.pixels = nullptr;
+    image.xsize = size.first;
+    image.ysize = size.second;
+    image.stride = size.first * 3 * sizeof(float);
+    image.type = jxl::SampleType::kFloat;
+    image.is_srgb = false;
+    inputs.push_back({"synthetic:" + std::to_string(size.first) + "x" +
+                          std::to_string(size.second),
+                      image, true});
+  }
+
+  std::vector<Result> results;
+  fprintf(stderr, "%-32s %7s %9s %8s %8s %10s %11s %11s\n", "input",
+          "threads", "MP/s", "bpp", "speedup", "efficiency", "peak RSS kB",
+          "peak kB");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    Input& input = inputs[i];
+    std::vector<float> synthetic;
+    if (input.synthetic) {
+      synthetic = SyntheticImage(input.image.xsize, input.image.ysize);
+      input.image.pixels = synthetic.data();
+    }
+    const double pixels = input.image.xsize * input.image.ysize;
+    const size_t first_result = results.size();
+    for (int num_threads : args.num_threads) {
+      Result result;
+      result.input = i;
+      if (!Run(input, args, num_threads, &result)) {
+        fprintf(stderr, "Encoding %s failed.\n", input.name.c_str());
+        return EXIT_FAILURE;
+      }
+      const Result& base = results.size() == first_result
+                               ? result
+                               : results[first_result];
+      if (result.hash != base.hash) {
+        fprintf(stderr, "Output of %s with %d threads differs from %d.\n",
+                input.name.c_str(), num_threads, base.num_threads);
+        return EXIT_FAILURE;
+      }
+      result.speedup = base.median_seconds / result.median_seconds;
+      result.efficiency = result.speedup * std::max(base.num_threads, 1) /
+                          std::max(num_threads, 1);
+      fprintf(stderr,
+              "%-32s %7d %9.3f %8.4f %8.3f %10.3f %11ld %11" PRIu64 "\n",
+              input.name.c_str(), num_threads,
+              pixels * 1e-6 / result.median_seconds,
+              result.compressed_size * 8.0 / pixels, result.speedup,
+              result.efficiency, result.peak_rss_kb, result.peak_alloc_kb);
+      results.push_back(result);
+    }
+    input.image.pixels = nullptr;
+  }
+  fprintf(stderr, "\nStage ms per encode, summed over threads\n");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    fprintf(stderr, "\n%-22s", inputs[i].name.c_str());
+    for (const Result& r : results) {
+      if (r.input == i) fprintf(stderr, " %10d", r.num_threads);
+    }
+    fprintf(stderr, "\n");
+    for (size_t s = 0; s < jxl::kNumEncodeStages; ++s) {
+      fprintf(stderr, "%-22s", jxl::EncodeStageName(s));
+      for (const Result& r : results) {
+        if (r.input != i) continue;
+        fprintf(stderr, " %10.2f", r.stage_times.seconds[s] * 1e3);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+  return WriteJson(args, inputs, results) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
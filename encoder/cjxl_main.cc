@@ -5,43 +5,232 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <chrono>  //NOLINT
+#include <vector>
+
+#include "encoder/base/cache_aligned.h"
 #include "encoder/base/printf_macros.h"
+#include "encoder/base/span.h"
 #include "encoder/enc_file.h"
-#include "encoder/image.h"
+#include "encoder/interleaved_image.h"
 #include "encoder/read_pfm.h"
+#include "encoder/simd_targets.h"
 
 namespace {
 struct CompressArgs {
   const char* file_in = nullptr;
   const char* file_out = nullptr;
   float distance = 1.0;
+  int effort = jxl::EncoderOptions::kDefaultEffort;
+  const char* simd_target = nullptr;
+  const char* max_simd_target = nullptr;
+  // Number of timed encodes per SIMD target, 0 to encode once to the output.
+  int benchmark_reps = 0;
+  bool print_stats = false;
+  // In megabytes, 0 for no limit.
+  size_t memory_budget_mb = 0;
+  // In bytes, 0 to encode at the given distance.
+  size_t target_size = 0;
+  // Output file of the 1:8 preview, if any.
+  const char* preview_out = nullptr;
+  bool fast_decode = false;
+  bool subsample_chroma = false;
+  bool huge_pages = false;
+  bool large_block_sizes = false;
 };
 
-bool WriteFile(const char* filename, const std::vector<uint8_t>& bytes) {
-  FILE* file = fopen(filename, "wb");
-  if (!file) {
-    fprintf(stderr, "Could not open %s for writing\nError: %s", filename,
-            strerror(errno));
-    return false;
+// Output sink that writes the codestream to a file as it is produced.
+class FileSink {
+ public:
+  ~FileSink() {
+    if (file_) fclose(file_);
   }
-  if (fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
-    fprintf(stderr, "Could not write to file\nError: %s", strerror(errno));
-    return false;
+
+  bool Open(const char* filename) {
+    file_ = fopen(filename, "wb");
+    if (!file_) {
+      fprintf(stderr, "Could not open %s for writing\nError: %s", filename,
+              strerror(errno));
+      return false;
+    }
+    return true;
   }
-  if (fclose(file) != 0) {
-    fprintf(stderr, "Could not close file\nError: %s", strerror(errno));
-    return false;
+
+  bool Write(jxl::Span<const uint8_t> bytes) {
+    if (file_ &&
+        fwrite(bytes.data(), 1, bytes.size(), file_) != bytes.size()) {
+      fprintf(stderr, "Could not write to file\nError: %s", strerror(errno));
+      return false;
+    }
+    bytes_written_ += bytes.size();
+    return true;
   }
-  return true;
-}
+
+  bool Close() {
+    if (!file_) return true;
+    FILE* file = file_;
+    file_ = nullptr;
+    if (fclose(file) != 0) {
+      fprintf(stderr, "Could not close file\nError: %s", strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  size_t bytes_written() const { return bytes_written_; }
+
+ private:
+  FILE* file_ = nullptr;
+  size_t bytes_written_ = 0;
+};
 
 void PrintHelp(char* arg0) {
   fprintf(stderr,
-          "Usage: %s <file in> [<file out>] [-d distance]\n\n"
-          "  NOTE: <file in> is a .pfm file in linear SRGB colorspace\n",
-          arg0);
+          "Usage: %s <file in> [<file out>] [-d distance] [-e effort]\n"
+          "       [--simd_target name] [--max_simd_target name]\n"
+          "       [--benchmark_simd_targets reps] [--stats]\n"
+          "       [--memory_budget MB] [--target_size bytes]\n"
+          "       [--preview file] [--fast_decode] [--subsample_chroma]\n"
+          "       [--huge_pages] [--large_block_sizes]\n\n"
+          "  -e effort: %d (fastest) to %d (densest), default %d\n"
+          "  --simd_target: only use this SIMD target\n"
+          "  --max_simd_target: use the best SIMD target up to this one\n"
+          "  --benchmark_simd_targets: encodes reps times with each SIMD\n"
+          "      target and reports the speeds instead of writing a file\n"
+          "  --stats: prints where the encoder spends its time and bits\n"
+          "  --memory_budget: limits the threads to keep the memory of the\n"
+          "      encoder roughly within this many megabytes\n"
+          "  --target_size: selects the distance at which the output takes\n"
+          "      at most this many bytes, starting from the -d distance\n"
+          "  --preview: also writes a 1:8 preview built from the DC of the\n"
+          "      image to this file\n"
+          "  --fast_decode: trades a few percent of density for faster\n"
+          "      decoding, see EncoderOptions::fast_decode\n"
+          "  --subsample_chroma: codes the chroma at half resolution, for\n"
+          "      low quality tiers, see EncoderOptions::subsample_chroma\n"
+          "  --huge_pages: backs the large buffers with transparent huge\n"
+          "      pages, see SetLargePageMode\n"
+          "  --large_block_sizes: also tries 32x32 transforms, see\n"
+          "      EncoderOptions::large_block_sizes\n\n"
+          "  Available SIMD targets, best first:",
+          arg0, jxl::EncoderOptions::kMinEffort,
+          jxl::EncoderOptions::kMaxEffort,
+          jxl::EncoderOptions::kDefaultEffort);
+  for (int64_t target : jxl::AvailableSimdTargets()) {
+    fprintf(stderr, " %s", jxl::SimdTargetName(target));
+  }
+  fprintf(stderr,
+          "\n\n"
+          "  NOTE: <file in> is a .pfm file in linear SRGB colorspace\n");
+}
+
+void PrintStats(const jxl::EncodeStats& stats) {
+  const jxl::StageTimes& times = stats.stage_times;
+  fprintf(stderr, "%-22s %10s %10s\n", "Stage", "Seconds", "Calls");
+  for (size_t i = 0; i < jxl::kNumEncodeStages; ++i) {
+    fprintf(stderr, "%-22s %10.4f %10" PRIu64 "\n", jxl::EncodeStageName(i),
+            times.seconds[i], times.calls[i]);
+  }
+  const std::vector<size_t>& bits = stats.section_bits;
+  if (bits.size() < 4) return;
+  const size_t num_dc_groups = stats.num_dc_groups;
+  size_t dc_group_bits = 0, ac_group_bits = 0;
+  for (size_t i = 1; i <= num_dc_groups; ++i) dc_group_bits += bits[i];
+  for (size_t i = num_dc_groups + 2; i < bits.size(); ++i) {
+    ac_group_bits += bits[i];
+  }
+  fprintf(stderr, "\n%-22s %10s\n", "Sections", "Bits");
+  fprintf(stderr, "%-22s %10" PRIuS "\n", "DC global", bits[0]);
+  fprintf(stderr, "%-22s %10" PRIuS "\n", "DC groups", dc_group_bits);
+  fprintf(stderr, "%-22s %10" PRIuS "\n", "AC global",
+          bits[num_dc_groups + 1]);
+  fprintf(stderr, "%-22s %10" PRIuS "\n", "AC groups", ac_group_bits);
+  uint64_t dc_tokens = 0, ac_tokens = 0;
+  for (uint64_t count : stats.dc_token_counts) dc_tokens += count;
+  for (uint64_t count : stats.ac_token_counts) ac_tokens += count;
+  fprintf(stderr, "\n%-22s %10" PRIu64 "\n%-22s %10" PRIu64 "\n",
+          "DC tokens", dc_tokens, "AC tokens", ac_tokens);
+  static const char* kStrategyNames[jxl::AcStrategy::kNumValidStrategies] = {
+      "DCT8", "DCT16X8", "DCT8X16", "DCT32"};
+  fprintf(stderr, "\n%-22s %10s\n", "AC strategy", "Count");
+  for (size_t i = 0; i < jxl::AcStrategy::kNumValidStrategies; ++i) {
+    fprintf(stderr, "%-22s %10" PRIu64 "\n", kStrategyNames[i],
+            stats.strategy_counts[i]);
+  }
+  const auto print_histogram_stats = [](const char* name,
+                                        const uint64_t* histogram,
+                                        int offset) {
+    uint64_t num = 0;
+    double sum = 0;
+    int min = 256, max = -1;
+    for (int i = 0; i < 256; ++i) {
+      if (histogram[i] == 0) continue;
+      num += histogram[i];
+      sum += histogram[i] * static_cast<double>(i - offset);
+      min = std::min(min, i);
+      max = i;
+    }
+    if (num == 0) return;
+    fprintf(stderr, "%-22s %8.2f %6d %6d\n", name, sum / num, min - offset,
+            max - offset);
+  };
+  fprintf(stderr, "\n%-22s %8s %6s %6s\n", "Field", "Mean", "Min", "Max");
+  print_histogram_stats("Quant field", stats.quant_field_histogram, 0);
+  print_histogram_stats("YtoX", stats.ytox_histogram, 128);
+  print_histogram_stats("YtoB", stats.ytob_histogram, 128);
+  const jxl::MemoryStats memory = jxl::GetMemoryStats();
+  fprintf(stderr,
+          "\n%-22s %10" PRIu64 "\n%-22s %10" PRIu64 "\n%-22s %10" PRIu64 "\n",
+          "Allocations", memory.num_allocations, "Peak allocated kB",
+          memory.max_bytes_in_use >> 10, "Cached kB",
+          memory.cached_bytes >> 10);
+}
+
+// Returns the available SIMD target with the given name, or 0 after printing
+// an error.
+int64_t ParseSimdTarget(const char* name) {
+  const int64_t target = jxl::SimdTargetFromName(name);
+  if (target == 0) {
+    fprintf(stderr, "Unknown or unavailable SIMD target: %s\n", name);
+  }
+  return target;
+}
+
+// Encodes the image reps times with each available SIMD target and prints
+// the speed of each target, in the order of AvailableSimdTargets.
+bool BenchmarkSimdTargets(const jxl::InterleavedImage& image, float distance,
+                          int effort, int reps) {
+  const double megapixels = image.xsize * image.ysize * 1e-6;
+  jxl::Encoder encoder;
+  encoder.SetOptions(jxl::EncoderOptions::ForEffort(effort));
+  size_t compressed_size = 0;
+  const auto discard = [&compressed_size](jxl::Span<const uint8_t> bytes) {
+    compressed_size += bytes.size();
+    return true;
+  };
+  for (int64_t target : jxl::AvailableSimdTargets()) {
+    if (!jxl::ForceSimdTarget(target)) return false;
+    // The first encode also allocates the buffers of the encoder, it is not
+    // timed.
+    if (!encoder.Encode(image, distance, discard)) return false;
+    compressed_size = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reps; ++i) {
+      if (!encoder.Encode(image, distance, discard)) return false;
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "%-8s %8.3f MP/s  %" PRIuS " bytes\n",
+            jxl::SimdTargetName(target),
+            reps * megapixels / elapsed.count(), compressed_size / reps);
+  }
+  jxl::ResetSimdTargets();
+  return true;
 }
 
 }  // namespace
@@ -67,6 +256,105 @@ int main(int argc, char** argv) {
       }
       continue;
     }
+    if (argv[i][0] == '-' && argv[i][1] == 'e') {
+      char* arg = argv[i][2] != '\0' ? &argv[i][2] : argv[++i];
+      if (i == argc) {
+        fprintf(stderr, "-e requires an argument\n");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long effort = strtol(arg, &end, 10);
+      if (*end != '\0' || effort < jxl::EncoderOptions::kMinEffort ||
+          effort > jxl::EncoderOptions::kMaxEffort) {
+        fprintf(stderr, "Invalid effort: %s\n", arg);
+        return EXIT_FAILURE;
+      }
+      args.effort = static_cast<int>(effort);
+      continue;
+    }
+    if (!strcmp("--simd_target", argv[i]) ||
+        !strcmp("--max_simd_target", argv[i])) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      if (!strcmp("--simd_target", argv[i])) {
+        args.simd_target = argv[++i];
+      } else {
+        args.max_simd_target = argv[++i];
+      }
+      continue;
+    }
+    if (!strcmp("--stats", argv[i])) {
+      args.print_stats = true;
+      continue;
+    }
+    if (!strcmp("--fast_decode", argv[i])) {
+      args.fast_decode = true;
+      continue;
+    }
+    if (!strcmp("--subsample_chroma", argv[i])) {
+      args.subsample_chroma = true;
+      continue;
+    }
+    if (!strcmp("--huge_pages", argv[i])) {
+      args.huge_pages = true;
+      continue;
+    }
+    if (!strcmp("--memory_budget", argv[i])) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long megabytes = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || megabytes < 0 || megabytes > (1L << 30)) {
+        fprintf(stderr, "Invalid memory budget: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.memory_budget_mb = megabytes;
+      continue;
+    }
+    if (!strcmp("--target_size", argv[i])) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long long bytes = strtoll(argv[++i], &end, 10);
+      if (*end != '\0' || bytes < 1) {
+        fprintf(stderr, "Invalid target size: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.target_size = bytes;
+      continue;
+    }
+    if (!strcmp("--preview", argv[i])) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.preview_out = argv[++i];
+      continue;
+    }
+    if (!strcmp("--large_block_sizes", argv[i])) {
+      args.large_block_sizes = true;
+      continue;
+    }
+    if (!strcmp("--benchmark_simd_targets", argv[i])) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s requires an argument\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      char* end;
+      long reps = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || reps < 1 || reps > 1000000) {
+        fprintf(stderr, "Invalid number of repetitions: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      args.benchmark_reps = static_cast<int>(reps);
+      continue;
+    }
     if (!args.file_in) {
       args.file_in = argv[i];
     } else if (!args.file_out) {
@@ -77,25 +365,94 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Missing input file.\n");
     return EXIT_FAILURE;
   }
-  jxl::Image3F image;
-  if (!jxl::ReadPFM(args.file_in, &image)) {
+  if (args.max_simd_target) {
+    const int64_t target = ParseSimdTarget(args.max_simd_target);
+    if (target == 0 || !jxl::LimitSimdTargets(target)) return EXIT_FAILURE;
+  }
+  if (args.simd_target) {
+    const int64_t target = ParseSimdTarget(args.simd_target);
+    if (target == 0 || !jxl::ForceSimdTarget(target)) return EXIT_FAILURE;
+  }
+  if (args.huge_pages &&
+      !jxl::Encoder::SetPageMode(jxl::PageMode::kTransparentHugePages)) {
+    fprintf(stderr, "Huge pages are not supported on this platform.\n");
+    return EXIT_FAILURE;
+  }
+  // The input is read directly from the mapped file while it is encoded.
+  jxl::MappedPFM pfm;
+  if (!pfm.Open(args.file_in)) {
     fprintf(stderr, "Error reading PFM input file.\n");
     return EXIT_FAILURE;
   }
+  const jxl::InterleavedImage& image = pfm.image();
   fprintf(stderr, "Read %" PRIuS "x%" PRIuS " pixels input image.\n",
-          image.xsize(), image.ysize());
+          image.xsize, image.ysize);
 
-  std::vector<uint8_t> output;
-  if (!jxl::EncodeFile(image, args.distance, &output)) {
+  if (args.benchmark_reps > 0) {
+    if (!BenchmarkSimdTargets(image, args.distance, args.effort,
+                              args.benchmark_reps)) {
+      fprintf(stderr, "Encoding failed.\n");
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+  fprintf(stderr, "Using SIMD target %s.\n",
+          jxl::SimdTargetName(jxl::CurrentSimdTarget()));
+
+  FileSink sink;
+  if (args.file_out && !sink.Open(args.file_out)) {
+    fprintf(stderr, "Failed to write to output file %s\n", args.file_out);
+    return EXIT_FAILURE;
+  }
+  const auto write = [&sink](jxl::Span<const uint8_t> bytes) {
+    return sink.Write(bytes);
+  };
+  jxl::Encoder encoder;
+  jxl::EncoderOptions options = jxl::EncoderOptions::ForEffort(args.effort);
+  options.collect_stats = args.print_stats;
+  options.memory_budget = args.memory_budget_mb << 20;
+  options.dc_preview = args.preview_out != nullptr;
+  options.fast_decode = args.fast_decode;
+  options.subsample_chroma = args.subsample_chroma;
+  if (args.large_block_sizes) options.large_block_sizes = true;
+  encoder.SetOptions(options);
+  float distance = args.distance;
+  const bool ok =
+      args.target_size > 0
+          ? encoder.EncodeForSize(image, args.target_size, &distance, write)
+          : encoder.Encode(image, distance, write);
+  if (!ok) {
     fprintf(stderr, "Encoding failed.\n");
+    if (args.file_out) {
+      sink.Close();
+      remove(args.file_out);
+    }
     return EXIT_FAILURE;
   }
-  fprintf(stderr, "Compressed to %" PRIuS " bytes.\n", output.size());
-
-  if (args.file_out && !WriteFile(args.file_out, output)) {
+  if (!sink.Close()) {
     fprintf(stderr, "Failed to write to output file %s\n", args.file_out);
     return EXIT_FAILURE;
   }
+  fprintf(stderr, "Compressed to %" PRIuS " bytes.\n", sink.bytes_written());
+  if (args.target_size > 0) {
+    fprintf(stderr, "Selected distance %.4f.\n", distance);
+  }
+  if (args.preview_out) {
+    std::vector<uint8_t> preview;
+    if (!encoder.EncodePreview(distance, &preview)) {
+      fprintf(stderr, "Encoding the preview failed.\n");
+      return EXIT_FAILURE;
+    }
+    FileSink preview_sink;
+    if (!preview_sink.Open(args.preview_out) ||
+        !preview_sink.Write(jxl::Span<const uint8_t>(preview)) ||
+        !preview_sink.Close()) {
+      fprintf(stderr, "Failed to write preview file %s\n", args.preview_out);
+      return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Wrote %" PRIuS " bytes preview.\n", preview.size());
+  }
+  if (args.print_stats) PrintStats(encoder.stats());
 
   return EXIT_SUCCESS;
 }
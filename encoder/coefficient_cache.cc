@@ -0,0 +1,85 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/coefficient_cache.h"
+
+#include <string.h>
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/coefficient_cache.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "encoder/base/compiler_specific.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::DemoteTo;
+using hwy::HWY_NAMESPACE::PromoteTo;
+using hwy::HWY_NAMESPACE::Rebind;
+
+// The sizes are multiples of kDCTBlockSize, and so of the number of lanes.
+void FloatToHalf(const float* JXL_RESTRICT in, size_t size,
+                 hwy::float16_t* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const Rebind<hwy::float16_t, decltype(df)> dh;
+  for (size_t i = 0; i < size; i += Lanes(df)) {
+    StoreU(DemoteTo(dh, LoadU(df, in + i)), dh, out + i);
+  }
+}
+
+void HalfToFloat(const hwy::float16_t* JXL_RESTRICT in, size_t size,
+                 float* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const Rebind<hwy::float16_t, decltype(df)> dh;
+  for (size_t i = 0; i < size; i += Lanes(df)) {
+    StoreU(PromoteTo(df, LoadU(dh, in + i)), df, out + i);
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+HWY_EXPORT(FloatToHalf);
+HWY_EXPORT(HalfToFloat);
+
+void CoefficientCache::Store(size_t bx, size_t by, AcStrategy acs,
+                             const float* coeffs) {
+  const size_t idx = Index(bx, by);
+  if (strategy_[idx] != kEmpty) return;
+  const size_t size = NumCoeffs(acs);
+  // The transforms of the stripe cover every pixel at most once.
+  JXL_ASSERT(used_ + size <= kNumCoeffs);
+  strategy_[idx] = acs.RawStrategy();
+  offset_[idx] = used_;
+  used_ += size;
+  if (half_float_) {
+    HWY_DYNAMIC_DISPATCH(FloatToHalf)
+    (coeffs, size, &half_coeffs_[offset_[idx]]);
+  } else {
+    memcpy(&coeffs_[offset_[idx]], coeffs, size * sizeof(float));
+  }
+}
+
+const float* CoefficientCache::Find(size_t bx, size_t by, AcStrategy acs,
+                                    float* buffer) const {
+  const size_t idx = Index(bx, by);
+  if (strategy_[idx] != acs.RawStrategy()) return nullptr;
+  if (!half_float_) return &coeffs_[offset_[idx]];
+  HWY_DYNAMIC_DISPATCH(HalfToFloat)
+  (&half_coeffs_[offset_[idx]], NumCoeffs(acs), buffer);
+  return buffer;
+}
+
+}  // namespace jxl
+#endif  // HWY_ONCE
@@ -0,0 +1,86 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_COEFFICIENT_CACHE_H_
+#define ENCODER_COEFFICIENT_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include <hwy/aligned_allocator.h>
+#include <hwy/base.h>
+
+#include "encoder/ac_strategy.h"
+#include "encoder/base/status.h"
+#include "encoder/common.h"
+
+namespace jxl {
+
+// Forward DCT coefficients of the transforms of one kGroupDim x kTileDim AC
+// stripe, filled in by the heuristics and consumed by the tokenization, so
+// that the blocks are not transformed again. Each transform is keyed by the
+// position of its first block within the stripe and its strategy. Its
+// coefficients are stored channel by channel in XYB order, each channel
+// having covered_blocks * kDCTBlockSize coefficients.
+class CoefficientCache {
+ public:
+  // With half_float, the coefficients are stored as IEEE half floats, which
+  // halves the size of the cache, see
+  // EncoderOptions::half_float_coefficient_cache.
+  explicit CoefficientCache(bool half_float = false) : half_float_(half_float) {
+    if (half_float_) {
+      half_coeffs_ = hwy::AllocateAligned<hwy::float16_t>(kNumCoeffs);
+    } else {
+      coeffs_ = hwy::AllocateAligned<float>(kNumCoeffs);
+    }
+    Reset();
+  }
+
+  bool half_float() const { return half_float_; }
+
+  void Reset() {
+    std::fill(strategy_, strategy_ + kNumBlocks, kEmpty);
+    used_ = 0;
+  }
+
+  // Stores the coefficients of the transform at block (bx, by), unless that
+  // block already has an entry.
+  void Store(size_t bx, size_t by, AcStrategy acs, const float* coeffs);
+
+  // Returns the coefficients of the transform at block (bx, by), or nullptr if
+  // they are not cached for this strategy. Half floats are converted into
+  // `buffer`, which must have room for all of them, and the float storage is
+  // returned as is.
+  const float* Find(size_t bx, size_t by, AcStrategy acs,
+                    float* buffer) const;
+
+ private:
+  static constexpr size_t kNumCoeffs = 3 * kGroupDim * kTileDim;
+  static constexpr size_t kNumBlocks = kGroupDimInBlocks * kTileDimInBlocks;
+  static constexpr uint8_t kEmpty = 0xff;
+
+  static size_t Index(size_t bx, size_t by) {
+    JXL_DASSERT(bx < kGroupDimInBlocks && by < kTileDimInBlocks);
+    return by * kGroupDimInBlocks + bx;
+  }
+
+  static size_t NumCoeffs(AcStrategy acs) {
+    return 3 * acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
+  }
+
+  bool half_float_;
+  hwy::AlignedFreeUniquePtr<float[]> coeffs_;
+  hwy::AlignedFreeUniquePtr<hwy::float16_t[]> half_coeffs_;
+  uint8_t strategy_[kNumBlocks];
+  uint32_t offset_[kNumBlocks];
+  size_t used_;
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_COEFFICIENT_CACHE_H_
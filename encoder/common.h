@@ -13,7 +13,6 @@
 #include <stddef.h>
 
 #include "encoder/base/compiler_specific.h"
-#include "encoder/config.h"
 
 namespace jxl {
 
@@ -37,11 +36,7 @@ constexpr size_t kGroupDim = 256;
 constexpr size_t kGroupDimInBlocks = kGroupDim / kBlockDim;
 constexpr size_t kDCGroupDim = kGroupDim * kBlockDim;
 constexpr size_t kColorTileDim = 64;
-#if OPTIMIZE_CHROMA_FROM_LUMA
 constexpr size_t kTileDim = kColorTileDim;
-#else
-constexpr size_t kTileDim = 16;
-#endif
 constexpr size_t kTileDimInBlocks = kTileDim / kBlockDim;
 constexpr size_t kGroupDimInTiles = kGroupDim / kTileDim;
 
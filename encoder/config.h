@@ -7,8 +7,138 @@
 #ifndef ENCODER_CONFIG_H_
 #define ENCODER_CONFIG_H_
 
-#define OPTIMIZE_CODE 0
-#define OPTIMIZE_CHROMA_FROM_LUMA 1
-#define OPTIMIZE_BLOCK_SIZES 1
+#include <stddef.h>
+
+namespace jxl {
+
+// Encoder features that trade encoding speed for density. They are selected
+// per frame at runtime, the hot loops are specialized for each combination.
+struct EncoderOptions {
+  // Computes the entropy codes from the histograms of each frame instead of
+  // using the static codes, see two_pass_code.
+  bool optimize_code = false;
+  // Computes the chroma from luma correlation of each 64x64 tile, otherwise
+  // no correlation is used.
+  bool optimize_chroma_from_luma = true;
+  // Searches for the best transform of each 16x16 block, otherwise only DCT8
+  // is used.
+  bool optimize_block_sizes = true;
+  // Decides the transforms of the clearly flat or clearly mixed 16x16 blocks
+  // from the variance of their pixels, and estimates the entropy of the
+  // candidate transforms only for the rest.
+  bool prefilter_block_sizes = false;
+  // With optimize_block_sizes, also tries to merge each 32x32 block into a
+  // single transform, which mostly pays off for smooth content. Its
+  // quantization weights are then signalled in the frame. On a small corpus of
+  // synthetic gradients, textures and noise and one rendered photo, at
+  // distances 0.5 to 4.5, it saves about 10% of the bytes at the same XYB
+  // PSNR at effort 4 (0% to 30% per image, none worse), for about 25% more
+  // encoding time. That PSNR is computed by the encoder from the quantization
+  // error of the coefficients, without the decoder filters, so it does not
+  // show whether the ringing of the larger transforms is more visible.
+  bool large_block_sizes = false;
+  // Computes the heuristics of each AC stripe right before tokenizing it and
+  // reuses their transformed blocks and XYB pixels. Otherwise the heuristics
+  // of all stripes are computed in a separate pass, which has more parallelism
+  // for images with few AC groups.
+  bool cache_coefficients = true;
+  // With cache_coefficients, keeps the cached coefficients as half floats,
+  // which brings the per-thread memory of a stripe from about 570 kB down to
+  // 470 kB, so that it fits in a 512 kB L2 cache. The heuristics still see
+  // the full precision; only the tokenization reads the rounded coefficients,
+  // whose relative error of at most 2^-11 is far below the quantization step
+  // of the AC coefficients. It can still flip the rounding of a coefficient or
+  // DC value close to the middle of two steps, so the output differs slightly
+  // from that of the float cache, without a visible change.
+  bool half_float_coefficient_cache = false;
+  // Estimates the masking of the adaptive quantization from every other pixel
+  // row only. The quant field then differs from the exact one by about 1% per
+  // block on average. On a small corpus of synthetic images and one rendered
+  // photo at effort 3, the adaptive quantization takes about a third less
+  // time, but the whole encode only about 1.5% less, for 0.1% more bytes at
+  // the same distance and the same XYB PSNR within 0.1%. That PSNR does not
+  // show the masking the field is for, and the saving is too small to be
+  // worth it, so no effort tier enables it.
+  bool fast_adaptive_quantization = false;
+  // With optimize_code, generates the tokens of a whole-image input twice
+  // instead of buffering them until the end of the frame: first only to collect
+  // their histograms, then to write them with the optimized codes. The
+  // heuristics are computed only once. Inputs that are read row by row always
+  // buffer the tokens.
+  bool two_pass_code = true;
+  // With optimize_code and a whole-image input, if this is more than 1, the AC
+  // codes are estimated from the tokens of only every sampled_code_stride-th
+  // AC group. Each group is then tokenized once, this takes precedence over
+  // two_pass_code.
+  size_t sampled_code_stride = 0;
+  // Without optimize_code and with a whole-image input, tokenizes a sample of
+  // the AC groups first, every sampled_code_stride-th one or every 8th if that
+  // is not set, and uses the set of static codes that is the cheapest for it.
+  bool select_static_code = false;
+  // With optimize_code, writes the tokens with ANS instead of prefix codes,
+  // which is denser but slower to decode. The tokens are then always buffered
+  // until the end of the frame, since ANS encodes them in reverse order.
+  bool use_ans = false;
+  // Favors the decoding speed over the density, for clients where the decode
+  // time matters more than the bytes: the edge preserving filter, the most
+  // expensive decoding stage at the larger distances, does at most one
+  // iteration instead of up to three, gaborish is never signalled, the
+  // transforms are limited to DCT8, DCT16X8 and DCT8X16, i.e. no
+  // large_block_sizes, and the entropy codes are prefix codes, i.e. no
+  // use_ans. The same distance then takes a few percent more bytes.
+  bool fast_decode = false;
+  // Codes the X and B channels at half the resolution in both directions, for
+  // the low quality tiers where their detail is lost anyway: their pixels are
+  // averaged 2x2 as each AC stripe is loaded, and only the lowest quarter of
+  // their frequencies is transformed from these and coded. For the transforms
+  // larger than DCT8, only that quarter is quantized, while the DCT8 blocks
+  // are still quantized whole together with Y. This cuts most of the transform
+  // and token work of the chroma. The decoder then takes the chroma detail
+  // from luma with the default correlation, the correlation of the tiles is
+  // not computed, i.e. no optimize_chroma_from_luma.
+  bool subsample_chroma = false;
+  // Fills in the EncodeStats of the EncoderCache of the frame, see
+  // enc_stats.h.
+  bool collect_stats = false;
+  // Fills in the preview of the EncoderCache of the frame with the quantized
+  // DC of the frame, i.e. a 1:8 downscaled linear sRGB image that costs only
+  // the dequantization and the color conversion.
+  bool dc_preview = false;
+  // If not 0, limits the number of threads that process the groups of a frame
+  // at the same time, so that the memory of the frame and of their scratch
+  // space stays roughly within this many bytes. The memory of the frame itself
+  // is not limited, and at least one thread is always used. The freed blocks
+  // that are kept for reuse, see MemoryStats::cached_bytes, count against the
+  // budget.
+  size_t memory_budget = 0;
+  // Keeps the sections of the frame in the EncoderCache, and when the next
+  // frame has the same size and options, generates again only the sections of
+  // the AC groups whose pixels changed, and of their DC groups. Only works
+  // with the static codes, and with whole-image inputs.
+  bool incremental = false;
+
+  static constexpr int kMinEffort = 1;
+  static constexpr int kMaxEffort = 4;
+  static constexpr int kDefaultEffort = 3;
+
+  // Returns the options of the given effort tier, from kMinEffort (fastest)
+  // to kMaxEffort (densest):
+  //   1: DCT8 only, no chroma from luma
+  //   2: prefiltered transform search
+  //   3: full transform search (default)
+  //   4: full transform search with 32x32 transforms and optimized entropy
+  //      codes
+  static EncoderOptions ForEffort(int effort) {
+    EncoderOptions options;
+    options.optimize_chroma_from_luma = effort >= 2;
+    options.optimize_block_sizes = effort >= 2;
+    options.prefilter_block_sizes = effort == 2;
+    options.large_block_sizes = effort >= 4;
+    options.optimize_code = effort >= 4;
+    return options;
+  }
+};
+
+}  // namespace jxl
 
 #endif  // ENCODER_CONFIG_H_
@@ -11,12 +11,14 @@
 #include <stdint.h>
 
 #include "encoder/ac_strategy.h"
+#include "encoder/base/status.h"
 #include "encoder/common.h"
 #include "encoder/image.h"
 
 namespace jxl {
 
 struct DCGroupData {
+  // Allocates storage for a DC group of at most xsize_blocks x ysize_blocks.
   DCGroupData(size_t xsize_blocks, size_t ysize_blocks)
       : quant_dc(xsize_blocks, ysize_blocks),
         raw_quant_field(xsize_blocks, ysize_blocks),
@@ -24,7 +26,26 @@ struct DCGroupData {
         ytox_map(DivCeil(xsize_blocks * kBlockDim, kColorTileDim),
                  DivCeil(ysize_blocks * kBlockDim, kColorTileDim)),
         ytob_map(DivCeil(xsize_blocks * kBlockDim, kColorTileDim),
-                 DivCeil(ysize_blocks * kBlockDim, kColorTileDim)) {
+                 DivCeil(ysize_blocks * kBlockDim, kColorTileDim)),
+        max_xsize_blocks(xsize_blocks),
+        max_ysize_blocks(ysize_blocks) {
+    Reset(xsize_blocks, ysize_blocks);
+  }
+  // Returns whether the storage is large enough for the given DC group size.
+  bool Fits(size_t xsize_blocks, size_t ysize_blocks) const {
+    return xsize_blocks <= max_xsize_blocks && ysize_blocks <= max_ysize_blocks;
+  }
+  // Prepares the already allocated storage for a (possibly smaller) DC group,
+  // so that one DCGroupData can be reused across DC groups.
+  void Reset(size_t xsize_blocks, size_t ysize_blocks) {
+    JXL_ASSERT(Fits(xsize_blocks, ysize_blocks));
+    const size_t xsize_tiles = DivCeil(xsize_blocks * kBlockDim, kColorTileDim);
+    const size_t ysize_tiles = DivCeil(ysize_blocks * kBlockDim, kColorTileDim);
+    quant_dc.ShrinkTo(xsize_blocks, ysize_blocks);
+    raw_quant_field.ShrinkTo(xsize_blocks, ysize_blocks);
+    ac_strategy.ShrinkTo(xsize_blocks, ysize_blocks);
+    ytox_map.ShrinkTo(xsize_tiles, ysize_tiles);
+    ytob_map.ShrinkTo(xsize_tiles, ysize_tiles);
     ac_strategy.FillDCT8();
     ZeroFillImage(&ytox_map);
     ZeroFillImage(&ytob_map);
@@ -34,6 +55,8 @@ struct DCGroupData {
   AcStrategyImage ac_strategy;
   ImageSB ytox_map;
   ImageSB ytob_map;
+  size_t max_xsize_blocks;
+  size_t max_ysize_blocks;
 };
 
 }  // namespace jxl
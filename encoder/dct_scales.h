@@ -57,6 +57,16 @@ struct DCTResampleScales<16, 2> {
   };
 };
 
+template <>
+struct DCTResampleScales<32, 4> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      0.974886821136879633,
+      0.901764195028874394,
+      0.787054918159101335,
+  };
+};
+
 // Inverses of the above.
 template <>
 struct DCTResampleScales<1, 8> {
@@ -73,6 +83,71 @@ struct DCTResampleScales<2, 16> {
   };
 };
 
+template <>
+struct DCTResampleScales<4, 32> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      1.025760096781115793,
+      1.108937353592731823,
+      1.270559368765487251,
+  };
+};
+
+// Scales of the DCT-(N/2) coefficients of the 2x downsampled pixels of a
+// block, which approximate the lowest frequencies of its DCT-N, i.e. the
+// inverses of cos(n/(2N) pi), see EncoderOptions::subsample_chroma.
+//
+// Python code for the tables below:
+//
+// for i in range(N // 2):
+//    print(1.0 / math.cos(i / (2 * N) * math.pi), end=", ")
+
+template <>
+struct DCTResampleScales<4, 8> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      1.019591158208318360,
+      1.082392200292394024,
+      1.202689773870090573,
+  };
+};
+
+template <>
+struct DCTResampleScales<8, 16> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      1.004838572376311356,
+      1.019591158208318360,
+      1.044997229879377709,
+      1.082392200292394024,
+      1.133888069632715379,
+      1.202689773870090573,
+      1.293643566719980154,
+  };
+};
+
+template <>
+struct DCTResampleScales<16, 32> {
+  static constexpr float kScales[] = {
+      1.000000000000000000,
+      1.001205996470392545,
+      1.004838572376311356,
+      1.010941919795087296,
+      1.019591158208318360,
+      1.030894619845249105,
+      1.044997229879377709,
+      1.062085182179568266,
+      1.082392200292394024,
+      1.106207792068889084,
+      1.133888069632715379,
+      1.165869936412267771,
+      1.202689773870090573,
+      1.245008246071329649,
+      1.293643566719980154,
+      1.349616682910011356,
+  };
+};
+
 // Constants for DCT implementation. Generated by the following snippet:
 // for i in range(N // 2):
 //    print(1.0 / (2 * math.cos((i + 0.5) * math.pi / N)), end=", ")
@@ -106,6 +181,18 @@ struct WcMultipliers<16> {
   };
 };
 
+template <>
+struct WcMultipliers<32> {
+  static constexpr float kMultipliers[] = {
+      0.5006029982351963, 0.5054709598975436, 0.5154473099226246,
+      0.5310425910897841, 0.5531038960344445, 0.5829349682061339,
+      0.6225041230356648, 0.6748083414550057, 0.7445362710022986,
+      0.8393496454155268, 0.9725682378619608, 1.1694399334328847,
+      1.4841646163141662, 2.057781009953411,  3.407608418468719,
+      10.190008123548033,
+  };
+};
+
 // Apply the DCT algorithm-intrinsic constants to DCTResampleScale.
 template <size_t FROM, size_t TO>
 constexpr float DCTTotalResampleScale(size_t x) {
@@ -10,6 +10,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "encoder/enc_ac_strategy.cc"
@@ -21,6 +22,8 @@
 #include "encoder/base/compiler_specific.h"
 #include "encoder/base/status.h"
 #include "encoder/chroma_from_luma.h"
+#include "encoder/coefficient_cache.h"
+#include "encoder/common.h"
 #include "encoder/enc_transforms-inl.h"
 
 // Some of the floating point constants in this file and in other
@@ -48,21 +51,28 @@ using hwy::HWY_NAMESPACE::IfThenZeroElse;
 using hwy::HWY_NAMESPACE::Round;
 using hwy::HWY_NAMESPACE::Sqrt;
 
+// If coeffs is not null, it holds the already computed coefficients of the
+// three channels, otherwise they are computed into block. Once the estimate
+// exceeds max_entropy, returns infinity without looking at the rest of the
+// channels.
 float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx0,
                       size_t by0, size_t cx, size_t cy, const float distance,
                       const DequantMatrices& matrices, const ImageF& qf,
                       const ImageF& maskf, int8_t ytox, int8_t ytob,
-                      float* block, float* scratch_space) {
+                      const float* coeffs, float max_entropy, float* block,
+                      float* scratch_space) {
   const size_t num_blocks = acs.covered_blocks_x() * acs.covered_blocks_y();
   const size_t size = num_blocks * kDCTBlockSize;
   const size_t bx = bx0 + cx;
   const size_t by = by0 + cy;
 
-  // Apply transform.
-  for (size_t c = 0; c < 3; c++) {
-    float* JXL_RESTRICT block_c = block + size * c;
-    TransformFromPixels(acs.Strategy(), &opsin.ConstPlaneRow(c, by * 8)[bx * 8],
-                        opsin.PixelsPerRow(), block_c, scratch_space);
+  // Apply transform. The Y channel is needed for all of them, X and B are
+  // transformed only when they are reached.
+  const bool apply_transform = coeffs == nullptr;
+  if (apply_transform) {
+    TransformFromPixels(acs.Strategy(), &opsin.ConstPlaneRow(1, by * 8)[bx * 8],
+                        opsin.PixelsPerRow(), block + size, scratch_space);
+    coeffs = block;
   }
 
   // Load QF value, calculate empirical heuristic on masking field
@@ -92,6 +102,12 @@ float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx0,
   const float cmap_factors[3] = {YtoXRatio(ytox), 0.0f, YtoBRatio(ytob)};
 
   for (size_t c = 0; c < 3; c++) {
+    if (apply_transform && c != 1) {
+      TransformFromPixels(acs.Strategy(),
+                          &opsin.ConstPlaneRow(c, by * 8)[bx * 8],
+                          opsin.PixelsPerRow(), block + size * c,
+                          scratch_space);
+    }
     const float* inv_matrix = matrices.InvMatrix(acs.RawStrategy(), c);
     const auto cmap_factor = Set(df, cmap_factors[c]);
     auto entropy_v = Zero(df);
@@ -107,8 +123,8 @@ float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx0,
     constexpr float kCostDelta = 5.3359184934516337f;
     auto cost_delta = Set(df, kCostDelta);
     for (size_t i = 0; i < num_blocks * kDCTBlockSize; i += Lanes(df)) {
-      const auto in = Load(df, block + c * size + i);
-      const auto in_y = Mul(Load(df, block + size + i), cmap_factor);
+      const auto in = Load(df, coeffs + c * size + i);
+      const auto in_y = Mul(Load(df, coeffs + size + i), cmap_factor);
       const auto im = Load(df, inv_matrix + i);
       const auto val = Mul(Sub(in, in_y), Mul(im, q));
       const auto rval = Round(val);
@@ -137,6 +153,9 @@ float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx0,
     // bias.
     constexpr float kZerosMul = 7.565053364251793f;
     entropy += kZerosMul * (CeilLog2Nonzero(nbits + 17) + nbits);
+    // The information loss term is non-negative, so this is a lower bound of
+    // the final estimate.
+    if (entropy > max_entropy) return std::numeric_limits<float>::infinity();
   }
   float infoloss = GetLane(SumOfLanes(df, info_loss));
   float infoloss2 = sqrt(num_blocks * GetLane(SumOfLanes(df, info_loss2)));
@@ -158,64 +177,157 @@ float EstimateEntropy(const AcStrategy& acs, const Image3F& opsin, size_t bx,
                       size_t by, size_t cx, size_t cy, const float distance,
                       const DequantMatrices& matrices, const ImageF& qf,
                       const ImageF& maskf, int8_t ytox, int8_t ytob,
-                      float* block, float* scratch_space) {
+                      const float* coeffs, float max_entropy, float* block,
+                      float* scratch_space) {
   return HWY_DYNAMIC_DISPATCH(EstimateEntropy)(
       acs, opsin, bx, by, cx, cy, distance, matrices, qf, maskf, ytox, ytob,
-      block, scratch_space);
+      coeffs, max_entropy, block, scratch_space);
 }
 
-void FindBest16x16Transform(const Image3F& opsin, const Rect& block_rect,
-                            size_t bx, size_t by, size_t cx, size_t cy,
-                            float distance, const DequantMatrices& matrices,
-                            const ImageF& qf, const ImageF& maskf, int8_t ytox,
-                            int8_t ytob,
-                            AcStrategyImage* JXL_RESTRICT ac_strategy,
-                            float* block, float* scratch_space) {
+namespace {
+
+enum class CellClass {
+  // All blocks are smooth, merging them is almost always cheaper.
+  kFlat,
+  // The blocks differ a lot in activity, e.g. an edge or the boundary of a
+  // texture, where the 8x8 transforms are almost always better.
+  kMixed,
+  // Needs the full entropy estimate.
+  kAmbiguous,
+};
+
+// Classifies the 16x16 cell at block (bx + cx, by + cy) of opsin by the
+// variance of the luma of its four 8x8 blocks, which is much cheaper than
+// estimating the entropy of the candidate transforms. The thresholds are
+// conservative, so that only the clear cases are decided here.
+CellClass ClassifyCell(const Image3F& opsin, size_t bx, size_t by, size_t cx,
+                       size_t cy, float distance) {
+  constexpr float kFlatSigmaPerDistance = 0.0015f;
+  constexpr float kMixedVarianceRatio = 16.0f;
+  const size_t x0 = (bx + cx) * kBlockDim;
+  const size_t y0 = (by + cy) * kBlockDim;
+  float min_var = std::numeric_limits<float>::max();
+  float max_var = 0.0f;
+  for (size_t dy = 0; dy < 2; ++dy) {
+    for (size_t dx = 0; dx < 2; ++dx) {
+      float sum = 0.0f;
+      float sum2 = 0.0f;
+      for (size_t iy = 0; iy < kBlockDim; ++iy) {
+        const float* JXL_RESTRICT row =
+            opsin.ConstPlaneRow(1, y0 + dy * kBlockDim + iy) + x0 +
+            dx * kBlockDim;
+        for (size_t ix = 0; ix < kBlockDim; ++ix) {
+          sum += row[ix];
+          sum2 += row[ix] * row[ix];
+        }
+      }
+      const float mean = sum * (1.0f / kDCTBlockSize);
+      const float var = sum2 * (1.0f / kDCTBlockSize) - mean * mean;
+      min_var = std::min(min_var, var);
+      max_var = std::max(max_var, var);
+    }
+  }
+  const float flat_sigma = kFlatSigmaPerDistance * distance;
+  const float flat_var = flat_sigma * flat_sigma;
+  if (max_var < flat_var) return CellClass::kFlat;
+  if (max_var > kMixedVarianceRatio * std::max(min_var, flat_var)) {
+    return CellClass::kMixed;
+  }
+  return CellClass::kAmbiguous;
+}
+
+}  // namespace
+
+void CacheCoefficients(const float* coeffs, size_t bx, size_t by,
+                       AcStrategy acs, CoefficientCache* cache) {
+  cache->Store(bx, by, acs, coeffs);
+}
+
+float FindBest16x16Transform(const Image3F& opsin, const Rect& block_rect,
+                             size_t bx, size_t by, size_t cx, size_t cy,
+                             float distance, const DequantMatrices& matrices,
+                             const ImageF& qf, const ImageF& maskf,
+                             int8_t ytox, int8_t ytob, bool prefilter,
+                             const float* dct8_coeffs,
+                             AcStrategyImage* JXL_RESTRICT ac_strategy,
+                             CoefficientCache* cache, float* block,
+                             float* scratch_space) {
+  const float kNoBound = std::numeric_limits<float>::infinity();
+  if (prefilter) {
+    const CellClass cell = ClassifyCell(opsin, bx, by, cx, cy, distance);
+    if (cell == CellClass::kMixed) return kNoBound;  // keep the 8x8 ones
+    if (cell == CellClass::kFlat) {
+      ac_strategy->Set(block_rect.x0() + bx + cx, block_rect.y0() + by + cy,
+                       AcStrategy::DCT16X8);
+      ac_strategy->Set(block_rect.x0() + bx + cx + 1, block_rect.y0() + by + cy,
+                       AcStrategy::DCT16X8);
+      return kNoBound;
+    }
+  }
   const AcStrategy acs8X8 = AcStrategy::FromRawStrategy(AcStrategy::DCT);
   const AcStrategy acs16X8 = AcStrategy::FromRawStrategy(AcStrategy::DCT16X8);
   const AcStrategy acs8X16 = AcStrategy::FromRawStrategy(AcStrategy::DCT8X16);
   // Favor all 8x8 transforms 16x8 at low butteraugli_target distances.
-  static const float k8x8mul1 = -0.55 * 0.75f;
-  static const float k8x8mul2 = 1.0735757687292623f * 0.75f;
-  static const float k8x8base = 1.4;
-  static const float mul8x8 = k8x8mul2 + k8x8mul1 / (distance + k8x8base);
-  static const float k8X16mul1 = -0.55;
-  static const float k8X16mul2 = 0.9019587899705066;
-  static const float k8X16base = 1.6;
-  static const float mul16x8 = k8X16mul2 + k8X16mul1 / (distance + k8X16base);
+  const float k8x8mul1 = -0.55 * 0.75f;
+  const float k8x8mul2 = 1.0735757687292623f * 0.75f;
+  const float k8x8base = 1.4;
+  const float mul8x8 = k8x8mul2 + k8x8mul1 / (distance + k8x8base);
+  const float k8X16mul1 = -0.55;
+  const float k8X16mul2 = 0.9019587899705066;
+  const float k8X16base = 1.6;
+  const float mul16x8 = k8X16mul2 + k8X16mul1 / (distance + k8X16base);
+  // With a cache, each candidate is computed into its own slot of block, so
+  // that the chosen ones can be stored after the decision: the 8x8 ones in
+  // slots 0 to 3, then 16x8 left and right and 8x16 top and bottom.
+  constexpr size_t kCandidateSize = 3 * 2 * kDCTBlockSize;
+  float* slots[8];
+  for (size_t i = 0; i < 8; ++i) {
+    slots[i] = cache ? block + i * kCandidateSize : block;
+  }
+  const float* candidates[8] = {slots[0], slots[1], slots[2], slots[3],
+                                slots[4], slots[5], slots[6], slots[7]};
   float entropy[2][2] = {};
   for (size_t dy = 0; dy < 2; ++dy) {
     for (size_t dx = 0; dx < 2; ++dx) {
+      const float* coeffs = nullptr;
+      if (dct8_coeffs != nullptr) {
+        size_t block_idx = (cy + dy) * kTileDimInBlocks + cx + dx;
+        coeffs = dct8_coeffs + block_idx * 3 * kDCTBlockSize;
+      }
       float entropy8x8 = 3.0f * mul8x8;
       entropy8x8 +=
           mul8x8 * EstimateEntropy(acs8X8, opsin, bx, by, cx + dx, cy + dy,
                                    distance, matrices, qf, maskf, ytox, ytob,
-                                   block, scratch_space);
+                                   coeffs, kNoBound, slots[dy * 2 + dx],
+                                   scratch_space);
       entropy[dy][dx] = entropy8x8;
+      if (coeffs != nullptr) candidates[dy * 2 + dx] = coeffs;
     }
   }
-  float entropy_16X8_left =
-      mul16x8 * EstimateEntropy(acs16X8, opsin, bx, by, cx, cy, distance,
-                                matrices, qf, maskf, ytox, ytob, block,
-                                scratch_space);
-  float entropy_16X8_right =
-      mul16x8 * EstimateEntropy(acs16X8, opsin, bx, by, cx + 1, cy, distance,
-                                matrices, qf, maskf, ytox, ytob, block,
-                                scratch_space);
-  float entropy_8X16_top =
-      mul16x8 * EstimateEntropy(acs8X16, opsin, bx, by, cx, cy, distance,
-                                matrices, qf, maskf, ytox, ytob, block,
-                                scratch_space);
-  float entropy_8X16_bottom =
-      mul16x8 * EstimateEntropy(acs8X16, opsin, bx, by, cx, cy + 1, distance,
-                                matrices, qf, maskf, ytox, ytob, block,
-                                scratch_space);
+  // Each of the larger transforms only matters if it is cheaper than the two
+  // 8x8 transforms it replaces, so its estimate can stop above that cost.
+  const auto estimate_merged = [&](const AcStrategy& acs, size_t x, size_t y,
+                                   float cost8x8, float* candidate) {
+    return mul16x8 * EstimateEntropy(acs, opsin, bx, by, x, y, distance,
+                                     matrices, qf, maskf, ytox, ytob, nullptr,
+                                     cost8x8 / mul16x8, candidate,
+                                     scratch_space);
+  };
+  float entropy_16X8_left = estimate_merged(
+      acs16X8, cx, cy, entropy[0][0] + entropy[1][0], slots[4]);
+  float entropy_16X8_right = estimate_merged(
+      acs16X8, cx + 1, cy, entropy[0][1] + entropy[1][1], slots[5]);
+  float entropy_8X16_top = estimate_merged(
+      acs8X16, cx, cy, entropy[0][0] + entropy[0][1], slots[6]);
+  float entropy_8X16_bottom = estimate_merged(
+      acs8X16, cx, cy + 1, entropy[1][0] + entropy[1][1], slots[7]);
   // Test if this 16x16 block should have 16x8 or 8x16 transforms,
   // because it can have only one or the other.
   float cost16x8 = std::min(entropy_16X8_left, entropy[0][0] + entropy[1][0]) +
                    std::min(entropy_16X8_right, entropy[0][1] + entropy[1][1]);
   float cost8x16 = std::min(entropy_8X16_top, entropy[0][0] + entropy[0][1]) +
                    std::min(entropy_8X16_bottom, entropy[1][0] + entropy[1][1]);
+  const float cost = std::min(cost16x8, cost8x16);
   if (cost16x8 < cost8x16) {
     if (entropy_16X8_left < entropy[0][0] + entropy[1][0]) {
       ac_strategy->Set(block_rect.x0() + bx + cx, block_rect.y0() + by + cy,
@@ -235,6 +347,50 @@ void FindBest16x16Transform(const Image3F& opsin, const Rect& block_rect,
                        AcStrategy::DCT8X16);
     }
   }
+  if (cache == nullptr) return cost;
+  // Store the coefficients of the chosen transforms. A merged candidate can
+  // only have been chosen if its estimate did not stop early, so all of its
+  // channels are transformed.
+  for (size_t dy = 0; dy < 2; ++dy) {
+    AcStrategyRow row = ac_strategy->ConstRow(block_rect, by + cy + dy);
+    for (size_t dx = 0; dx < 2; ++dx) {
+      const AcStrategy acs = row[bx + cx + dx];
+      if (!acs.IsFirstBlock()) continue;
+      size_t i = (acs.Strategy() == AcStrategy::DCT16X8   ? 4 + dx
+                  : acs.Strategy() == AcStrategy::DCT8X16 ? 6 + dy
+                                                          : dy * 2 + dx);
+      CacheCoefficients(candidates[i], bx + cx + dx, by + cy + dy, acs, cache);
+    }
+  }
+  return cost;
+}
+
+void FindBest32x32Transform(const Image3F& opsin, const Rect& block_rect,
+                            size_t bx, size_t by, size_t cx, size_t cy,
+                            float distance, const DequantMatrices& matrices,
+                            const ImageF& qf, const ImageF& maskf, int8_t ytox,
+                            int8_t ytob, float cost16x16,
+                            AcStrategyImage* JXL_RESTRICT ac_strategy,
+                            float* block, float* scratch_space) {
+  // Not all of the 16x16 cells have an estimate.
+  if (!std::isfinite(cost16x16)) return;
+  const AcStrategy acs32X32 = AcStrategy::FromRawStrategy(AcStrategy::DCT32X32);
+  // More conservative than the 16x8 transforms, since a single coefficient of
+  // a 32x32 transform rings over a larger area. Tuned on the bytes at the same
+  // XYB PSNR, see EncoderOptions::large_block_sizes: with a multiplier below
+  // 1, most blocks of noisy images are merged and take about 20% more bytes.
+  const float k32X32mul1 = 0.2;
+  const float k32X32mul2 = 1.05;
+  const float k32X32base = 1.6;
+  const float mul32x32 = k32X32mul2 + k32X32mul1 / (distance + k32X32base);
+  const float entropy32x32 =
+      mul32x32 * EstimateEntropy(acs32X32, opsin, bx, by, cx, cy, distance,
+                                 matrices, qf, maskf, ytox, ytob, nullptr,
+                                 cost16x16 / mul32x32, block, scratch_space);
+  if (entropy32x32 < cost16x16) {
+    ac_strategy->Set(block_rect.x0() + bx + cx, block_rect.y0() + by + cy,
+                     AcStrategy::DCT32X32);
+  }
 }
 
 void AdjustQuantField(const AcStrategyImage& ac_strategy,
@@ -9,16 +9,46 @@
 
 #include "encoder/ac_strategy.h"
 #include "encoder/base/status.h"
+#include "encoder/coefficient_cache.h"
 #include "encoder/image.h"
 #include "encoder/quant_weights.h"
 
 namespace jxl {
 
-void FindBest16x16Transform(const Image3F& opsin, const Rect& block_rect,
+// Stores the coefficients of the transform at block (bx, by) of the stripe in
+// the cache, unless that block already has an entry.
+void CacheCoefficients(const float* coeffs, size_t bx, size_t by,
+                       AcStrategy acs, CoefficientCache* cache);
+
+// Selects the transforms of the 16x16 cell at block (bx + cx, by + cy) of
+// opsin. With prefilter, the clear cases are decided from the variance of the
+// blocks, and the candidate transforms are only compared for the rest. If
+// dct8_coeffs is not null, it holds the DCT8 coefficients of the tile at block
+// (bx, by), as stored by ComputeCmapTile. If cache is not null, the
+// coefficients of the chosen transforms are stored in it, which needs room for
+// 8 * 3 * 2 * kDCTBlockSize coefficients in block. Returns the estimated
+// entropy of the chosen transforms, or infinity if the prefilter decided them.
+float FindBest16x16Transform(const Image3F& opsin, const Rect& block_rect,
+                             size_t bx, size_t by, size_t cx, size_t cy,
+                             float distance, const DequantMatrices& matrices,
+                             const ImageF& qf, const ImageF& maskf,
+                             int8_t ytox, int8_t ytob, bool prefilter,
+                             const float* dct8_coeffs,
+                             AcStrategyImage* JXL_RESTRICT ac_strategy,
+                             CoefficientCache* cache, float* block,
+                             float* scratch_space);
+
+// Replaces the transforms of the 32x32 cell at block (bx + cx, by + cy) of
+// opsin with a DCT32X32 if that is cheaper than cost16x16, the sum of the
+// estimates of FindBest16x16Transform for its four 16x16 cells. Needs room for
+// 3 * kMaxCoeffArea coefficients in block. The coefficients of the merged
+// transform are not cached, since the cache already has the entries of the
+// transforms that it replaces.
+void FindBest32x32Transform(const Image3F& opsin, const Rect& block_rect,
                             size_t bx, size_t by, size_t cx, size_t cy,
                             float distance, const DequantMatrices& matrices,
                             const ImageF& qf, const ImageF& maskf, int8_t ytox,
-                            int8_t ytob,
+                            int8_t ytob, float cost16x16,
                             AcStrategyImage* JXL_RESTRICT ac_strategy,
                             float* block, float* scratch_space);
 
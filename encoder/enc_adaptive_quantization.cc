@@ -34,6 +34,7 @@ using hwy::HWY_NAMESPACE::AbsDiff;
 using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::And;
 using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::Sqrt;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
@@ -113,12 +114,13 @@ static float RatioOfDerivativesOfCubicRootToSimpleGamma(float v) {
 
 template <class D, class V>
 V GammaModulation(const D d, const size_t x, const size_t y,
-                  const ImageF& xyb_x, const ImageF& xyb_y, const V out_val) {
+                  const ImageF& xyb_x, const ImageF& xyb_y,
+                  const size_t row_step, const V out_val) {
   const float kBias = 0.16f;
   auto overall_ratio = Zero(d);
   auto bias = Set(d, kBias);
   auto half = Set(d, 0.5f);
-  for (size_t dy = 0; dy < 8; ++dy) {
+  for (size_t dy = 0; dy < 8; dy += row_step) {
     const float* const JXL_RESTRICT row_in_x = xyb_x.Row(y + dy);
     const float* const JXL_RESTRICT row_in_y = xyb_y.Row(y + dy);
     for (size_t dx = 0; dx < 8; dx += Lanes(d)) {
@@ -135,7 +137,7 @@ V GammaModulation(const D d, const size_t x, const size_t y,
       overall_ratio = Add(overall_ratio, avg_ratio);
     }
   }
-  overall_ratio = Mul(SumOfLanes(d, overall_ratio), Set(d, 1.0f / 64));
+  overall_ratio = Mul(SumOfLanes(d, overall_ratio), Set(d, row_step / 64.0f));
   // ideally -1.0, but likely optimal correction adds some entropy, so slightly
   // less than that.
   // ln(2) constant folded in because we want std::log but have FastLog2f.
@@ -146,7 +148,8 @@ V GammaModulation(const D d, const size_t x, const size_t y,
 template <class D, class V>
 V ColorModulation(const D d, const size_t x, const size_t y,
                   const ImageF& xyb_x, const ImageF& xyb_y, const ImageF& xyb_b,
-                  const double butteraugli_target, V out_val) {
+                  const double butteraugli_target, const size_t row_step,
+                  V out_val) {
   static const float kStrengthMul = 2.177823400325309;
   static const float kRedRampStart = 0.0073200141118951231;
   static const float kRedRampLength = 0.019421555948474039;
@@ -168,7 +171,7 @@ V ColorModulation(const D d, const size_t x, const size_t y,
   // Calculate how much of the 8x8 block is covered with blue or red.
   auto blue_coverage = Zero(d);
   auto red_coverage = Zero(d);
-  for (size_t dy = 0; dy < 8; ++dy) {
+  for (size_t dy = 0; dy < 8; dy += row_step) {
     const float* const JXL_RESTRICT row_in_x = xyb_x.Row(y + dy);
     const float* const JXL_RESTRICT row_in_y = xyb_y.Row(y + dy);
     const float* const JXL_RESTRICT row_in_b = xyb_b.Row(y + dy);
@@ -191,13 +194,14 @@ V ColorModulation(const D d, const size_t x, const size_t y,
   // blue we consider as if it was fully red or blue.
   static const float ratio = 30.610615782142737f;  // out of 64 pixels.
 
-  auto overall_red_coverage = SumOfLanes(d, red_coverage);
+  const auto row_step_v = Set(d, static_cast<float>(row_step));
+  auto overall_red_coverage = Mul(SumOfLanes(d, red_coverage), row_step_v);
   overall_red_coverage =
       Min(overall_red_coverage, Set(d, ratio * kRedRampLength));
   overall_red_coverage =
       Mul(overall_red_coverage, Set(d, red_strength / ratio));
 
-  auto overall_blue_coverage = SumOfLanes(d, blue_coverage);
+  auto overall_blue_coverage = Mul(SumOfLanes(d, blue_coverage), row_step_v);
   overall_blue_coverage =
       Min(overall_blue_coverage, Set(d, ratio * kBlueRampLength));
   overall_blue_coverage =
@@ -209,7 +213,7 @@ V ColorModulation(const D d, const size_t x, const size_t y,
 // Change precision in 8x8 blocks that have high frequency content.
 template <class D, class V>
 V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
-               const V out_val) {
+               const size_t row_step, const V out_val) {
   // Zero out the invalid differences for the rightmost value per row.
   const Rebind<uint32_t, D> du;
   HWY_ALIGN constexpr uint32_t kMaskRight[kBlockDim] = {~0u, ~0u, ~0u, ~0u,
@@ -217,7 +221,7 @@ V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
 
   auto sum = Zero(d);  // sum of absolute differences with right and below
 
-  for (size_t dy = 0; dy < 8; ++dy) {
+  for (size_t dy = 0; dy < 8; dy += row_step) {
     const float* JXL_RESTRICT row_in = xyb.Row(y + dy) + x;
     const float* JXL_RESTRICT row_in_next =
         dy == 7 ? row_in : xyb.Row(y + dy + 1) + x;
@@ -243,12 +247,15 @@ V HfModulation(const D d, const size_t x, const size_t y, const ImageF& xyb,
   }
 
   sum = SumOfLanes(d, sum);
-  return MulAdd(sum, Set(d, -2.0052193233688884f / 112), out_val);
+  return MulAdd(sum, Set(d, row_step * -2.0052193233688884f / 112), out_val);
 }
 
+// With a row_step of 2, the modulations look at only every other pixel row of
+// each block.
 void PerBlockModulations(const float butteraugli_target, const ImageF& xyb_x,
                          const ImageF& xyb_y, const ImageF& xyb_b,
-                         const float scale, const Rect& rect, ImageF* out) {
+                         const float scale, const Rect& rect,
+                         const size_t row_step, ImageF* out) {
   JXL_ASSERT(SameSize(xyb_x, xyb_y));
 
   float base_level = 0.5f * scale;
@@ -272,10 +279,10 @@ void PerBlockModulations(const float butteraugli_target, const ImageF& xyb_x,
       size_t x = ix * 8;
       auto out_val = Set(df, row_out[ix - rect.x0()]);
       out_val = ComputeMask(df, out_val);
-      out_val = HfModulation(df, x, y, xyb_y, out_val);
+      out_val = HfModulation(df, x, y, xyb_y, row_step, out_val);
       out_val = ColorModulation(df, x, y, xyb_x, xyb_y, xyb_b,
-                                butteraugli_target, out_val);
-      out_val = GammaModulation(df, x, y, xyb_x, xyb_y, out_val);
+                                butteraugli_target, row_step, out_val);
+      out_val = GammaModulation(df, x, y, xyb_x, xyb_y, row_step, out_val);
       // We want multiplicative quantization field, so everything
       // until this point has been modulating the exponent.
       row_out[ix - rect.x0()] =
@@ -320,6 +327,28 @@ void StoreMin4(const float v, float& min0, float& min1, float& min2,
   }
 }
 
+// Same as above for each lane, without branches.
+template <typename V>
+void StoreMin4(const V v, V& min0, V& min1, V& min2, V& min3) {
+  min3 = Max(min2, Min(min3, v));
+  min2 = Max(min1, Min(min2, v));
+  min1 = Max(min0, Min(min1, v));
+  min0 = Min(min0, v);
+}
+
+template <typename V>
+void SortPair(V& a, V& b) {
+  const V t = a;
+  a = Min(a, b);
+  b = Max(t, b);
+}
+
+static const float kMulC = 0.05f;
+static const float kMul0 = 0.05f;
+static const float kMul1 = 0.05f;
+static const float kMul2 = 0.05f;
+static const float kMul3 = 0.05f;
+
 // Look for smooth areas near the area of degradation.
 // If the areas are generally smooth, don't do masking.
 // Output is downsampled 2x.
@@ -328,6 +357,12 @@ void FuzzyErosion(const Rect& from_rect, const ImageF& from, ImageF* to) {
   const size_t ysize = from.ysize();
   constexpr int kStep = 1;
   static_assert(kStep == 1, "Step must be 1");
+  const HWY_FULL(float) df;
+  const size_t N = Lanes(df);
+  // The eroded values of one row, before the 2x downsampling.
+  JXL_ASSERT(from_rect.xsize() <= 2 * kTileDimInBlocks);
+  JXL_ASSERT(from_rect.xsize() % 2 == 0);
+  HWY_ALIGN float row_eroded[2 * kTileDimInBlocks];
   for (size_t fy = 0; fy < from_rect.ysize(); ++fy) {
     size_t y = fy + from_rect.y0();
     size_t ym1 = y >= kStep ? y - kStep : y;
@@ -335,8 +370,8 @@ void FuzzyErosion(const Rect& from_rect, const ImageF& from, ImageF* to) {
     const float* rowt = from.Row(ym1);
     const float* row = from.Row(y);
     const float* rowb = from.Row(yp1);
-    float* row_out = to->Row(fy / 2);
-    for (size_t fx = 0; fx < from_rect.xsize(); ++fx) {
+    // Clamps the neighbourhood at the left and right edges of the image.
+    const auto scalar_erosion = [&](size_t fx) {
       size_t x = fx + from_rect.x0();
       size_t xm1 = x >= kStep ? x - kStep : x;
       size_t xp1 = x + kStep < xsize ? x + kStep : x;
@@ -357,26 +392,55 @@ void FuzzyErosion(const Rect& from_rect, const ImageF& from, ImageF* to) {
       StoreMin4(rowb[xm1], min0, min1, min2, min3);
       StoreMin4(rowb[x], min0, min1, min2, min3);
       StoreMin4(rowb[xp1], min0, min1, min2, min3);
-      static const float kMulC = 0.05f;
-      static const float kMul0 = 0.05f;
-      static const float kMul1 = 0.05f;
-      static const float kMul2 = 0.05f;
-      static const float kMul3 = 0.05f;
-      float v = kMulC * row[x] + kMul0 * min0 + kMul1 * min1 + kMul2 * min2 +
-                kMul3 * min3;
-      if (fx % 2 == 0 && fy % 2 == 0) {
-        row_out[fx / 2] = v;
-      } else {
-        row_out[fx / 2] += v;
-      }
+      row_eroded[fx] = kMulC * row[x] + kMul0 * min0 + kMul1 * min1 +
+                       kMul2 * min2 + kMul3 * min3;
+    };
+    size_t fx = 0;
+    if (from_rect.x0() == 0) {
+      scalar_erosion(fx++);
+    }
+    // The whole neighbourhood of these lanes is inside the image.
+    for (; fx + N <= from_rect.xsize() && fx + from_rect.x0() + N < xsize;
+         fx += N) {
+      const size_t x = fx + from_rect.x0();
+      const auto center = LoadU(df, row + x);
+      auto min0 = center;
+      auto min1 = LoadU(df, row + x - 1);
+      auto min2 = LoadU(df, row + x + 1);
+      auto min3 = LoadU(df, rowt + x - 1);
+      // Sorting network of the first four values.
+      SortPair(min0, min1);
+      SortPair(min2, min3);
+      SortPair(min0, min2);
+      SortPair(min1, min3);
+      SortPair(min1, min2);
+      StoreMin4(LoadU(df, rowt + x), min0, min1, min2, min3);
+      StoreMin4(LoadU(df, rowt + x + 1), min0, min1, min2, min3);
+      StoreMin4(LoadU(df, rowb + x - 1), min0, min1, min2, min3);
+      StoreMin4(LoadU(df, rowb + x), min0, min1, min2, min3);
+      StoreMin4(LoadU(df, rowb + x + 1), min0, min1, min2, min3);
+      auto v = Mul(Set(df, kMulC), center);
+      v = MulAdd(Set(df, kMul0), min0, v);
+      v = MulAdd(Set(df, kMul1), min1, v);
+      v = MulAdd(Set(df, kMul2), min2, v);
+      v = MulAdd(Set(df, kMul3), min3, v);
+      StoreU(v, df, row_eroded + fx);
+    }
+    for (; fx < from_rect.xsize(); ++fx) {
+      scalar_erosion(fx);
+    }
+    float* row_out = to->Row(fy / 2);
+    for (size_t ox = 0; ox < from_rect.xsize() / 2; ++ox) {
+      const float v = row_eroded[2 * ox] + row_eroded[2 * ox + 1];
+      row_out[ox] = fy % 2 == 0 ? v : row_out[ox] + v;
     }
   }
 }
 
 void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
-                                   float distance, ImageF* pre_erosion,
-                                   float* diff_buffer, ImageF* aq_map,
-                                   ImageF* mask) {
+                                   float distance, bool fast,
+                                   ImageF* pre_erosion, float* diff_buffer,
+                                   ImageF* aq_map, ImageF* mask) {
   const size_t xsize = xyb.xsize();
   const size_t ysize = xyb.ysize();
   static const float kAcQuant = 0.8294f;
@@ -403,10 +467,12 @@ void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
   if (y_start != 0) y_start -= 4;
   if (y_end != xyb.ysize()) y_end += 4;
   pre_erosion->ShrinkTo((x1 - x0) / 4, (y_end - y_start) / 4);
+  // The fast mode samples only every other pixel row.
+  const size_t row_step = fast ? 2 : 1;
 
   // Computes image (padded to multiple of 8x8) of local pixel differences.
   // Subsample both directions by 4.
-  for (size_t y = y_start; y < y_end; ++y) {
+  for (size_t y = y_start; y < y_end; y += row_step) {
     size_t y2 = y + 1 < ysize ? y + 1 : y;
     size_t y1 = y > 0 ? y - 1 : y;
 
@@ -481,12 +547,13 @@ void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
     for (; x < x1; ++x) {
       scalar_pixel(x);
     }
-    if (y % 4 == 3) {
+    if (y % 4 == 4 - row_step) {
       float* row_dout = pre_erosion->Row((y - y_start) / 4);
+      const float mul = 0.25f * row_step;
       for (size_t x = 0; x < (x1 - x0) / 4; x++) {
         row_dout[x] = (row_out[x * 4] + row_out[x * 4 + 1] +
                        row_out[x * 4 + 2] + row_out[x * 4 + 3]) *
-                      0.25f;
+                      mul;
       }
     }
   }
@@ -501,7 +568,7 @@ void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
     }
   }
   PerBlockModulations(distance, xyb.Plane(0), xyb.Plane(1), xyb.Plane(2), scale,
-                      rect, aq_map);
+                      rect, row_step, aq_map);
 }
 }  // namespace
 
@@ -517,11 +584,12 @@ HWY_EXPORT(ComputeAdaptiveQuantFieldTile);
 
 void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
                                    const Rect& block_rect, float distance,
-                                   float inv_scale, ImageF* pre_erosion,
-                                   float* diff_buffer, ImageF* aq_map,
-                                   ImageF* mask, ImageB* raw_quant_field) {
+                                   float inv_scale, bool fast,
+                                   ImageF* pre_erosion, float* diff_buffer,
+                                   ImageF* aq_map, ImageF* mask,
+                                   ImageB* raw_quant_field) {
   HWY_DYNAMIC_DISPATCH(ComputeAdaptiveQuantFieldTile)
-  (xyb, rect, distance, pre_erosion, diff_buffer, aq_map, mask);
+  (xyb, rect, distance, fast, pre_erosion, diff_buffer, aq_map, mask);
   for (size_t y = 0; y < rect.ysize(); ++y) {
     const float* row_qf = aq_map->ConstRow(y);
     uint8_t* row_qi = block_rect.Row(raw_quant_field, rect.y0() + y);
@@ -11,11 +11,14 @@
 
 namespace jxl {
 
+// With `fast`, the masking is estimated from only every other pixel row, which
+// costs about half as much, see EncoderOptions::fast_adaptive_quantization.
 void ComputeAdaptiveQuantFieldTile(const Image3F& xyb, const Rect& rect,
-                                   const Rect& block_rect, float inv_scale,
-                                   float distance, ImageF* pre_erosion,
-                                   float* diff_buffer, ImageF* aq_map,
-                                   ImageF* mask, ImageB* raw_quant_field);
+                                   const Rect& block_rect, float distance,
+                                   float inv_scale, bool fast,
+                                   ImageF* pre_erosion, float* diff_buffer,
+                                   ImageF* aq_map, ImageF* mask,
+                                   ImageB* raw_quant_field);
 
 }  // namespace jxl
 
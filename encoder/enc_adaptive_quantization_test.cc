@@ -0,0 +1,84 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_adaptive_quantization.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "encoder/common.h"
+#include "encoder/enc_xyb.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// Quant field of each tile of `xyb`, as ProcessTile computes it.
+ImageF QuantField(const Image3F& xyb, float distance, bool fast) {
+  const size_t xsize_blocks = xyb.xsize() / kBlockDim;
+  const size_t ysize_blocks = xyb.ysize() / kBlockDim;
+  const Rect block_rect(0, 0, xsize_blocks, ysize_blocks);
+  ImageF field(xsize_blocks, ysize_blocks);
+  ImageB raw_quant_field(xsize_blocks, ysize_blocks);
+  ImageF aq_map(kTileDimInBlocks, kTileDimInBlocks);
+  ImageF mask(kTileDimInBlocks, kTileDimInBlocks);
+  ImageF pre_erosion(kTileDimInBlocks * 2 + 2, kTileDimInBlocks * 2 + 2);
+  ImageF diff_buffer(kTileDim + 8, 1);
+  for (size_t ty = 0; ty < ysize_blocks; ty += kTileDimInBlocks) {
+    for (size_t tx = 0; tx < xsize_blocks; tx += kTileDimInBlocks) {
+      const Rect rect(tx, ty, kTileDimInBlocks, kTileDimInBlocks,
+                      xsize_blocks, ysize_blocks);
+      ComputeAdaptiveQuantFieldTile(xyb, rect, block_rect, distance,
+                                    /*inv_scale=*/1.0f, fast, &pre_erosion,
+                                    diff_buffer.Row(0), &aq_map, &mask,
+                                    &raw_quant_field);
+      for (size_t y = 0; y < rect.ysize(); ++y) {
+        memcpy(rect.Row(&field, y), aq_map.ConstRow(y),
+               rect.xsize() * sizeof(float));
+      }
+    }
+  }
+  return field;
+}
+
+// Every other pixel row is enough for the masking: on a TestImage, the fast
+// field is within 1% of the exact one on average, with at most 9% for single
+// blocks, and has no bias towards coarser or finer quantization.
+TEST(AdaptiveQuantizationTest, FastFieldIsCloseToExact) {
+  Image3F xyb = test::TestImage(512, 384);
+  ToXYB(&xyb);
+  for (float distance : {1.0f, 3.0f}) {
+    const ImageF exact = QuantField(xyb, distance, /*fast=*/false);
+    const ImageF fast = QuantField(xyb, distance, /*fast=*/true);
+    double sum_diff = 0;
+    double sum_abs_diff = 0;
+    double max_abs_diff = 0;
+    for (size_t y = 0; y < exact.ysize(); ++y) {
+      for (size_t x = 0; x < exact.xsize(); ++x) {
+        const float e = exact.ConstRow(y)[x];
+        const double diff = (fast.ConstRow(y)[x] - e) / e;
+        sum_diff += diff;
+        sum_abs_diff += fabs(diff);
+        max_abs_diff = std::max(max_abs_diff, fabs(diff));
+      }
+    }
+    const size_t num_blocks = exact.xsize() * exact.ysize();
+    EXPECT_LT(fabs(sum_diff / num_blocks), 0.005) << "distance " << distance;
+    EXPECT_LT(sum_abs_diff / num_blocks, 0.015) << "distance " << distance;
+    EXPECT_LT(max_abs_diff, 0.15) << "distance " << distance;
+    // The fast mode does skip rows.
+    EXPECT_GT(max_abs_diff, 0.0) << "distance " << distance;
+  }
+}
+
+}  // namespace
+}  // namespace jxl
@@ -0,0 +1,65 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "encoder/base/span.h"
+#include "encoder/enc_file.h"
+#include "encoder/image.h"
+#include "encoder/interleaved_image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// A plain encode between StartAnimation and the last frame would write a
+// second codestream into the middle of the animation, so it is rejected.
+TEST(EncAnimationTest, EncodeFailsDuringAnimation) {
+  const size_t kSize = 64;
+  const Image3F image = test::TestImage(kSize, kSize);
+  std::vector<uint8_t> pixels(kSize * kSize * 3, 128);
+  InterleavedImage frame;
+  frame.pixels = pixels.data();
+  frame.xsize = kSize;
+  frame.ysize = kSize;
+  frame.stride = kSize * 3;
+
+  Encoder encoder(2);
+  std::vector<uint8_t> animation;
+  const OutputSink sink = [&animation](Span<const uint8_t> bytes) {
+    animation.insert(animation.end(), bytes.data(),
+                     bytes.data() + bytes.size());
+    return true;
+  };
+  ASSERT_TRUE(encoder.StartAnimation(kSize, kSize, AnimationParams(), sink));
+  std::vector<uint8_t> output;
+  EXPECT_FALSE(encoder.Encode(image, 1.0f, &output));
+  EXPECT_FALSE(encoder.StartAnimation(kSize, kSize, AnimationParams(), sink));
+
+  bool callback_ok = false;
+  std::unique_ptr<EncodeHandle> handle = encoder.AddFrameAsync(
+      frame, 1.0f, 1, /*is_last=*/false,
+      [&callback_ok](bool ok) { callback_ok = ok; });
+  EXPECT_TRUE(handle->Wait());
+  EXPECT_TRUE(handle->Done());
+  EXPECT_TRUE(callback_ok);
+  // Still in the animation after an async frame.
+  EXPECT_FALSE(encoder.Encode(image, 1.0f, &output));
+
+  const size_t size_before_last = animation.size();
+  ASSERT_TRUE(encoder.AddFrame(frame, 1.0f, 1, /*is_last=*/true));
+  EXPECT_GT(animation.size(), size_before_last);
+  // The animation has ended with its last frame.
+  EXPECT_TRUE(encoder.Encode(image, 1.0f, &output));
+  EXPECT_FALSE(output.empty());
+}
+
+}  // namespace
+}  // namespace jxl
@@ -0,0 +1,288 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_ans.h"
+
+#include <algorithm>
+
+#include "encoder/base/bits.h"
+#include "encoder/base/status.h"
+#include "encoder/token.h"
+
+namespace jxl {
+
+namespace {
+
+static constexpr size_t kANSAlphabetSize = 1 << kANSLogAlphaSize;
+
+// Scales the counts of the histogram so that they sum to kANSTabSize, keeping
+// every symbol that occurs. Unused histograms get a single symbol.
+void NormalizeCounts(const Histogram& histo, uint16_t* counts) {
+  std::fill(counts, counts + kAlphabetSize, 0);
+  uint64_t total = 0;
+  for (size_t i = 0; i < kAlphabetSize; ++i) total += histo.counts[i];
+  if (total == 0) {
+    counts[0] = kANSTabSize;
+    return;
+  }
+  uint32_t sum = 0;
+  size_t max_symbol = 0;
+  for (size_t i = 0; i < kAlphabetSize; ++i) {
+    if (histo.counts[i] == 0) continue;
+    const uint64_t scaled =
+        (uint64_t{histo.counts[i]} * kANSTabSize + total / 2) / total;
+    counts[i] = std::max<uint64_t>(1, scaled);
+    sum += counts[i];
+    if (counts[i] > counts[max_symbol]) max_symbol = i;
+  }
+  // The rounding error goes to the largest counts, where it costs the least.
+  while (sum > kANSTabSize) {
+    size_t largest = max_symbol;
+    for (size_t i = 0; i < kAlphabetSize; ++i) {
+      if (counts[i] > counts[largest]) largest = i;
+    }
+    JXL_ASSERT(counts[largest] > 1);
+    --counts[largest];
+    --sum;
+  }
+  counts[max_symbol] += kANSTabSize - sum;
+}
+
+struct AliasEntry {
+  uint8_t cutoff;
+  uint8_t right_value;
+  uint16_t offsets1;
+};
+
+// Builds the alias table of the distribution the same way as the decoder, so
+// that the slots of the symbols are where the decoder expects them.
+void InitAliasTable(const uint16_t* counts, AliasEntry* table) {
+  constexpr uint32_t kEntrySize = kANSTabSize >> kANSLogAlphaSize;
+  size_t num_symbols = 0;
+  size_t single_symbol = 0;
+  for (size_t i = 0; i < kAlphabetSize; ++i) {
+    if (counts[i] == 0) continue;
+    ++num_symbols;
+    single_symbol = i;
+  }
+  if (num_symbols == 1) {
+    for (size_t i = 0; i < kANSAlphabetSize; ++i) {
+      table[i].right_value = single_symbol;
+      table[i].cutoff = 0;
+      table[i].offsets1 = kEntrySize * i;
+    }
+    return;
+  }
+  uint32_t cutoffs[kANSAlphabetSize];
+  std::vector<size_t> underfull;
+  std::vector<size_t> overfull;
+  for (size_t i = 0; i < kANSAlphabetSize; ++i) {
+    cutoffs[i] = i < kAlphabetSize ? counts[i] : 0;
+    if (cutoffs[i] > kEntrySize) {
+      overfull.push_back(i);
+    } else if (cutoffs[i] < kEntrySize) {
+      underfull.push_back(i);
+    }
+  }
+  // Fill the underfull entries with the excess of the overfull ones.
+  while (!overfull.empty()) {
+    const size_t over = overfull.back();
+    overfull.pop_back();
+    JXL_ASSERT(!underfull.empty());
+    const size_t under = underfull.back();
+    underfull.pop_back();
+    const uint32_t by = kEntrySize - cutoffs[under];
+    cutoffs[over] -= by;
+    table[under].right_value = over;
+    table[under].offsets1 = cutoffs[over];
+    if (cutoffs[over] < kEntrySize) {
+      underfull.push_back(over);
+    } else if (cutoffs[over] > kEntrySize) {
+      overfull.push_back(over);
+    }
+  }
+  for (size_t i = 0; i < kANSAlphabetSize; ++i) {
+    if (cutoffs[i] == kEntrySize) {
+      table[i].right_value = i;
+      table[i].offsets1 = 0;
+      table[i].cutoff = 0;
+    } else {
+      table[i].offsets1 -= cutoffs[i];
+      table[i].cutoff = cutoffs[i];
+    }
+  }
+}
+
+void StoreVarLenUint8(size_t n, BitWriter* writer) {
+  JXL_DASSERT(n <= 255);
+  if (n == 0) {
+    writer->Write(1, 0);
+  } else {
+    writer->Write(1, 1);
+    size_t nbits = FloorLog2Nonzero(n);
+    writer->Write(3, nbits);
+    writer->Write(nbits, n - (1ULL << nbits));
+  }
+}
+
+// Static prefix code of the log counts of the general histogram encoding.
+static const uint8_t kLogCountBitLengths[14] = {
+    5, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 6, 7, 7,
+};
+static const uint8_t kLogCountSymbols[14] = {
+    17, 11, 15, 3, 9, 7, 4, 2, 5, 6, 0, 33, 1, 65,
+};
+
+void WriteANSHistogram(const uint16_t* counts, BitWriter* writer) {
+  size_t num_symbols = 0;
+  size_t symbols[2] = {0, 0};
+  size_t length = 0;
+  size_t omit_pos = 0;
+  for (size_t i = 0; i < kAlphabetSize; ++i) {
+    if (counts[i] == 0) continue;
+    if (num_symbols < 2) symbols[num_symbols] = i;
+    ++num_symbols;
+    length = i + 1;
+    if (counts[i] > counts[omit_pos]) omit_pos = i;
+  }
+  JXL_ASSERT(num_symbols > 0);
+  if (num_symbols <= 2) {
+    writer->Write(1, 1);  // simple code
+    writer->Write(1, num_symbols - 1);
+    for (size_t i = 0; i < num_symbols; ++i) {
+      StoreVarLenUint8(symbols[i], writer);
+    }
+    if (num_symbols == 2) {
+      writer->Write(kANSLogTabSize, counts[symbols[0]]);
+    }
+    return;
+  }
+  writer->Write(1, 0);  // no simple code
+  writer->Write(1, 0);  // no flat distribution
+  // The counts are stored with full precision, i.e. a shift of
+  // kANSLogTabSize, in an Elias gamma like code of shift + 1 = 13.
+  writer->Write(3, 7);
+  writer->Write(3, (kANSLogTabSize + 1) & 7);
+  StoreVarLenUint8(length - 3, writer);
+  // The log count of the first largest count is the largest of the others,
+  // plus one for those before it, since its count is implied by them.
+  uint8_t logcounts[kAlphabetSize];
+  uint8_t omit_log = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const uint32_t count = counts[i];
+    logcounts[i] = count == 0 ? 0 : FloorLog2Nonzero(count) + 1;
+    if (i < omit_pos) {
+      omit_log = std::max<uint8_t>(omit_log, logcounts[i] + 1);
+    } else if (i > omit_pos) {
+      omit_log = std::max<uint8_t>(omit_log, logcounts[i]);
+    }
+  }
+  logcounts[omit_pos] = omit_log;
+  for (size_t i = 0; i < length; ++i) {
+    writer->Write(kLogCountBitLengths[logcounts[i]],
+                  kLogCountSymbols[logcounts[i]]);
+  }
+  for (size_t i = 0; i < length; ++i) {
+    if (i == omit_pos || logcounts[i] <= 1) continue;
+    const size_t bitcount = logcounts[i] - 1;
+    writer->Write(bitcount, counts[i] - (1u << bitcount));
+  }
+}
+
+}  // namespace
+
+void BuildANSCodes(const std::vector<Histogram>& histograms,
+                   EntropyCode* code) {
+  const size_t num = histograms.size();
+  code->ans_counts.resize(num * kAlphabetSize);
+  code->ans_slots.resize(num * kAlphabetSize);
+  code->ans_reverse_map.resize(num * kANSTabSize);
+  AliasEntry table[kANSAlphabetSize] = {};
+  for (size_t h = 0; h < num; ++h) {
+    uint16_t* counts = &code->ans_counts[h * kAlphabetSize];
+    uint16_t* slots = &code->ans_slots[h * kAlphabetSize];
+    uint16_t* reverse_map = &code->ans_reverse_map[h * kANSTabSize];
+    NormalizeCounts(histograms[h], counts);
+    for (size_t i = 0, start = 0; i < kAlphabetSize; ++i) {
+      slots[i] = start;
+      start += counts[i];
+    }
+    InitAliasTable(counts, table);
+    // Same lookup as that of the decoder, for every state modulo the table
+    // size, giving the symbol and its offset among the slots of that symbol.
+    constexpr uint32_t kLogEntrySize = kANSLogTabSize - kANSLogAlphaSize;
+    for (uint32_t pos = 0; pos < kANSTabSize; ++pos) {
+      const uint32_t i = pos >> kLogEntrySize;
+      const AliasEntry& entry = table[i];
+      const uint32_t offset_in_entry = pos & ((1u << kLogEntrySize) - 1);
+      const bool greater = offset_in_entry >= entry.cutoff;
+      const uint32_t symbol = greater ? entry.right_value : i;
+      const uint32_t offset =
+          greater ? entry.offsets1 + offset_in_entry : offset_in_entry;
+      JXL_ASSERT(symbol < kAlphabetSize && offset < counts[symbol]);
+      reverse_map[slots[symbol] + offset] = pos;
+    }
+  }
+}
+
+void WriteANSCodes(const EntropyCode& code, BitWriter* writer) {
+  const size_t num = code.num_prefix_codes;
+  JXL_ASSERT(code.ans_counts.size() == num * kAlphabetSize);
+  BitWriter::Allotment allotment(writer, 16 + num * (16 + 40 * kAlphabetSize));
+  writer->Write(1, 0);  // use_prefix_code
+  writer->Write(2, kANSLogAlphaSize - 5);
+  for (size_t i = 0; i < num; ++i) {
+    writer->Write(4, 4);  // split_exponent
+    writer->Write(3, 2);  // msb_in_token
+    writer->Write(2, 0);  // lsb_in_token
+  }
+  for (size_t i = 0; i < num; ++i) {
+    WriteANSHistogram(&code.ans_counts[i * kAlphabetSize], writer);
+  }
+  allotment.Reclaim(writer);
+}
+
+void ANSEncoder::PutToken(uint32_t histo, uint32_t value) {
+  const uint32_t h = code_.context_map[histo];
+  uint32_t tok, nbits, bits;
+  UintCoder().Encode(value, &tok, &nbits, &bits);
+  JXL_DASSERT(tok < kAlphabetSize);
+  // The decoder reads the extra bits after the symbol, so they are added
+  // before it.
+  if (nbits > 0) {
+    bits_.push_back((nbits << 24) | bits);
+    total_bits_ += nbits;
+  }
+  const uint32_t freq = code_.ans_counts[h * kAlphabetSize + tok];
+  JXL_DASSERT(freq > 0);
+  if ((state_ >> (32 - kANSLogTabSize)) >= freq) {
+    bits_.push_back((16u << 24) | (state_ & 0xffff));
+    total_bits_ += 16;
+    state_ >>= 16;
+  }
+  const uint32_t v = state_ / freq;
+  const uint32_t offset = state_ - v * freq;
+  const size_t slot = code_.ans_slots[h * kAlphabetSize + tok] + offset;
+  state_ = (v << kANSLogTabSize) +
+           code_.ans_reverse_map[h * kANSTabSize + slot];
+}
+
+void ANSEncoder::WriteTo(BitWriter* writer) {
+  BitWriter::Allotment allotment(writer, 32 + total_bits_);
+  BufferedBitWriter buffered(writer);
+  buffered.Write(32, state_);
+  for (size_t i = bits_.size(); i > 0; --i) {
+    const uint32_t entry = bits_[i - 1];
+    buffered.Write(entry >> 24, entry & 0xffffff);
+  }
+  buffered.Flush();
+  allotment.Reclaim(writer);
+  state_ = kInitialState;
+  bits_.clear();
+  total_bits_ = 0;
+}
+
+}  // namespace jxl
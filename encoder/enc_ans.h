@@ -0,0 +1,67 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_ENC_ANS_H_
+#define ENCODER_ENC_ANS_H_
+
+// Encoder side of the rANS entropy coding of the JPEG XL bitstream, an
+// alternative to the prefix codes that spends fractional bits per token.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/enc_bit_writer.h"
+#include "encoder/entropy_code.h"
+#include "encoder/histogram.h"
+
+namespace jxl {
+
+static constexpr uint32_t kANSLogTabSize = 12;
+static constexpr uint32_t kANSTabSize = 1 << kANSLogTabSize;
+// With this alphabet size, the hybrid uint configs are the same as those of
+// the prefix codes.
+static constexpr uint32_t kANSLogAlphaSize = 8;
+
+// Fills in the ANS distributions of `code` from the histograms of its prefix
+// codes, after the contexts were clustered.
+void BuildANSCodes(const std::vector<Histogram>& histograms,
+                   EntropyCode* code);
+
+// Writes the part of the entropy code after the context map, in place of the
+// prefix codes.
+void WriteANSCodes(const EntropyCode& code, BitWriter* writer);
+
+// Encodes one stream of tokens, i.e. the tokens between two sequences of raw
+// bits of a section, which the decoder starts by reading the state. Since ANS
+// decodes in the reverse order of the encoding, the tokens are added from the
+// last one to the first one, and written at once when the stream is complete.
+class ANSEncoder {
+ public:
+  explicit ANSEncoder(const EntropyCode& code) : code_(code) {}
+
+  // Adds a token of the prefix code with index `histo`, before the context
+  // map of the code is applied, like the tokens of TokenBuffer.
+  void PutToken(uint32_t histo, uint32_t value);
+
+  // Writes the final state and the extra bits of the tokens in decoding order,
+  // and starts a new stream.
+  void WriteTo(BitWriter* writer);
+
+ private:
+  static constexpr uint32_t kInitialState = 0x130000;
+
+  const EntropyCode& code_;
+  uint32_t state_ = kInitialState;
+  // Renormalization and extra bits, with the number of bits in the top byte,
+  // in encoding order.
+  std::vector<uint32_t> bits_;
+  size_t total_bits_ = 0;
+};
+
+}  // namespace jxl
+#endif  // ENCODER_ENC_ANS_H_
@@ -0,0 +1,78 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <vector>
+
+#include "encoder/config.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+using test::DecodedImage;
+
+// The entropy code does not change the tokens, so the ANS codestream must
+// decode to exactly the same pixels as the prefix code one, which in turn
+// must be close to the input.
+void ExpectSameAsPrefixCode(const Image3F& image, float distance,
+                            float max_error) {
+  EncoderOptions options = EncoderOptions::ForEffort(4);
+  ASSERT_TRUE(options.optimize_code);
+  options.use_ans = true;
+  const std::vector<uint8_t> ans =
+      test::EncodeWithOptions(image, distance, options);
+  options.use_ans = false;
+  const std::vector<uint8_t> prefix =
+      test::EncodeWithOptions(image, distance, options);
+  ASSERT_FALSE(ans.empty());
+  ASSERT_FALSE(prefix.empty());
+  EXPECT_NE(ans, prefix);
+
+  DecodedImage ans_decoded, prefix_decoded;
+  ASSERT_TRUE(test::DecodeToLinear(ans, &ans_decoded));
+  ASSERT_TRUE(test::DecodeToLinear(prefix, &prefix_decoded));
+  EXPECT_EQ(image.xsize(), ans_decoded.xsize);
+  EXPECT_EQ(image.ysize(), ans_decoded.ysize);
+  EXPECT_EQ(prefix_decoded.pixels, ans_decoded.pixels);
+  EXPECT_LT(test::MaxAbsDifference(image, prefix_decoded), max_error);
+}
+
+// Several AC groups, each in a section of its own, next to the DC group whose
+// quantized DC and AC metadata are separate ANS streams, split by the raw bits
+// of the header of the AC metadata.
+TEST(EncAnsTest, MultipleGroups) {
+  ExpectSameAsPrefixCode(test::TestImage(600, 400), 1.0f, 0.25f);
+}
+
+// A single group, where all sections are merged into one and each of their
+// ANS streams follows the raw bits of the previous one.
+TEST(EncAnsTest, SingleGroup) {
+  ExpectSameAsPrefixCode(test::TestImage(200, 120), 1.0f, 0.25f);
+}
+
+// The residuals of the quantized DC and most AC contexts have a single
+// symbol, and most contexts are empty.
+TEST(EncAnsTest, FlatImage) {
+  ExpectSameAsPrefixCode(test::FlatImage(300, 300, 0.2f, 0.4f, 0.1f), 1.0f,
+                         0.05f);
+}
+
+// Only one block, so only a handful of contexts have tokens at all.
+TEST(EncAnsTest, SinglePixel) {
+  ExpectSameAsPrefixCode(test::FlatImage(1, 1, 0.5f, 0.3f, 0.7f), 1.0f,
+                         0.05f);
+}
+
+// Large coefficients, whose hybrid uint tokens have many extra bits that are
+// interleaved with the ANS state flushes.
+TEST(EncAnsTest, LowDistance) {
+  ExpectSameAsPrefixCode(test::TestImage(256, 256, 7), 0.1f, 0.05f);
+}
+
+}  // namespace
+}  // namespace jxl
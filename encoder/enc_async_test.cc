@@ -0,0 +1,51 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <stdint.h>
+
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "encoder/enc_file.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// The callback of an encode may wait for and destroy the handle of a later
+// encode, which then runs on the async thread before the callback returns.
+TEST(EncAsyncTest, WaitForLaterEncodeInCallback) {
+  const Image3F image = test::TestImage(64, 64);
+  Encoder encoder(2);
+  std::promise<void> second_started;
+  std::shared_future<void> second_ready = second_started.get_future().share();
+  std::unique_ptr<EncodeHandle> second;
+  bool second_ok = false;
+  bool second_done = false;
+  std::vector<uint8_t> first_output;
+  std::unique_ptr<EncodeHandle> first = encoder.EncodeAsync(
+      image, 1.0f, &first_output, [&](bool ok) {
+        second_ready.wait();
+        second_ok = second->Wait();
+        second_done = second->Done();
+        second.reset();
+      });
+  std::vector<uint8_t> second_output;
+  second = encoder.EncodeAsync(image, 2.0f, &second_output);
+  second_started.set_value();
+  EXPECT_TRUE(first->Wait());
+  EXPECT_TRUE(second_ok);
+  EXPECT_TRUE(second_done);
+  EXPECT_FALSE(second);
+  EXPECT_FALSE(first_output.empty());
+  EXPECT_FALSE(second_output.empty());
+}
+
+}  // namespace
+}  // namespace jxl
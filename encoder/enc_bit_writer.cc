@@ -8,17 +8,19 @@
 
 #include <string.h>  // memcpy
 
+#include <algorithm>
+
 #include "encoder/base/byte_order.h"
 
 namespace jxl {
 
+constexpr size_t BitWriter::kChunkSize;
+
 BitWriter::Allotment::Allotment(BitWriter* JXL_RESTRICT writer, size_t max_bits)
     : max_bits_(max_bits) {
   if (writer == nullptr) return;
   prev_bits_written_ = writer->BitsWritten();
-  const size_t prev_bytes = writer->storage_.size();
-  const size_t next_bytes = DivCeil(max_bits, kBitsPerByte);
-  writer->storage_.resize(prev_bytes + next_bytes);
+  writer->reserved_end_ = writer->Reserve(max_bits);
   parent_ = writer->current_allotment_;
   writer->current_allotment_ = this;
 }
@@ -42,11 +44,11 @@ void BitWriter::Allotment::PrivateReclaim(BitWriter* JXL_RESTRICT writer,
   JXL_ASSERT(*used_bits <= max_bits_);
   *unused_bits = max_bits_ - *used_bits;
 
-  // Reclaim unused bytes whole bytes from writer's allotment.
-  const size_t unused_bytes = *unused_bits / kBitsPerByte;  // truncate
-  JXL_ASSERT(writer->storage_.size() >= unused_bytes);
-  writer->storage_.resize(writer->storage_.size() - unused_bytes);
+  // The unused storage stays in the chunk for the next allotments, but is no
+  // longer reserved, so that the parent only keeps room for its own bits on
+  // top of the ones written here.
   writer->current_allotment_ = parent_;
+  writer->reserved_end_ -= *unused_bits;
   // Ensure we don't also charge the parent for these bits.
   auto parent = parent_;
   while (parent != nullptr) {
@@ -55,6 +57,73 @@ void BitWriter::Allotment::PrivateReclaim(BitWriter* JXL_RESTRICT writer,
   }
 }
 
+size_t BitWriter::Reserve(size_t max_bits) {
+  // The bits of a nested allotment are not charged to its parent, so they go
+  // after all the bits that the open allotments may still write.
+  const size_t end =
+      (current_allotment_ != nullptr ? std::max(reserved_end_, bits_written_)
+                                     : bits_written_) +
+      max_bits;
+  const size_t pos = ChunkPos();
+  // The partial byte, the new bits and the zero byte after them.
+  const size_t needed = pos + 1 + DivCeil(end - bits_written_, kBitsPerByte);
+  if (needed <= storage_.size()) return end;
+  if (needed <= storage_.capacity() || storage_.capacity() < kChunkSize ||
+      pos == 0) {
+    // Reallocations copy at most about kChunkSize bytes.
+    storage_.resize(needed);
+    return end;
+  }
+  // Nothing was written after pos yet, so the new chunk takes over the
+  // reservations of the open allotments.
+  PaddedBytes next;
+  next.resize(std::max(kChunkSize, needed - pos));
+  next[0] = storage_[pos];
+  storage_.resize(pos);
+  chunks_.push_back(std::move(storage_));
+  chunk_bytes_ += pos;
+  storage_ = std::move(next);
+  return end;
+}
+
+void BitWriter::Gather() {
+  if (chunks_.empty()) return;
+  // Also copies the partial byte.
+  // Keeps the room of the current chunk, which open allotments may use.
+  PaddedBytes all;
+  all.resize(chunk_bytes_ + storage_.size());
+  size_t pos = 0;
+  for (const PaddedBytes& chunk : chunks_) {
+    memcpy(all.data() + pos, chunk.data(), chunk.size());
+    pos += chunk.size();
+  }
+  memcpy(all.data() + pos, storage_.data(), ChunkPos() + 1);
+  chunks_.clear();
+  chunk_bytes_ = 0;
+  storage_ = std::move(all);
+}
+
+std::vector<Span<const uint8_t>> BitWriter::GetSpans() const {
+  // Callers must ensure byte alignment to avoid uninitialized bits.
+  JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+  std::vector<Span<const uint8_t>> spans;
+  spans.reserve(chunks_.size() + 1);
+  for (const PaddedBytes& chunk : chunks_) {
+    spans.emplace_back(chunk.data(), chunk.size());
+  }
+  spans.emplace_back(storage_.data(), ChunkPos());
+  return spans;
+}
+
+void BitWriter::CopyTo(uint8_t* output) const {
+  JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+  for (const PaddedBytes& chunk : chunks_) {
+    memcpy(output, chunk.data(), chunk.size());
+    output += chunk.size();
+  }
+  if (ChunkPos() > 0) memcpy(output, storage_.data(), ChunkPos());
+}
+
 void BitWriter::AppendByteAligned(std::vector<BitWriter>* others) {
   // Total size to add so we can preallocate
   size_t other_bytes = 0;
@@ -67,39 +136,40 @@ void BitWriter::AppendByteAligned(std::vector<BitWriter>* others) {
     // images with no alpha. Do nothing.
     return;
   }
-  storage_.resize(storage_.size() + other_bytes + 1);  // extra zero padding
-
   // Concatenate by copying bytes because both source and destination are bytes.
-  JXL_ASSERT(BitsWritten() % kBitsPerByte == 0);
-  size_t pos = BitsWritten() / kBitsPerByte;
+  uint8_t* output = AppendBytes(other_bytes);
   for (BitWriter& writer : *others) {
     BitWriter::Allotment allotment(&writer, 8);
     writer.ZeroPadToByte();
     allotment.Reclaim(&writer);
-    const Span<const uint8_t> span = writer.GetSpan();
-    if (!span.empty()) {
-      memcpy(storage_.data() + pos, span.data(), span.size());
-      pos += span.size();
-    }
+    writer.CopyTo(output);
+    output += writer.BitsWritten() / kBitsPerByte;
   }
-  storage_[pos++] = 0;  // for next Write
-  JXL_ASSERT(pos <= storage_.size());
-  bits_written_ += other_bytes * kBitsPerByte;
+}
+
+uint8_t* BitWriter::AppendBytes(size_t num_bytes) {
+  JXL_ASSERT(BitsWritten() % kBitsPerByte == 0);
+  Reserve(num_bytes * kBitsPerByte);
+  const size_t pos = ChunkPos();
+  storage_[pos + num_bytes] = 0;  // for next Write
+  bits_written_ += num_bytes * kBitsPerByte;
+  return storage_.data() + pos;
 }
 
 void BitWriter::Append(const BitWriter& other) {
-  // Total size to add so we can preallocate
-  size_t other_bytes = DivCeil(other.BitsWritten(), kBitsPerByte);
-  if (other_bytes == 0) {
-    return;
+  if (other.BitsWritten() == 0) return;
+  Reserve(other.BitsWritten());
+  const auto append_bytes = [this](const uint8_t* bytes, size_t num_bytes) {
+    for (size_t i = 0; i < num_bytes; ++i) {
+      Write(8, bytes[i]);
+    }
+  };
+  for (const PaddedBytes& chunk : other.chunks_) {
+    append_bytes(chunk.data(), chunk.size());
   }
-  storage_.resize(storage_.size() + other_bytes + 1);  // extra zero padding
-
-  size_t other_full_bytes = other.BitsWritten() / kBitsPerByte;
+  size_t other_full_bytes = other.ChunkPos();
   size_t other_trailing_bits = other.BitsWritten() % kBitsPerByte;
-  for (size_t i = 0; i < other_full_bytes; ++i) {
-    Write(8, other.storage_[i]);
-  }
+  append_bytes(other.storage_.data(), other_full_bytes);
   if (other_trailing_bits > 0) {
     uint64_t last_byte = other.storage_[other_full_bytes];
     uint64_t last_byte_mask = (1u << other_trailing_bits) - 1;
@@ -119,7 +189,7 @@ void BitWriter::Append(const BitWriter& other) {
 void BitWriter::Write(size_t n_bits, uint64_t bits) {
   JXL_DASSERT((bits >> n_bits) == 0);
   JXL_DASSERT(n_bits <= kMaxBitsPerCall);
-  uint8_t* p = &storage_[bits_written_ / kBitsPerByte];
+  uint8_t* p = &storage_[ChunkPos()];
   const size_t bits_in_first_byte = bits_written_ % kBitsPerByte;
   bits <<= bits_in_first_byte;
 #if JXL_BYTE_ORDER_LITTLE
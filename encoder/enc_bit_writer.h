@@ -8,6 +8,9 @@
 #define LIB_JXL_ENC_BIT_WRITER_H_
 
 // BitWriter class: unbuffered writes using unaligned 64-bit stores.
+//
+// The bytes are stored in chunks of about kChunkSize bytes, so that a large
+// writer grows without reallocating and copying what was already written.
 
 #include <stddef.h>
 #include <stdint.h>
@@ -35,6 +38,10 @@ struct BitWriter {
   // yet zero-initialized).
   static constexpr size_t kMaxBitsPerCall = 56;
 
+  // Once the current chunk has at least this many bytes, a new chunk is
+  // started instead of growing it.
+  static constexpr size_t kChunkSize = 1 << 16;
+
   BitWriter() : bits_written_(0) {}
 
   // Disallow copying - may lead to bugs.
@@ -45,18 +52,44 @@ struct BitWriter {
 
   size_t BitsWritten() const { return bits_written_; }
 
-  Span<const uint8_t> GetSpan() const {
+  // Discards all written bits, but keeps the storage of the first chunk for
+  // reuse.
+  void Reset() {
+    JXL_ASSERT(current_allotment_ == nullptr);
+    bits_written_ = 0;
+    if (!chunks_.empty()) {
+      storage_ = std::move(chunks_[0]);
+      chunks_.clear();
+    }
+    chunk_bytes_ = 0;
+    // Zero-initializes the first byte, see PaddedBytes::resize.
+    storage_.resize(0);
+    storage_.resize(1, 0);
+  }
+
+  // Returns the written bytes, after gathering the chunks into one if there
+  // are several.
+  Span<const uint8_t> GetSpan() {
     // Callers must ensure byte alignment to avoid uninitialized bits.
     JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+    Gather();
     return Span<const uint8_t>(storage_.data(), bits_written_ / kBitsPerByte);
   }
 
+  // Returns the written bytes chunk by chunk, without gathering them.
+  std::vector<Span<const uint8_t>> GetSpans() const;
+
+  // Copies the written bytes to `output`, which must have room for all of
+  // them.
+  void CopyTo(uint8_t* output) const;
+
   // Example usage: bytes = std::move(writer).TakeBytes(); Useful for the
   // top-level encoder which returns PaddedBytes, not a BitWriter.
   // *this must be an rvalue reference and is invalid afterwards.
   PaddedBytes&& TakeBytes() && {
     // Callers must ensure byte alignment to avoid uninitialized bits.
     JXL_ASSERT(bits_written_ % kBitsPerByte == 0);
+    Gather();
     storage_.resize(bits_written_ / kBitsPerByte);
     return std::move(storage_);
   }
@@ -64,12 +97,18 @@ struct BitWriter {
  public:
   void Append(const BitWriter& other);
   void AppendByteAligned(std::vector<BitWriter>* others);
+  // Grows the byte-aligned writer by num_bytes bytes and returns where they
+  // start, the caller fills them in, possibly from several threads.
+  uint8_t* AppendBytes(size_t num_bytes);
 
   class Allotment {
    public:
-    // Expands a BitWriter's storage. Must happen before calling Write or
-    // ZeroPadToByte. Must call ReclaimUnused after writing to reclaim the
-    // unused storage so that BitWriter memory use remains tightly bounded.
+    // Makes room for max_bits in a BitWriter's current chunk. Must happen
+    // before calling Write or ZeroPadToByte. Within another allotment, whose
+    // max_bits do not include the bits of this one, the room is after the room
+    // of the enclosing one. This only checks the size of the chunk if it has
+    // room already, so the storage is never shrunk again. Must call Reclaim
+    // after writing.
     Allotment(BitWriter* JXL_RESTRICT writer, size_t max_bits);
     ~Allotment();
 
@@ -113,9 +152,69 @@ struct BitWriter {
   }
 
  private:
+  // Makes room in storage_ for max_bits after the written bits and after the
+  // bits that the open allotments may still write, by growing it while it is
+  // smaller than kChunkSize and otherwise by starting a new chunk. Returns the
+  // end of the room in bits from the start of the writer.
+  size_t Reserve(size_t max_bits);
+
+  // Moves all chunks into storage_.
+  void Gather();
+
+  // Position of the byte with the next bit within storage_.
+  size_t ChunkPos() const {
+    return bits_written_ / kBitsPerByte - chunk_bytes_;
+  }
+
   size_t bits_written_;
+  // The earlier chunks, each with a whole number of bytes, since the last
+  // partial byte moves to the next chunk, and their total size.
+  std::vector<PaddedBytes> chunks_;
+  size_t chunk_bytes_ = 0;
+  // The current chunk. Its size is at least one more than ChunkPos(), the
+  // bytes after the written bits are not initialized, except for the first
+  // of them.
   PaddedBytes storage_;
   Allotment* current_allotment_ = nullptr;
+  // End of the room reserved by the open allotments, in bits from the start
+  // of the writer. Only valid while current_allotment_ is set.
+  size_t reserved_end_ = 0;
+};
+
+// Collects the bits of consecutive small writes in a 64-bit register and
+// passes them to the BitWriter only when the register is full, instead of
+// doing a load and store of the storage for every write. The BitWriter must
+// not be written directly until Flush is called, and the allotment must be
+// reclaimed only after that.
+class BufferedBitWriter {
+ public:
+  explicit BufferedBitWriter(BitWriter* JXL_RESTRICT writer)
+      : writer_(writer) {}
+  ~BufferedBitWriter() { JXL_DASSERT(num_bits_ == 0); }
+
+  BufferedBitWriter(const BufferedBitWriter&) = delete;
+  BufferedBitWriter& operator=(const BufferedBitWriter&) = delete;
+
+  // The function can write up to 32 bits in one go.
+  JXL_INLINE void Write(size_t n_bits, uint64_t bits) {
+    JXL_DASSERT(n_bits <= 32);
+    JXL_DASSERT((bits >> n_bits) == 0);
+    if (num_bits_ + n_bits > BitWriter::kMaxBitsPerCall) Flush();
+    buffer_ |= bits << num_bits_;
+    num_bits_ += n_bits;
+  }
+
+  void Flush() {
+    if (num_bits_ == 0) return;
+    writer_->Write(num_bits_, buffer_);
+    buffer_ = 0;
+    num_bits_ = 0;
+  }
+
+ private:
+  BitWriter* JXL_RESTRICT writer_;
+  uint64_t buffer_ = 0;
+  size_t num_bits_ = 0;
 };
 
 }  // namespace jxl
@@ -0,0 +1,98 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_bit_writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/span.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// Writes num_bits bits of the pattern, 8 at a time, starting at bit `first`
+// of it, and appends them to *expected.
+void WritePattern(size_t first, size_t num_bits, BitWriter* writer,
+                  std::vector<bool>* expected) {
+  for (size_t i = 0; i < num_bits; i += 8) {
+    const size_t n = num_bits - i < 8 ? num_bits - i : 8;
+    uint64_t bits = 0;
+    for (size_t j = 0; j < n; ++j) {
+      const bool bit = ((first + i + j) * 2654435761u >> 13) & 1;
+      bits |= static_cast<uint64_t>(bit) << j;
+      expected->push_back(bit);
+    }
+    writer->Write(n, bits);
+  }
+}
+
+void ExpectBits(const std::vector<bool>& expected, BitWriter* writer) {
+  ASSERT_EQ(expected.size(), writer->BitsWritten());
+  const Span<const uint8_t> bytes = writer->GetSpan();
+  for (size_t i = 0; i < expected.size(); ++i) {
+    ASSERT_EQ(expected[i], (bytes[i / 8] >> (i % 8)) & 1) << "bit " << i;
+  }
+}
+
+// The bits of a nested allotment are not charged to the enclosing one, which
+// may still write all of its max_bits after them.
+TEST(BitWriterTest, NestedAllotmentsKeepTheRoomOfTheirParent) {
+  BitWriter writer;
+  std::vector<bool> expected;
+  BitWriter::Allotment parent(&writer, 1024);
+  WritePattern(0, 3, &writer, &expected);
+  {
+    BitWriter::Allotment child(&writer, 500);
+    WritePattern(3, 500, &writer, &expected);
+    {
+      BitWriter::Allotment grandchild(&writer, 300);
+      WritePattern(503, 300, &writer, &expected);
+      grandchild.Reclaim(&writer);
+    }
+    child.Reclaim(&writer);
+  }
+  WritePattern(803, 1021, &writer, &expected);
+  writer.ZeroPadToByte();
+  for (size_t i = expected.size(); i < writer.BitsWritten(); ++i) {
+    expected.push_back(false);
+  }
+  parent.Reclaim(&writer);
+  ExpectBits(expected, &writer);
+}
+
+// A nested allotment that starts a new chunk takes the remaining room of the
+// enclosing allotment along to it.
+TEST(BitWriterTest, NestedAllotmentInNewChunk) {
+  BitWriter writer;
+  std::vector<bool> expected;
+  // Fills the first chunk up to its last few bytes.
+  const size_t kFillBits = (BitWriter::kChunkSize - 16) * 8;
+  {
+    BitWriter::Allotment fill(&writer, kFillBits);
+    WritePattern(0, kFillBits, &writer, &expected);
+    fill.Reclaim(&writer);
+  }
+  BitWriter::Allotment parent(&writer, 4096);
+  WritePattern(kFillBits, 64, &writer, &expected);
+  {
+    BitWriter::Allotment child(&writer, 8 * BitWriter::kChunkSize);
+    WritePattern(kFillBits + 64, 8 * BitWriter::kChunkSize, &writer,
+                 &expected);
+    child.Reclaim(&writer);
+  }
+  WritePattern(kFillBits + 64 + 8 * BitWriter::kChunkSize, 4032, &writer,
+               &expected);
+  parent.Reclaim(&writer);
+  ASSERT_GT(writer.GetSpans().size(), 1u);
+  ExpectBits(expected, &writer);
+}
+
+}  // namespace
+}  // namespace jxl
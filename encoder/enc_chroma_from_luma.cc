@@ -63,7 +63,7 @@ int32_t FindBestMultiplier(const float* values_m, const float* values_s,
 
 void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
                      const DequantMatrices& dequant, int8_t* ytox, int8_t* ytob,
-                     float* block_storage, float* scratch,
+                     float* dct8_coeffs, float* scratch,
                      float* coeff_storage) {
   constexpr float kDistanceMultiplierAC = 1e-3f;
 
@@ -73,9 +73,6 @@ void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
   const size_t y1 = tile_brect.y0() + tile_brect.ysize();
 
   // All are aligned.
-  float* HWY_RESTRICT block_y = block_storage;
-  float* HWY_RESTRICT block_x = block_y + kDCTBlockSize;
-  float* HWY_RESTRICT block_b = block_x + kDCTBlockSize;
   float* HWY_RESTRICT coeffs_yx = coeff_storage;
   float* HWY_RESTRICT coeffs_x = coeffs_yx + kTileDim * kTileDim;
   float* HWY_RESTRICT coeffs_yb = coeffs_x + kTileDim * kTileDim;
@@ -91,6 +88,11 @@ void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
     size_t stride = opsin.PixelsPerRow();
 
     for (size_t x = x0; x < x1; x++) {
+      float* HWY_RESTRICT block_x =
+          dct8_coeffs + ((y - y0) * kTileDimInBlocks + x - x0) * 3 *
+                            kDCTBlockSize;
+      float* HWY_RESTRICT block_y = block_x + kDCTBlockSize;
+      float* HWY_RESTRICT block_b = block_y + kDCTBlockSize;
       AcStrategy acs = AcStrategy::FromRawStrategy(AcStrategy::Type::DCT);
       TransformFromPixels(acs.Strategy(), row_y + x * kBlockDim, stride,
                           block_y, scratch_space);
@@ -103,12 +105,7 @@ void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
       const float* const JXL_RESTRICT qm_b =
           dequant.InvMatrix(acs.Strategy(), 2);
 
-      // Zero out DCs. This introduces terms in the optimization loop that
-      // don't affect the result, as they are all 0, but allow for simpler
-      // SIMDfication.
-      block_y[0] = 0;
-      block_x[0] = 0;
-      block_b[0] = 0;
+      const size_t block_start = num_ac;
       for (size_t i = 0; i < kDCTBlockSize; i += Lanes(df)) {
         const auto b_y = Load(df, block_y + i);
         const auto b_x = Load(df, block_x + i);
@@ -121,6 +118,14 @@ void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
         Store(Mul(b_b, qqm_b), df, coeffs_b + num_ac);
         num_ac += Lanes(df);
       }
+      // Zero out DCs, but keep the coefficients intact for the AC strategy
+      // search. This introduces terms in the optimization loop that don't
+      // affect the result, as they are all 0, but allow for simpler
+      // SIMDfication.
+      coeffs_yx[block_start] = 0;
+      coeffs_x[block_start] = 0;
+      coeffs_yb[block_start] = 0;
+      coeffs_b[block_start] = 0;
     }
   }
   JXL_CHECK(num_ac % Lanes(df) == 0);
@@ -142,10 +147,10 @@ HWY_EXPORT(ComputeCmapTile);
 
 void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
                      const DequantMatrices& dequant, int8_t* ytox, int8_t* ytob,
-                     float* block_storage, float* scratch_space,
+                     float* dct8_coeffs, float* scratch_space,
                      float* coeff_storage) {
   HWY_DYNAMIC_DISPATCH(ComputeCmapTile)
-  (opsin, tile_brect, dequant, ytox, ytob, block_storage, scratch_space,
+  (opsin, tile_brect, dequant, ytox, ytob, dct8_coeffs, scratch_space,
    coeff_storage);
 }
 
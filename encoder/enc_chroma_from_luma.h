@@ -16,9 +16,12 @@
 
 namespace jxl {
 
+// Also stores the DCT8 coefficients of the X, Y and B channels of each block
+// (bx, by) of the tile at dct8_coeffs + (by * kTileDimInBlocks + bx) * 3 *
+// kDCTBlockSize, where they can be reused by the AC strategy search.
 void ComputeCmapTile(const Image3F& opsin, const Rect& tile_brect,
                      const DequantMatrices& dequant, int8_t* ytox, int8_t* ytob,
-                     float* block_storage, float* scratch_space,
+                     float* dct8_coeffs, float* scratch_space,
                      float* coeff_storage);
 
 }  // namespace jxl
@@ -10,28 +10,55 @@
 #include <limits>
 #include <map>
 
-#include "encoder/enc_huffman_tree.h"
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/enc_cluster.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
 
-namespace jxl {
-namespace {
+#include "encoder/fast_math-inl.h"
 
-void HistogramBitCost(const Histogram& a) {
-  a.bit_cost = 0;
-  if (a.total_count == 0) return;
-  uint8_t depths[kAlphabetSize] = {};
-  CreateHuffmanTree(a.counts, kAlphabetSize, 15, depths);
-  for (size_t i = 0; i < kAlphabetSize; ++i) {
-    a.bit_cost += a.counts[i] * depths[i];
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Rebind;
+
+// Returns the Shannon entropy in bits of the histogram with the counts of a,
+// plus those of b if kCombined is true. The combined histogram is not
+// materialized.
+template <bool kCombined>
+float Entropy(const Histogram& a, const Histogram& b) {
+  const size_t total_count = a.total_count + (kCombined ? b.total_count : 0);
+  if (total_count == 0) return 0.0f;
+  // At most 16 lanes, so that the padded counts are whole vectors.
+  const HWY_CAPPED(float, 16) df;
+  const Rebind<int32_t, decltype(df)> di;
+  const Rebind<uint32_t, decltype(df)> du;
+  const auto zero = Zero(df);
+  const auto inv_total = Set(df, 1.0f / total_count);
+  auto entropy = Zero(df);
+  for (size_t i = 0; i < kPaddedAlphabetSize; i += Lanes(df)) {
+    auto counts_u = LoadU(du, a.counts + i);
+    if (kCombined) counts_u = Add(counts_u, LoadU(du, b.counts + i));
+    const auto counts = ConvertTo(df, BitCast(di, counts_u));
+    // The logarithm of zero is undefined, but the zero counts add nothing.
+    const auto log_p = IfThenZeroElse(Eq(counts, zero),
+                                      FastLog2f(df, Mul(counts, inv_total)));
+    entropy = NegMulAdd(counts, log_p, entropy);
   }
+  return GetLane(SumOfLanes(df, entropy));
 }
 
+void HistogramEntropy(const Histogram& a) {
+  a.entropy = Entropy<false>(a, a);
+}
+
+// Returns how many more bits a and b cost together than separately, using the
+// cached entropies of a and b.
 float HistogramDistance(const Histogram& a, const Histogram& b) {
   if (a.total_count == 0 || b.total_count == 0) return 0;
-  Histogram combined;
-  combined.AddHistogram(a);
-  combined.AddHistogram(b);
-  HistogramBitCost(combined);
-  return combined.bit_cost - a.bit_cost - b.bit_cost;
+  return Entropy<true>(a, b) - a.entropy - b.entropy;
 }
 
 // First step of a k-means clustering with a fancy distance metric.
@@ -51,7 +78,7 @@ void FastClusterHistograms(const std::vector<Histogram>& in,
       dists[i] = 0.0f;
       continue;
     }
-    HistogramBitCost(in[i]);
+    HistogramEntropy(in[i]);
     if (in[i].total_count > in[largest_idx].total_count) {
       largest_idx = i;
     }
@@ -84,11 +111,23 @@ void FastClusterHistograms(const std::vector<Histogram>& in,
       }
     }
     (*out)[best].AddHistogram(in[i]);
-    HistogramBitCost((*out)[best]);
+    HistogramEntropy((*out)[best]);
     (*histogram_symbols)[i] = best;
   }
 }
 
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(FastClusterHistograms);  // Local function.
+
+namespace {
+
 // -----------------------------------------------------------------------------
 // Histogram refinement
 
@@ -118,16 +157,21 @@ void HistogramReindex(const std::vector<uint32_t>& symbols,
 
 void ClusterHistograms(std::vector<Histogram>* histograms,
                        std::vector<uint8_t>* context_map) {
-  if (histograms->size() <= 1) return;
+  if (histograms->size() <= 1) {
+    context_map->assign(histograms->size(), 0);
+    return;
+  }
   static const size_t kClustersLimit = 8;
   size_t max_histograms = std::min(kClustersLimit, histograms->size());
 
   std::vector<Histogram> in(*histograms);
   std::vector<uint32_t> histogram_symbols;
-  FastClusterHistograms(in, max_histograms, histograms, &histogram_symbols);
+  HWY_DYNAMIC_DISPATCH(FastClusterHistograms)(in, max_histograms, histograms,
+                                              &histogram_symbols);
 
   // Convert the context map to a canonical form.
   HistogramReindex(histogram_symbols, histograms, context_map);
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
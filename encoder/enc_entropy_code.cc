@@ -6,6 +6,9 @@
 
 #include "encoder/enc_entropy_code.h"
 
+#include <algorithm>
+
+#include "encoder/enc_ans.h"
 #include "encoder/enc_cluster.h"
 #include "encoder/enc_huffman_tree.h"
 #include "encoder/histogram.h"
@@ -482,10 +485,22 @@ void BuildHuffmanCodes(const std::vector<Histogram>& histograms,
     ConvertBitDepthsToSymbols(prefix_code.depths, length, prefix_code.bits);
   }
   code->prefix_codes = code->prefix_code_storage.data();
+  PackPrefixCodes(code);
 }
 
 }  // namespace
 
+void PackPrefixCodes(EntropyCode* code) {
+  code->packed_codes.resize(code->num_prefix_codes * kAlphabetSize);
+  for (size_t i = 0; i < code->num_prefix_codes; ++i) {
+    const PrefixCode& prefix_code = code->prefix_codes[i];
+    uint32_t* packed = &code->packed_codes[i * kAlphabetSize];
+    for (size_t j = 0; j < kAlphabetSize; ++j) {
+      packed[j] = prefix_code.bits[j] | (prefix_code.depths[j] << 16);
+    }
+  }
+}
+
 void OptimizePrefixCodes(const std::vector<Token>& tokens, EntropyCode* code) {
   std::vector<Histogram> histograms(code->num_prefix_codes);
   BuildHistograms(tokens, code->context_map, code->num_contexts, &histograms);
@@ -511,12 +526,38 @@ void OptimizeEntropyCode(std::vector<Histogram>* histograms,
   code->num_contexts = code->num_prefix_codes;
   JXL_ASSERT(code->context_map_storage.size() == code->num_contexts);
   BuildHuffmanCodes(*histograms, code);
+  if (code->use_ans) BuildANSCodes(*histograms, code);
+}
+
+void ExtrapolateSampledHistograms(size_t stride,
+                                  std::vector<Histogram>* histograms) {
+  for (Histogram& histo : *histograms) {
+    histo.total_count = 0;
+    for (size_t i = 0; i < kAlphabetSize; ++i) {
+      histo.counts[i] = std::max<uint32_t>(1, histo.counts[i] * stride);
+      histo.total_count += histo.counts[i];
+    }
+  }
+}
+
+void FlattenContextMap(EntropyCode* code) {
+  if (code->orig_context_map == nullptr) return;
+  std::vector<uint8_t> context_map(code->orig_num_contexts);
+  for (size_t i = 0; i < code->orig_num_contexts; ++i) {
+    context_map[i] = code->context_map[code->orig_context_map[i]];
+  }
+  code->context_map_storage.swap(context_map);
+  code->context_map = code->context_map_storage.data();
+  code->num_contexts = code->orig_num_contexts;
+  code->orig_context_map = nullptr;
+  code->orig_num_contexts = 0;
 }
 
 void WriteContextMap(const EntropyCode& code, BitWriter* writer) {
   const size_t num_contexts =
       code.orig_context_map ? code.orig_num_contexts : code.num_contexts;
-  if (num_contexts == 0) {
+  // A single context has no context map.
+  if (num_contexts <= 1) {
     return;
   }
   if (*std::max_element(code.context_map,
@@ -550,7 +591,11 @@ void WriteContextMap(const EntropyCode& code, BitWriter* writer) {
 
 void WriteEntropyCode(const EntropyCode& code, BitWriter* writer) {
   WriteContextMap(code, writer);
-  WritePrefixCodes(code.prefix_codes, code.num_prefix_codes, writer);
+  if (code.use_ans) {
+    WriteANSCodes(code, writer);
+  } else {
+    WritePrefixCodes(code.prefix_codes, code.num_prefix_codes, writer);
+  }
 }
 
 }  // namespace jxl
@@ -10,6 +10,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "encoder/base/bits.h"
+#include "encoder/base/compiler_specific.h"
 #include "encoder/enc_bit_writer.h"
 #include "encoder/entropy_code.h"
 #include "encoder/histogram.h"
@@ -30,6 +32,24 @@ void WriteContextMap(const EntropyCode& code, BitWriter* writer);
 
 void WriteEntropyCode(const EntropyCode& code, BitWriter* writer);
 
+// Turns the histograms of the tokens of a sample of about one in `stride`
+// sections into estimates of the histograms of all sections. Every symbol that
+// the sample did not see gets the count of a single token, so that the codes
+// built from them can also write the tokens of the contexts and symbols that
+// only occur outside of the sample.
+void ExtrapolateSampledHistograms(size_t stride,
+                                  std::vector<Histogram>* histograms);
+
+// Replaces the context map of a code whose contexts were clustered by
+// OptimizeEntropyCode with the composition of the original one and the
+// clustering, so that tokens of the original contexts can be written with it.
+// This does not change how the code is written to the bitstream.
+void FlattenContextMap(EntropyCode* code);
+
+// Fills in code->packed_codes from the prefix codes, this has to be done again
+// whenever they change. The Optimize* functions do it themselves.
+void PackPrefixCodes(EntropyCode* code);
+
 // This is an upper bound on the average bits per token on an array of
 // at most 256x256 entropy coded tokens.
 static constexpr size_t kMaxBitsPerToken = 24;
@@ -44,5 +64,44 @@ static inline void WriteToken(const Token& token, const EntropyCode& code,
   writer->Write(pc.depths[tok] + nbits, data);
 }
 
+// Same as UintCoder::Encode, but without branches, so that the small values
+// are not mispredicted when they are mixed with the rare large ones.
+static JXL_INLINE void EncodeUintBranchless(uint32_t value,
+                                            uint32_t* JXL_RESTRICT token,
+                                            uint32_t* JXL_RESTRICT nbits,
+                                            uint32_t* JXL_RESTRICT bits) {
+  const bool is_small = value < 16;
+  // At least 4, so that the shifts below are defined for the small values.
+  const uint32_t n = FloorLog2Nonzero(value | 16u);
+  const uint32_t m = value - (1u << n);
+  *token = is_small ? value : (n << 2) + (m >> (n - 2));
+  *nbits = is_small ? 0 : n - 2;
+  *bits = value & ((1u << *nbits) - 1);
+}
+
+static JXL_INLINE void WriteToken(const Token& token, const EntropyCode& code,
+                                  BufferedBitWriter* writer) {
+  uint32_t tok, nbits, bits;
+  EncodeUintBranchless(token.value, &tok, &nbits, &bits);
+  const uint32_t packed = code.packed_codes[code.context_map[token.context] *
+                                                kAlphabetSize +
+                                            tok];
+  const uint32_t depth = packed >> 16;
+  writer->Write(depth + nbits, (packed & 0xFFFF) | (bits << depth));
+}
+
+// Writes the tokens with the bit pattern of calling WriteToken for each of
+// them, the writer must have an allotment for them. The prefix codes must have
+// been packed.
+static inline void WriteTokens(const Token* tokens, size_t num,
+                               const EntropyCode& code, BitWriter* writer) {
+  JXL_DASSERT(!code.packed_codes.empty());
+  BufferedBitWriter buffered(writer);
+  for (size_t i = 0; i < num; ++i) {
+    WriteToken(tokens[i], code, &buffered);
+  }
+  buffered.Flush();
+}
+
 }  // namespace jxl
 #endif  // ENCODER_ENC_ENTROPY_CODE_H_
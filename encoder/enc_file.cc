@@ -9,12 +9,23 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>   //NOLINT
+#include <thread>  //NOLINT
+#include <utility>
 #include <vector>
 
 #include "encoder/base/data_parallel.h"
+#include "encoder/base/padded_bytes.h"
+#include "encoder/base/printf_macros.h"
 #include "encoder/enc_bit_writer.h"
 #include "encoder/enc_frame.h"
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
 
 namespace jxl {
 
@@ -50,58 +61,660 @@ Status WriteSizeHeader(size_t xsize64, size_t ysize64, BitWriter* writer) {
   return true;
 }
 
-}  // namespace
-
-bool EncodeFile(const Image3F& input, float distance,
-                std::vector<uint8_t>* output) {
-  if (distance < 0.0) {
-    return JXL_FAILURE("Invalid butteraugli distance (%f)", distance);
-  } else if (distance == 0.0) {
+Status ValidateDistance(float* distance) {
+  if (*distance < 0.0) {
+    return JXL_FAILURE("Invalid butteraugli distance (%f)", *distance);
+  } else if (*distance == 0.0) {
     return JXL_FAILURE("Lossless compression is not supported.");
-  } else if (distance <= 0.03) {
+  } else if (*distance <= 0.03) {
     // Distance where the average BPP is still slightly smaller on photographs
     // than for lossless JPEG XL.
-    distance = 0.03;
+    *distance = 0.03;
+  }
+  return true;
+}
+
+Status WriteAnimationHeader(const AnimationParams& params, BitWriter* writer) {
+  const uint32_t num = params.tps_numerator;
+  const uint32_t den = params.tps_denominator;
+  if (num == 0 || num > (1u << 30) || den == 0 || (den > 1024 && den != 1001)) {
+    return JXL_FAILURE("Invalid tick rate %u/%u", num, den);
+  }
+  if (num == 100) {
+    writer->Write(2, 0);
+  } else if (num == 1000) {
+    writer->Write(2, 1);
+  } else if (num <= 1024) {
+    writer->Write(2, 2);
+    writer->Write(10, num - 1);
+  } else {
+    writer->Write(2, 3);
+    writer->Write(30, num - 1);
+  }
+  if (den == 1) {
+    writer->Write(2, 0);
+  } else if (den == 1001) {
+    writer->Write(2, 1);
+  } else if (den <= 256) {
+    writer->Write(2, 2);
+    writer->Write(8, den - 1);
+  } else {
+    writer->Write(2, 3);
+    writer->Write(10, den - 1);
+  }
+  const uint32_t loops = params.num_loops;
+  if (loops == 0) {
+    writer->Write(2, 0);
+  } else if (loops < 8) {
+    writer->Write(2, 1);
+    writer->Write(3, loops);
+  } else if (loops < 65536) {
+    writer->Write(2, 2);
+    writer->Write(16, loops);
+  } else {
+    writer->Write(2, 3);
+    writer->Write(32, loops);
+  }
+  writer->Write(1, 0);  // no timecodes
+  return true;
+}
+
+// Writes the headers of a still image, or of an animation if `animation` is
+// not null. The recompressed JPEGs are 8-bit sRGB images that are not XYB
+// encoded.
+Status WriteImageHeader(size_t xsize, size_t ysize, BitWriter* writer,
+                        const AnimationParams* animation = nullptr,
+                        bool jpeg = false) {
+  if (xsize == 0 || ysize == 0) {
+    return JXL_FAILURE("Empty image");
+  }
+  BitWriter::Allotment allotment(writer, 1024);
+  writer->Write(8, 0xFF);
+  writer->Write(8, kCodestreamMarker);
+  JXL_RETURN_IF_ERROR(WriteSizeHeader(xsize, ysize, writer));
+  writer->Write(1, 0);  // not all default image metadata
+  if (animation) {
+    writer->Write(1, 1);  // extra fields in image metadata
+    writer->Write(3, 0);  // identity orientation
+    writer->Write(1, 0);  // no intrinsic size
+    writer->Write(1, 0);  // no preview
+    writer->Write(1, 1);  // animation
+    JXL_RETURN_IF_ERROR(WriteAnimationHeader(*animation, writer));
+  } else {
+    writer->Write(1, 0);  // no extra fields in image metadata
+  }
+  if (jpeg) {
+    writer->Write(1, 0);  // integer samples
+    writer->Write(2, 0);  // 8 bits per sample
+  } else {
+    writer->Write(1, 1);  // floating point samples
+    writer->Write(2, 0);  // 32 bits per sample
+    writer->Write(4, 7);  // 8 exponent bits per sample
+  }
+  writer->Write(1, 0);  // modular 16 bit sufficient
+  writer->Write(2, 0);  // no extra channels
+  if (jpeg) {
+    writer->Write(1, 0);  // not xyb encoded
+    writer->Write(1, 1);  // all default (sRGB) color encoding
+    if (animation) {
+      writer->Write(1, 1);  // all default tone mapping
+    }
+    writer->Write(2, 0);  // no extensions
+    writer->Write(1, 1);  // all default transform data
+    writer->ZeroPadToByte();
+    allotment.Reclaim(writer);
+    return true;
+  }
+  writer->Write(1, 1);  // xyb encoded
+  writer->Write(1, 0);  // not all default color encoding
+  writer->Write(1, 0);  // no icc
+  writer->Write(2, 0);  // RGB color space
+  writer->Write(2, 1);  // D65 white point
+  writer->Write(2, 1);  // SRGB primaries
+  writer->Write(1, 0);  // no gamma
+  writer->Write(2, 2);  // transfer function selector bits (2 .. 17)
+  writer->Write(4, 6);  // linear transfer function (enum value 8)
+  writer->Write(2, 1);  // relative rendering intent
+  if (animation) {
+    writer->Write(1, 1);  // all default tone mapping
+  }
+  writer->Write(2, 0);  // no extensions
+  writer->Write(1, 1);  // all default transform data
+  writer->ZeroPadToByte();
+  allotment.Reclaim(writer);
+  return true;
+}
+
+Status ValidateInterleavedImage(const InterleavedImage& image) {
+  if (image.pixels == nullptr) {
+    return JXL_FAILURE("Missing pixels");
   }
-  if (input.xsize() == 0 || input.ysize() == 0) {
+  if (image.num_channels != 3 && image.num_channels != 4) {
+    return JXL_FAILURE("Invalid number of channels (%" PRIuS ")",
+                       image.num_channels);
+  }
+  const size_t row_bytes = image.xsize * image.BytesPerPixel();
+  const size_t abs_stride =
+      static_cast<size_t>(image.stride < 0 ? -image.stride : image.stride);
+  if (image.ysize > 1 && abs_stride < row_bytes) {
+    return JXL_FAILURE("Stride too small");
+  }
+  return true;
+}
+
+Status ValidateJPEGCoefficients(const JPEGCoefficients& jpeg) {
+  if (jpeg.xsize == 0 || jpeg.ysize == 0) {
     return JXL_FAILURE("Empty image");
   }
+  for (size_t c = 0; c < kNumJPEGComponents; ++c) {
+    if (jpeg.coeffs[c] == nullptr) {
+      return JXL_FAILURE("Missing coefficients");
+    }
+    if (jpeg.blocks_per_row[c] < DivCeil(jpeg.xsize, kBlockDim)) {
+      return JXL_FAILURE("Too few blocks per row");
+    }
+    for (size_t k = 0; k < kDCTBlockSize; ++k) {
+      if (jpeg.quant[c][k] == 0) {
+        return JXL_FAILURE("Invalid quantization table");
+      }
+    }
+  }
+  return true;
+}
+
+void CopyToOutput(const BitWriter& writer, std::vector<uint8_t>* output) {
+  output->resize(writer.BitsWritten() / kBitsPerByte);
+  writer.CopyTo(output->data());
+}
+
+// Returns the part of target_size that is left for the frame after the
+// headers that are already in the writer.
+size_t FrameTargetSize(size_t target_size, const BitWriter& writer) {
+  const size_t header_size = DivCeil(writer.BitsWritten(), kBitsPerByte);
+  return target_size > header_size ? target_size - header_size : 0;
+}
+
+}  // namespace
+
+size_t EstimateCompressedSize(size_t xsize, size_t ysize, float distance) {
+  // Photographs take about 1.5 bits per pixel at distance 1, and the size
+  // shrinks somewhat slower than the distance grows.
+  const float bits_per_pixel = 1.5f / std::pow(std::max(distance, 0.1f), 0.8f);
+  return 4096 + static_cast<size_t>(xsize * ysize * bits_per_pixel / 8);
+}
 
+Encoder::Encoder(int num_worker_threads,
+                 ThreadParallelRunner::Schedule schedule,
+                 ThreadParallelRunner::Affinity affinity)
+    : pool_(num_worker_threads, schedule, affinity) {}
+
+Encoder::Encoder(JxlParallelRunner runner, void* runner_opaque)
+    : pool_(runner, runner_opaque) {}
+
+Status Encoder::CheckNoAnimation() const {
+  // A codestream started in between would end up in the middle of the frames
+  // of the animation, and would change the groups kept for its next frame.
+  if (in_animation_) return JXL_FAILURE("Animation in progress");
+  return true;
+}
+
+Status Encoder::EncodeToWriter(const Image3F& input, float distance) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(), &writer_));
+  return EncodeFrame(distance, options_, input, &pool_, &writer_, &cache_);
+}
+
+Status Encoder::EncodeToWriter(size_t xsize, size_t ysize,
+                               const RowSource& source, float distance) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(xsize, ysize, &writer_));
+  return EncodeFrame(distance, options_, xsize, ysize, source, &pool_,
+                     &writer_, &cache_);
+}
+
+Status Encoder::EncodeToWriter(const InterleavedImage& input, float distance) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(ValidateInterleavedImage(input));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize, input.ysize, &writer_));
+  return EncodeFrame(distance, options_, input, &pool_, &writer_, &cache_);
+}
+
+Status Encoder::EncodeToWriter(const JPEGCoefficients& jpeg) {
+  JXL_RETURN_IF_ERROR(ValidateJPEGCoefficients(jpeg));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(jpeg.xsize, jpeg.ysize, &writer_,
+                                       /*animation=*/nullptr, /*jpeg=*/true));
+  return EncodeFrame(options_, jpeg, &pool_, &writer_, &cache_);
+}
+
+bool Encoder::Encode(const Image3F& input, float distance,
+                     std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(input, distance));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::Encode(size_t xsize, size_t ysize, const RowSource& source,
+                     float distance, std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(xsize, ysize, source, distance));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::Encode(const Image3F& input, float distance,
+                     PaddedBytes* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(input, distance));
+  *output = std::move(writer_).TakeBytes();
+  return true;
+}
+
+bool Encoder::Encode(size_t xsize, size_t ysize, const RowSource& source,
+                     float distance, PaddedBytes* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(xsize, ysize, source, distance));
+  *output = std::move(writer_).TakeBytes();
+  return true;
+}
+
+bool Encoder::Encode(const Image3F& input, float distance,
+                     const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(), &writer_));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  return EncodeFrame(distance, options_, input, &pool_, sink, &cache_);
+}
+
+bool Encoder::Encode(size_t xsize, size_t ysize, const RowSource& source,
+                     float distance, const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(xsize, ysize, &writer_));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  return EncodeFrame(distance, options_, xsize, ysize, source, &pool_, sink,
+                     &cache_);
+}
+
+bool Encoder::Encode(size_t xsize, size_t ysize, TileSource* source,
+                     float distance, const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(xsize, ysize, &writer_));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  return EncodeFrame(distance, options_, xsize, ysize, source, &pool_, sink,
+                     &cache_);
+}
+
+bool Encoder::Encode(const InterleavedImage& input, float distance,
+                     std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(input, distance));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::Encode(const InterleavedImage& input, float distance,
+                     PaddedBytes* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(input, distance));
+  *output = std::move(writer_).TakeBytes();
+  return true;
+}
+
+bool Encoder::Encode(const InterleavedImage& input, float distance,
+                     const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(ValidateInterleavedImage(input));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize, input.ysize, &writer_));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  return EncodeFrame(distance, options_, input, &pool_, sink, &cache_);
+}
+
+bool Encoder::Encode(const JPEGCoefficients& jpeg,
+                     std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriter(jpeg));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::Encode(const JPEGCoefficients& jpeg, const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(ValidateJPEGCoefficients(jpeg));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(jpeg.xsize, jpeg.ysize, &writer_,
+                                       /*animation=*/nullptr, /*jpeg=*/true));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  return EncodeFrame(options_, jpeg, &pool_, sink, &cache_);
+}
+
+Status Encoder::EncodeToWriterForSize(const Image3F& input,
+                                      size_t target_size, float* distance) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(distance));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize(), input.ysize(), &writer_));
+  return EncodeFrameForSize(FrameTargetSize(target_size, writer_), options_,
+                            input, &pool_, distance, &writer_, &cache_);
+}
+
+Status Encoder::EncodeToWriterForSize(const InterleavedImage& input,
+                                      size_t target_size, float* distance) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(distance));
+  JXL_RETURN_IF_ERROR(ValidateInterleavedImage(input));
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(input.xsize, input.ysize, &writer_));
+  return EncodeFrameForSize(FrameTargetSize(target_size, writer_), options_,
+                            input, &pool_, distance, &writer_, &cache_);
+}
+
+bool Encoder::EncodeForSize(const Image3F& input, size_t target_size,
+                            float* distance, std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriterForSize(input, target_size, distance));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::EncodeForSize(const InterleavedImage& input, size_t target_size,
+                            float* distance, std::vector<uint8_t>* output) {
+  JXL_RETURN_IF_ERROR(EncodeToWriterForSize(input, target_size, distance));
+  CopyToOutput(writer_, output);
+  return true;
+}
+
+bool Encoder::EncodeForSize(const InterleavedImage& input, size_t target_size,
+                            float* distance, const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(EncodeToWriterForSize(input, target_size, distance));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write output");
+  return true;
+}
+
+EncodeHandle::~EncodeHandle() {
+  Cancel();
+  Wait();
+}
+
+bool EncodeHandle::Wait() {
+  if (std::this_thread::get_id() == thread_id_) {
+    // In a callback, where the later encodes are still queued and waiting for
+    // them would never return.
+    while (!finished_) {
+      if (!encoder_->RunNextAsyncJob()) {
+        return JXL_FAILURE("Async encode is not queued");
+      }
+    }
+    return ok_;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this]() { return Done(); });
+  return ok_;
+}
+
+void EncodeHandle::Finish(bool ok, const EncodeCallback& done) {
+  ok_ = ok;
+  finished_ = true;
+  if (done) done(ok);
+  // The handle may be destroyed as soon as the mutex is released.
+  std::lock_guard<std::mutex> lock(mutex_);
+  done_.store(true, std::memory_order_release);
+  done_cv_.notify_all();
+}
+
+Encoder::~Encoder() {
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    async_exit_ = true;
+  }
+  async_cv_.notify_one();
+  if (async_thread_.joinable()) async_thread_.join();
+}
+
+void Encoder::RunAsyncThread() {
+  std::unique_lock<std::mutex> lock(async_mutex_);
+  for (;;) {
+    async_cv_.wait(lock,
+                   [this]() { return async_exit_ || !async_jobs_.empty(); });
+    // The pending encodes are finished before the thread exits.
+    if (async_jobs_.empty()) return;
+    std::function<void()> job = std::move(async_jobs_.front());
+    async_jobs_.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+bool Encoder::RunNextAsyncJob() {
+  std::function<void()> job;
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (async_jobs_.empty()) return false;
+    job = std::move(async_jobs_.front());
+    async_jobs_.pop_front();
+  }
+  job();
+  return true;
+}
+
+std::unique_ptr<EncodeHandle> Encoder::StartAsync(
+    const std::function<bool()>& encode, EncodeCallback done) {
+  std::unique_ptr<EncodeHandle> handle(new EncodeHandle());
+  EncodeHandle* h = handle.get();
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (!async_thread_.joinable()) {
+      async_thread_ = std::thread([this]() { RunAsyncThread(); });
+    }
+    h->thread_id_ = async_thread_.get_id();
+    h->encoder_ = this;
+    async_jobs_.push_back([this, h, encode, done]() {
+      cache_.set_cancel_flag(&h->cancel_);
+      const bool ok = encode();
+      cache_.set_cancel_flag(nullptr);
+      h->Finish(ok, done);
+    });
+  }
+  async_cv_.notify_one();
+  return handle;
+}
+
+std::unique_ptr<EncodeHandle> Encoder::EncodeAsync(
+    const Image3F& input, float distance, std::vector<uint8_t>* output,
+    EncodeCallback done) {
+  return StartAsync(
+      [this, &input, distance, output]() {
+        return Encode(input, distance, output);
+      },
+      done);
+}
+
+std::unique_ptr<EncodeHandle> Encoder::EncodeAsync(
+    const InterleavedImage& input, float distance,
+    std::vector<uint8_t>* output, EncodeCallback done) {
+  // The InterleavedImage only points to the pixels, so it is copied.
+  return StartAsync(
+      [this, input, distance, output]() {
+        return Encode(input, distance, output);
+      },
+      done);
+}
+
+bool Encoder::EncodePreview(float distance, std::vector<uint8_t>* output) {
+  const Image3F& preview = cache_.preview();
+  if (preview.xsize() == 0) return JXL_FAILURE("No preview");
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  EncoderOptions options = options_;
+  options.dc_preview = false;
+  options.incremental = false;
+  // The preview is in the cache, so it is encoded with a temporary one.
   BitWriter writer;
-  BitWriter::Allotment allotment(&writer, 1024);
-  writer.Write(8, 0xFF);
-  writer.Write(8, kCodestreamMarker);
-  JXL_RETURN_IF_ERROR(WriteSizeHeader(input.xsize(), input.ysize(), &writer));
-  writer.Write(1, 0);  // not all default image metadata
-  writer.Write(1, 0);  // no extra fields in image metadata
-  writer.Write(1, 1);  // floating point samples
-  writer.Write(2, 0);  // 32 bits per sample
-  writer.Write(4, 7);  // 8 exponent bits per sample
-  writer.Write(1, 0);  // modular 16 bit sufficient
-  writer.Write(2, 0);  // no extra channels
-  writer.Write(1, 1);  // xyb encoded
-  writer.Write(1, 0);  // not all default color encoding
-  writer.Write(1, 0);  // no icc
-  writer.Write(2, 0);  // RGB color space
-  writer.Write(2, 1);  // D65 white point
-  writer.Write(2, 1);  // SRGB primaries
-  writer.Write(1, 0);  // no gamma
-  writer.Write(2, 2);  // transfer function selector bits (2 .. 17)
-  writer.Write(4, 6);  // linear transfer function (enum value 8)
-  writer.Write(2, 1);  // relative rendering intent
-  writer.Write(2, 0);  // no extensions
-  writer.Write(1, 1);  // all default transform data
-  writer.ZeroPadToByte();
-  allotment.Reclaim(&writer);
-
-  ThreadPool pool;
-  JXL_RETURN_IF_ERROR(EncodeFrame(distance, input, &pool, &writer));
-
-  PaddedBytes compressed;
-  compressed = std::move(writer).TakeBytes();
-  output->assign(compressed.data(), compressed.data() + compressed.size());
+  JXL_RETURN_IF_ERROR(
+      WriteImageHeader(preview.xsize(), preview.ysize(), &writer));
+  JXL_RETURN_IF_ERROR(
+      EncodeFrame(distance, options, preview, &pool_, &writer));
+  CopyToOutput(writer, output);
+  return true;
+}
+
+bool Encoder::StartAnimation(size_t xsize, size_t ysize,
+                             const AnimationParams& params,
+                             const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(CheckNoAnimation());
+  writer_.Reset();
+  JXL_RETURN_IF_ERROR(WriteImageHeader(xsize, ysize, &writer_, &params));
+  if (!sink(writer_.GetSpan())) return JXL_FAILURE("Failed to write header");
+  animation_sink_ = sink;
+  animation_xsize_ = xsize;
+  animation_ysize_ = ysize;
+  in_animation_ = true;
+  return true;
+}
+
+Status Encoder::StartAnimationFrame(size_t xsize, size_t ysize,
+                                    uint32_t duration, bool is_last,
+                                    FrameInfo* info) {
+  if (!in_animation_) return JXL_FAILURE("No animation started");
+  if (xsize != animation_xsize_ || ysize != animation_ysize_) {
+    return JXL_FAILURE("Frame size differs from the animation size");
+  }
+  if (duration == 0) return JXL_FAILURE("Frame without duration");
+  // The animation ends with its last frame, even if that fails.
+  if (is_last) in_animation_ = false;
+  info->animation = true;
+  info->duration = duration;
+  info->is_last = is_last;
+  return true;
+}
+
+bool Encoder::AddFrame(const Image3F& frame, float distance,
+                       uint32_t duration, bool is_last) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  FrameInfo info;
+  JXL_RETURN_IF_ERROR(StartAnimationFrame(frame.xsize(), frame.ysize(),
+                                          duration, is_last, &info));
+  return EncodeFrame(distance, info, options_, frame, &pool_, animation_sink_,
+                     &cache_);
+}
+
+bool Encoder::AddFrame(const InterleavedImage& frame, float distance,
+                       uint32_t duration, bool is_last) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  JXL_RETURN_IF_ERROR(ValidateInterleavedImage(frame));
+  FrameInfo info;
+  JXL_RETURN_IF_ERROR(StartAnimationFrame(frame.xsize, frame.ysize, duration,
+                                          is_last, &info));
+  return EncodeFrame(distance, info, options_, frame, &pool_, animation_sink_,
+                     &cache_);
+}
+
+std::unique_ptr<EncodeHandle> Encoder::AddFrameAsync(
+    const InterleavedImage& frame, float distance, uint32_t duration,
+    bool is_last, EncodeCallback done) {
+  // The InterleavedImage only points to the pixels, so it is copied.
+  return StartAsync(
+      [this, frame, distance, duration, is_last]() {
+        return AddFrame(frame, distance, duration, is_last);
+      },
+      done);
+}
 
+bool Encoder::EncodeBatch(const std::vector<const Image3F*>& inputs,
+                          float distance,
+                          std::vector<std::vector<uint8_t>>* outputs) {
+  JXL_RETURN_IF_ERROR(ValidateDistance(&distance));
+  outputs->resize(inputs.size());
+  const auto init = [&](size_t num_threads) {
+    if (batch_memory_.size() < num_threads) batch_memory_.resize(num_threads);
+    return true;
+  };
+  std::atomic<bool> has_error{false};
+  const auto encode_image = [&](const uint32_t i, const size_t thread) {
+    if (has_error) return;
+    if (!batch_memory_[thread]) {
+      batch_memory_[thread].reset(new BatchMemory());
+    }
+    BatchMemory* mem = batch_memory_[thread].get();
+    const Image3F& input = *inputs[i];
+    mem->writer.Reset();
+    // The groups of each image are processed by a nested Run on the pool.
+    if (!WriteImageHeader(input.xsize(), input.ysize(), &mem->writer) ||
+        !EncodeFrame(distance, options_, input, &pool_, &mem->writer,
+                     &mem->cache)) {
+      has_error = true;
+      return;
+    }
+    CopyToOutput(mem->writer, &(*outputs)[i]);
+  };
+  JXL_RETURN_IF_ERROR(
+      pool_.Run(0, inputs.size(), init, encode_image, "EncodeBatch"));
+  if (has_error) return JXL_FAILURE("Failed to encode batch");
   return true;
 }
 
+bool EncodeFile(const Image3F& input, float distance,
+                std::vector<uint8_t>* output) {
+  return Encoder().Encode(input, distance, output);
+}
+
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, std::vector<uint8_t>* output) {
+  return Encoder().Encode(xsize, ysize, source, distance, output);
+}
+
+bool EncodeFile(const Image3F& input, float distance, PaddedBytes* output) {
+  return Encoder().Encode(input, distance, output);
+}
+
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, PaddedBytes* output) {
+  return Encoder().Encode(xsize, ysize, source, distance, output);
+}
+
+bool EncodeFile(const Image3F& input, float distance,
+                const OutputSink& sink) {
+  return Encoder().Encode(input, distance, sink);
+}
+
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, const OutputSink& sink) {
+  return Encoder().Encode(xsize, ysize, source, distance, sink);
+}
+
+bool EncodeFile(size_t xsize, size_t ysize, TileSource* source,
+                float distance, const OutputSink& sink) {
+  return Encoder().Encode(xsize, ysize, source, distance, sink);
+}
+
+bool EncodeFile(const InterleavedImage& input, float distance,
+                std::vector<uint8_t>* output) {
+  return Encoder().Encode(input, distance, output);
+}
+
+bool EncodeFile(const InterleavedImage& input, float distance,
+                PaddedBytes* output) {
+  return Encoder().Encode(input, distance, output);
+}
+
+bool EncodeFile(const InterleavedImage& input, float distance,
+                const OutputSink& sink) {
+  return Encoder().Encode(input, distance, sink);
+}
+
+bool EncodeFile(const JPEGCoefficients& jpeg, std::vector<uint8_t>* output) {
+  return Encoder().Encode(jpeg, output);
+}
+
+bool EncodeFile(const JPEGCoefficients& jpeg, const OutputSink& sink) {
+  return Encoder().Encode(jpeg, sink);
+}
+
 }  // namespace jxl
@@ -7,11 +7,29 @@
 #ifndef ENCODER_ENC_FILE_H_
 #define ENCODER_ENC_FILE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <condition_variable>  //NOLINT
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>   //NOLINT
+#include <thread>  //NOLINT
 #include <vector>
 
+#include "encoder/base/cache_aligned.h"
+#include "encoder/base/data_parallel.h"
+#include "encoder/base/padded_bytes.h"
+#include "encoder/base/status.h"
+#include "encoder/config.h"
+#include "encoder/enc_bit_writer.h"
+#include "encoder/enc_frame.h"
+#include "encoder/enc_stats.h"
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
+#include "encoder/jpeg_coefficients.h"
 
 namespace jxl {
 
@@ -20,6 +38,287 @@ namespace jxl {
 bool EncodeFile(const Image3F& input, float distance,
                 std::vector<uint8_t>* output);
 
+// Same as above, but the xsize x ysize input image is pulled from `source`
+// one band of rows at a time, see EncodeFrame.
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, std::vector<uint8_t>* output);
+
+// Same as the above, but the codestream is moved into *output instead of being
+// copied, which also saves the copy for callers that can use a PaddedBytes.
+bool EncodeFile(const Image3F& input, float distance, PaddedBytes* output);
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, PaddedBytes* output);
+
+// Same as the above, but the codestream is passed to `sink` piece by piece in
+// stream order instead of being collected in one buffer, see EncodeFrame.
+bool EncodeFile(const Image3F& input, float distance, const OutputSink& sink);
+bool EncodeFile(size_t xsize, size_t ysize, const RowSource& source,
+                float distance, const OutputSink& sink);
+
+// Same as the above, but the input is read from `source` one AC group at a
+// time, see TileSource. For images that are too large to be in memory, the
+// codestream is only passed to a sink.
+bool EncodeFile(size_t xsize, size_t ysize, TileSource* source,
+                float distance, const OutputSink& sink);
+
+// Same as the above, but the input is an interleaved 8-bit, 16-bit or float
+// RGB(A) image, either sRGB-encoded or linear, see InterleavedImage.
+bool EncodeFile(const InterleavedImage& input, float distance,
+                std::vector<uint8_t>* output);
+bool EncodeFile(const InterleavedImage& input, float distance,
+                PaddedBytes* output);
+bool EncodeFile(const InterleavedImage& input, float distance,
+                const OutputSink& sink);
+
+// Losslessly recompresses the quantized DCT coefficients of a JPEG into a
+// codestream that decodes to the same pixels, see JPEGCoefficients.
+bool EncodeFile(const JPEGCoefficients& jpeg, std::vector<uint8_t>* output);
+bool EncodeFile(const JPEGCoefficients& jpeg, const OutputSink& sink);
+
+// Returns a generous estimate of the size of the codestream of a typical
+// photograph, for callers that reserve their output buffers up front. It is
+// not an upper bound, the output still grows as needed.
+size_t EstimateCompressedSize(size_t xsize, size_t ysize, float distance);
+
+// Timing of the frames of an animation, see Encoder::StartAnimation.
+struct AnimationParams {
+  // The durations of the frames are in ticks of tps_denominator /
+  // tps_numerator seconds, tps_numerator is at most 2^30 and tps_denominator
+  // at most 1024, or 1001 for the NTSC rates.
+  uint32_t tps_numerator = 100;
+  uint32_t tps_denominator = 1;
+  // Number of times the animation is played, 0 for forever.
+  uint32_t num_loops = 0;
+};
+
+class Encoder;
+
+// Called with whether the encode succeeded, on the async thread of the
+// Encoder. It must not destroy the EncodeHandle of its own encode, but may
+// start the next async encode or frame, and wait for or destroy the handles
+// of the other encodes.
+typedef std::function<void(bool ok)> EncodeCallback;
+
+// Handle of an encode started by Encoder::EncodeAsync.
+class EncodeHandle {
+ public:
+  EncodeHandle() = default;
+  EncodeHandle(const EncodeHandle&) = delete;
+  EncodeHandle& operator=(const EncodeHandle&) = delete;
+  // Cancels the encode if it is still running, and waits for it.
+  ~EncodeHandle();
+
+  // Returns whether the encode has finished, after its callback returned.
+  bool Done() const { return done_.load(std::memory_order_acquire); }
+
+  // Waits until the encode has finished and returns whether it succeeded.
+  // From the callback of this encode, returns its result right away. From the
+  // callback of an earlier encode of the same Encoder, which runs on the async
+  // thread before this one, runs the queued encodes up to this one on that
+  // thread instead of waiting for them forever.
+  bool Wait();
+
+  // Asks the encode to stop. The threads stop at their next AC stripe or DC
+  // group, and the encode then fails. Can be called from any thread.
+  void Cancel() { cancel_.store(true, std::memory_order_relaxed); }
+
+ private:
+  friend class Encoder;
+
+  // Called on the async thread of the Encoder once the encode has finished.
+  void Finish(bool ok, const EncodeCallback& done);
+
+  std::atomic<bool> cancel_{false};
+  std::atomic<bool> done_{false};
+  // Only written by the async thread, before done_ is set.
+  bool ok_ = false;
+  bool finished_ = false;
+  std::thread::id thread_id_;
+  Encoder* encoder_ = nullptr;
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+};
+
+// Same as the EncodeFile functions, but keeps the thread pool, the
+// pre-computed tables and the buffers between Encode calls, which amortizes
+// the setup cost when encoding many images. Not thread-safe.
+class Encoder {
+ public:
+  // See ThreadParallelRunner for the schedule and affinity of the workers.
+  // Pinning the workers to NUMA nodes works best with the work stealing
+  // schedule, which gives the workers of each node neighbouring groups.
+  explicit Encoder(
+      int num_worker_threads = std::thread::hardware_concurrency(),
+      ThreadParallelRunner::Schedule schedule =
+          ThreadParallelRunner::Schedule::kGuided,
+      ThreadParallelRunner::Affinity affinity =
+          ThreadParallelRunner::Affinity::kNone);
+  // Runs all parallel work with an external runner, e.g. one that adapts the
+  // executor of the application, see JxlParallelRunner. The runner_opaque
+  // must outlive the Encoder.
+  Encoder(JxlParallelRunner runner, void* runner_opaque);
+  // Finishes the pending async encodes.
+  ~Encoder();
+
+  // Backs the large images and buffers of the encoders of the whole process
+  // with huge pages, optionally carved out of a preallocated region of
+  // region_bytes, see SetLargePageMode. A new region can only be set once the
+  // Encoders that hold buffers of the previous one are destroyed.
+  static bool SetPageMode(PageMode mode, size_t region_bytes = 0) {
+    return SetLargePageMode(mode, region_bytes);
+  }
+
+  // Takes the heuristics of the subsequent Encode calls of pixels from
+  // `backend`, see HeuristicsBackend. Not used by EncodeBatch.
+  void SetHeuristicsBackend(HeuristicsBackend* backend) {
+    cache_.set_heuristics_backend(backend);
+  }
+
+  // The options are used by all subsequent Encode calls.
+  void SetOptions(const EncoderOptions& options) { options_ = options; }
+  const EncoderOptions& options() const { return options_; }
+
+  // Stats of the last Encode call with EncoderOptions::collect_stats, not
+  // filled in by EncodeBatch.
+  const EncodeStats& stats() const { return cache_.stats(); }
+
+  // Preview of the last Encode call with EncoderOptions::dc_preview, not
+  // filled in by EncodeBatch, see EncoderCache::preview.
+  const Image3F& preview() const { return cache_.preview(); }
+  // Encodes the preview into a separate small codestream. Since the preview
+  // has 1/64th of the pixels of the image, this takes a small fraction of
+  // the time of the image.
+  bool EncodePreview(float distance, std::vector<uint8_t>* output);
+
+  bool Encode(const Image3F& input, float distance,
+              std::vector<uint8_t>* output);
+  bool Encode(size_t xsize, size_t ysize, const RowSource& source,
+              float distance, std::vector<uint8_t>* output);
+  bool Encode(const Image3F& input, float distance, PaddedBytes* output);
+  bool Encode(size_t xsize, size_t ysize, const RowSource& source,
+              float distance, PaddedBytes* output);
+  bool Encode(const Image3F& input, float distance, const OutputSink& sink);
+  bool Encode(size_t xsize, size_t ysize, const RowSource& source,
+              float distance, const OutputSink& sink);
+  bool Encode(size_t xsize, size_t ysize, TileSource* source, float distance,
+              const OutputSink& sink);
+  bool Encode(const InterleavedImage& input, float distance,
+              std::vector<uint8_t>* output);
+  bool Encode(const InterleavedImage& input, float distance,
+              PaddedBytes* output);
+  bool Encode(const InterleavedImage& input, float distance,
+              const OutputSink& sink);
+  bool Encode(const JPEGCoefficients& jpeg, std::vector<uint8_t>* output);
+  bool Encode(const JPEGCoefficients& jpeg, const OutputSink& sink);
+
+  // Same as Encode, but selects the distance at which the codestream takes at
+  // most target_size bytes, see EncodeFrameForSize. On input, *distance is the
+  // distance to start from, on output the distance that was used.
+  bool EncodeForSize(const Image3F& input, size_t target_size, float* distance,
+                     std::vector<uint8_t>* output);
+  bool EncodeForSize(const InterleavedImage& input, size_t target_size,
+                     float* distance, std::vector<uint8_t>* output);
+  bool EncodeForSize(const InterleavedImage& input, size_t target_size,
+                     float* distance, const OutputSink& sink);
+
+  // Starts encoding `input` into *output and returns without waiting for it.
+  // The encode runs on the thread pool, driven by the async thread of the
+  // Encoder, which is started by the first async encode and is reused by all
+  // later ones, and calls `done` when it has finished. Async encodes started
+  // meanwhile run after it in order. The input, the output and the Encoder
+  // must stay valid, and no other method of the Encoder may be called, until
+  // the encode has finished.
+  std::unique_ptr<EncodeHandle> EncodeAsync(const Image3F& input,
+                                            float distance,
+                                            std::vector<uint8_t>* output,
+                                            EncodeCallback done = nullptr);
+  std::unique_ptr<EncodeHandle> EncodeAsync(const InterleavedImage& input,
+                                            float distance,
+                                            std::vector<uint8_t>* output,
+                                            EncodeCallback done = nullptr);
+
+  // Starts the codestream of an animation of xsize x ysize frames, whose bytes
+  // are passed to `sink` as the frames are added. All frames share the thread
+  // pool, the tables and the buffers, so after the first one there is no
+  // per-frame setup. With EncoderOptions::incremental, only the groups that
+  // changed since the previous frame are encoded again. Until the last frame,
+  // the Encode and EncodeForSize calls and another StartAnimation fail.
+  bool StartAnimation(size_t xsize, size_t ysize, const AnimationParams& params,
+                      const OutputSink& sink);
+  // Encodes the next frame of the animation, which is shown for `duration`
+  // ticks, at least one. The animation ends with the frame with is_last.
+  bool AddFrame(const Image3F& frame, float distance, uint32_t duration,
+                bool is_last);
+  bool AddFrame(const InterleavedImage& frame, float distance,
+                uint32_t duration, bool is_last);
+  // Same as AddFrame, but returns without waiting like EncodeAsync, so that
+  // the next frame can be read meanwhile. It can only be added once this one
+  // has finished.
+  std::unique_ptr<EncodeHandle> AddFrameAsync(const InterleavedImage& frame,
+                                              float distance,
+                                              uint32_t duration, bool is_last,
+                                              EncodeCallback done = nullptr);
+
+  // Encodes all `inputs` into the corresponding `outputs`, distributing whole
+  // images over the thread pool, so that the throughput scales with the number
+  // of threads even for images that are too small to be processed in
+  // parallel. Each thread keeps its own tables and buffers between images and
+  // batches. Returns false if any of the images failed to encode.
+  bool EncodeBatch(const std::vector<const Image3F*>& inputs, float distance,
+                   std::vector<std::vector<uint8_t>>* outputs);
+
+ private:
+  friend class EncodeHandle;
+
+  // Writes the whole codestream to writer_.
+  Status EncodeToWriter(const Image3F& input, float distance);
+  Status EncodeToWriter(size_t xsize, size_t ysize, const RowSource& source,
+                        float distance);
+  Status EncodeToWriter(const InterleavedImage& input, float distance);
+  Status EncodeToWriter(const JPEGCoefficients& jpeg);
+  Status EncodeToWriterForSize(const Image3F& input, size_t target_size,
+                               float* distance);
+  Status EncodeToWriterForSize(const InterleavedImage& input,
+                               size_t target_size, float* distance);
+  // Fails between StartAnimation and the last frame of the animation, where
+  // only AddFrame and AddFrameAsync may be called.
+  Status CheckNoAnimation() const;
+  // Checks the next frame of the animation and fills in its *info.
+  Status StartAnimationFrame(size_t xsize, size_t ysize, uint32_t duration,
+                             bool is_last, FrameInfo* info);
+  // Queues `encode` on the async thread, with the cancellation flag of a new
+  // handle.
+  std::unique_ptr<EncodeHandle> StartAsync(const std::function<bool()>& encode,
+                                           EncodeCallback done);
+  // Runs the queued async encodes until the Encoder is destroyed.
+  void RunAsyncThread();
+  // Runs the next queued async encode on the calling thread, which must be
+  // the async thread. Returns false if there is none.
+  bool RunNextAsyncJob();
+
+  EncoderOptions options_;
+  ThreadPool pool_;
+  EncoderCache cache_;
+  BitWriter writer_;
+  // State of the animation between StartAnimation and its last frame.
+  OutputSink animation_sink_;
+  size_t animation_xsize_ = 0;
+  size_t animation_ysize_ = 0;
+  bool in_animation_ = false;
+  // Per-thread state of EncodeBatch.
+  struct BatchMemory {
+    EncoderCache cache;
+    BitWriter writer;
+  };
+  std::vector<std::unique_ptr<BatchMemory>> batch_memory_;
+  // Queue of the async encodes, guarded by async_mutex_.
+  std::mutex async_mutex_;
+  std::condition_variable async_cv_;
+  std::deque<std::function<void()>> async_jobs_;
+  bool async_exit_ = false;
+  std::thread async_thread_;
+};
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_FILE_H_
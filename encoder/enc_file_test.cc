@@ -0,0 +1,149 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_file.h"
+
+#include <math.h>
+
+#include <vector>
+
+#include "encoder/ac_strategy.h"
+#include "encoder/config.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+using test::DecodedImage;
+
+// Every effort tier decodes with libjxl, to pixels close to the input.
+TEST(EncFileTest, EffortTiersRoundTrip) {
+  const Image3F image = test::TestImage(600, 400);
+  for (int effort = EncoderOptions::kMinEffort;
+       effort <= EncoderOptions::kMaxEffort; ++effort) {
+    const std::vector<uint8_t> codestream = test::EncodeWithOptions(
+        image, 1.0f, EncoderOptions::ForEffort(effort));
+    DecodedImage decoded;
+    ASSERT_TRUE(test::DecodeToLinear(codestream, &decoded))
+        << "effort " << effort;
+    EXPECT_LT(test::MaxAbsDifference(image, decoded), 0.25f)
+        << "effort " << effort;
+  }
+}
+
+// Smooth image, where most 32x32 blocks are merged into DCT32X32 transforms.
+Image3F SmoothImage(size_t xsize, size_t ysize) {
+  Image3F image(xsize, ysize);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      float* row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row[x] = 0.4f + 0.2f * sinf(0.011f * (c + 1) * x) *
+                            cosf(0.007f * (3 - c) * y);
+      }
+    }
+  }
+  return image;
+}
+
+// Encodes at effort 4, with or without large_block_sizes, and returns the
+// largest difference of the decoded pixels from the input.
+float LargeBlocksError(const Image3F& image, bool large_block_sizes,
+                       uint64_t* num_dct32) {
+  EncoderOptions options = EncoderOptions::ForEffort(4);
+  options.large_block_sizes = large_block_sizes;
+  options.collect_stats = true;
+  Encoder encoder(2);
+  encoder.SetOptions(options);
+  std::vector<uint8_t> codestream;
+  EXPECT_TRUE(encoder.Encode(image, 1.0f, &codestream));
+  *num_dct32 = encoder.stats().strategy_counts[AcStrategy::DCT32X32];
+  DecodedImage decoded;
+  EXPECT_TRUE(test::DecodeToLinear(codestream, &decoded));
+  return test::MaxAbsDifference(image, decoded);
+}
+
+// The DCT32X32 weights are signalled in the frame. If the decoder computed
+// different weights from them than the encoder uses, the coefficients of the
+// DCT32X32 blocks would be scaled wrongly and the error would be far above
+// that of the same image without them.
+TEST(EncFileTest, LargeBlockSizesRoundTrip) {
+  const Image3F image = SmoothImage(512, 384);
+  uint64_t num_dct32;
+  const float error = LargeBlocksError(image, true, &num_dct32);
+  EXPECT_GT(num_dct32, 0u);
+  uint64_t num_dct32_default;
+  const float error_default =
+      LargeBlocksError(image, false, &num_dct32_default);
+  EXPECT_EQ(0u, num_dct32_default);
+  EXPECT_LT(error, 0.1f);
+  EXPECT_LT(error, 2.0f * error_default + 0.01f);
+}
+
+// Each codestream of consecutive incremental encodes decodes to pixels close
+// to its input, also where the transforms of the previous frame are not
+// reused.
+TEST(EncFileTest, IncrementalRoundTrip) {
+  const std::vector<Image3F> frames =
+      test::TexturedFlatTexturedFrames(600, 400);
+  for (int effort = EncoderOptions::kMinEffort;
+       effort <= EncoderOptions::kMaxEffort; ++effort) {
+    for (bool large_block_sizes : {false, true}) {
+      EncoderOptions options = EncoderOptions::ForEffort(effort);
+      options.incremental = true;
+      options.large_block_sizes = large_block_sizes;
+      Encoder encoder(2);
+      encoder.SetOptions(options);
+      for (size_t i = 0; i < frames.size(); ++i) {
+        std::vector<uint8_t> codestream;
+        ASSERT_TRUE(encoder.Encode(frames[i], 1.0f, &codestream));
+        DecodedImage decoded;
+        ASSERT_TRUE(test::DecodeToLinear(codestream, &decoded))
+            << "effort " << effort << " large_block_sizes "
+            << large_block_sizes << " frame " << i;
+        EXPECT_LT(test::MaxAbsDifference(frames[i], decoded), 0.25f)
+            << "effort " << effort << " large_block_sizes "
+            << large_block_sizes << " frame " << i;
+      }
+    }
+  }
+}
+
+// Every frame of an incremental animation decodes to pixels close to its
+// input, also where the transforms of the previous frame are not reused, and
+// also with the heuristics computed by the reference backend.
+TEST(EncFileTest, IncrementalAnimationRoundTrip) {
+  const std::vector<Image3F> frames =
+      test::TexturedFlatTexturedFrames(600, 400);
+  for (int effort = EncoderOptions::kMinEffort;
+       effort <= EncoderOptions::kMaxEffort; ++effort) {
+    for (bool large_block_sizes : {false, true}) {
+      for (bool backend : {false, true}) {
+        EncoderOptions options = EncoderOptions::ForEffort(effort);
+        options.incremental = true;
+        options.large_block_sizes = large_block_sizes;
+        const std::vector<uint8_t> codestream = test::EncodeAnimation(
+            frames, 1.0f, options, /*num_threads=*/2, backend);
+        std::vector<DecodedImage> decoded;
+        ASSERT_TRUE(test::DecodeFramesToLinear(codestream, &decoded))
+            << "effort " << effort << " large_block_sizes "
+            << large_block_sizes << " backend " << backend;
+        ASSERT_EQ(frames.size(), decoded.size());
+        for (size_t i = 0; i < frames.size(); ++i) {
+          EXPECT_LT(test::MaxAbsDifference(frames[i], decoded[i]), 0.25f)
+              << "effort " << effort << " large_block_sizes "
+              << large_block_sizes << " backend " << backend << " frame "
+              << i;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace jxl
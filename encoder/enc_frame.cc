@@ -8,12 +8,16 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <array>
 #include <atomic>
 #include <cmath>
+#include <condition_variable>  //NOLINT
 #include <limits>
+#include <memory>
+#include <mutex>  //NOLINT
 #include <numeric>
 #include <queue>
 #include <vector>
@@ -26,6 +30,7 @@
 #include "encoder/base/padded_bytes.h"
 #include "encoder/base/status.h"
 #include "encoder/chroma_from_luma.h"
+#include "encoder/coefficient_cache.h"
 #include "encoder/common.h"
 #include "encoder/config.h"
 #include "encoder/dc_group_data.h"
@@ -36,11 +41,16 @@
 #include "encoder/enc_cluster.h"
 #include "encoder/enc_entropy_code.h"
 #include "encoder/enc_group.h"
+#include "encoder/enc_modular.h"
+#include "encoder/enc_stats.h"
 #include "encoder/enc_xyb.h"
 #include "encoder/entropy_code.h"
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
+#include "encoder/jpeg_coefficients.h"
 #include "encoder/quant_weights.h"
 #include "encoder/static_entropy_codes.h"
+#include "encoder/token_buffer.h"
 
 namespace jxl {
 namespace {
@@ -112,7 +122,11 @@ struct DistanceParams {
   uint32_t epf_iters;
 };
 
-DistanceParams ComputeDistanceParams(float distance) {
+// Number of edge preserving filter iterations with
+// EncoderOptions::fast_decode.
+static constexpr uint32_t kFastDecodeMaxEpfIters = 1;
+
+DistanceParams ComputeDistanceParams(float distance, bool fast_decode) {
   DistanceParams p;
   p.distance = distance;
   // Quantization scales.
@@ -152,6 +166,9 @@ DistanceParams ComputeDistanceParams(float distance) {
       p.epf_iters++;
     }
   }
+  if (fast_decode) {
+    p.epf_iters = std::min(p.epf_iters, kFastDecodeMaxEpfIters);
+  }
   return p;
 }
 
@@ -279,40 +296,39 @@ static constexpr uint8_t kGradientContextLut[1024] = {
     12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
     12, 12, 12, 12, 12, 12, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
 };
-static constexpr int64_t kGradRangeMin = 0;
 static constexpr int64_t kGradRangeMid = 512;
 static constexpr int64_t kGradRangeMax = 1023;
 static constexpr size_t kNumDCContexts = 45;
 
-void WriteDCTokens(const Image3S& quant_dc, const EntropyCode& dc_code,
-                   BitWriter* writer) {
-  size_t nblocks = quant_dc.xsize() * quant_dc.ysize();
-  size_t allotment_size = kMaxBitsPerToken * nblocks;
-  const intptr_t onerow = quant_dc.Plane(0).PixelsPerRow();
-  for (size_t c : {1, 0, 2}) {
-    BitWriter::Allotment allotment(writer, allotment_size);
-    for (size_t y = 0; y < quant_dc.ysize(); y++) {
-      for (size_t x = 0; x < quant_dc.xsize(); x++) {
-        const int16_t* qrow = quant_dc.PlaneRow(c, y);
-        int64_t left = (x ? qrow[x - 1] : y ? *(qrow + x - onerow) : 0);
-        int64_t top = (y ? *(qrow + x - onerow) : left);
-        int64_t topleft = (x && y ? *(qrow + x - 1 - onerow) : left);
-        int32_t guess = ClampedGradient(top, left, topleft);
-        uint32_t gradprop = Clamp1(kGradRangeMid + top + left - topleft,
-                                   kGradRangeMin, kGradRangeMax);
-        int32_t residual = qrow[x] - guess;
-        uint32_t ctx_id = kGradientContextLut[gradprop];
-        Token token(ctx_id, PackSigned(residual));
-#if OPTIMIZE_CODE
-        writer->Write(8, dc_code.context_map[token.context]);
-        writer->Write(16, token.value);
-#else
-        WriteToken(token, dc_code, writer);
-#endif
-      }
+// If token_counts is not null, the number of tokens of each context is added
+// to it, here and in WriteACMetadataTokens.
+template <class Writer>
+void WriteDCChannelTokens(const ImageS& channel, const EntropyCode& dc_code,
+                          uint64_t* token_counts, Writer* writer) {
+  constexpr size_t kMaxRowSize = kDCGroupDim / kBlockDim;
+  const size_t xsize = channel.xsize();
+  JXL_DASSERT(xsize <= kMaxRowSize);
+  typename Writer::Allotment allotment(writer, kMaxBitsPerToken * xsize *
+                                                   channel.ysize());
+  // The residuals and contexts of each row are computed at once, and then
+  // its tokens are written at once.
+  uint32_t residuals[kMaxRowSize];
+  uint32_t properties[kMaxRowSize];
+  Token tokens[kMaxRowSize];
+  for (size_t y = 0; y < channel.ysize(); y++) {
+    ComputeGradientResiduals(channel.ConstRow(y),
+                             y ? channel.ConstRow(y - 1) : nullptr, xsize,
+                             kGradRangeMid, kGradRangeMax, residuals,
+                             properties);
+    for (size_t x = 0; x < xsize; x++) {
+      tokens[x] = Token(kGradientContextLut[properties[x]], residuals[x]);
     }
-    allotment.Reclaim(writer);
+    if (token_counts) {
+      for (size_t x = 0; x < xsize; x++) ++token_counts[tokens[x].context];
+    }
+    WriteTokens(tokens, xsize, dc_code, writer);
   }
+  allotment.Reclaim(writer);
 }
 
 size_t CountACBlocks(const AcStrategyImage& ac_strategy) {
@@ -326,17 +342,19 @@ size_t CountACBlocks(const AcStrategyImage& ac_strategy) {
   return num;
 }
 
+template <class Writer>
 void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
                            const AcStrategyImage& ac_strategy,
                            const ImageB& raw_quant_field,
-                           const EntropyCode& dc_code, BitWriter* writer) {
+                           const EntropyCode& dc_code, uint64_t* token_counts,
+                           Writer* writer) {
   size_t xsize_blocks = ac_strategy.xsize();
   size_t ysize_blocks = ac_strategy.ysize();
   size_t nblocks = xsize_blocks * ysize_blocks;
   size_t allotment_size = kMaxBitsPerToken * nblocks;
   {
     // YtoX and YtoB tokens.
-    BitWriter::Allotment allotment(writer, allotment_size);
+    typename Writer::Allotment allotment(writer, allotment_size);
     for (size_t c = 0; c < 2; ++c) {
       const ImageSB& cfl_map = (c == 0 ? ytox_map : ytob_map);
       const intptr_t onerow = cfl_map.PixelsPerRow();
@@ -350,12 +368,8 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
           int32_t residual = static_cast<int32_t>(row[x]) - guess;
           uint32_t ctx_id = 2u - c;
           Token token(ctx_id, PackSigned(residual));
-#if OPTIMIZE_CODE
-          writer->Write(8, dc_code.context_map[token.context]);
-          writer->Write(16, token.value);
-#else
           WriteToken(token, dc_code, writer);
-#endif
+          if (token_counts) ++token_counts[ctx_id];
         }
       }
     }
@@ -363,7 +377,7 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
   }
   {
     // Ac strategy tokens.
-    BitWriter::Allotment allotment(writer, allotment_size);
+    typename Writer::Allotment allotment(writer, allotment_size);
     int32_t left = 0;
     for (size_t y = 0; y < ysize_blocks; y++) {
       AcStrategyRow row_acs = ac_strategy.ConstRow(y);
@@ -372,12 +386,8 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
         int32_t cur = row_acs[x].StrategyCode();
         uint32_t ctx_id = (left > 11 ? 7 : left > 5 ? 8 : left > 3 ? 9 : 10);
         Token token(ctx_id, PackSigned(cur));
-#if OPTIMIZE_CODE
-        writer->Write(8, dc_code.context_map[token.context]);
-        writer->Write(16, token.value);
-#else
         WriteToken(token, dc_code, writer);
-#endif
+        if (token_counts) ++token_counts[ctx_id];
         left = cur;
       }
     }
@@ -385,7 +395,7 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
   }
   {
     // Quant field tokens.
-    BitWriter::Allotment allotment(writer, allotment_size);
+    typename Writer::Allotment allotment(writer, allotment_size);
     int32_t left = ac_strategy.ConstRow(0)[0].StrategyCode();
     for (size_t y = 0; y < ysize_blocks; y++) {
       AcStrategyRow row_acs = ac_strategy.ConstRow(y);
@@ -396,12 +406,8 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
         int32_t residual = cur - left;
         uint32_t ctx_id = (left > 11 ? 3 : left > 5 ? 4 : left > 3 ? 5 : 6);
         Token token(ctx_id, PackSigned(residual));
-#if OPTIMIZE_CODE
-        writer->Write(8, dc_code.context_map[token.context]);
-        writer->Write(16, token.value);
-#else
         WriteToken(token, dc_code, writer);
-#endif
+        if (token_counts) ++token_counts[ctx_id];
         left = cur;
       }
     }
@@ -409,36 +415,59 @@ void WriteACMetadataTokens(const ImageSB& ytox_map, const ImageSB& ytob_map,
   }
   {
     // EPF tokens.
-    BitWriter::Allotment allotment(writer, allotment_size);
+    typename Writer::Allotment allotment(writer, allotment_size);
     for (size_t i = 0; i < nblocks; ++i) {
       Token token(0, PackSigned(4));
-#if OPTIMIZE_CODE
-      writer->Write(8, dc_code.context_map[token.context]);
-      writer->Write(16, token.value);
-#else
       WriteToken(token, dc_code, writer);
-#endif
     }
+    if (token_counts) token_counts[0] += nblocks;
     allotment.Reclaim(writer);
   }
 }
 
-void WriteFrameHeader(uint32_t x_qm_scale, uint32_t epf_iters,
-                      BitWriter* writer) {
+// The frames of JPEG coefficients are YCbCr frames of an image that is not
+// XYB encoded.
+void WriteFrameHeader(uint32_t x_qm_scale, uint32_t epf_iters, bool ycbcr,
+                      const FrameInfo& info, BitWriter* writer) {
   BitWriter::Allotment allotment(writer, 1024);
   writer->Write(1, 0);    // not all default
   writer->Write(2, 0);    // regular frame
   writer->Write(1, 0);    // vardct
   writer->Write(2, 2);    // flags selector bits (17 .. 272)
   writer->Write(8, 111);  // skip adaptive dc flag (128)
-  writer->Write(2, 0);    // no upsampling
-  writer->Write(3, x_qm_scale);
-  writer->Write(3, 2);  // b_qm_scale
+  if (ycbcr) {
+    writer->Write(1, 1);  // YCbCr
+    writer->Write(6, 0);  // no chroma subsampling
+  }
+  writer->Write(2, 0);  // no upsampling
+  if (!ycbcr) {
+    writer->Write(3, x_qm_scale);
+    writer->Write(3, 2);  // b_qm_scale
+  }
   writer->Write(2, 0);  // one pass
   writer->Write(1, 0);  // no custom frame size or origin
   writer->Write(2, 0);  // replace blend mode
-  writer->Write(1, 1);  // last frame
+  if (info.animation) {
+    if (info.duration <= 1) {
+      writer->Write(2, info.duration);
+    } else if (info.duration < 256) {
+      writer->Write(2, 2);
+      writer->Write(8, info.duration);
+    } else {
+      writer->Write(2, 3);
+      writer->Write(32, info.duration);
+    }
+  }
+  writer->Write(1, info.is_last);
+  if (!info.is_last) {
+    writer->Write(2, 0);  // not saved as reference
+    // Only frames without duration or saved as reference can be referenced.
+    if (!info.animation || info.duration == 0) {
+      writer->Write(1, 0);  // not saved before color transform
+    }
+  }
   writer->Write(2, 0);  // no name
+  // The default loop filter also enables gaborish.
   if (epf_iters == 2) {
     writer->Write(1, 1);  // default loop filter
   } else {
@@ -456,6 +485,26 @@ void WriteFrameHeader(uint32_t x_qm_scale, uint32_t epf_iters,
   allotment.Reclaim(writer);
 }
 
+// The JPEG quantization steps are relative to 8 times the 8-bit sample range,
+// since the DC step is that of 8 times the average of the block.
+static constexpr float kJPEGQuantDenom = 8 * 255;
+
+// Returns the binary16 bits of the positive v, which must be in the normal
+// range of binary16 after rounding to its 10 bits of mantissa.
+uint16_t FloatToF16(float v) {
+  JXL_ASSERT(v > 0);
+  int exp;
+  const float mantissa = std::frexp(v, &exp);  // in [0.5, 1)
+  uint32_t bits = std::lround((2 * mantissa - 1) * 1024);
+  int biased_exp = exp - 1 + 15;
+  if (bits == 1024) {
+    bits = 0;
+    ++biased_exp;
+  }
+  JXL_ASSERT(biased_exp > 0 && biased_exp < 31);
+  return (biased_exp << 10) | bits;
+}
+
 void WriteQuantScales(int global_scale, int quant_dc, BitWriter* writer) {
   if (global_scale < 2049) {
     writer->Write(2, 0);
@@ -501,11 +550,25 @@ void WriteContextTree(size_t num_dc_groups, BitWriter* writer) {
   allotment.Reclaim(writer);
 }
 
-void WriteDCGlobal(const DistanceParams& distp, const size_t num_dc_groups,
-                   const EntropyCode& dc_code, BitWriter* writer) {
+// If jpeg is not null, the DC steps are those of its quant tables, and the
+// channels are not correlated.
+void WriteDCGlobal(const DistanceParams& distp, const JPEGCoefficients* jpeg,
+                   const size_t num_dc_groups, const EntropyCode& dc_code,
+                   BitWriter* writer) {
   BitWriter::Allotment allotment(writer, 1024);
-  writer->Write(1, 1);  // default dequant dc
-  WriteQuantScales(distp.global_scale, distp.quant_dc, writer);
+  if (jpeg) {
+    writer->Write(1, 0);  // non-default dequant dc
+    for (size_t c = 0; c < 3; ++c) {
+      const uint16_t step = jpeg->quant[kJPEGComponentOfChannel[c]][0];
+      writer->Write(16, FloatToF16(step * (128.0f / kJPEGQuantDenom)));
+    }
+    // The global scale is the denominator and quant_dc is 1, so that the DC
+    // multipliers are the steps themselves.
+    WriteQuantScales(1 << 16, 1, writer);
+  } else {
+    writer->Write(1, 1);  // default dequant dc
+    WriteQuantScales(distp.global_scale, distp.quant_dc, writer);
+  }
   writer->Write(1, 0);   // non-default BlockCtxMap
   writer->Write(16, 0);  // no dc ctx, no qft
   {
@@ -513,17 +576,103 @@ void WriteDCGlobal(const DistanceParams& distp, const size_t num_dc_groups,
                      nullptr, 0);
     WriteContextMap(code, writer);
   }
-  writer->Write(1, 1);  // default DC camp
+  if (jpeg) {
+    writer->Write(1, 0);    // non-default DC cmap
+    writer->Write(2, 0);    // default color factor
+    writer->Write(16, 0);   // zero base correlation x
+    writer->Write(16, 0);   // zero base correlation b
+    writer->Write(8, 128);  // zero ytox_dc
+    writer->Write(8, 128);  // zero ytob_dc
+  } else {
+    writer->Write(1, 1);  // default DC camp
+  }
   WriteContextTree(num_dc_groups, writer);
   writer->Write(1, 0);  // no lz77
   allotment.Reclaim(writer);
   WriteEntropyCode(dc_code, writer);
 }
 
-void WriteACGlobal(size_t num_groups, const EntropyCode& ac_code,
+// Only the DCT32X32 weights are signalled, from kDCT32DistanceBands, the
+// other transforms use the default ones.
+void WriteQuantMatrices(bool large_blocks, BitWriter* writer) {
+  if (!large_blocks) {
+    writer->Write(1, 1);  // all default quant matrices
+    return;
+  }
+  constexpr size_t kNumQuantTables = 17;
+  constexpr size_t kDCT32QuantTable = 5;
+  writer->Write(1, 0);
+  for (size_t i = 0; i < kNumQuantTables; ++i) {
+    if (i != kDCT32QuantTable) {
+      writer->Write(3, 0);  // library mode, default table
+      continue;
+    }
+    writer->Write(3, 6);  // DCT mode
+    writer->Write(4, kNumDCT32DistanceBands - 1);
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t b = 0; b < kNumDCT32DistanceBands; ++b) {
+        writer->Write(16, kDCT32DistanceBands[c][b]);
+      }
+    }
+  }
+}
+
+// The DCT8 weights are the quant tables of the JPEG image, in a raw table
+// that is coded as a modular image with a single Zero predictor leaf, the
+// other transforms use the default ones.
+void WriteJPEGQuantMatrices(const JPEGCoefficients& jpeg, BitWriter* writer) {
+  constexpr size_t kNumQuantTables = 17;
+  std::vector<Token> tree_tokens = {
+      {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0},
+  };
+  EntropyCode tree_code(nullptr, kNumTreeContexts, nullptr, 0);
+  OptimizeEntropyCode(tree_tokens, &tree_code);
+  std::vector<Token> tokens;
+  for (size_t c = 0; c < 3; ++c) {
+    const uint16_t* quant = jpeg.quant[kJPEGComponentOfChannel[c]];
+    // JPEG XL transposes the DCT, JPEG does not.
+    for (size_t y = 0; y < kBlockDim; ++y) {
+      for (size_t x = 0; x < kBlockDim; ++x) {
+        tokens.emplace_back(0, PackSigned(quant[x * kBlockDim + y]));
+      }
+    }
+  }
+  EntropyCode code(nullptr, 1, nullptr, 0);
+  OptimizeEntropyCode(tokens, &code);
+  writer->AllocateAndWrite(1, 0);  // not all default quant matrices
+  writer->AllocateAndWrite(3, 7);  // raw mode of the DCT8 table
+  writer->AllocateAndWrite(16, FloatToF16(1.0f / kJPEGQuantDenom));
+  writer->AllocateAndWrite(4, 2);  // local tree, default wp, no transforms
+  writer->AllocateAndWrite(1, 0);  // no lz77
+  WriteEntropyCode(tree_code, writer);
+  {
+    BitWriter::Allotment allotment(writer,
+                                   kMaxBitsPerToken * tree_tokens.size());
+    for (const Token& t : tree_tokens) {
+      WriteToken(t, tree_code, writer);
+    }
+    allotment.Reclaim(writer);
+  }
+  writer->AllocateAndWrite(1, 0);  // no lz77
+  WriteEntropyCode(code, writer);
+  BitWriter::Allotment allotment(writer,
+                                 3 * (kNumQuantTables - 1) +
+                                     kMaxBitsPerToken * tokens.size());
+  for (const Token& t : tokens) {
+    WriteToken(t, code, writer);
+  }
+  for (size_t i = 1; i < kNumQuantTables; ++i) {
+    writer->Write(3, 0);  // library mode, default table
+  }
+  allotment.Reclaim(writer);
+}
+
+void WriteACGlobal(size_t num_groups, bool large_blocks,
+                   const JPEGCoefficients* jpeg, const EntropyCode& ac_code,
                    BitWriter* writer) {
+  if (jpeg) WriteJPEGQuantMatrices(*jpeg, writer);
   BitWriter::Allotment allotment(writer, 1024);
-  writer->Write(1, 1);  // all default quant matrices
+  if (!jpeg) WriteQuantMatrices(large_blocks, writer);
   size_t num_histo_bits = CeilLog2Nonzero(num_groups);
   if (num_histo_bits != 0) writer->Write(num_histo_bits, 0);
   writer->Write(2, 3);
@@ -533,40 +682,54 @@ void WriteACGlobal(size_t num_groups, const EntropyCode& ac_code,
   WriteEntropyCode(ac_code, writer);
 }
 
-void WriteDCGroup(const DCGroupData& data, const EntropyCode& dc_code,
-                  BitWriter* writer) {
-  {
-    BitWriter::Allotment allotment(writer, 1024);
-#if OPTIMIZE_CODE
-    writer->Write(8, kMaxContexts + 6);
-    writer->Write(16, 12);
-#else
+// The DC group section consists of these parts, which can be generated
+// independently and then concatenated: the Y, X and B channels of the
+// quantized DC, the first one after the header of the section, and the AC
+// metadata.
+static constexpr size_t kNumDCGroupParts = 4;
+
+template <class Writer>
+void WriteDCGroupPart(const DCGroupData& data, size_t part,
+                      const EntropyCode& dc_code, uint64_t* token_counts,
+                      Writer* writer) {
+  static constexpr size_t kChannelOrder[3] = {1, 0, 2};
+  if (part == 0) {
+    typename Writer::Allotment allotment(writer, 1024);
     writer->Write(2, 0);  // extra_dc_precision
     writer->Write(4, 3);  // use global tree, default wp, no transforms
-#endif
     allotment.Reclaim(writer);
   }
-  WriteDCTokens(data.quant_dc, dc_code, writer);
+  if (part < 3) {
+    WriteDCChannelTokens(data.quant_dc.Plane(kChannelOrder[part]), dc_code,
+                         token_counts, writer);
+    return;
+  }
   {
     size_t num_blocks = data.ac_strategy.xsize() * data.ac_strategy.ysize();
     size_t num_ac_blocks = CountACBlocks(data.ac_strategy);
     size_t nb_bits = CeilLog2Nonzero(num_blocks);
-    BitWriter::Allotment allotment(writer, 1024);
-#if OPTIMIZE_CODE
-    if (nb_bits != 0) {
-      writer->Write(8, kMaxContexts + nb_bits);
-      writer->Write(16, num_ac_blocks - 1);
-    }
-    writer->Write(8, kMaxContexts + 4);
-    writer->Write(16, 3);
-#else
+    typename Writer::Allotment allotment(writer, 1024);
     if (nb_bits != 0) writer->Write(nb_bits, num_ac_blocks - 1);
     writer->Write(4, 3);  // use global tree, default wp, no transforms
-#endif
     allotment.Reclaim(writer);
   }
   WriteACMetadataTokens(data.ytox_map, data.ytob_map, data.ac_strategy,
-                        data.raw_quant_field, dc_code, writer);
+                        data.raw_quant_field, dc_code, token_counts, writer);
+}
+
+// Writes the parts of the DC group section, either all of them if num_parts
+// is 1, or only the given one.
+template <class Writer>
+void WriteDCGroup(const DCGroupData& data, size_t part, size_t num_parts,
+                  const EntropyCode& dc_code, uint64_t* token_counts,
+                  Writer* writer) {
+  if (num_parts > 1) {
+    WriteDCGroupPart(data, part, dc_code, token_counts, writer);
+    return;
+  }
+  for (part = 0; part < kNumDCGroupParts; ++part) {
+    WriteDCGroupPart(data, part, dc_code, token_counts, writer);
+  }
 }
 
 void WriteTOC(const std::vector<BitWriter>& sections, BitWriter* output) {
@@ -594,28 +757,6 @@ void WriteTOC(const std::vector<BitWriter>& sections, BitWriter* output) {
   allotment.Reclaim(output);
 }
 
-void CopyAndPadImage(const Image3F& from, const Rect& r, Image3F* to) {
-  size_t xsize_padded = DivCeil(r.xsize(), kBlockDim) * kBlockDim;
-  size_t ysize_padded = DivCeil(r.ysize(), kBlockDim) * kBlockDim;
-  to->ShrinkTo(xsize_padded, ysize_padded);
-  for (size_t y = 0; y < r.ysize(); ++y) {
-    for (size_t c = 0; c < 3; ++c) {
-      memcpy(to->PlaneRow(c, y), r.ConstPlaneRow(from, c, y),
-             r.xsize() * sizeof(float));
-      float last_val = to->PlaneRow(c, y)[r.xsize() - 1];
-      for (size_t x = r.xsize(); x < xsize_padded; ++x) {
-        to->PlaneRow(c, y)[x] = last_val;
-      }
-    }
-  }
-  for (size_t c = 0; c < 3; ++c) {
-    float* last_row = to->PlaneRow(c, r.ysize() - 1);
-    for (size_t y = r.ysize(); y < ysize_padded; ++y) {
-      memcpy(to->PlaneRow(c, y), last_row, xsize_padded * sizeof(float));
-    }
-  }
-}
-
 // These are temporary structures needed to process one tile.
 struct TileProcessorMemory {
   TileProcessorMemory()
@@ -623,185 +764,1161 @@ struct TileProcessorMemory {
         masking(kTileDimInBlocks, kTileDimInBlocks),
         pre_erosion(kTileDimInBlocks * 2 + 2, kTileDimInBlocks * 2 + 2),
         diff_buffer(kTileDim + 8, 1) {
-#if (OPTIMIZE_BLOCK_SIZES || OPTIMIZE_CHROMA_FROM_LUMA)
     mem_dct = hwy::AllocateAligned<float>(kMaxCoeffArea * 4);
-#endif
-#if OPTIMIZE_CHROMA_FROM_LUMA
     mem_cmap = hwy::AllocateAligned<float>(kTileDim * kTileDim * 4);
-#endif
+    mem_dct8 = hwy::AllocateAligned<float>(kTileDim * kTileDim * 3);
   }
   ImageF quant_field;
   ImageF masking;
   ImageF pre_erosion;
   ImageF diff_buffer;
-#if (OPTIMIZE_BLOCK_SIZES || OPTIMIZE_CHROMA_FROM_LUMA)
+  // Room for the 8 transform candidates of a 16x16 block, see
+  // FindBest16x16Transform, which is also that of the 32x32 candidate.
   hwy::AlignedFreeUniquePtr<float[]> mem_dct;
   float* block_storage() { return mem_dct.get(); }
   float* scratch_space() { return mem_dct.get() + 3 * kMaxCoeffArea; }
-#endif
-#if OPTIMIZE_CHROMA_FROM_LUMA
   float* coeff_storage() { return mem_cmap.get(); }
   hwy::AlignedFreeUniquePtr<float[]> mem_cmap;
-#endif
+  // DCT8 coefficients of the tile, shared by chroma from luma and the AC
+  // strategy search.
+  float* dct8_storage() { return mem_dct8.get(); }
+  hwy::AlignedFreeUniquePtr<float[]> mem_dct8;
 };
 
 void ProcessTile(const Image3F& group, const Rect& tile_brect,
                  const Rect& group_brect, const Rect& group_trect,
-                 const DistanceParams& distp, const DequantMatrices& matrices,
-                 DCGroupData* dc_data, TileProcessorMemory* tmem) {
-  ComputeAdaptiveQuantFieldTile(group, tile_brect, group_brect, distp.distance,
-                                distp.inv_scale, &tmem->pre_erosion,
-                                tmem->diff_buffer.Row(0), &tmem->quant_field,
-                                &tmem->masking, &dc_data->raw_quant_field);
+                 const DistanceParams& distp, const EncoderOptions& options,
+                 const DequantMatrices& matrices, DCGroupData* dc_data,
+                 TileProcessorMemory* tmem, CoefficientCache* cache,
+                 StageTimes* times) {
+  {
+    StageTimer timer(times, kStageAdaptiveQuantization);
+    ComputeAdaptiveQuantFieldTile(
+        group, tile_brect, group_brect, distp.distance, distp.inv_scale,
+        options.fast_adaptive_quantization, &tmem->pre_erosion,
+        tmem->diff_buffer.Row(0), &tmem->quant_field, &tmem->masking,
+        &dc_data->raw_quant_field);
+  }
   int8_t ytox = 0, ytob = 0;
-  (void)ytox;
-  (void)ytob;
-#if OPTIMIZE_CHROMA_FROM_LUMA
-  ComputeCmapTile(group, tile_brect, matrices, &ytox, &ytob,
-                  tmem->block_storage(), tmem->scratch_space(),
-                  tmem->coeff_storage());
-  const size_t tx = tile_brect.x0() / kTileDimInBlocks;
-  const size_t ty = tile_brect.y0() / kTileDimInBlocks;
-  group_trect.Row(&dc_data->ytox_map, ty)[tx] = ytox;
-  group_trect.Row(&dc_data->ytob_map, ty)[tx] = ytob;
-#endif
-#if OPTIMIZE_BLOCK_SIZES
-  for (size_t cy = 0; cy + 1 < tile_brect.ysize(); cy += 2) {
-    for (size_t cx = 0; cx + 1 < tile_brect.xsize(); cx += 2) {
-      FindBest16x16Transform(group, group_brect, tile_brect.x0(),
-                             tile_brect.y0(), cx, cy, distp.distance, matrices,
-                             tmem->quant_field, tmem->masking, ytox, ytob,
-                             &dc_data->ac_strategy, tmem->block_storage(),
-                             tmem->scratch_space());
-    }
+  const float* dct8_coeffs = nullptr;
+  if (options.optimize_chroma_from_luma) {
+    StageTimer timer(times, kStageChromaFromLuma);
+    ComputeCmapTile(group, tile_brect, matrices, &ytox, &ytob,
+                    tmem->dct8_storage(), tmem->scratch_space(),
+                    tmem->coeff_storage());
+    dct8_coeffs = tmem->dct8_storage();
+    const size_t tx = tile_brect.x0() / kTileDimInBlocks;
+    const size_t ty = tile_brect.y0() / kTileDimInBlocks;
+    group_trect.Row(&dc_data->ytox_map, ty)[tx] = ytox;
+    group_trect.Row(&dc_data->ytob_map, ty)[tx] = ytob;
   }
+  // Block-rectangle of the tile within the DC group.
   Rect rect(group_brect.x0() + tile_brect.x0(),
             group_brect.y0() + tile_brect.y0(), tile_brect.xsize(),
             tile_brect.ysize());
-  AdjustQuantField(dc_data->ac_strategy, rect, &dc_data->raw_quant_field);
-#endif
-}
-
-Status ProcessDCGroup(const Image3F& linear, size_t dc_gx, size_t dc_gy,
-                      const DistanceParams& distp,
-                      const DequantMatrices& matrices,
-                      const EntropyCode& dc_code, const EntropyCode& ac_code,
-                      ThreadPool* pool, std::vector<BitWriter>* output) {
-  // Dimensions of the whole image.
-  ImageDim dim(linear.xsize(), linear.ysize());
-  // Rectangle of the current DC group within the image.
-  Rect dc_group_rect = dim.PixelRect(dc_gx, dc_gy, kDCGroupDim);
-  // Dimensions of the current DC group.
-  ImageDim dc_group_dim(dc_group_rect.xsize(), dc_group_rect.ysize());
-
-  // 514 kB total memory for DC group data (384 kB quantized DC, 64 kB AQ field
-  // 64 kB AC strategy, 2 kB Chroma from luma).
-  DCGroupData dc_data(dc_group_dim.xsize_blocks, dc_group_dim.ysize_blocks);
-  // 192 kB for holding the XYB image for one AC stripe, can be reduced to 48 kB
-  // if OPTIMIZE_CHROMA_FROM_LUMA is disabled and 16x16 tiles are used. One per
-  // group processor thread.
-  Image3F stripe(kGroupDim, kTileDim);
-  // 3.5 kB of temporary data for DCT and holding the quantized coefficients.
-  // One per group processor thread.
+  // The search only sets the merged transforms, and in incremental mode the
+  // DC group still has the transforms of an earlier frame.
+  dc_data->ac_strategy.FillDCT8(rect);
+  if (options.optimize_block_sizes) {
+    StageTimer timer(times, kStageAcStrategy);
+    constexpr size_t kTileDimInCells = kTileDimInBlocks / 2;
+    float cost16x16[kTileDimInCells][kTileDimInCells];
+    for (size_t cy = 0; cy + 1 < tile_brect.ysize(); cy += 2) {
+      for (size_t cx = 0; cx + 1 < tile_brect.xsize(); cx += 2) {
+        cost16x16[cy / 2][cx / 2] = FindBest16x16Transform(
+            group, group_brect, tile_brect.x0(), tile_brect.y0(), cx, cy,
+            distp.distance, matrices, tmem->quant_field, tmem->masking, ytox,
+            ytob, options.prefilter_block_sizes, dct8_coeffs,
+            &dc_data->ac_strategy, cache, tmem->block_storage(),
+            tmem->scratch_space());
+      }
+    }
+    // Merges the 16x16 cells into 32x32 transforms where those are cheaper
+    // than the already chosen transforms.
+    for (size_t cy = 0; cy + 3 < tile_brect.ysize(); cy += 4) {
+      for (size_t cx = 0; cx + 3 < tile_brect.xsize(); cx += 4) {
+        if (!options.large_block_sizes) continue;
+        const size_t y = cy / 2;
+        const size_t x = cx / 2;
+        const float cost = cost16x16[y][x] + cost16x16[y][x + 1] +
+                           cost16x16[y + 1][x] + cost16x16[y + 1][x + 1];
+        FindBest32x32Transform(group, group_brect, tile_brect.x0(),
+                               tile_brect.y0(), cx, cy, distp.distance,
+                               matrices, tmem->quant_field, tmem->masking,
+                               ytox, ytob, cost, &dc_data->ac_strategy,
+                               tmem->block_storage(), tmem->scratch_space());
+      }
+    }
+    AdjustQuantField(dc_data->ac_strategy, rect, &dc_data->raw_quant_field);
+  }
+  if (cache != nullptr && dct8_coeffs != nullptr) {
+    // The 8x8 transforms that were not already stored by the search.
+    for (size_t y = 0; y < tile_brect.ysize(); ++y) {
+      const size_t by = tile_brect.y0() + y;
+      AcStrategyRow row = dc_data->ac_strategy.ConstRow(group_brect, by);
+      for (size_t x = 0; x < tile_brect.xsize(); ++x) {
+        const size_t bx = tile_brect.x0() + x;
+        if (row[bx].Strategy() != AcStrategy::DCT) continue;
+        const float* coeffs =
+            dct8_coeffs + (y * kTileDimInBlocks + x) * 3 * kDCTBlockSize;
+        CacheCoefficients(coeffs, bx, by, row[bx], cache);
+      }
+    }
+  }
+}
+
+// The part of the EncodeStats that each thread collects on its own.
+struct ThreadStats {
+  StageTimes stage_times;
+  uint64_t dc_token_counts[kNumDCContexts] = {};
+  uint64_t ac_token_counts[kNumACContexts] = {};
+};
+
+// Per-thread temporary structures needed to process one AC stripe.
+struct GroupScratchMemory {
+  GroupScratchMemory()
+      : stripe(kGroupDim, kTileDim),
+        num_nzeros(kGroupDimInBlocks, kGroupDimInBlocks) {}
+  // 192 kB for holding the XYB image for one AC stripe.
+  Image3F stripe;
+  // 52 kB of temporary data for DCT and holding the quantized coefficients.
   GroupProcessorMemory gmem;
   // 3 kB for the number of nonzeros per block, needed for context calculation.
-  // One per group processor thread.
-  Image3B num_nzeros(kGroupDimInBlocks, kGroupDimInBlocks);
-  // 68 kB temporary data per tile processor thread, this can be reduced to less
-  // than 4 kB if OPTIMIZE_CHROMA_FROM_LUMA is disabled.
+  Image3B num_nzeros;
+  // 129 kB temporary data per tile processor thread, 112 kB of which is only
+  // used with chroma from luma.
   TileProcessorMemory tmem;
+  // Stats and stage times of the thread, null unless they are collected.
+  ThreadStats* stats = nullptr;
+  StageTimes* times = nullptr;
+  // 192 kB (96 kB with half_float) for the coefficients of one AC stripe,
+  // allocated on first use.
+  CoefficientCache* coeff_cache(bool half_float) {
+    if (!coeff_cache_ || coeff_cache_->half_float() != half_float) {
+      coeff_cache_.reset(new CoefficientCache(half_float));
+    }
+    return coeff_cache_.get();
+  }
+  std::unique_ptr<CoefficientCache> coeff_cache_;
+  // 48 kB for the subsampled X and B channels of one AC stripe, allocated on
+  // first use. Its plane 1 is not used.
+  Image3F* half_chroma() {
+    if (half_chroma_.xsize() == 0) {
+      half_chroma_ = Image3F(kGroupDim / 2, kTileDim / 2);
+    }
+    return &half_chroma_;
+  }
+  Image3F half_chroma_;
+};
+
+// Location of the kGroupDim x kTileDim AC stripe in the image_gx-th AC group
+// column and image_ty-th tile row of the image.
+struct StripeRects {
+  StripeRects(const ImageDim& dim, size_t image_gx, size_t image_ty) {
+    constexpr size_t kDCGroupDimInGroups = kDCGroupDim / kGroupDim;
+    constexpr size_t kDCGroupDimInTiles = kDCGroupDim / kTileDim;
+    const size_t dc_gx = image_gx / kDCGroupDimInGroups;
+    const size_t dc_gy = image_ty / kDCGroupDimInTiles;
+    const size_t gx = image_gx % kDCGroupDimInGroups;
+    const size_t dc_ty = image_ty % kDCGroupDimInTiles;
+    // Dimensions of the enclosing DC group.
+    Rect dc_group_rect = dim.PixelRect(dc_gx, dc_gy, kDCGroupDim);
+    ImageDim dc_group_dim(dc_group_rect.xsize(), dc_group_rect.ysize());
+    dc_group_idx = dc_gy * dim.xsize_dc_groups + dc_gx;
+    pixel_rect = dim.PixelRect(image_gx, image_ty, kGroupDim, kTileDim);
+    block_rect = dc_group_dim.BlockRect(gx, dc_ty, kGroupDimInBlocks,
+                                        kTileDimInBlocks);
+    tile_rect = dc_group_dim.TileRect(gx, dc_ty, kGroupDimInTiles, 1);
+  }
+  size_t dc_group_idx;
+  // Rectangle of the AC stripe within the image.
+  Rect pixel_rect;
+  // Block-rectangle of the AC stripe within the DC group.
+  Rect block_rect;
+  // Tile-rectangle of the AC stripe within the DC group.
+  Rect tile_rect;
+};
+
+// Input pixels of a frame: either a rectangle of a linear float image
+// starting at pixel (x0, y0) of the frame, or the whole frame as an
+// interleaved image, or as the coefficients of a JPEG.
+struct FrameInput {
+  explicit FrameInput(const Image3F& linear, size_t y0 = 0)
+      : linear(&linear), y0(y0) {}
+  FrameInput(const Image3F& linear, size_t x0, size_t y0)
+      : linear(&linear), x0(x0), y0(y0) {}
+  explicit FrameInput(const InterleavedImage& interleaved)
+      : interleaved(&interleaved) {}
+  explicit FrameInput(const JPEGCoefficients& jpeg) : jpeg(&jpeg) {}
+  const Image3F* linear = nullptr;
+  const InterleavedImage* interleaved = nullptr;
+  const JPEGCoefficients* jpeg = nullptr;
+  size_t x0 = 0;
+  size_t y0 = 0;
+};
 
-  // Process AC groups, can be done in parallel, each thread fills in 1/64th of
-  // the dc_data.
-  for (size_t gix = 0; gix < dc_group_dim.num_groups; ++gix) {
-    size_t gx = gix % dc_group_dim.xsize_groups;
-    size_t gy = gix / dc_group_dim.xsize_groups;
-    size_t image_gx = dc_gx * kBlockDim + gx;
-    size_t image_gy = dc_gy * kBlockDim + gy;
-    const size_t ac_group_idx =
-        2 + dim.num_dc_groups + image_gy * dim.xsize_groups + image_gx;
-    // Rectangle of the current AC group within the image.
-    Rect group_rect = dim.PixelRect(image_gx, image_gy, kGroupDim);
-    // Dimensions of the current AC group.
-    ImageDim group_dim(group_rect.xsize(), group_rect.ysize());
-    // Process AC group one 256 x kTileDim stripe at a time. These must be done
-    // sequentially, because there is context dependence between the stripes.
-    for (size_t ty = 0; ty < group_dim.ysize_tiles; ++ty) {
-      size_t dc_ty = gy * kGroupDimInTiles + ty;
-      size_t image_ty = image_gy * kGroupDimInTiles + ty;
-      // Rectangle of the current AC stripe within the image.
-      Rect stripe_rect = dim.PixelRect(image_gx, image_ty, kGroupDim, kTileDim);
-      // Dimensions of the current AC stripe.
-      ImageDim stripe_dim(stripe_rect.xsize(), stripe_rect.ysize());
-      // Block-rectangle of the current AC stripe within the DC group.
-      Rect stripe_brect = dc_group_dim.BlockRect(gx, dc_ty, kGroupDimInBlocks,
-                                                 kTileDimInBlocks);
-      // Tile-rectangle of the current AC stripe within the DC group.
-      Rect stripe_trect = dc_group_dim.TileRect(gx, dc_ty, kGroupDimInTiles, 1);
-      // Convert current AC stripe to XYB, pad to whole blocks if necessary.
-      CopyAndPadImage(linear, stripe_rect, &stripe);
-      ToXYB(&stripe);
-      // Compute heuristics data one kTileDim x kTileDim tile at a time. These
-      // can be done in parallel.
-      for (size_t tx = 0; tx < group_dim.xsize_tiles; ++tx) {
-        // Block-rectangle of the current tile within the AC stripe.
-        Rect tile_brect = stripe_dim.BlockRect(tx, 0, kTileDimInBlocks);
-        ProcessTile(stripe, tile_brect, stripe_brect, stripe_trect, distp,
-                    matrices, &dc_data, &tmem);
+// Averages each 2x2 pixels of the X and B channels of the stripe into the
+// planes 0 and 2 of *half_chroma, see EncoderOptions::subsample_chroma.
+void DownsampleChroma(const Image3F& stripe, Image3F* half_chroma) {
+  // The stripe is padded to whole blocks.
+  const size_t xsize = stripe.xsize() / 2;
+  const size_t ysize = stripe.ysize() / 2;
+  half_chroma->ShrinkTo(xsize, ysize);
+  for (size_t c : {0, 2}) {
+    for (size_t y = 0; y < ysize; ++y) {
+      const float* JXL_RESTRICT row0 = stripe.ConstPlaneRow(c, 2 * y);
+      const float* JXL_RESTRICT row1 = stripe.ConstPlaneRow(c, 2 * y + 1);
+      float* JXL_RESTRICT row_out = half_chroma->PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row_out[x] = 0.25f * (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] +
+                              row1[2 * x + 1]);
       }
-      // Write AC stripe to bitstream and fill in dc_data->quant_dc.
-      WriteACGroup(stripe, stripe_brect, matrices, distp.scale, distp.scale_dc,
-                   distp.x_qm_scale, &dc_data, ac_code, &num_nzeros, &gmem,
-                   &(*output)[ac_group_idx]);
     }
   }
+}
+
+// Converts the AC stripe at pixel_rect of the frame to XYB into *stripe. If
+// half_chroma is not null, also downsamples its chroma into it, while the
+// stripe is still in the cache.
+void LoadXYBStripe(const FrameInput& input, const Rect& pixel_rect,
+                   Image3F* stripe, StageTimes* times,
+                   Image3F* half_chroma = nullptr) {
+  StageTimer timer(times, kStageToXYB);
+  // Both pad to whole blocks if necessary.
+  if (input.interleaved) {
+    InterleavedToXYB(*input.interleaved, pixel_rect, stripe);
+  } else {
+    Rect input_rect(pixel_rect.x0() - input.x0, pixel_rect.y0() - input.y0,
+                    pixel_rect.xsize(), pixel_rect.ysize());
+    CopyPadToXYB(*input.linear, input_rect, stripe);
+  }
+  if (half_chroma) DownsampleChroma(*stripe, half_chroma);
+}
 
-  // Write DC group to bitstream.
-  const size_t dc_group_idx = 1 + dc_gy * dim.xsize_dc_groups + dc_gx;
-  WriteDCGroup(dc_data, dc_code, &(*output)[dc_group_idx]);
+// Computes the heuristics data (adaptive quantization, chroma from luma and
+// AC strategy) of the AC stripe already loaded into mem->stripe, one
+// kTileDim x kTileDim tile at a time. There is no context dependence between
+// the stripes, so these can be done in parallel. If cache is not null, it is
+// filled with the coefficients computed along the way.
+void ComputeStripeHeuristics(const StripeRects& rects,
+                             const DistanceParams& distp,
+                             const EncoderOptions& options,
+                             const DequantMatrices& matrices,
+                             DCGroupData* dc_data, GroupScratchMemory* mem,
+                             CoefficientCache* cache) {
+  // Dimensions of the current AC stripe.
+  ImageDim stripe_dim(rects.pixel_rect.xsize(), rects.pixel_rect.ysize());
+  if (cache != nullptr) cache->Reset();
+  for (size_t tx = 0; tx < stripe_dim.xsize_tiles; ++tx) {
+    // Block-rectangle of the current tile within the AC stripe.
+    Rect tile_brect = stripe_dim.BlockRect(tx, 0, kTileDimInBlocks);
+    ProcessTile(mem->stripe, tile_brect, rects.block_rect, rects.tile_rect,
+                distp, options, matrices, dc_data, &mem->tmem, cache,
+                mem->times);
+  }
+}
+
+// Per-thread scratch memory, allocated on the first task of each thread.
+class ScratchMemory {
+ public:
+  Status Init(size_t num_threads) {
+    if (mem_.size() < num_threads) mem_.resize(num_threads);
+    if (stats_.size() < num_threads) stats_.resize(num_threads);
+    return true;
+  }
+  GroupScratchMemory* Get(size_t thread) {
+    if (!mem_[thread]) {
+      mem_[thread].reset(new GroupScratchMemory());
+    }
+    mem_[thread]->stats = Stats(thread);
+    mem_[thread]->times = Times(thread);
+    return mem_[thread].get();
+  }
+
+  // Returns the stats of the thread, or null if they are not collected.
+  // These are separate allocations, so that the threads do not write to the
+  // same cache lines.
+  ThreadStats* Stats(size_t thread) {
+    if (!collect_stats_) return nullptr;
+    if (!stats_[thread]) stats_[thread].reset(new ThreadStats());
+    return stats_[thread].get();
+  }
+
+  // Returns the stage times of the thread, or null if they are not collected.
+  StageTimes* Times(size_t thread) {
+    if (!JXL_ENABLE_STAGE_TIMING) return nullptr;
+    ThreadStats* stats = Stats(thread);
+    return stats ? &stats->stage_times : nullptr;
+  }
+
+  // Clears the stats of all threads for a new frame.
+  void ResetStats(bool collect_stats) {
+    collect_stats_ = collect_stats;
+    for (auto& stats : stats_) {
+      if (stats) *stats = ThreadStats();
+    }
+  }
+
+  // Adds the stats of all threads to *sum, whose token counts must already
+  // have the number of contexts as their size.
+  void AddStats(EncodeStats* sum) const {
+    for (const auto& stats : stats_) {
+      if (!stats) continue;
+      sum->stage_times.Add(stats->stage_times);
+      for (size_t i = 0; i < kNumDCContexts; ++i) {
+        sum->dc_token_counts[i] += stats->dc_token_counts[i];
+      }
+      for (size_t i = 0; i < kNumACContexts; ++i) {
+        sum->ac_token_counts[i] += stats->ac_token_counts[i];
+      }
+    }
+  }
+
+ private:
+  std::vector<std::unique_ptr<GroupScratchMemory>> mem_;
+  std::vector<std::unique_ptr<ThreadStats>> stats_;
+  bool collect_stats_ = false;
+};
+
+// What the sections and DC group data kept in the cache were generated from,
+// see EncoderOptions::incremental.
+struct IncrementalState {
+  bool valid = false;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  float distance = 0;
+  EncoderOptions options;
+  // Hash of the input pixels of each AC group.
+  std::vector<uint64_t> group_hashes;
+};
+
+}  // namespace
+
+struct EncoderCache::Data {
+  DequantMatrices matrices;
+  ScratchMemory mem;
+  std::vector<DCGroupData> dc_data;
+  std::vector<BitWriter> sections;
+  std::vector<TokenBuffer> tokens;
+  std::vector<BitWriter> dc_part_sections;
+  std::vector<TokenBuffer> dc_part_tokens;
+  BitWriter header;
+  EncodeStats stats;
+  const std::atomic<bool>* cancel = nullptr;
+  HeuristicsBackend* heuristics_backend = nullptr;
+  IncrementalState incremental;
+  Image3F preview;
+};
+
+EncoderCache::EncoderCache() : data_(new Data()) {}
+EncoderCache::~EncoderCache() = default;
+
+const EncodeStats& EncoderCache::stats() const { return data_->stats; }
+
+const Image3F& EncoderCache::preview() const { return data_->preview; }
+
+void EncoderCache::set_cancel_flag(const std::atomic<bool>* cancel) {
+  data_->cancel = cancel;
+}
+
+void EncoderCache::set_heuristics_backend(HeuristicsBackend* backend) {
+  data_->heuristics_backend = backend;
+}
+
+namespace {
+
+// Returns the static entropy codes of the given set of kStaticCodeSets.
+EntropyCode StaticDCCode(size_t code_set) {
+  const StaticCodeSet& set = kStaticCodeSets[code_set];
+  EntropyCode code(set.dc_context_map, kNumDCContexts, set.dc_prefix_codes,
+                   set.num_dc_prefix_codes);
+  PackPrefixCodes(&code);
+  return code;
+}
+
+EntropyCode StaticACCode(size_t code_set) {
+  const StaticCodeSet& set = kStaticCodeSets[code_set];
+  EntropyCode code(set.ac_context_map, kNumACContexts, set.ac_prefix_codes,
+                   set.num_ac_prefix_codes);
+  PackPrefixCodes(&code);
+  return code;
+}
+
+// Returns the default static entropy codes, or the initial context maps of the
+// codes that are optimized at the end of the frame.
+EntropyCode InitialDCCode(bool optimize_code) {
+  if (optimize_code) {
+    return EntropyCode(kOptimizedDCContextMap, kNumDCContexts, nullptr,
+                       kNumOptimizedDCPrefixCodes);
+  }
+  return StaticDCCode(0);
+}
+
+EntropyCode InitialACCode(bool optimize_code) {
+  if (optimize_code) {
+    return EntropyCode(kOptimizedACContextMap, kNumACContexts, nullptr,
+                       kNumOptimizedACPrefixCodes);
+  }
+  return StaticACCode(0);
+}
+
+// Where the group sections of the current pass go.
+enum class SectionMode {
+  kWrite,              // Directly to the section writers.
+  kBufferTokens,       // To the token buffers, until the codes are optimized.
+  kCollectHistograms,  // Only to the per-thread histograms.
+  kCollectCosts,       // Only to the per-thread costs of the static codes.
+  kSkip,               // Nowhere, they are generated by another pass.
+};
+
+// Rough upper estimates of the memory of a frame, for the memory budget.
+// Quantized DC, quant field and AC strategy of the DC groups.
+static constexpr size_t kDCGroupBytesPerBlock = 8;
+// Sections of a photograph, generously.
+static constexpr size_t kSectionBytesPerBlock = 32;
+// Buffered tokens of the sections, which take about 3 bits each.
+static constexpr size_t kTokenBytesPerBlock =
+    kSectionBytesPerBlock * kBitsPerByte / 3 * sizeof(Token);
+// GroupScratchMemory of each thread, including the coefficient cache.
+static constexpr size_t kScratchBytesPerThread = 576 << 10;
+
+// Returns the number of threads that fit in the memory budget of the options
+// next to the frame data and the freed blocks kept for reuse, or 0 if there is
+// no budget.
+size_t MaxThreadsForBudget(const ImageDim& dim,
+                           const EncoderOptions& options) {
+  if (options.memory_budget == 0) return 0;
+  const size_t num_blocks = dim.xsize_blocks * dim.ysize_blocks;
+  size_t frame_bytes =
+      num_blocks * (kDCGroupBytesPerBlock + kSectionBytesPerBlock);
+  frame_bytes += GetMemoryStats().cached_bytes;
+  if (options.optimize_code) frame_bytes += num_blocks * kTokenBytesPerBlock;
+  if (frame_bytes + kScratchBytesPerThread >= options.memory_budget) return 1;
+  return (options.memory_budget - frame_bytes) / kScratchBytesPerThread;
+}
+
+// Same as RunOnPool, but if max_threads is not 0, the tasks are run by at most
+// that many threads at the same time, which are passed to data_func as thread
+// indices below max_threads. This bounds the per-thread memory.
+template <class InitFunc, class DataFunc>
+Status RunOnPoolLimited(ThreadPool* pool, const uint32_t begin,
+                        const uint32_t end, size_t max_threads,
+                        const InitFunc& init_func, const DataFunc& data_func,
+                        const char* caller) {
+  if (max_threads == 0) {
+    return RunOnPool(pool, begin, end, init_func, data_func, caller);
+  }
+  const uint32_t num_slots =
+      std::min<uint32_t>(max_threads, end > begin ? end - begin : 0);
+  std::atomic<uint32_t> next{begin};
+  const auto init_slots = [&](size_t num_threads) {
+    return init_func(num_slots);
+  };
+  const auto run_slot = [&](const uint32_t slot, size_t thread) {
+    for (uint32_t i = next++; i < end; i = next++) data_func(i, slot);
+  };
+  return RunOnPool(pool, 0, num_slots, init_slots, run_slot, caller);
+}
+
+// Returns whether the tokens generated in `mode` are counted in the stats.
+// Every token of the frame is generated exactly once in one of these modes.
+bool CountsTokens(SectionMode mode) {
+  return mode == SectionMode::kWrite || mode == SectionMode::kBufferTokens;
+}
+
+// Returns whether the options generate the same sections from the same input.
+bool SameOutputOptions(const EncoderOptions& a, const EncoderOptions& b) {
+  return a.optimize_code == b.optimize_code &&
+         a.optimize_chroma_from_luma == b.optimize_chroma_from_luma &&
+         a.optimize_block_sizes == b.optimize_block_sizes &&
+         a.prefilter_block_sizes == b.prefilter_block_sizes &&
+         a.large_block_sizes == b.large_block_sizes &&
+         a.cache_coefficients == b.cache_coefficients &&
+         a.half_float_coefficient_cache == b.half_float_coefficient_cache &&
+         a.fast_adaptive_quantization == b.fast_adaptive_quantization &&
+         a.two_pass_code == b.two_pass_code &&
+         a.sampled_code_stride == b.sampled_code_stride &&
+         a.select_static_code == b.select_static_code &&
+         a.use_ans == b.use_ans && a.fast_decode == b.fast_decode &&
+         a.subsample_chroma == b.subsample_chroma;
+}
+
+// Returns the options without the features that EncoderOptions::fast_decode
+// and EncoderOptions::subsample_chroma turn off.
+EncoderOptions EffectiveOptions(const EncoderOptions& options) {
+  EncoderOptions effective = options;
+  if (options.fast_decode) {
+    effective.large_block_sizes = false;
+    effective.use_ans = false;
+  }
+  if (options.subsample_chroma) {
+    effective.optimize_chroma_from_luma = false;
+  }
+  return effective;
+}
+
+// Data shared by all groups of a frame. The tables and buffers are borrowed
+// from an EncoderCache.
+struct FrameData {
+  FrameData(size_t xsize, size_t ysize, float distance,
+            const EncoderOptions& options, EncoderCache::Data* cache)
+      : dim(xsize, ysize),
+        distp(ComputeDistanceParams(distance, options.fast_decode)),
+        options(EffectiveOptions(options)),
+        matrices(cache->matrices),
+        dc_code(InitialDCCode(options.optimize_code)),
+        ac_code(InitialACCode(options.optimize_code)),
+        mem(&cache->mem),
+        dc_data(cache->dc_data),
+        sections(cache->sections),
+        tokens(cache->tokens),
+        dc_part_sections(cache->dc_part_sections),
+        dc_part_tokens(cache->dc_part_tokens),
+        header(cache->header),
+        preview(cache->preview),
+        stats(options.collect_stats ? &cache->stats : nullptr),
+        cancel(cache->cancel),
+        heuristics_backend(cache->heuristics_backend),
+        max_threads(MaxThreadsForBudget(dim, options)),
+        ac_mode(options.optimize_code ? SectionMode::kBufferTokens
+                                      : SectionMode::kWrite),
+        dc_mode(ac_mode),
+        incremental(cache->incremental) {
+    ac_code.use_ans = this->options.optimize_code && this->options.use_ans;
+    dc_code.use_ans = ac_code.use_ans;
+    // The static codes make each AC group section depend only on the pixels
+    // of the group. A single group frame has only one merged section.
+    incremental_enabled = options.incremental && !options.optimize_code &&
+                          !options.select_static_code && dim.num_groups > 1;
+    reuse_sections = incremental_enabled && incremental.valid &&
+                     incremental.xsize == xsize &&
+                     incremental.ysize == ysize &&
+                     incremental.distance == distance &&
+                     SameOutputOptions(incremental.options, options);
+    incremental.valid = false;
+    incremental.xsize = xsize;
+    incremental.ysize = ysize;
+    incremental.distance = distance;
+    incremental.options = options;
+    // The storage of the new DC groups is allocated by InitDCGroups.
+    while (dc_data.size() < dim.num_dc_groups) dc_data.emplace_back(0, 0);
+    sections.resize(2 + dim.num_dc_groups + dim.num_groups);
+    if (!reuse_sections) ResetSections();
+    header.Reset();
+    if (stats) *stats = EncodeStats();
+    mem->ResetStats(stats != nullptr);
+  }
+  void ResetSections() {
+    for (BitWriter& section : sections) {
+      section.Reset();
+    }
+    if (options.optimize_code) {
+      tokens.resize(sections.size());
+      for (TokenBuffer& section_tokens : tokens) {
+        section_tokens.Reset();
+      }
+    }
+  }
+  // Starts generating the frame again at another distance, with the
+  // heuristics of the DC groups kept from the last pass, see
+  // EncodeFrameForSize.
+  void Restart(float distance) {
+    distp = ComputeDistanceParams(distance, options.fast_decode);
+    dc_code = InitialDCCode(options.optimize_code);
+    ac_code = InitialACCode(options.optimize_code);
+    ac_code.use_ans = options.optimize_code && options.use_ans;
+    dc_code.use_ans = ac_code.use_ans;
+    ac_mode = options.optimize_code ? SectionMode::kBufferTokens
+                                    : SectionMode::kWrite;
+    dc_mode = ac_mode;
+    sample_stride = 0;
+    sample_pass = false;
+    heuristics_done = true;
+    dc_histograms.clear();
+    ac_histograms.clear();
+    ac_costs.clear();
+    // The sections of a single group frame were merged into one.
+    sections.resize(2 + dim.num_dc_groups + dim.num_groups);
+    ResetSections();
+    header.Reset();
+    if (stats) *stats = EncodeStats();
+    mem->ResetStats(stats != nullptr);
+  }
+  // Pre-computed image dimension-derived values.
+  ImageDim dim;
+  // Distance dependent parameters.
+  DistanceParams distp;
+  EncoderOptions options;
+  // Dequantization matrices and static entropy codes.
+  const DequantMatrices& matrices;
+  EntropyCode dc_code;
+  EntropyCode ac_code;
+  ScratchMemory* mem;
+  std::vector<DCGroupData>& dc_data;
+  // Section writers.
+  std::vector<BitWriter>& sections;
+  // Buffered tokens of the group sections with optimize_code, indexed like
+  // the sections.
+  std::vector<TokenBuffer>& tokens;
+  // Parts of the DC group sections after the first one, while they are
+  // generated by separate tasks, indexed by the DC group within the current
+  // rows and the part.
+  std::vector<BitWriter>& dc_part_sections;
+  std::vector<TokenBuffer>& dc_part_tokens;
+  // Frame header and TOC, when the sections are passed to an OutputSink.
+  BitWriter& header;
+  FrameInfo info;
+  // See EncoderOptions::dc_preview.
+  Image3F& preview;
+  // Filled in at the end of the frame with collect_stats, null otherwise.
+  EncodeStats* stats;
+  // Stage times of the calling thread, outside of the thread pool tasks.
+  StageTimes times;
+  // Cancellation flag of the cache, may be null.
+  const std::atomic<bool>* cancel;
+  // Computes the heuristics instead of the threads if not null.
+  HeuristicsBackend* heuristics_backend;
+  // Maximum number of threads that process groups at the same time, 0 for no
+  // limit, see EncoderOptions::memory_budget.
+  size_t max_threads;
+  SectionMode ac_mode;
+  SectionMode dc_mode;
+  // With sampled_code_stride, every sample_stride-th AC group is sampled, and
+  // the current pass generates either only the sampled AC groups, or only the
+  // rest of them.
+  size_t sample_stride = 0;
+  bool sample_pass = false;
+  // Whether the heuristics of all AC stripes are already computed, in the
+  // second pass of two_pass_code.
+  bool heuristics_done = false;
+  // The recompressed JPEG, null for pixel input.
+  const JPEGCoefficients* jpeg = nullptr;
+  // Per-thread histograms of the DC and AC prefix codes, in the first pass of
+  // two_pass_code.
+  std::vector<HistogramCollector> dc_histograms;
+  std::vector<HistogramCollector> ac_histograms;
+  // Whether the histograms are per context instead of per prefix code.
+  bool raw_context_histograms = false;
+  // AC codes of all static code sets and their per-thread costs, while the
+  // set is being selected.
+  std::vector<EntropyCode> static_ac_codes;
+  std::vector<CodeCostCollector> ac_costs;
+  // State of EncoderOptions::incremental in the cache.
+  IncrementalState& incremental;
+  // Whether the frame can be generated incrementally, and whether the sections
+  // and the DC group data of the last frame are still in the cache and can be
+  // reused for the groups whose pixels did not change.
+  bool incremental_enabled;
+  bool reuse_sections;
+  // Whether the group hashes of the state are those of this frame.
+  bool hashes_ready = false;
+  // If not empty, only the AC and DC groups with nonzero entries are
+  // generated, the sections of the others are kept from the last frame.
+  std::vector<uint8_t> dirty_groups;
+  std::vector<uint8_t> dirty_dc_groups;
+
+  // Returns the stage times of the calling thread, or null if they are not
+  // collected.
+  StageTimes* Times() {
+    return JXL_ENABLE_STAGE_TIMING && stats ? &times : nullptr;
+  }
+
+  // With EncoderOptions::incremental, whether the AC group or the DC group
+  // has to be generated again.
+  bool IsDirtyGroup(size_t ac_group_idx) const {
+    return dirty_groups.empty() || dirty_groups[ac_group_idx];
+  }
+  bool IsDirtyDCGroup(size_t dc_group_idx) const {
+    return dirty_dc_groups.empty() || dirty_dc_groups[dc_group_idx];
+  }
+
+  bool Cancelled() const {
+    return cancel && cancel->load(std::memory_order_relaxed);
+  }
+
+  // Whether the AC group is generated in the current pass.
+  bool ProcessesACGroup(size_t ac_group_idx) const {
+    if (!IsDirtyGroup(ac_group_idx)) return false;
+    if (sample_stride <= 1) return true;
+    return (ac_group_idx % sample_stride == 0) == sample_pass;
+  }
+};
+
+// Prepares the DC group data of the frame, reusing the storage of earlier
+// frames where it is large enough. The DC groups are allocated by the pool, so
+// that with workers pinned to NUMA nodes, each DC group is most likely on the
+// node of the workers that process its region.
+Status InitDCGroups(FrameData* frame, ThreadPool* pool) {
+  // The data of the unchanged groups, or the heuristics of the last pass of
+  // the rate control, are still valid.
+  if (frame->reuse_sections || frame->heuristics_done) return true;
+  const ImageDim& dim = frame->dim;
+  // 514 kB total memory per DC group (384 kB quantized DC, 64 kB AQ field
+  // 64 kB AC strategy, 2 kB Chroma from luma).
+  const auto init_dc_group = [&](const uint32_t i, const size_t thread) {
+    size_t dc_gx = i % dim.xsize_dc_groups;
+    size_t dc_gy = i / dim.xsize_dc_groups;
+    Rect dc_group_rect = dim.PixelRect(dc_gx, dc_gy, kDCGroupDim);
+    ImageDim dc_group_dim(dc_group_rect.xsize(), dc_group_rect.ysize());
+    const size_t xsize_blocks = dc_group_dim.xsize_blocks;
+    const size_t ysize_blocks = dc_group_dim.ysize_blocks;
+    DCGroupData& dc_data = frame->dc_data[i];
+    if (dc_data.Fits(xsize_blocks, ysize_blocks)) {
+      dc_data.Reset(xsize_blocks, ysize_blocks);
+    } else {
+      dc_data = DCGroupData(xsize_blocks, ysize_blocks);
+    }
+  };
+  return RunOnPool(pool, 0, dim.num_dc_groups, ThreadPool::NoInit,
+                   init_dc_group, "InitDCGroups");
+}
+
+// Returns the per-thread histograms for the tokens of `code`.
+HistogramCollector CodeHistograms(const EntropyCode& code, bool raw_contexts) {
+  return HistogramCollector(
+      raw_contexts ? code.num_contexts : code.num_prefix_codes, raw_contexts);
+}
+
+// Makes sure that each thread has its own histograms or costs in the passes
+// that collect them. Those of earlier calls are kept.
+Status InitCollectors(size_t num_threads, FrameData* frame) {
+  const bool raw = frame->raw_context_histograms;
+  if (frame->dc_mode == SectionMode::kCollectHistograms &&
+      frame->dc_histograms.size() < num_threads) {
+    frame->dc_histograms.resize(num_threads,
+                                CodeHistograms(frame->dc_code, raw));
+  }
+  if (frame->ac_mode == SectionMode::kCollectHistograms &&
+      frame->ac_histograms.size() < num_threads) {
+    frame->ac_histograms.resize(num_threads,
+                                CodeHistograms(frame->ac_code, raw));
+  }
+  if (frame->ac_mode == SectionMode::kCollectCosts &&
+      frame->ac_costs.size() < num_threads) {
+    frame->ac_costs.resize(num_threads,
+                           CodeCostCollector(&frame->static_ac_codes));
+  }
+  return true;
+}
+
+// Writes the AC group at (image_gx, image_gy) to the bitstream and fills in
+// its 1/64th of the quantized DC. Unless the options have cache_coefficients,
+// or in the second pass of two_pass_code, the heuristics of all of its stripes
+// must have been computed already.
+template <class Writer>
+Status WriteACGroupStripes(const FrameInput& input, size_t image_gx,
+                           size_t image_gy, FrameData* frame,
+                           GroupScratchMemory* mem, Writer* output) {
+  const ImageDim& dim = frame->dim;
+  const DistanceParams& distp = frame->distp;
+  // Rectangle of the current AC group within the image.
+  Rect group_rect = dim.PixelRect(image_gx, image_gy, kGroupDim);
+  // Dimensions of the current AC group.
+  ImageDim group_dim(group_rect.xsize(), group_rect.ysize());
+  mem->gmem.token_counts = mem->stats && CountsTokens(frame->ac_mode)
+                               ? mem->stats->ac_token_counts
+                               : nullptr;
+  Image3F* half_chroma = frame->options.subsample_chroma && !input.jpeg
+                             ? mem->half_chroma()
+                             : nullptr;
+  mem->gmem.half_chroma = half_chroma;
+  // Process AC group one 256 x kTileDim stripe at a time. These must be done
+  // sequentially, because there is context dependence between the stripes.
+  for (size_t ty = 0; ty < group_dim.ysize_tiles; ++ty) {
+    // The caller fails the whole frame after a cancellation.
+    if (frame->Cancelled()) return true;
+    size_t image_ty = image_gy * kGroupDimInTiles + ty;
+    StripeRects rects(dim, image_gx, image_ty);
+    DCGroupData* dc_data = &frame->dc_data[rects.dc_group_idx];
+    if (input.jpeg) {
+      // The coefficients are already quantized, there are no heuristics.
+      StageTimer timer(mem->times, kStageWriteACGroup);
+      Rect image_brect(rects.pixel_rect.x0() / kBlockDim,
+                       rects.pixel_rect.y0() / kBlockDim,
+                       rects.block_rect.xsize(), rects.block_rect.ysize());
+      WriteACGroup(*input.jpeg, image_brect, rects.block_rect, dc_data,
+                   frame->ac_code, &mem->num_nzeros, &mem->gmem, output);
+      continue;
+    }
+    // Without cache_coefficients, the XYB stripe is recomputed here instead of
+    // being kept from the heuristics stage, this is cheap compared to storing
+    // the whole image.
+    LoadXYBStripe(input, rects.pixel_rect, &mem->stripe, mem->times,
+                  half_chroma);
+    CoefficientCache* cache = nullptr;
+    if (frame->options.cache_coefficients && !frame->heuristics_done &&
+        !frame->heuristics_backend) {
+      cache = mem->coeff_cache(frame->options.half_float_coefficient_cache);
+      ComputeStripeHeuristics(rects, distp, frame->options, frame->matrices,
+                              dc_data, mem, cache);
+    }
+    StageTimer timer(mem->times, kStageWriteACGroup);
+    WriteACGroup(mem->stripe, rects.block_rect, frame->matrices, distp.scale,
+                 distp.scale_dc, distp.x_qm_scale, dc_data, frame->ac_code,
+                 frame->options.optimize_chroma_from_luma, cache,
+                 &mem->num_nzeros, &mem->gmem, output);
+  }
   return true;
 }
 
-#if OPTIMIZE_CODE
-void OptimizeSections(EntropyCode* code, BitWriter* sections, size_t num) {
-  std::vector<Histogram> histograms(code->num_prefix_codes);
-  for (size_t i = 0; i < num; ++i) {
-    Span<const uint8_t> bytes = sections[i].GetSpan();
-    JXL_ASSERT(bytes.size() % 3 == 0);
-    for (size_t j = 0; j < bytes.size(); j += 3) {
-      uint8_t context = bytes[j];
-      uint16_t value = (bytes[j + 2] << 8) + bytes[j + 1];
-      if (context < kMaxContexts) {
-        JXL_ASSERT(context < histograms.size());
-        uint32_t tok, nbits, bits;
-        UintCoder().Encode(value, &tok, &nbits, &bits);
-        JXL_ASSERT(tok < kAlphabetSize);
-        histograms[context].Add(tok);
+// Hands out the AC group and DC group tasks of some DC group rows in the
+// order of their dependencies. The AC groups are handed out DC group by DC
+// group. The tasks of a DC group become ready when all of its AC groups are
+// done, and then go before the remaining AC groups, so that they run while
+// the AC groups of the next DC groups are in flight.
+class GroupPipeline {
+ public:
+  struct Task {
+    bool is_ac;
+    size_t ac_group_idx;
+    // Index of the DC group among those of the pipeline, and for DC group
+    // tasks, the index of the task within the DC group.
+    size_t dc_group;
+    size_t part;
+  };
+
+  // The DC groups are those of dc_rect, in DC group units, in row-major
+  // order. Each of them has num_dc_tasks tasks, none if it is 0.
+  GroupPipeline(const ImageDim& dim, const Rect& dc_rect, size_t num_dc_tasks)
+      : num_dc_tasks_(num_dc_tasks) {
+    constexpr size_t kDCGroupDimInGroups = kDCGroupDim / kGroupDim;
+    for (size_t dc_gy = dc_rect.y0(); dc_gy < dc_rect.y1(); ++dc_gy) {
+      for (size_t dc_gx = dc_rect.x0(); dc_gx < dc_rect.x1(); ++dc_gx) {
+        const size_t gy_end =
+            std::min(dim.ysize_groups, (dc_gy + 1) * kDCGroupDimInGroups);
+        const size_t gx_end =
+            std::min(dim.xsize_groups, (dc_gx + 1) * kDCGroupDimInGroups);
+        const size_t dc_group = num_ac_pending_.size();
+        num_ac_pending_.push_back(0);
+        for (size_t gy = dc_gy * kDCGroupDimInGroups; gy < gy_end; ++gy) {
+          for (size_t gx = dc_gx * kDCGroupDimInGroups; gx < gx_end; ++gx) {
+            const size_t ac_group_idx = gy * dim.xsize_groups + gx;
+            ac_tasks_.push_back({true, ac_group_idx, dc_group, 0});
+            ++num_ac_pending_[dc_group];
+          }
+        }
       }
     }
+    num_dc_pending_.resize(num_ac_pending_.size(), num_dc_tasks);
   }
-  OptimizeEntropyCode(&histograms, code);
-  for (size_t i = 0; i < num; ++i) {
-    Span<const uint8_t> bytes = sections[i].GetSpan();
-    BitWriter writer;
-    size_t num_tokens = bytes.size() / 3;
-    BitWriter::Allotment allotment(&writer, kMaxBitsPerToken * num_tokens);
-    for (size_t j = 0; j < bytes.size(); j += 3) {
-      uint8_t context = bytes[j];
-      uint16_t value = (bytes[j + 2] << 8) + bytes[j + 1];
-      if (context >= kMaxContexts) {
-        writer.Write(context - kMaxContexts, value);
+
+  size_t num_tasks() const {
+    return ac_tasks_.size() + num_dc_pending_.size() * num_dc_tasks_;
+  }
+
+  // Returns the next task, waiting for one to become ready if needed. Must
+  // be called at most num_tasks() times.
+  Task Next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (ready_.empty() && next_ac_ == ac_tasks_.size()) ready_cv_.wait(lock);
+    if (ready_.empty()) return ac_tasks_[next_ac_++];
+    const Task task = ready_.back();
+    ready_.pop_back();
+    return task;
+  }
+
+  // Must be called after each task is done, including the failed and skipped
+  // ones. Returns whether it was the last task of its DC group.
+  bool Finish(const Task& task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!task.is_ac) return --num_dc_pending_[task.dc_group] == 0;
+    if (--num_ac_pending_[task.dc_group] > 0 || num_dc_tasks_ == 0) {
+      return false;
+    }
+    for (size_t part = num_dc_tasks_; part > 0; --part) {
+      ready_.push_back({false, 0, task.dc_group, part - 1});
+    }
+    lock.unlock();
+    ready_cv_.notify_all();
+    return false;
+  }
+
+ private:
+  const size_t num_dc_tasks_;
+  std::vector<Task> ac_tasks_;
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+  // Guarded by mutex_.
+  size_t next_ac_ = 0;
+  std::vector<Task> ready_;
+  std::vector<size_t> num_ac_pending_;
+  std::vector<size_t> num_dc_pending_;
+};
+
+// Has the heuristics backend of the frame fill in the heuristics of the DC
+// groups of dc_rect, in DC group units.
+Status OffloadHeuristics(const Rect& dc_rect, FrameData* frame) {
+  const ImageDim& dim = frame->dim;
+  for (size_t dc_gy = dc_rect.y0(); dc_gy < dc_rect.y1(); ++dc_gy) {
+    for (size_t dc_gx = dc_rect.x0(); dc_gx < dc_rect.x1(); ++dc_gx) {
+      const size_t idx = dc_gy * dim.xsize_dc_groups + dc_gx;
+      if (!frame->IsDirtyDCGroup(idx)) continue;
+      if (!frame->heuristics_backend->ComputeDCGroupHeuristics(
+              dim.PixelRect(dc_gx, dc_gy, kDCGroupDim), frame->distp.distance,
+              frame->distp.inv_scale, &frame->dc_data[idx])) {
+        return JXL_FAILURE("Heuristics backend failed");
+      }
+    }
+  }
+  return true;
+}
+
+// Generates the AC group and DC group sections of the DC groups of dc_rect,
+// in DC group units, input must contain all pixels of these DC groups.
+Status EncodeDCGroups(const FrameInput& input, const Rect& dc_rect,
+                      FrameData* frame, ThreadPool* pool) {
+  const ImageDim& dim = frame->dim;
+  ScratchMemory* mem = frame->mem;
+  constexpr size_t kDCGroupDimInTiles = kDCGroupDim / kTileDim;
+  constexpr size_t kDCGroupDimInGroups = kDCGroupDim / kGroupDim;
+  const auto init_mem = [&](size_t num_threads) {
+    return mem->Init(num_threads);
+  };
+  const auto init_group = [&](size_t num_threads) {
+    return mem->Init(num_threads) && InitCollectors(num_threads, frame);
+  };
+
+  // Compute the heuristics of all AC stripes. Each stripe fills in its own
+  // part of the DC group data, so these can be done in parallel. With
+  // cache_coefficients, this is done by the AC groups instead, right before
+  // tokenizing each of their stripes.
+  const bool offload_heuristics =
+      frame->heuristics_backend && !frame->heuristics_done && !input.jpeg;
+  if (offload_heuristics) {
+    JXL_RETURN_IF_ERROR(OffloadHeuristics(dc_rect, frame));
+  }
+  if (!frame->options.cache_coefficients && !frame->heuristics_done &&
+      !input.jpeg && !offload_heuristics) {
+    const size_t ty_begin = dc_rect.y0() * kDCGroupDimInTiles;
+    const size_t ty_end =
+        std::min(dim.ysize_tiles, dc_rect.y1() * kDCGroupDimInTiles);
+    const size_t gx_begin = dc_rect.x0() * kDCGroupDimInGroups;
+    const size_t xsize_groups =
+        std::min(dim.xsize_groups, dc_rect.x1() * kDCGroupDimInGroups) -
+        gx_begin;
+    const auto compute_heuristics = [&](const uint32_t i, const size_t thread) {
+      if (frame->Cancelled()) return;
+      const size_t image_gx = gx_begin + i % xsize_groups;
+      const size_t image_ty = ty_begin + i / xsize_groups;
+      const size_t image_gy = image_ty / kGroupDimInTiles;
+      if (!frame->IsDirtyGroup(image_gy * dim.xsize_groups + image_gx)) return;
+      StripeRects rects(dim, image_gx, image_ty);
+      GroupScratchMemory* stripe_mem = mem->Get(thread);
+      LoadXYBStripe(input, rects.pixel_rect, &stripe_mem->stripe,
+                    stripe_mem->times);
+      ComputeStripeHeuristics(rects, frame->distp, frame->options,
+                              frame->matrices,
+                              &frame->dc_data[rects.dc_group_idx], stripe_mem,
+                              /*cache=*/nullptr);
+    };
+    JXL_RETURN_IF_ERROR(RunOnPoolLimited(
+        pool, 0, (ty_end - ty_begin) * xsize_groups, frame->max_threads,
+        init_mem, compute_heuristics, "ComputeHeuristics"));
+    if (frame->Cancelled()) return JXL_FAILURE("Encoding cancelled");
+  }
+
+  // Generate the AC group and DC group sections. Each AC group writes only
+  // its own section and its own part of the quantized DC, so these can be done
+  // in parallel. The sections of each DC group are generated as soon as its AC
+  // groups are done. With only a few DC groups, each of their parts is a
+  // separate task, so that the DC groups are not a serial tail after the AC
+  // groups.
+  const size_t num_dc_groups = dc_rect.xsize() * dc_rect.ysize();
+  // Index of the i-th DC group of dc_rect within the frame.
+  const auto dc_group_idx = [&](size_t i) {
+    return (dc_rect.y0() + i / dc_rect.xsize()) * dim.xsize_dc_groups +
+           dc_rect.x0() + i % dc_rect.xsize();
+  };
+  const bool write_dc = frame->dc_mode != SectionMode::kSkip;
+  const size_t num_parts =
+      num_dc_groups < kNumDCGroupParts ? kNumDCGroupParts : 1;
+  const size_t num_extra_parts = num_dc_groups * (kNumDCGroupParts - 1);
+  if (num_parts > 1 && frame->dc_mode == SectionMode::kWrite) {
+    frame->dc_part_sections.resize(num_extra_parts);
+    for (BitWriter& part : frame->dc_part_sections) part.Reset();
+  } else if (num_parts > 1 && frame->dc_mode == SectionMode::kBufferTokens) {
+    frame->dc_part_tokens.resize(num_extra_parts);
+    for (TokenBuffer& part : frame->dc_part_tokens) part.Reset();
+  }
+  GroupPipeline pipeline(dim, dc_rect, write_dc ? num_parts : 0);
+  std::atomic<bool> has_error{false};
+  const auto process_ac_group = [&](size_t ac_group_idx, size_t thread) {
+    if (has_error || frame->Cancelled()) return;
+    size_t image_gx = ac_group_idx % dim.xsize_groups;
+    size_t image_gy = ac_group_idx / dim.xsize_groups;
+    size_t section_idx = 2 + dim.num_dc_groups + ac_group_idx;
+    if (!frame->ProcessesACGroup(ac_group_idx)) return;
+    GroupScratchMemory* group_mem = mem->Get(thread);
+    bool ok;
+    if (frame->ac_mode == SectionMode::kBufferTokens) {
+      ok = WriteACGroupStripes(input, image_gx, image_gy, frame, group_mem,
+                               &frame->tokens[section_idx]);
+    } else if (frame->ac_mode == SectionMode::kCollectHistograms) {
+      ok = WriteACGroupStripes(input, image_gx, image_gy, frame, group_mem,
+                               &frame->ac_histograms[thread]);
+    } else if (frame->ac_mode == SectionMode::kCollectCosts) {
+      ok = WriteACGroupStripes(input, image_gx, image_gy, frame, group_mem,
+                               &frame->ac_costs[thread]);
+    } else {
+      ok = WriteACGroupStripes(input, image_gx, image_gy, frame, group_mem,
+                               &frame->sections[section_idx]);
+    }
+    if (!ok) has_error = true;
+  };
+  // The first part goes directly to the section, the others are appended to
+  // it after the last one is done.
+  const auto part_idx = [&](size_t i, size_t part) {
+    return i * (kNumDCGroupParts - 1) + part - 1;
+  };
+  const auto process_dc_group = [&](size_t i, size_t part, size_t thread) {
+    const DCGroupData& dc_data = frame->dc_data[dc_group_idx(i)];
+    size_t section_idx = 1 + dc_group_idx(i);
+    StageTimer timer(mem->Times(thread), kStageWriteDCGroup);
+    ThreadStats* stats = mem->Stats(thread);
+    uint64_t* token_counts = stats && CountsTokens(frame->dc_mode)
+                                 ? stats->dc_token_counts
+                                 : nullptr;
+    if (frame->dc_mode == SectionMode::kBufferTokens) {
+      TokenBuffer* tokens = part == 0
+                                ? &frame->tokens[section_idx]
+                                : &frame->dc_part_tokens[part_idx(i, part)];
+      WriteDCGroup(dc_data, part, num_parts, frame->dc_code, token_counts,
+                   tokens);
+    } else if (frame->dc_mode == SectionMode::kCollectHistograms) {
+      WriteDCGroup(dc_data, part, num_parts, frame->dc_code, token_counts,
+                   &frame->dc_histograms[thread]);
+    } else {
+      BitWriter* writer = part == 0
+                              ? &frame->sections[section_idx]
+                              : &frame->dc_part_sections[part_idx(i, part)];
+      WriteDCGroup(dc_data, part, num_parts, frame->dc_code, token_counts,
+                   writer);
+    }
+  };
+  const auto append_parts = [&](size_t i) {
+    if (num_parts == 1 || frame->dc_mode == SectionMode::kCollectHistograms) {
+      return;
+    }
+    const size_t section_idx = 1 + dc_group_idx(i);
+    for (size_t part = 1; part < kNumDCGroupParts; ++part) {
+      if (frame->dc_mode == SectionMode::kBufferTokens) {
+        frame->tokens[section_idx].Append(
+            frame->dc_part_tokens[part_idx(i, part)]);
       } else {
-        WriteToken(Token(context, value), *code, &writer);
+        frame->sections[section_idx].Append(
+            frame->dc_part_sections[part_idx(i, part)]);
       }
     }
-    allotment.Reclaim(&writer);
-    std::swap(sections[i], writer);
+  };
+  // Each call runs exactly one task of the pipeline, but not necessarily the
+  // one with the index of the call.
+  const auto process_task = [&](const uint32_t /*i*/, const size_t thread) {
+    const GroupPipeline::Task task = pipeline.Next();
+    if (task.is_ac) {
+      process_ac_group(task.ac_group_idx, thread);
+      pipeline.Finish(task);
+      return;
+    }
+    const bool skip = has_error || frame->Cancelled() ||
+                      !frame->IsDirtyDCGroup(dc_group_idx(task.dc_group));
+    if (!skip) process_dc_group(task.dc_group, task.part, thread);
+    if (pipeline.Finish(task) && !skip) append_parts(task.dc_group);
+  };
+  JXL_RETURN_IF_ERROR(RunOnPoolLimited(pool, 0, pipeline.num_tasks(),
+                                       frame->max_threads, init_group,
+                                       process_task, "EncodeGroups"));
+  if (has_error) return JXL_FAILURE("Failed to encode AC groups");
+  if (frame->Cancelled()) return JXL_FAILURE("Encoding cancelled");
+  return true;
+}
+
+// Same as above, for the DC group rows [dc_gy_begin, dc_gy_end).
+Status EncodeDCGroupRows(const FrameInput& input, size_t dc_gy_begin,
+                         size_t dc_gy_end, FrameData* frame,
+                         ThreadPool* pool) {
+  const Rect dc_rect(0, dc_gy_begin, frame->dim.xsize_dc_groups,
+                     dc_gy_end - dc_gy_begin);
+  return EncodeDCGroups(input, dc_rect, frame, pool);
+}
+
+// Adds the per-thread histograms to the first `num` of *histograms.
+void SumHistograms(const std::vector<HistogramCollector>& threads, size_t num,
+                   std::vector<Histogram>* histograms) {
+  if (histograms->size() < num) histograms->resize(num);
+  for (const HistogramCollector& thread_histos : threads) {
+    for (size_t j = 0; j < num; ++j) {
+      (*histograms)[j].AddHistogram(thread_histos.histograms[j]);
+    }
   }
 }
-#endif
 
-void CombineSections(std::vector<BitWriter>* sections, BitWriter* writer) {
+// Optimizes `code` for the sum of the per-thread histograms of its prefix
+// codes, which were collected from one in `sample_stride` sections.
+void OptimizeCodeForHistograms(const std::vector<HistogramCollector>& threads,
+                               size_t sample_stride, EntropyCode* code) {
+  std::vector<Histogram> histograms;
+  SumHistograms(threads, code->num_prefix_codes, &histograms);
+  if (sample_stride > 1) {
+    ExtrapolateSampledHistograms(sample_stride, &histograms);
+  }
+  OptimizeEntropyCode(&histograms, code);
+}
+
+// Adds the tokens of every stride-th of `num` sections to per-thread
+// histograms of the prefix codes of `code`.
+Status BuildSectionHistograms(const EntropyCode& code,
+                              const TokenBuffer* tokens, size_t num,
+                              size_t stride, ThreadPool* pool,
+                              std::vector<HistogramCollector>* threads) {
+  const auto init = [&](size_t num_threads) {
+    threads->resize(num_threads, HistogramCollector(code.num_prefix_codes));
+    return true;
+  };
+  std::atomic<bool> has_error{false};
+  const auto add_histograms = [&](const uint32_t i, const size_t thread) {
+    if (!tokens[i * stride].AddToHistograms(&(*threads)[thread].histograms)) {
+      has_error = true;
+    }
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, (num + stride - 1) / stride, init,
+                                add_histograms, "BuildHistograms"));
+  if (has_error) return JXL_FAILURE("Failed to build section histograms");
+  return true;
+}
+
+// Writes the buffered tokens of every stride-th of `num` sections into the
+// corresponding sections. The sections are independent of each other once the
+// code is known.
+Status WriteSectionTokens(const EntropyCode& code, const TokenBuffer* tokens,
+                          BitWriter* sections, size_t num, size_t stride,
+                          ThreadPool* pool) {
+  std::atomic<bool> has_error{false};
+  const auto write_section = [&](const uint32_t i, const size_t thread) {
+    if (!tokens[i * stride].WriteTo(code, &sections[i * stride])) {
+      has_error = true;
+    }
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, (num + stride - 1) / stride,
+                                ThreadPool::NoInit, write_section,
+                                "WriteSections"));
+  if (has_error) return JXL_FAILURE("Failed to write section tokens");
+  return true;
+}
+
+// Optimizes `code` for the tokens of `num` sections and writes them into the
+// corresponding sections.
+Status OptimizeSections(EntropyCode* code, const TokenBuffer* tokens,
+                        BitWriter* sections, size_t num, ThreadPool* pool) {
+  // Each thread collects the histograms of its own sections, these are summed
+  // up afterwards.
+  std::vector<HistogramCollector> thread_histograms;
+  JXL_RETURN_IF_ERROR(BuildSectionHistograms(*code, tokens, num, /*stride=*/1,
+                                             pool, &thread_histograms));
+  OptimizeCodeForHistograms(thread_histograms, /*sample_stride=*/1, code);
+  return WriteSectionTokens(*code, tokens, sections, num, /*stride=*/1, pool);
+}
+
+void MergeSingleGroupSections(std::vector<BitWriter>* sections) {
   if (sections->size() == 4) {
     // If we have only one AC group, everything must be put into one section.
     for (size_t i = 1; i < 4; ++i) {
@@ -809,54 +1926,806 @@ void CombineSections(std::vector<BitWriter>* sections, BitWriter* writer) {
     }
     sections->resize(1);
   }
+}
+
+// Fills in the preview of the frame with its dequantized DC, converted back to
+// linear sRGB, see EncoderOptions::dc_preview.
+Status BuildPreview(FrameData* frame, ThreadPool* pool) {
+  if (!frame->options.dc_preview) return true;
+  constexpr size_t kDCGroupDimInBlocks = kDCGroupDim / kBlockDim;
+  const ImageDim& dim = frame->dim;
+  Image3F& preview = frame->preview;
+  if (preview.xsize() != dim.xsize_blocks ||
+      preview.ysize() != dim.ysize_blocks) {
+    preview = Image3F(dim.xsize_blocks, dim.ysize_blocks);
+  }
+  float mul[3];
+  for (size_t c = 0; c < 3; ++c) {
+    mul[c] = kDCQuant[c] / frame->distp.scale_dc;
+  }
+  // The B channel is quantized after subtracting the Y channel.
+  const float cfl_factor = kInvDCQuant[2] * kDCQuant[1];
+  const auto dequantize_dc_group = [&](const uint32_t i, const size_t thread) {
+    const Image3S& quant_dc = frame->dc_data[i].quant_dc;
+    const size_t bx0 = (i % dim.xsize_dc_groups) * kDCGroupDimInBlocks;
+    const size_t by0 = (i / dim.xsize_dc_groups) * kDCGroupDimInBlocks;
+    for (size_t y = 0; y < quant_dc.ysize(); ++y) {
+      const int16_t* JXL_RESTRICT row_x = quant_dc.ConstPlaneRow(0, y);
+      const int16_t* JXL_RESTRICT row_y = quant_dc.ConstPlaneRow(1, y);
+      const int16_t* JXL_RESTRICT row_b = quant_dc.ConstPlaneRow(2, y);
+      float* JXL_RESTRICT out_x = preview.PlaneRow(0, by0 + y) + bx0;
+      float* JXL_RESTRICT out_y = preview.PlaneRow(1, by0 + y) + bx0;
+      float* JXL_RESTRICT out_b = preview.PlaneRow(2, by0 + y) + bx0;
+      for (size_t x = 0; x < quant_dc.xsize(); ++x) {
+        out_x[x] = row_x[x] * mul[0];
+        out_y[x] = row_y[x] * mul[1];
+        out_b[x] = (row_b[x] + row_y[x] * cfl_factor) * mul[2];
+      }
+    }
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, dim.num_dc_groups, ThreadPool::NoInit,
+                                dequantize_dc_group, "BuildPreview"));
+  XYBToLinear(&preview);
+  return true;
+}
+
+// Writes the TOC and the sections to *writer. The offset of each section in
+// the output is known from the sizes of the ones before it, so the sections
+// are copied in parallel.
+Status CombineSections(std::vector<BitWriter>* sections, ThreadPool* pool,
+                       BitWriter* writer) {
+  MergeSingleGroupSections(sections);
   WriteTOC(*sections, writer);
-  writer->AppendByteAligned(sections);
+  std::vector<size_t> offsets(sections->size() + 1);
+  for (size_t i = 0; i < sections->size(); ++i) {
+    offsets[i + 1] =
+        offsets[i] + DivCeil((*sections)[i].BitsWritten(), kBitsPerByte);
+  }
+  uint8_t* output = writer->AppendBytes(offsets.back());
+  const auto copy_section = [&](const uint32_t i, const size_t thread) {
+    BitWriter& section = (*sections)[i];
+    BitWriter::Allotment allotment(&section, 8);
+    section.ZeroPadToByte();
+    allotment.Reclaim(&section);
+    JXL_DASSERT(section.BitsWritten() / kBitsPerByte ==
+                offsets[i + 1] - offsets[i]);
+    section.CopyTo(output + offsets[i]);
+  };
+  return RunOnPool(pool, 0, sections->size(), ThreadPool::NoInit,
+                   copy_section, "CombineSections");
 }
 
-}  // namespace
+// Generates the global sections of a frame whose groups have all been
+// generated.
+Status FinishSections(FrameData* frame, ThreadPool* pool) {
+  const ImageDim& dim = frame->dim;
+  std::vector<BitWriter>& sections = frame->sections;
+
+  if (frame->dc_mode == SectionMode::kBufferTokens) {
+    StageTimer timer(frame->Times(), kStageOptimizeSections);
+    JXL_RETURN_IF_ERROR(OptimizeSections(&frame->dc_code, &frame->tokens[1],
+                                         &sections[1], dim.num_dc_groups,
+                                         pool));
+  }
+  if (frame->ac_mode == SectionMode::kBufferTokens) {
+    StageTimer timer(frame->Times(), kStageOptimizeSections);
+    size_t ac_group_start = 2 + dim.num_dc_groups;
+    JXL_RETURN_IF_ERROR(OptimizeSections(
+        &frame->ac_code, &frame->tokens[ac_group_start],
+        &sections[ac_group_start], dim.num_groups, pool));
+  }
+
+  // Generate DC and AC global sections.
+  WriteDCGlobal(frame->distp, frame->jpeg, dim.num_dc_groups,
+                frame->dc_code, &sections[0]);
+  const bool large_blocks = frame->options.optimize_block_sizes &&
+                            frame->options.large_block_sizes;
+  WriteACGlobal(dim.num_groups, large_blocks, frame->jpeg, frame->ac_code,
+                &sections[1 + dim.num_dc_groups]);
+  return true;
+}
+
+// Records the section sizes, once all sections are generated, but before the
+// sections of a single group frame are merged.
+void RecordSectionStats(FrameData* frame) {
+  if (!frame->stats) return;
+  std::vector<size_t>& section_bits = frame->stats->section_bits;
+  frame->stats->num_dc_groups = frame->dim.num_dc_groups;
+  section_bits.clear();
+  for (const BitWriter& section : frame->sections) {
+    section_bits.push_back(section.BitsWritten());
+  }
+}
+
+// Adds the distributions of the block and color tile data of a DC group.
+void AddDCGroupStats(const DCGroupData& data, EncodeStats* stats) {
+  const AcStrategyImage& ac_strategy = data.ac_strategy;
+  for (size_t y = 0; y < ac_strategy.ysize(); ++y) {
+    AcStrategyRow row_acs = ac_strategy.ConstRow(y);
+    const uint8_t* row_qf = data.raw_quant_field.ConstRow(y);
+    for (size_t x = 0; x < ac_strategy.xsize(); ++x) {
+      if (row_acs[x].IsFirstBlock()) {
+        ++stats->strategy_counts[row_acs[x].RawStrategy()];
+      }
+      ++stats->quant_field_histogram[row_qf[x]];
+    }
+  }
+  for (size_t y = 0; y < data.ytox_map.ysize(); ++y) {
+    const int8_t* row_ytox = data.ytox_map.ConstRow(y);
+    const int8_t* row_ytob = data.ytob_map.ConstRow(y);
+    for (size_t x = 0; x < data.ytox_map.xsize(); ++x) {
+      ++stats->ytox_histogram[row_ytox[x] + 128];
+      ++stats->ytob_histogram[row_ytob[x] + 128];
+    }
+  }
+}
+
+// Sums up the stats of all threads and of all DC groups, once the frame is
+// complete.
+void FinishStats(FrameData* frame) {
+  if (!frame->stats) return;
+  EncodeStats* stats = frame->stats;
+  stats->dc_token_counts.assign(kNumDCContexts, 0);
+  stats->ac_token_counts.assign(kNumACContexts, 0);
+  stats->stage_times.Add(frame->times);
+  frame->mem->AddStats(stats);
+  for (size_t i = 0; i < frame->dim.num_dc_groups; ++i) {
+    AddDCGroupStats(frame->dc_data[i], stats);
+  }
+}
+
+// Writes the frame header and the sections of the frame to *writer.
+Status FinishFrame(FrameData* frame, ThreadPool* pool, BitWriter* writer) {
+  JXL_RETURN_IF_ERROR(FinishSections(frame, pool));
+  RecordSectionStats(frame);
+  JXL_RETURN_IF_ERROR(BuildPreview(frame, pool));
+  {
+    StageTimer timer(frame->Times(), kStageCombineSections);
+    // Assemble final bitstream.
+    WriteFrameHeader(frame->distp.x_qm_scale, frame->distp.epf_iters,
+                     frame->jpeg != nullptr, frame->info, writer);
+    JXL_RETURN_IF_ERROR(CombineSections(&frame->sections, pool, writer));
+  }
+  FinishStats(frame);
+  frame->incremental.valid = frame->hashes_ready;
+  return true;
+}
+
+// Passes the frame header and TOC, and then each section of the frame to
+// `sink`, without copying the sections.
+Status FinishFrame(FrameData* frame, ThreadPool* pool,
+                   const OutputSink& sink) {
+  JXL_RETURN_IF_ERROR(FinishSections(frame, pool));
+  RecordSectionStats(frame);
+  JXL_RETURN_IF_ERROR(BuildPreview(frame, pool));
+  {
+    StageTimer timer(frame->Times(), kStageCombineSections);
+    std::vector<BitWriter>& sections = frame->sections;
+    MergeSingleGroupSections(&sections);
+    BitWriter* header = &frame->header;
+    WriteFrameHeader(frame->distp.x_qm_scale, frame->distp.epf_iters,
+                     frame->jpeg != nullptr, frame->info, header);
+    WriteTOC(sections, header);
+    if (!sink(header->GetSpan())) {
+      return JXL_FAILURE("Failed to write frame header");
+    }
+    for (BitWriter& section : sections) {
+      BitWriter::Allotment allotment(&section, 8);
+      section.ZeroPadToByte();
+      allotment.Reclaim(&section);
+      for (const Span<const uint8_t>& span : section.GetSpans()) {
+        if (!span.empty() && !sink(span)) {
+          return JXL_FAILURE("Failed to write section");
+        }
+      }
+    }
+  }
+  FinishStats(frame);
+  frame->incremental.valid = frame->hashes_ready;
+  return true;
+}
+
+// Returns the data of `cache`, or of a new temporary cache if it is null.
+EncoderCache::Data* GetCacheData(EncoderCache* cache,
+                                 std::unique_ptr<EncoderCache>* local_cache) {
+  if (cache == nullptr) {
+    local_cache->reset(new EncoderCache());
+    cache = local_cache->get();
+  }
+  return cache->data();
+}
+
+// Generates the sections of a whole-image input with the AC codes estimated
+// from the sampled AC groups, see EncoderOptions::sampled_code_stride. The
+// tokens of the sampled groups are buffered, those of the rest are written
+// directly. The DC groups come last and are always buffered.
+Status EncodeWithSampledCode(const FrameInput& input, FrameData* frame,
+                             ThreadPool* pool) {
+  const ImageDim& dim = frame->dim;
+  const size_t stride = frame->options.sampled_code_stride;
+  const size_t ac_group_start = 2 + dim.num_dc_groups;
+  frame->sample_stride = stride;
+  frame->sample_pass = true;
+  frame->dc_mode = SectionMode::kSkip;
+  JXL_RETURN_IF_ERROR(
+      EncodeDCGroupRows(input, 0, dim.ysize_dc_groups, frame, pool));
+  std::vector<HistogramCollector> thread_histograms;
+  JXL_RETURN_IF_ERROR(BuildSectionHistograms(
+      frame->ac_code, &frame->tokens[ac_group_start], dim.num_groups, stride,
+      pool, &thread_histograms));
+  OptimizeCodeForHistograms(thread_histograms, stride, &frame->ac_code);
+  JXL_RETURN_IF_ERROR(WriteSectionTokens(
+      frame->ac_code, &frame->tokens[ac_group_start],
+      &frame->sections[ac_group_start], dim.num_groups, stride, pool));
+  // The tokens of the other groups have the original contexts.
+  FlattenContextMap(&frame->ac_code);
+  frame->sample_pass = false;
+  frame->ac_mode = SectionMode::kWrite;
+  frame->dc_mode = SectionMode::kBufferTokens;
+  // The separate heuristics pass has already covered all AC stripes.
+  frame->heuristics_done = !frame->options.cache_coefficients;
+  return EncodeDCGroupRows(input, 0, dim.ysize_dc_groups, frame, pool);
+}
+
+// Replaces the static codes of the frame with the set of kStaticCodeSets that
+// is the cheapest for the AC tokens of the sampled AC groups, see
+// EncoderOptions::select_static_code. Computes the heuristics of the AC
+// stripes that are not recomputed together with the tokenization.
+Status SelectStaticCodes(const FrameInput& input, FrameData* frame,
+                         ThreadPool* pool) {
+  constexpr size_t kDefaultSampleStride = 8;
+  const EncoderOptions& options = frame->options;
+  frame->static_ac_codes.clear();
+  for (size_t i = 0; i < kNumStaticCodeSets; ++i) {
+    frame->static_ac_codes.push_back(StaticACCode(i));
+  }
+  frame->sample_stride = options.sampled_code_stride > 1
+                             ? options.sampled_code_stride
+                             : kDefaultSampleStride;
+  frame->sample_pass = true;
+  frame->ac_mode = SectionMode::kCollectCosts;
+  frame->dc_mode = SectionMode::kSkip;
+  JXL_RETURN_IF_ERROR(
+      EncodeDCGroupRows(input, 0, frame->dim.ysize_dc_groups, frame, pool));
+  std::vector<size_t> costs(kNumStaticCodeSets);
+  for (const CodeCostCollector& thread_costs : frame->ac_costs) {
+    for (size_t i = 0; i < kNumStaticCodeSets; ++i) {
+      costs[i] += thread_costs.costs[i];
+    }
+  }
+  const size_t best = std::min_element(costs.begin(), costs.end()) -
+                      costs.begin();
+  frame->dc_code = StaticDCCode(best);
+  frame->ac_code = StaticACCode(best);
+  // All AC groups are generated again, also the sampled ones.
+  frame->sample_stride = 0;
+  frame->ac_mode = frame->dc_mode = SectionMode::kWrite;
+  frame->heuristics_done = !options.cache_coefficients;
+  return true;
+}
+
+// Hash of the bytes, only for detecting changes of the input.
+uint64_t HashBytes(const uint8_t* data, size_t size, uint64_t hash) {
+  constexpr uint64_t kMul = 0x9E3779B97F4A7C15ull;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * kMul;
+    hash ^= hash >> 29;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ data[i]) * kMul;
+  }
+  return hash;
+}
+
+// Returns the hash of the input pixels of the pixel rectangle of the frame.
+uint64_t HashPixels(const FrameInput& input, const Rect& rect) {
+  uint64_t hash = 0;
+  if (input.interleaved) {
+    const InterleavedImage& image = *input.interleaved;
+    const size_t pixel_bytes = image.BytesPerPixel();
+    for (size_t y = 0; y < rect.ysize(); ++y) {
+      const uint8_t* row =
+          image.ConstRow(rect.y0() + y) + rect.x0() * pixel_bytes;
+      hash = HashBytes(row, rect.xsize() * pixel_bytes, hash);
+    }
+    return hash;
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < rect.ysize(); ++y) {
+      const float* row =
+          input.linear->ConstPlaneRow(c, rect.y0() - input.y0 + y) +
+          rect.x0() - input.x0;
+      hash = HashBytes(reinterpret_cast<const uint8_t*>(row),
+                       rect.xsize() * sizeof(float), hash);
+    }
+  }
+  return hash;
+}
+
+// With EncoderOptions::incremental, hashes the pixels of each AC group, and if
+// the sections of the last frame can be reused, selects the changed AC groups
+// and their DC groups to be generated again.
+Status PrepareIncremental(const FrameInput& input, FrameData* frame,
+                          ThreadPool* pool) {
+  if (!frame->incremental_enabled) return true;
+  const ImageDim& dim = frame->dim;
+  std::vector<uint64_t> hashes(dim.num_groups);
+  const auto hash_group = [&](const uint32_t i, const size_t thread) {
+    hashes[i] = HashPixels(input, dim.PixelRect(i % dim.xsize_groups,
+                                                i / dim.xsize_groups,
+                                                kGroupDim));
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, dim.num_groups, ThreadPool::NoInit,
+                                hash_group, "HashGroups"));
+  IncrementalState& state = frame->incremental;
+  if (frame->reuse_sections) {
+    constexpr size_t kDCGroupDimInGroups = kDCGroupDim / kGroupDim;
+    std::vector<BitWriter>& sections = frame->sections;
+    frame->dirty_groups.assign(dim.num_groups, 0);
+    frame->dirty_dc_groups.assign(dim.num_dc_groups, 0);
+    for (size_t i = 0; i < dim.num_groups; ++i) {
+      if (hashes[i] == state.group_hashes[i]) continue;
+      const size_t gx = i % dim.xsize_groups;
+      const size_t gy = i / dim.xsize_groups;
+      frame->dirty_groups[i] = 1;
+      frame->dirty_dc_groups[(gy / kDCGroupDimInGroups) * dim.xsize_dc_groups +
+                             gx / kDCGroupDimInGroups] = 1;
+      sections[2 + dim.num_dc_groups + i].Reset();
+    }
+    for (size_t i = 0; i < dim.num_dc_groups; ++i) {
+      if (frame->dirty_dc_groups[i]) sections[1 + i].Reset();
+    }
+    // The global sections are cheap, they are always generated again.
+    sections[0].Reset();
+    sections[1 + dim.num_dc_groups].Reset();
+  }
+  state.group_hashes.swap(hashes);
+  frame->hashes_ready = true;
+  return true;
+}
+
+Status EncodeAllDCGroupRows(const FrameInput& input, FrameData* frame,
+                            ThreadPool* pool) {
+  // All input is available, so all DC groups can be done in parallel.
+  const size_t dc_gy_end = frame->dim.ysize_dc_groups;
+  JXL_RETURN_IF_ERROR(InitDCGroups(frame, pool));
+  JXL_RETURN_IF_ERROR(PrepareIncremental(input, frame, pool));
+  if (frame->ac_mode == SectionMode::kWrite &&
+      frame->options.select_static_code && kNumStaticCodeSets > 1) {
+    JXL_RETURN_IF_ERROR(SelectStaticCodes(input, frame, pool));
+  }
+  // The ANS streams are encoded once all of their tokens are known.
+  if (frame->ac_mode == SectionMode::kBufferTokens && frame->options.use_ans) {
+    return EncodeDCGroupRows(input, 0, dc_gy_end, frame, pool);
+  }
+  if (frame->ac_mode == SectionMode::kBufferTokens &&
+      frame->options.sampled_code_stride > 1) {
+    return EncodeWithSampledCode(input, frame, pool);
+  }
+  if (frame->ac_mode != SectionMode::kBufferTokens ||
+      !frame->options.two_pass_code) {
+    return EncodeDCGroupRows(input, 0, dc_gy_end, frame, pool);
+  }
+  // The input can also be read again, so instead of buffering the tokens, the
+  // first pass only collects their histograms, and the second one regenerates
+  // them with the final codes. The quantized DC, whose tokens are generated by
+  // the DC groups, is recomputed identically by the second pass.
+  frame->ac_mode = frame->dc_mode = SectionMode::kCollectHistograms;
+  JXL_RETURN_IF_ERROR(EncodeDCGroupRows(input, 0, dc_gy_end, frame, pool));
+  OptimizeCodeForHistograms(frame->dc_histograms, /*sample_stride=*/1,
+                            &frame->dc_code);
+  OptimizeCodeForHistograms(frame->ac_histograms, /*sample_stride=*/1,
+                            &frame->ac_code);
+  // The tokens of the second pass have the original contexts.
+  FlattenContextMap(&frame->dc_code);
+  FlattenContextMap(&frame->ac_code);
+  frame->ac_mode = frame->dc_mode = SectionMode::kWrite;
+  frame->heuristics_done = true;
+  return EncodeDCGroupRows(input, 0, dc_gy_end, frame, pool);
+}
 
-Status EncodeFrame(const float distance, const Image3F& linear,
-                   ThreadPool* pool, BitWriter* writer) {
-  // Pre-compute image dimension-derived values.
-  ImageDim dim(linear.xsize(), linear.ysize());
+Status EncodeDCGroupRowsFromSource(const RowSource& source, FrameData* frame,
+                                   ThreadPool* pool) {
+  const size_t xsize = frame->dim.xsize;
+  const size_t ysize = frame->dim.ysize;
+  // The changed groups are not known before all of the input is read.
+  if (frame->reuse_sections) {
+    frame->reuse_sections = false;
+    frame->ResetSections();
+  }
+  JXL_RETURN_IF_ERROR(InitDCGroups(frame, pool));
+  // Input band of one row of DC groups, reused for each row.
+  Image3F band(xsize, std::min(ysize, kDCGroupDim));
+  for (size_t dc_gy = 0; dc_gy < frame->dim.ysize_dc_groups; ++dc_gy) {
+    const size_t y0 = dc_gy * kDCGroupDim;
+    band.ShrinkTo(xsize, std::min(ysize - y0, kDCGroupDim));
+    if (!source(y0, &band)) {
+      return JXL_FAILURE("Failed to get input rows");
+    }
+    JXL_RETURN_IF_ERROR(EncodeDCGroupRows(FrameInput(band, y0), dc_gy,
+                                          dc_gy + 1, frame, pool));
+  }
+  return true;
+}
 
-  // Compute distance dependent parameters.
-  DistanceParams distp = ComputeDistanceParams(distance);
+// Number of AC groups that are prefetched ahead of the one being read from a
+// TileSource, i.e. two rows of AC groups of a DC group.
+static constexpr size_t kTilePrefetchDistance = 2 * kDCGroupDim / kGroupDim;
+
+Status EncodeDCGroupsFromTiles(TileSource* source, FrameData* frame,
+                               ThreadPool* pool) {
+  const ImageDim& dim = frame->dim;
+  constexpr size_t kDCGroupDimInGroups = kDCGroupDim / kGroupDim;
+  // The changed groups are not known before all of the input is read.
+  if (frame->reuse_sections) {
+    frame->reuse_sections = false;
+    frame->ResetSections();
+  }
+  JXL_RETURN_IF_ERROR(InitDCGroups(frame, pool));
+  // Rectangles of the AC groups in reading order, and the end of those of
+  // each DC group.
+  std::vector<Rect> rects;
+  std::vector<size_t> dc_group_end;
+  for (size_t dc_gy = 0; dc_gy < dim.ysize_dc_groups; ++dc_gy) {
+    for (size_t dc_gx = 0; dc_gx < dim.xsize_dc_groups; ++dc_gx) {
+      const size_t gy_end =
+          std::min(dim.ysize_groups, (dc_gy + 1) * kDCGroupDimInGroups);
+      const size_t gx_end =
+          std::min(dim.xsize_groups, (dc_gx + 1) * kDCGroupDimInGroups);
+      for (size_t gy = dc_gy * kDCGroupDimInGroups; gy < gy_end; ++gy) {
+        for (size_t gx = dc_gx * kDCGroupDimInGroups; gx < gx_end; ++gx) {
+          rects.push_back(dim.PixelRect(gx, gy, kGroupDim));
+        }
+      }
+      dc_group_end.push_back(rects.size());
+    }
+  }
+  size_t num_prefetched = 0;
+  const auto prefetch = [&](size_t end) {
+    for (; num_prefetched < std::min(end, rects.size()); ++num_prefetched) {
+      source->Prefetch(rects[num_prefetched]);
+    }
+  };
+  // Input of one DC group and of one AC group, reused for each of them.
+  Image3F dc_group(std::min(dim.xsize, kDCGroupDim),
+                   std::min(dim.ysize, kDCGroupDim));
+  Image3F tile(kGroupDim, kGroupDim);
+  for (size_t dc_idx = 0, i = 0; dc_idx < dim.num_dc_groups; ++dc_idx) {
+    const size_t dc_gx = dc_idx % dim.xsize_dc_groups;
+    const size_t dc_gy = dc_idx / dim.xsize_dc_groups;
+    const Rect dc_rect = dim.PixelRect(dc_gx, dc_gy, kDCGroupDim);
+    dc_group.ShrinkTo(dc_rect.xsize(), dc_rect.ysize());
+    for (; i < dc_group_end[dc_idx]; ++i) {
+      // The prefetches of the last AC groups of this DC group overlap the
+      // reading of the first ones of the next DC group with the encoding.
+      prefetch(i + 1 + kTilePrefetchDistance);
+      const Rect& rect = rects[i];
+      tile.ShrinkTo(rect.xsize(), rect.ysize());
+      if (!source->ReadTile(rect, &tile)) {
+        return JXL_FAILURE("Failed to read input tile");
+      }
+      const Rect rect_in_dc_group(rect.x0() - dc_rect.x0(),
+                                  rect.y0() - dc_rect.y0(), rect.xsize(),
+                                  rect.ysize());
+      for (size_t c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < rect.ysize(); ++y) {
+          memcpy(rect_in_dc_group.PlaneRow(&dc_group, c, y),
+                 tile.ConstPlaneRow(c, y), rect.xsize() * sizeof(float));
+        }
+      }
+    }
+    JXL_RETURN_IF_ERROR(EncodeDCGroups(
+        FrameInput(dc_group, dc_rect.x0(), dc_rect.y0()),
+        Rect(dc_gx, dc_gy, 1, 1), frame, pool));
+  }
+  return true;
+}
+
+// Returns the options of recompressing a JPEG. The static codes are made for
+// the pixel input, and the coefficients are cheap to tokenize, so the codes
+// are always optimized.
+EncoderOptions JPEGOptions(const EncoderOptions& options) {
+  EncoderOptions jpeg_options = options;
+  jpeg_options.optimize_code = true;
+  jpeg_options.select_static_code = false;
+  jpeg_options.incremental = false;
+  jpeg_options.dc_preview = false;
+  return jpeg_options;
+}
+
+}  // namespace
 
-  // Initialize dequantization matrices and static entropy codes.
+struct CPUHeuristicsBackend::Memory {
   DequantMatrices matrices;
-  EntropyCode dc_code(kDCContextMap, kNumDCContexts, kDCPrefixCodes,
-                      kNumDCPrefixCodes);
-  EntropyCode ac_code(kACContextMap, kNumACContexts, kACPrefixCodes,
-                      kNumACPrefixCodes);
-
-  // Allocate section writers.
-  const size_t num_sections = 2 + dim.num_dc_groups + dim.num_groups;
-  std::vector<BitWriter> sections(num_sections);
-
-  // Generate DC group and AC group sections per 2048x2048 tile.
-  // These can be done in parallel.
-  for (size_t i = 0; i < dim.num_dc_groups; ++i) {
-    size_t dc_gx = i % dim.xsize_dc_groups;
-    size_t dc_gy = i / dim.xsize_dc_groups;
-    JXL_RETURN_IF_ERROR(ProcessDCGroup(linear, dc_gx, dc_gy, distp, matrices,
-                                       dc_code, ac_code, pool, &sections));
+  GroupScratchMemory scratch;
+};
+
+CPUHeuristicsBackend::CPUHeuristicsBackend(const Image3F& image,
+                                           const EncoderOptions& options)
+    : image_(image), options_(EffectiveOptions(options)), mem_(new Memory()) {}
+
+CPUHeuristicsBackend::~CPUHeuristicsBackend() = default;
+
+bool CPUHeuristicsBackend::ComputeDCGroupHeuristics(const Rect& rect,
+                                                    float distance,
+                                                    float quant_scale,
+                                                    DCGroupData* dc_data) {
+  const ImageDim dim(image_.xsize(), image_.ysize());
+  if (rect.x1() > dim.xsize || rect.y1() > dim.ysize) {
+    return JXL_FAILURE("DC group outside of the image of the backend");
+  }
+  const DistanceParams distp =
+      ComputeDistanceParams(distance, options_.fast_decode);
+  if (distp.inv_scale != quant_scale) {
+    return JXL_FAILURE("Options differ from those of the frame");
   }
+  // The same stripes as EncodeDCGroups, one after the other.
+  const size_t gx_end = DivCeil(rect.x1(), kGroupDim);
+  const size_t ty_end = DivCeil(rect.y1(), kTileDim);
+  for (size_t image_ty = rect.y0() / kTileDim; image_ty < ty_end; ++image_ty) {
+    for (size_t image_gx = rect.x0() / kGroupDim; image_gx < gx_end;
+         ++image_gx) {
+      StripeRects rects(dim, image_gx, image_ty);
+      LoadXYBStripe(FrameInput(image_), rects.pixel_rect,
+                    &mem_->scratch.stripe, /*times=*/nullptr);
+      ComputeStripeHeuristics(rects, distp, options_, mem_->matrices, dc_data,
+                              &mem_->scratch, /*cache=*/nullptr);
+    }
+  }
+  return true;
+}
 
-#if OPTIMIZE_CODE
-  OptimizeSections(&dc_code, &sections[1], dim.num_dc_groups);
-  size_t ac_group_start = 2 + dim.num_dc_groups;
-  OptimizeSections(&ac_code, &sections[ac_group_start], dim.num_groups);
-#endif
+Status CollectContextHistograms(const float distance,
+                                const EncoderOptions& options,
+                                const InterleavedImage& image,
+                                ThreadPool* pool,
+                                std::vector<Histogram>* dc_histograms,
+                                std::vector<Histogram>* ac_histograms) {
+  EncoderOptions static_options = options;
+  static_options.optimize_code = false;
+  static_options.select_static_code = false;
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(image.xsize, image.ysize, distance, static_options,
+                  GetCacheData(nullptr, &local_cache));
+  frame.ac_mode = frame.dc_mode = SectionMode::kCollectHistograms;
+  frame.raw_context_histograms = true;
+  JXL_RETURN_IF_ERROR(InitDCGroups(&frame, pool));
+  JXL_RETURN_IF_ERROR(EncodeDCGroupRows(FrameInput(image), 0,
+                                        frame.dim.ysize_dc_groups, &frame,
+                                        pool));
+  SumHistograms(frame.dc_histograms, kNumDCContexts, dc_histograms);
+  SumHistograms(frame.ac_histograms, kNumACContexts, ac_histograms);
+  return true;
+}
 
-  // Generate DC and AC global sections.
-  WriteDCGlobal(distp, dim.num_dc_groups, dc_code, &sections[0]);
-  WriteACGlobal(dim.num_groups, ac_code, &sections[1 + dim.num_dc_groups]);
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const Image3F& linear, ThreadPool* pool, BitWriter* writer,
+                   EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(linear.xsize(), linear.ysize(), distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(linear), &frame, pool));
+  return FinishFrame(&frame, pool, writer);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, const RowSource& source,
+                   ThreadPool* pool, BitWriter* writer, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(xsize, ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeDCGroupRowsFromSource(source, &frame, pool));
+  return FinishFrame(&frame, pool, writer);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const Image3F& linear, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(linear.xsize(), linear.ysize(), distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(linear), &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, const RowSource& source,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(xsize, ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeDCGroupRowsFromSource(source, &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, TileSource* source,
+                   ThreadPool* pool, BitWriter* writer, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(xsize, ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeDCGroupsFromTiles(source, &frame, pool));
+  return FinishFrame(&frame, pool, writer);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, TileSource* source,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(xsize, ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeDCGroupsFromTiles(source, &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
 
-  // Assemble final bitstream.
-  WriteFrameHeader(distp.x_qm_scale, distp.epf_iters, writer);
-  CombineSections(&sections, writer);
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   BitWriter* writer, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(image.xsize, image.ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(image), &frame, pool));
+  return FinishFrame(&frame, pool, writer);
+}
+
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(image.xsize, image.ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(image), &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
+Status EncodeFrame(const float distance, const FrameInfo& info,
+                   const EncoderOptions& options, const Image3F& linear,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(linear.xsize(), linear.ysize(), distance, options,
+                  GetCacheData(cache, &local_cache));
+  frame.info = info;
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(linear), &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
+Status EncodeFrame(const float distance, const FrameInfo& info,
+                   const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(image.xsize, image.ysize, distance, options,
+                  GetCacheData(cache, &local_cache));
+  frame.info = info;
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(image), &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
+namespace {
+
+// Generates the frame at a sequence of distances, and appends to *writer the
+// largest one that fits into target_size bytes, or the smallest one if none
+// does. Only the first pass computes the heuristics, the others reuse them,
+// so they only quantize and tokenize the AC stripes again. The raw quant
+// field is relative to the global scale, so it stays valid when the distance
+// changes the scale.
+Status EncodeFrameForSize(size_t target_size, const EncoderOptions& options,
+                          const FrameInput& input, size_t xsize, size_t ysize,
+                          ThreadPool* pool, float* distance, BitWriter* writer,
+                          EncoderCache* cache) {
+  constexpr size_t kMaxPasses = 4;
+  // A pass that is at most this much smaller than the target is accepted.
+  constexpr float kTolerance = 0.02f;
+  constexpr float kMinDistance = 0.03f;
+  constexpr float kMaxDistance = 25.0f;
+  // Guess of the exponent of size ~ distance^-k, for the second pass.
+  constexpr float kDefaultExponent = 0.8f;
+  EncoderOptions pass_options = options;
+  // The heuristics are kept separately from the tokenization, and all groups
+  // are generated in each pass.
+  pass_options.cache_coefficients = false;
+  pass_options.incremental = false;
+  float d = Clamp1(*distance, kMinDistance, kMaxDistance);
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(xsize, ysize, d, pass_options,
+                  GetCacheData(cache, &local_cache));
+  BitWriter pass_writer;
+  BitWriter best_writer;
+  size_t best_size = 0;
+  bool best_fits = false;
+  float prev_d = 0.0f;
+  size_t prev_size = 0;
+  for (size_t pass = 0; pass < kMaxPasses; ++pass) {
+    if (pass > 0) frame.Restart(d);
+    pass_writer.Reset();
+    JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(input, &frame, pool));
+    JXL_RETURN_IF_ERROR(FinishFrame(&frame, pool, &pass_writer));
+    const size_t size = DivCeil(pass_writer.BitsWritten(), kBitsPerByte);
+    const bool fits = size <= target_size;
+    if (pass == 0 || (fits && (!best_fits || size > best_size)) ||
+        (!fits && !best_fits && size < best_size)) {
+      std::swap(pass_writer, best_writer);
+      best_size = size;
+      best_fits = fits;
+      *distance = d;
+    }
+    if (fits && size >= target_size * (1.0f - kTolerance)) break;
+    float exponent = kDefaultExponent;
+    if (pass > 0 && size != prev_size) {
+      exponent = -std::log(static_cast<float>(size) / prev_size) /
+                 std::log(d / prev_d);
+      exponent = Clamp1(exponent, 0.2f, 2.0f);
+    }
+    // Aims at the middle of the accepted range.
+    const float target = target_size * (1.0f - 0.5f * kTolerance);
+    const float next_d = Clamp1(
+        d * std::pow(size / target, 1.0f / exponent), kMinDistance,
+        kMaxDistance);
+    if (next_d == d) break;
+    prev_d = d;
+    prev_size = size;
+    d = next_d;
+  }
+  // The frame ends at a byte boundary, so after byte aligned headers it is
+  // copied at once.
+  if (writer->BitsWritten() % kBitsPerByte == 0) {
+    best_writer.CopyTo(
+        writer->AppendBytes(best_writer.BitsWritten() / kBitsPerByte));
+  } else {
+    writer->Append(best_writer);
+  }
   return true;
 }
 
+}  // namespace
+
+Status EncodeFrameForSize(size_t target_size, const EncoderOptions& options,
+                          const Image3F& linear, ThreadPool* pool,
+                          float* distance, BitWriter* writer,
+                          EncoderCache* cache) {
+  return EncodeFrameForSize(target_size, options, FrameInput(linear),
+                            linear.xsize(), linear.ysize(), pool, distance,
+                            writer, cache);
+}
+
+Status EncodeFrameForSize(size_t target_size, const EncoderOptions& options,
+                          const InterleavedImage& image, ThreadPool* pool,
+                          float* distance, BitWriter* writer,
+                          EncoderCache* cache) {
+  return EncodeFrameForSize(target_size, options, FrameInput(image),
+                            image.xsize, image.ysize, pool, distance, writer,
+                            cache);
+}
+
+Status EncodeFrame(const EncoderOptions& options,
+                   const JPEGCoefficients& jpeg, ThreadPool* pool,
+                   BitWriter* writer, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(jpeg.xsize, jpeg.ysize, 1.0f, JPEGOptions(options),
+                  GetCacheData(cache, &local_cache));
+  frame.jpeg = &jpeg;
+  // The JPEG decoder does not smooth its output either.
+  frame.distp.epf_iters = 0;
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(jpeg), &frame, pool));
+  return FinishFrame(&frame, pool, writer);
+}
+
+Status EncodeFrame(const EncoderOptions& options,
+                   const JPEGCoefficients& jpeg, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache) {
+  std::unique_ptr<EncoderCache> local_cache;
+  FrameData frame(jpeg.xsize, jpeg.ysize, 1.0f, JPEGOptions(options),
+                  GetCacheData(cache, &local_cache));
+  frame.jpeg = &jpeg;
+  frame.distp.epf_iters = 0;
+  JXL_RETURN_IF_ERROR(EncodeAllDCGroupRows(FrameInput(jpeg), &frame, pool));
+  return FinishFrame(&frame, pool, sink);
+}
+
 }  // namespace jxl
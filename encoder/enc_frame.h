@@ -7,17 +7,257 @@
 #ifndef ENCODER_ENC_FRAME_H_
 #define ENCODER_ENC_FRAME_H_
 
+#include <stddef.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
 #include "encoder/base/data_parallel.h"
+#include "encoder/base/span.h"
 #include "encoder/base/status.h"
+#include "encoder/config.h"
+#include "encoder/dc_group_data.h"
 #include "encoder/enc_bit_writer.h"
+#include "encoder/enc_stats.h"
+#include "encoder/histogram.h"
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
+#include "encoder/jpeg_coefficients.h"
 
 namespace jxl {
 
+class HeuristicsBackend;
+
+// Tables and buffers that consecutive EncodeFrame calls can reuse instead of
+// computing and allocating them again for each frame. Must not be used by two
+// EncodeFrame calls at the same time.
+class EncoderCache {
+ public:
+  EncoderCache();
+  ~EncoderCache();
+  EncoderCache(const EncoderCache&) = delete;
+  EncoderCache& operator=(const EncoderCache&) = delete;
+
+  struct Data;
+  Data* data() const { return data_.get(); }
+
+  // Stats of the last frame encoded with EncoderOptions::collect_stats.
+  const EncodeStats& stats() const;
+
+  // Preview of the last frame encoded with EncoderOptions::dc_preview. Its
+  // size is that of the frame divided by 8, rounded up.
+  const Image3F& preview() const;
+
+  // If not null, the frames encoded with this cache check *cancel before each
+  // AC stripe and DC group, and fail soon after it becomes true.
+  void set_cancel_flag(const std::atomic<bool>* cancel);
+
+  // If not null, the frames of pixels encoded with this cache take their
+  // heuristics from `backend` instead of computing them on the threads. The
+  // backend must outlive the frames.
+  void set_heuristics_backend(HeuristicsBackend* backend);
+
+ private:
+  std::unique_ptr<Data> data_;
+};
+
+// Position and timing of a frame in a codestream of several frames.
+struct FrameInfo {
+  // Whether the image metadata of the codestream has an animation header, in
+  // which case the frame is shown for `duration` ticks.
+  bool animation = false;
+  uint32_t duration = 0;
+  bool is_last = true;
+};
+
 // Encodes a single frame (including its header) into a byte stream.
-// Groups may be processed in parallel by `pool`.
-Status EncodeFrame(const float distance, const Image3F& linear,
-                   ThreadPool* pool, BitWriter* writer);
+// Groups may be processed in parallel by `pool`. If `cache` is null, a
+// temporary one is used.
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const Image3F& linear, ThreadPool* pool, BitWriter* writer,
+                   EncoderCache* cache = nullptr);
+
+// Callback that fills in *band with the rows [y0, y0 + band->ysize()) of the
+// linear sRGB input image; band->xsize() is the image width. Returns false on
+// error.
+typedef std::function<bool(size_t y0, Image3F* band)> RowSource;
+
+// Same as above, but the input is requested from `source` one band of
+// kDCGroupDim rows at a time, in top to bottom order, so that only one band
+// needs to be in memory at a time.
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, const RowSource& source,
+                   ThreadPool* pool, BitWriter* writer,
+                   EncoderCache* cache = nullptr);
+
+// Input of a frame that is too large to be in memory at once, e.g. a
+// gigapixel scan from a tiled TIFF or image pyramid reader, which is read one
+// rectangle at a time. The rectangles are those of the AC groups, i.e.
+// kGroupDim x kGroupDim pixels clipped to the image, requested one DC group
+// at a time in row-major order, and in row-major order within each DC group.
+// All calls are made from the thread that called EncodeFrame.
+class TileSource {
+ public:
+  virtual ~TileSource() = default;
+
+  // Fills in *tile, which has the size of rect, with the linear sRGB pixels
+  // of rect. Returns false on error.
+  virtual bool ReadTile(const Rect& rect, Image3F* tile) = 0;
+
+  // Called for each rect a few AC groups before it is read, so that the
+  // source can start reading it asynchronously while the encoder is busy
+  // with the previous ones. Does nothing by default.
+  virtual void Prefetch(const Rect& rect) {}
+};
+
+// Extension point for computing the heuristics of the frames outside of the
+// encoder threads: the XYB conversion, the adaptive quantization, the chroma
+// from luma and the transform search. The transforms, the quantization and
+// the tokenization of the coefficients, and the DC groups, stay on the encoder
+// threads. Only the serial CPUHeuristicsBackend reference is provided; there
+// is no GPU backend, and no speedup of any backend has been measured. See
+// EncoderCache::set_heuristics_backend.
+class HeuristicsBackend {
+ public:
+  virtual ~HeuristicsBackend() = default;
+
+  // Fills in the heuristics of the DC group at `rect`, in pixels, of the
+  // input of the current EncodeFrame call, which the backend gets from the
+  // application:
+  //  - ac_strategy, whose transforms must each lie within one kTileDim x
+  //    kTileDim tile, since the AC groups transform and tokenize their
+  //    kTileDim rows high stripes independently;
+  //  - raw_quant_field, the adaptive quantization field times quant_scale,
+  //    rounded and clamped to [1, 255], and then over each transform of more
+  //    than one block set to its largest value within the transform, as
+  //    AdjustQuantField does, since the decoder reads one value per
+  //    transform;
+  //  - ytox_map and ytob_map, which are only used with
+  //    EncoderOptions::optimize_chroma_from_luma.
+  // All of them must be written for every block and tile, since the storage
+  // of *dc_data, which has the size of the DC group, may still hold the
+  // heuristics of an earlier frame: it is only reset to all-DCT8 and zero
+  // maps when the sections of the previous frame are not reused. With
+  // EncoderOptions::incremental, only the DC groups with changed pixels are
+  // passed again, and their unchanged AC groups keep the sections of the
+  // previous frame, so the heuristics must be the same for the same pixels
+  // and distance. Called once per DC group and frame, from the thread that
+  // called EncodeFrame, returns false on error.
+  virtual bool ComputeDCGroupHeuristics(const Rect& rect, float distance,
+                                        float quant_scale,
+                                        DCGroupData* dc_data) = 0;
+};
+
+// Reference HeuristicsBackend, which computes the heuristics of the DC groups
+// from the linear sRGB `image` of the frames on the calling thread, with the
+// same code as the encoder threads. The frames are then the same as without a
+// backend, unless the options have cache_coefficients, whose coefficients
+// the backend does not fill in. The image and the options must be those of
+// the frames, and the image must outlive the backend.
+class CPUHeuristicsBackend : public HeuristicsBackend {
+ public:
+  CPUHeuristicsBackend(const Image3F& image, const EncoderOptions& options);
+  ~CPUHeuristicsBackend() override;
+
+  bool ComputeDCGroupHeuristics(const Rect& rect, float distance,
+                                float quant_scale,
+                                DCGroupData* dc_data) override;
+
+ private:
+  struct Memory;
+  const Image3F& image_;
+  const EncoderOptions options_;
+  std::unique_ptr<Memory> mem_;
+};
+
+// Callback that receives the next part of the encoded byte stream. Returns
+// false on error. The bytes stay valid until the encode function that called
+// the sink returns, so the sink may also collect them and write them at once,
+// e.g. with writev.
+typedef std::function<bool(Span<const uint8_t> bytes)> OutputSink;
+
+// Same as the above, but instead of being appended to a writer, the frame
+// header with the TOC and then each section is passed to `sink` in stream
+// order, without first copying them into one buffer.
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const Image3F& linear, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache = nullptr);
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, const RowSource& source,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache = nullptr);
+
+// Same as the above, but the input is read from `source` one AC group at a
+// time, so that only one DC group of input pixels is in memory at a time.
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, TileSource* source,
+                   ThreadPool* pool, BitWriter* writer,
+                   EncoderCache* cache = nullptr);
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   size_t xsize, size_t ysize, TileSource* source,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache = nullptr);
+
+// Same as the above, but the input is an interleaved RGB(A) image, which is
+// converted to XYB one stripe at a time, so the image is never copied to a
+// full-size float image.
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   BitWriter* writer, EncoderCache* cache = nullptr);
+Status EncodeFrame(const float distance, const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache = nullptr);
+
+// Same as the above, but the frame header is that of `info`, instead of that
+// of the only frame of a still image.
+Status EncodeFrame(const float distance, const FrameInfo& info,
+                   const EncoderOptions& options, const Image3F& linear,
+                   ThreadPool* pool, const OutputSink& sink,
+                   EncoderCache* cache = nullptr);
+Status EncodeFrame(const float distance, const FrameInfo& info,
+                   const EncoderOptions& options,
+                   const InterleavedImage& image, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache = nullptr);
+
+// Same as the above, but the frame losslessly recompresses the quantized DCT
+// coefficients of a JPEG, so that it decodes to the same pixels as the JPEG.
+// There is no distance, and of `options`, only the entropy coding and
+// threading options apply; the entropy codes are always optimized.
+Status EncodeFrame(const EncoderOptions& options,
+                   const JPEGCoefficients& jpeg, ThreadPool* pool,
+                   BitWriter* writer, EncoderCache* cache = nullptr);
+Status EncodeFrame(const EncoderOptions& options,
+                   const JPEGCoefficients& jpeg, ThreadPool* pool,
+                   const OutputSink& sink, EncoderCache* cache = nullptr);
+
+// Same as the EncodeFrame functions, but instead of using a given distance,
+// selects the distance at which the frame takes at most target_size bytes,
+// and as close to it as possible. On input, *distance is the distance of the
+// first pass, on output the distance of the written frame. Each further pass
+// only quantizes and tokenizes the frame again with the heuristics of the
+// first one, and usually 2-3 passes are enough. If even the largest distance
+// does not fit, the smallest generated frame is written.
+Status EncodeFrameForSize(size_t target_size, const EncoderOptions& options,
+                          const Image3F& linear, ThreadPool* pool,
+                          float* distance, BitWriter* writer,
+                          EncoderCache* cache = nullptr);
+Status EncodeFrameForSize(size_t target_size, const EncoderOptions& options,
+                          const InterleavedImage& image, ThreadPool* pool,
+                          float* distance, BitWriter* writer,
+                          EncoderCache* cache = nullptr);
+
+// Tokenizes the frame with the static codes like EncodeFrame, but instead of
+// writing the tokens, adds them to the histograms of their DC and AC contexts,
+// which are resized to the number of contexts if needed. Used to train the
+// static codes.
+Status CollectContextHistograms(const float distance,
+                                const EncoderOptions& options,
+                                const InterleavedImage& image,
+                                ThreadPool* pool,
+                                std::vector<Histogram>* dc_histograms,
+                                std::vector<Histogram>* ac_histograms);
 
 }  // namespace jxl
 
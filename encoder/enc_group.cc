@@ -6,6 +6,8 @@
 
 #include "encoder/enc_group.h"
 
+#include <string.h>
+
 #include <utility>
 
 #include "hwy/aligned_allocator.h"
@@ -21,10 +23,11 @@
 #include "encoder/base/compiler_specific.h"
 #include "encoder/chroma_from_luma.h"
 #include "encoder/common.h"
-#include "encoder/config.h"
 #include "encoder/enc_entropy_code.h"
 #include "encoder/enc_transforms-inl.h"
 #include "encoder/image.h"
+#include "encoder/jpeg_coefficients.h"
+#include "encoder/token_buffer.h"
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -34,6 +37,7 @@ using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::And;
 using hwy::HWY_NAMESPACE::AndNot;
 using hwy::HWY_NAMESPACE::ApproximateReciprocal;
+using hwy::HWY_NAMESPACE::GatherIndex;
 using hwy::HWY_NAMESPACE::Ge;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElse;
@@ -41,14 +45,18 @@ using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Lt;
 using hwy::HWY_NAMESPACE::MaskFromVec;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::RebindToUnsigned;
 using hwy::HWY_NAMESPACE::Round;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::TestBit;
 using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::Xor;
 
 // Returns number of non-zero coefficients (but skip LLF).
 // We cannot rely on block[] being all-zero bits, so first truncate to integer.
 // Also writes the per-8x8 block nzeros starting at nzeros_pos.
-uint8_t NumNonZeroExceptLLF(const size_t cx, const size_t cy,
+int32_t NumNonZeroExceptLLF(const size_t cx, const size_t cy,
                             const AcStrategy acs, const size_t covered_blocks,
                             const size_t log2_covered_blocks,
                             const int32_t* JXL_RESTRICT block,
@@ -104,49 +112,6 @@ uint8_t NumNonZeroExceptLLF(const size_t cx, const size_t cy,
   return nzeros;
 }
 
-// Specialization for 8x8, where only top-left is LLF/DC.
-// About 1% overall speedup vs. NumNonZeroExceptLLF.
-uint8_t NumNonZero8x8ExceptDC(const int32_t* JXL_RESTRICT block,
-                              uint8_t* JXL_RESTRICT nzeros_pos) {
-  const HWY_CAPPED(int32_t, kBlockDim) di;
-
-  const auto zero = Zero(di);
-  // Add FF..FF for every zero coefficient, negate to get #zeros.
-  auto neg_sum_zero = zero;
-
-  {
-    // First row has DC, so mask
-    const size_t y = 0;
-    HWY_ALIGN const int32_t dc_mask_lanes[kBlockDim] = {-1};
-
-    for (size_t x = 0; x < kBlockDim; x += Lanes(di)) {
-      const auto dc_mask = Load(di, dc_mask_lanes + x);
-
-      // DC counts as zero so we don't include it in nzeros.
-      const auto coef = AndNot(dc_mask, Load(di, &block[y * kBlockDim + x]));
-
-      neg_sum_zero = Add(neg_sum_zero, VecFromMask(di, Eq(coef, zero)));
-    }
-  }
-
-  // Remaining rows: no mask
-  for (size_t y = 1; y < kBlockDim; y++) {
-    for (size_t x = 0; x < kBlockDim; x += Lanes(di)) {
-      const auto coef = Load(di, &block[y * kBlockDim + x]);
-      neg_sum_zero = Add(neg_sum_zero, VecFromMask(di, Eq(coef, zero)));
-    }
-  }
-
-  // We want 64 - sum_zero, add because neg_sum_zero is already negated.
-  const uint8_t nzeros =
-      static_cast<uint8_t>(static_cast<int32_t>(kDCTBlockSize) +
-                           GetLane(SumOfLanes(di, neg_sum_zero)));
-
-  *nzeros_pos = nzeros;
-
-  return nzeros;
-}
-
 JXL_INLINE uint8_t PredictFromTopAndLeft(
     const uint8_t* const JXL_RESTRICT row_top,
     const uint8_t* const JXL_RESTRICT row, size_t x, int32_t default_val) {
@@ -164,23 +129,146 @@ JXL_INLINE uint8_t PredictFromTopAndLeft(
 using coeff_order_t = uint32_t;
 
 constexpr coeff_order_t kCoeffOrders[] = {
-    0,   1,   8,   16, 9,   2,   3,   10,  17,  24,  32,  25,  18,  11,  4,
-    5,   12,  19,  26, 33,  40,  48,  41,  34,  27,  20,  13,  6,   7,   14,
-    21,  28,  35,  42, 49,  56,  57,  50,  43,  36,  29,  22,  15,  23,  30,
-    37,  44,  51,  58, 59,  52,  45,  38,  31,  39,  46,  53,  60,  61,  54,
-    47,  55,  62,  63, 0,   1,   16,  2,   3,   17,  32,  18,  4,   5,   19,
-    33,  48,  34,  20, 6,   7,   21,  35,  49,  64,  50,  36,  22,  8,   9,
-    23,  37,  51,  65, 80,  66,  52,  38,  24,  10,  11,  25,  39,  53,  67,
-    81,  96,  82,  68, 54,  40,  26,  12,  13,  27,  41,  55,  69,  83,  97,
-    112, 98,  84,  70, 56,  42,  28,  14,  15,  29,  43,  57,  71,  85,  99,
-    113, 114, 100, 86, 72,  58,  44,  30,  31,  45,  59,  73,  87,  101, 115,
-    116, 102, 88,  74, 60,  46,  47,  61,  75,  89,  103, 117, 118, 104, 90,
-    76,  62,  63,  77, 91,  105, 119, 120, 106, 92,  78,  79,  93,  107, 121,
-    122, 108, 94,  95, 109, 123, 124, 110, 111, 125, 126, 127,
+    0,    1,    8,    16,   9,    2,    3,    10,   17,   24,   32,   25,
+    18,   11,   4,    5,    12,   19,   26,   33,   40,   48,   41,   34,
+    27,   20,   13,   6,    7,    14,   21,   28,   35,   42,   49,   56,
+    57,   50,   43,   36,   29,   22,   15,   23,   30,   37,   44,   51,
+    58,   59,   52,   45,   38,   31,   39,   46,   53,   60,   61,   54,
+    47,   55,   62,   63,   0,    1,    16,   2,    3,    17,   32,   18,
+    4,    5,    19,   33,   48,   34,   20,   6,    7,    21,   35,   49,
+    64,   50,   36,   22,   8,    9,    23,   37,   51,   65,   80,   66,
+    52,   38,   24,   10,   11,   25,   39,   53,   67,   81,   96,   82,
+    68,   54,   40,   26,   12,   13,   27,   41,   55,   69,   83,   97,
+    112,  98,   84,   70,   56,   42,   28,   14,   15,   29,   43,   57,
+    71,   85,   99,   113,  114,  100,  86,   72,   58,   44,   30,   31,
+    45,   59,   73,   87,   101,  115,  116,  102,  88,   74,   60,   46,
+    47,   61,   75,   89,   103,  117,  118,  104,  90,   76,   62,   63,
+    77,   91,   105,  119,  120,  106,  92,   78,   79,   93,   107,  121,
+    122,  108,  94,   95,   109,  123,  124,  110,  111,  125,  126,  127,
+    0,    1,    2,    3,    32,   33,   34,   35,   64,   65,   66,   67,
+    96,   97,   98,   99,   128,  4,    5,    36,   129,  160,  192,  161,
+    130,  68,   37,   6,    7,    38,   69,   100,  131,  162,  193,  224,
+    256,  225,  194,  163,  132,  101,  70,   39,   8,    9,    40,   71,
+    102,  133,  164,  195,  226,  257,  288,  320,  289,  258,  227,  196,
+    165,  134,  103,  72,   41,   10,   11,   42,   73,   104,  135,  166,
+    197,  228,  259,  290,  321,  352,  384,  353,  322,  291,  260,  229,
+    198,  167,  136,  105,  74,   43,   12,   13,   44,   75,   106,  137,
+    168,  199,  230,  261,  292,  323,  354,  385,  416,  448,  417,  386,
+    355,  324,  293,  262,  231,  200,  169,  138,  107,  76,   45,   14,
+    15,   46,   77,   108,  139,  170,  201,  232,  263,  294,  325,  356,
+    387,  418,  449,  480,  512,  481,  450,  419,  388,  357,  326,  295,
+    264,  233,  202,  171,  140,  109,  78,   47,   16,   17,   48,   79,
+    110,  141,  172,  203,  234,  265,  296,  327,  358,  389,  420,  451,
+    482,  513,  544,  576,  545,  514,  483,  452,  421,  390,  359,  328,
+    297,  266,  235,  204,  173,  142,  111,  80,   49,   18,   19,   50,
+    81,   112,  143,  174,  205,  236,  267,  298,  329,  360,  391,  422,
+    453,  484,  515,  546,  577,  608,  640,  609,  578,  547,  516,  485,
+    454,  423,  392,  361,  330,  299,  268,  237,  206,  175,  144,  113,
+    82,   51,   20,   21,   52,   83,   114,  145,  176,  207,  238,  269,
+    300,  331,  362,  393,  424,  455,  486,  517,  548,  579,  610,  641,
+    672,  704,  673,  642,  611,  580,  549,  518,  487,  456,  425,  394,
+    363,  332,  301,  270,  239,  208,  177,  146,  115,  84,   53,   22,
+    23,   54,   85,   116,  147,  178,  209,  240,  271,  302,  333,  364,
+    395,  426,  457,  488,  519,  550,  581,  612,  643,  674,  705,  736,
+    768,  737,  706,  675,  644,  613,  582,  551,  520,  489,  458,  427,
+    396,  365,  334,  303,  272,  241,  210,  179,  148,  117,  86,   55,
+    24,   25,   56,   87,   118,  149,  180,  211,  242,  273,  304,  335,
+    366,  397,  428,  459,  490,  521,  552,  583,  614,  645,  676,  707,
+    738,  769,  800,  832,  801,  770,  739,  708,  677,  646,  615,  584,
+    553,  522,  491,  460,  429,  398,  367,  336,  305,  274,  243,  212,
+    181,  150,  119,  88,   57,   26,   27,   58,   89,   120,  151,  182,
+    213,  244,  275,  306,  337,  368,  399,  430,  461,  492,  523,  554,
+    585,  616,  647,  678,  709,  740,  771,  802,  833,  864,  896,  865,
+    834,  803,  772,  741,  710,  679,  648,  617,  586,  555,  524,  493,
+    462,  431,  400,  369,  338,  307,  276,  245,  214,  183,  152,  121,
+    90,   59,   28,   29,   60,   91,   122,  153,  184,  215,  246,  277,
+    308,  339,  370,  401,  432,  463,  494,  525,  556,  587,  618,  649,
+    680,  711,  742,  773,  804,  835,  866,  897,  928,  960,  929,  898,
+    867,  836,  805,  774,  743,  712,  681,  650,  619,  588,  557,  526,
+    495,  464,  433,  402,  371,  340,  309,  278,  247,  216,  185,  154,
+    123,  92,   61,   30,   31,   62,   93,   124,  155,  186,  217,  248,
+    279,  310,  341,  372,  403,  434,  465,  496,  527,  558,  589,  620,
+    651,  682,  713,  744,  775,  806,  837,  868,  899,  930,  961,  992,
+    993,  962,  931,  900,  869,  838,  807,  776,  745,  714,  683,  652,
+    621,  590,  559,  528,  497,  466,  435,  404,  373,  342,  311,  280,
+    249,  218,  187,  156,  125,  94,   63,   95,   126,  157,  188,  219,
+    250,  281,  312,  343,  374,  405,  436,  467,  498,  529,  560,  591,
+    622,  653,  684,  715,  746,  777,  808,  839,  870,  901,  932,  963,
+    994,  995,  964,  933,  902,  871,  840,  809,  778,  747,  716,  685,
+    654,  623,  592,  561,  530,  499,  468,  437,  406,  375,  344,  313,
+    282,  251,  220,  189,  158,  127,  159,  190,  221,  252,  283,  314,
+    345,  376,  407,  438,  469,  500,  531,  562,  593,  624,  655,  686,
+    717,  748,  779,  810,  841,  872,  903,  934,  965,  996,  997,  966,
+    935,  904,  873,  842,  811,  780,  749,  718,  687,  656,  625,  594,
+    563,  532,  501,  470,  439,  408,  377,  346,  315,  284,  253,  222,
+    191,  223,  254,  285,  316,  347,  378,  409,  440,  471,  502,  533,
+    564,  595,  626,  657,  688,  719,  750,  781,  812,  843,  874,  905,
+    936,  967,  998,  999,  968,  937,  906,  875,  844,  813,  782,  751,
+    720,  689,  658,  627,  596,  565,  534,  503,  472,  441,  410,  379,
+    348,  317,  286,  255,  287,  318,  349,  380,  411,  442,  473,  504,
+    535,  566,  597,  628,  659,  690,  721,  752,  783,  814,  845,  876,
+    907,  938,  969,  1000, 1001, 970,  939,  908,  877,  846,  815,  784,
+    753,  722,  691,  660,  629,  598,  567,  536,  505,  474,  443,  412,
+    381,  350,  319,  351,  382,  413,  444,  475,  506,  537,  568,  599,
+    630,  661,  692,  723,  754,  785,  816,  847,  878,  909,  940,  971,
+    1002, 1003, 972,  941,  910,  879,  848,  817,  786,  755,  724,  693,
+    662,  631,  600,  569,  538,  507,  476,  445,  414,  383,  415,  446,
+    477,  508,  539,  570,  601,  632,  663,  694,  725,  756,  787,  818,
+    849,  880,  911,  942,  973,  1004, 1005, 974,  943,  912,  881,  850,
+    819,  788,  757,  726,  695,  664,  633,  602,  571,  540,  509,  478,
+    447,  479,  510,  541,  572,  603,  634,  665,  696,  727,  758,  789,
+    820,  851,  882,  913,  944,  975,  1006, 1007, 976,  945,  914,  883,
+    852,  821,  790,  759,  728,  697,  666,  635,  604,  573,  542,  511,
+    543,  574,  605,  636,  667,  698,  729,  760,  791,  822,  853,  884,
+    915,  946,  977,  1008, 1009, 978,  947,  916,  885,  854,  823,  792,
+    761,  730,  699,  668,  637,  606,  575,  607,  638,  669,  700,  731,
+    762,  793,  824,  855,  886,  917,  948,  979,  1010, 1011, 980,  949,
+    918,  887,  856,  825,  794,  763,  732,  701,  670,  639,  671,  702,
+    733,  764,  795,  826,  857,  888,  919,  950,  981,  1012, 1013, 982,
+    951,  920,  889,  858,  827,  796,  765,  734,  703,  735,  766,  797,
+    828,  859,  890,  921,  952,  983,  1014, 1015, 984,  953,  922,  891,
+    860,  829,  798,  767,  799,  830,  861,  892,  923,  954,  985,  1016,
+    1017, 986,  955,  924,  893,  862,  831,  863,  894,  925,  956,  987,
+    1018, 1019, 988,  957,  926,  895,  927,  958,  989,  1020, 1021, 990,
+    959,  991,  1022, 1023,
 };
 
 // Maps from ac strategy to offset in kCoeffOrders[]
-static constexpr size_t kCoeffOrderOffset[] = {0, kDCTBlockSize, kDCTBlockSize};
+static constexpr size_t kCoeffOrderOffset[] = {0, kDCTBlockSize, kDCTBlockSize,
+                                               3 * kDCTBlockSize};
+
+// Gathers the size coefficients of block into scan in the coefficient order,
+// with their signs packed as by PackSigned, and computes the zero density
+// context of each of them after the skip LLF coefficients, given the nzeros
+// nonzero coefficients of the block. Returns one past the position of the
+// last nonzero coefficient in the scan order, but at least skip, the contexts
+// are only computed up to there.
+size_t ScanBlock(const int32_t* JXL_RESTRICT block,
+                 const coeff_order_t* JXL_RESTRICT order, size_t skip,
+                 size_t size, size_t nzeros, size_t log2_covered_blocks,
+                 size_t histo_offset, int32_t* JXL_RESTRICT scan,
+                 uint32_t* JXL_RESTRICT contexts) {
+  const HWY_CAPPED(int32_t, kDCTBlockSize) di;
+  const RebindToUnsigned<decltype(di)> du;
+  for (size_t k = 0; k < size; k += Lanes(di)) {
+    const auto idx = BitCast(di, LoadU(du, order + k));
+    const auto v = GatherIndex(di, block, idx);
+    Store(Xor(ShiftLeft<1>(v), ShiftRight<31>(v)), di, scan + k);
+  }
+  size_t end = size;
+  while (end > skip && scan[end - 1] == 0) --end;
+  // The context depends on the number of nonzeros that are left, so this is a
+  // running count over the scan.
+  size_t prev = (nzeros > size / 16 ? 0 : 1);
+  for (size_t k = skip; k < end; ++k) {
+    contexts[k] = histo_offset + ZeroDensityContext(nzeros, k, skip,
+                                                    log2_covered_blocks, prev);
+    prev = scan[k] != 0;
+    nzeros -= prev;
+  }
+  JXL_DASSERT(nzeros == 0);
+  return end;
+}
 
 template <class DI>
 HWY_INLINE HWY_MAYBE_UNUSED Vec<Rebind<float, DI>> AdjustQuantBias(
@@ -217,14 +305,15 @@ HWY_INLINE HWY_MAYBE_UNUSED Vec<Rebind<float, DI>> AdjustQuantBias(
   return IfThenElse(is_01, one_bias, bias);
 }
 
-// NOTE: caller takes care of extracting quant from rect of RawQuantField.
-void QuantizeBlockAC(const float* JXL_RESTRICT block_in, size_t c,
-                     const float* JXL_RESTRICT qm, int32_t quant, float scale,
-                     float qm_multiplier, size_t xsize, size_t ysize,
-                     int32_t* JXL_RESTRICT block_out) {
-  const float qac = scale * quant;
-  // Not SIMD-fied for now.
-  float thres[4] = {0.58f, 0.635f, 0.66f, 0.7f};
+// Computes the thresholds below which the coefficients of channel c are
+// quantized to zero, for the top left, top right, bottom left and bottom right
+// quarters of an xsize x ysize block.
+void QuantizeThresholds(size_t c, size_t xsize, size_t ysize,
+                        float* JXL_RESTRICT thres) {
+  thres[0] = 0.58f;
+  thres[1] = 0.635f;
+  thres[2] = 0.66f;
+  thres[3] = 0.7f;
   if (c == 0) {
     for (int i = 1; i < 4; ++i) {
       thres[i] += 0.08f;
@@ -240,6 +329,58 @@ void QuantizeBlockAC(const float* JXL_RESTRICT block_in, size_t c,
       thres[i] -= Clamp1(0.003f * xsize * ysize, 0.f, (c > 0 ? 0.08f : 0.12f));
     }
   }
+}
+
+// Returns the thresholds for the coefficients k to k + Lanes(df) - 1 of a block
+// with rows of width coefficients and size coefficients in total, i.e. the
+// vectors can span several rows on wide targets. thres is the output of
+// QuantizeThresholds.
+template <class DF>
+HWY_INLINE Vec<DF> ThresholdsForLanes(DF df, size_t k, size_t width,
+                                      size_t size,
+                                      const float* JXL_RESTRICT thres) {
+  const Rebind<int32_t, DF> di;
+  const auto idx = Iota(di, static_cast<int32_t>(k));
+  // The width is a power of two, so the lanes in the right half of the rows
+  // have the width / 2 bit set.
+  const auto right = MaskFromVec(
+      BitCast(df, VecFromMask(di, TestBit(idx, Set(di, width / 2)))));
+  const auto bottom = MaskFromVec(
+      BitCast(df, VecFromMask(di, Ge(idx, Set(di, size / 2)))));
+  const auto top_thr = IfThenElse(right, Set(df, thres[1]), Set(df, thres[0]));
+  const auto bottom_thr =
+      IfThenElse(right, Set(df, thres[3]), Set(df, thres[2]));
+  return IfThenElse(bottom, bottom_thr, top_thr);
+}
+
+// NOTE: caller takes care of extracting quant from rect of RawQuantField.
+void QuantizeBlockAC(const float* JXL_RESTRICT block_in, size_t c,
+                     const float* JXL_RESTRICT qm, int32_t quant, float scale,
+                     float qm_multiplier, size_t xsize, size_t ysize,
+                     int32_t* JXL_RESTRICT block_out) {
+  const float qac = scale * quant;
+  // Not SIMD-fied for now.
+  float thres[4];
+  QuantizeThresholds(c, xsize, ysize, thres);
+
+  const HWY_CAPPED(float, kDCTBlockSize) dw;
+  if (Lanes(dw) > kBlockDim) {
+    // Wide vectors (AVX-512, SVE) cover several rows of the block at once.
+    const HWY_CAPPED(int32_t, kDCTBlockSize) diw;
+    const size_t width = xsize * kBlockDim;
+    const size_t size = width * ysize * kBlockDim;
+    const auto quant = Set(dw, qac * qm_multiplier);
+    for (size_t k = 0; k < size; k += Lanes(dw)) {
+      const auto thr = ThresholdsForLanes(dw, k, width, size, thres);
+      const auto q = Mul(Load(dw, qm + k), quant);
+      const auto in = Load(dw, block_in + k);
+      const auto val = Mul(q, in);
+      const auto nzero_mask = Ge(Abs(val), thr);
+      const auto v = ConvertTo(diw, IfThenElseZero(nzero_mask, Round(val)));
+      Store(v, diw, block_out + k);
+    }
+    return;
+  }
 
   {
     HWY_CAPPED(float, kBlockDim) df;
@@ -277,6 +418,13 @@ void QuantizeBlockAC(const float* JXL_RESTRICT block_in, size_t c,
   }
 }
 
+constexpr float kDefaultQuantBias[4] = {
+    1.0f - 0.05465007330715401f,
+    1.0f - 0.07005449891748593f,
+    1.0f - 0.049935103337343655f,
+    0.145f,
+};
+
 // NOTE: caller takes care of extracting quant from rect of RawQuantField.
 void QuantizeRoundtripYBlockAC(const float* JXL_RESTRICT qm,
                                const float* JXL_RESTRICT dqm, float scale,
@@ -287,12 +435,6 @@ void QuantizeRoundtripYBlockAC(const float* JXL_RESTRICT qm,
   HWY_CAPPED(float, kDCTBlockSize) df;
   HWY_CAPPED(int32_t, kDCTBlockSize) di;
   const auto inv_qac = Set(df, 1.0 / (scale * quant));
-  constexpr float kDefaultQuantBias[4] = {
-      1.0f - 0.05465007330715401f,
-      1.0f - 0.07005449891748593f,
-      1.0f - 0.049935103337343655f,
-      0.145f,
-  };
   for (size_t k = 0; k < kDCTBlockSize * xsize * ysize; k += Lanes(df)) {
     const auto quant = Load(di, quantized + k);
     const auto adj_quant = AdjustQuantBias(di, 1, quant, kDefaultQuantBias);
@@ -301,32 +443,230 @@ void QuantizeRoundtripYBlockAC(const float* JXL_RESTRICT qm,
   }
 }
 
-void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
-                  const DequantMatrices& matrices, const float scale,
-                  const float scale_dc, const uint32_t x_qm_scale,
-                  DCGroupData* dc_data, const EntropyCode& ac_code,
-                  Image3B* num_nzeros, GroupProcessorMemory* mem,
-                  BitWriter* writer) {
+// Same as QuantizeRoundtripYBlockAC, the color correlation unapply and
+// QuantizeBlockAC of the X and B channels followed by the NumNonZeroExceptLLF
+// of the three channels, for a DCT8 block, in a single pass over the
+// coefficients in XYB order. Since the inverse matrices are zero for the DC,
+// the quantized DC are zero and the DC of the channels are those of coeffs.
+void QuantizeDCT8Block(const float* JXL_RESTRICT coeffs,
+                       const DequantMatrices& matrices, float scale,
+                       int32_t quant, float x_qm_mul, float x_ratio,
+                       float b_ratio, int32_t* JXL_RESTRICT quantized,
+                       uint8_t* JXL_RESTRICT nzeros) {
+  // Unlike QuantizeBlockAC, the vectors may span several rows, so that the
+  // whole vector is used on wide targets.
+  const HWY_CAPPED(float, kDCTBlockSize) df;
+  const HWY_CAPPED(int32_t, kDCTBlockSize) di;
+  const size_t kind = AcStrategy::Type::DCT;
+  const float* JXL_RESTRICT xqm = matrices.InvMatrix(kind, 0);
+  const float* JXL_RESTRICT yqm = matrices.InvMatrix(kind, 1);
+  const float* JXL_RESTRICT bqm = matrices.InvMatrix(kind, 2);
+  const float* JXL_RESTRICT ydqm = matrices.Matrix(kind, 1);
+  const float qac = scale * quant;
+  const auto quant_x = Set(df, qac * x_qm_mul);
+  const auto quant_yb = Set(df, qac);
+  const auto inv_qac = Set(df, 1.0 / (scale * quant));
+  const auto x_factor = Set(df, x_ratio);
+  const auto b_factor = Set(df, b_ratio);
+  float thres[3][4];
+  for (size_t c = 0; c < 3; ++c) {
+    QuantizeThresholds(c, 1, 1, thres[c]);
+  }
+
+  const auto zero = Zero(di);
+  // Add FF..FF for every zero coefficient, negate to get #zeros.
+  auto neg_zeros_x = zero;
+  auto neg_zeros_y = zero;
+  auto neg_zeros_b = zero;
+  for (size_t k = 0; k < kDCTBlockSize; k += Lanes(df)) {
+    const auto thr_x =
+        ThresholdsForLanes(df, k, kBlockDim, kDCTBlockSize, thres[0]);
+    const auto thr_y =
+        ThresholdsForLanes(df, k, kBlockDim, kDCTBlockSize, thres[1]);
+    const auto thr_b =
+        ThresholdsForLanes(df, k, kBlockDim, kDCTBlockSize, thres[2]);
+
+    // Quantize Y and dequantize it for the color correlation.
+    const auto in_y = Load(df, coeffs + kDCTBlockSize + k);
+    const auto val_y = Mul(Mul(Load(df, yqm + k), quant_yb), in_y);
+    const auto q_y =
+        ConvertTo(di, IfThenElseZero(Ge(Abs(val_y), thr_y), Round(val_y)));
+    Store(q_y, di, quantized + kDCTBlockSize + k);
+    const auto adj_y = AdjustQuantBias(di, 1, q_y, kDefaultQuantBias);
+    const auto rt_y = Mul(Mul(adj_y, Load(df, ydqm + k)), inv_qac);
+
+    const auto in_x = NegMulAdd(x_factor, rt_y, Load(df, coeffs + k));
+    const auto val_x = Mul(Mul(Load(df, xqm + k), quant_x), in_x);
+    const auto q_x =
+        ConvertTo(di, IfThenElseZero(Ge(Abs(val_x), thr_x), Round(val_x)));
+    Store(q_x, di, quantized + k);
+
+    const auto in_b =
+        NegMulAdd(b_factor, rt_y, Load(df, coeffs + 2 * kDCTBlockSize + k));
+    const auto val_b = Mul(Mul(Load(df, bqm + k), quant_yb), in_b);
+    const auto q_b =
+        ConvertTo(di, IfThenElseZero(Ge(Abs(val_b), thr_b), Round(val_b)));
+    Store(q_b, di, quantized + 2 * kDCTBlockSize + k);
+
+    neg_zeros_x = Add(neg_zeros_x, VecFromMask(di, Eq(q_x, zero)));
+    neg_zeros_y = Add(neg_zeros_y, VecFromMask(di, Eq(q_y, zero)));
+    neg_zeros_b = Add(neg_zeros_b, VecFromMask(di, Eq(q_b, zero)));
+  }
+  JXL_DASSERT(quantized[0] == 0 && quantized[kDCTBlockSize] == 0 &&
+              quantized[2 * kDCTBlockSize] == 0);
+
+  // We want 64 - #zeros, add because the sums are already negated.
+  const int32_t area = kDCTBlockSize;
+  nzeros[0] = area + GetLane(SumOfLanes(di, neg_zeros_x));
+  nzeros[1] = area + GetLane(SumOfLanes(di, neg_zeros_y));
+  nzeros[2] = area + GetLane(SumOfLanes(di, neg_zeros_b));
+}
+
+// With subsampled chroma, zeroes the quantized coefficients of the X or B
+// channel of a cx x cy block outside of the lowest quarter of its frequencies,
+// whose residuals after the color correlation are not coded. Returns the
+// number of the remaining nonzeros, except the LLF.
+int32_t KeepLowestFrequencies(size_t cx, size_t cy,
+                              int32_t* JXL_RESTRICT block) {
+  const size_t width = cx * kBlockDim;
+  const size_t height = cy * kBlockDim;
+  int32_t nzeros = 0;
+  for (size_t y = 0; y < height; ++y) {
+    int32_t* JXL_RESTRICT row = block + y * width;
+    if (y >= height / 2) {
+      memset(row, 0, width * sizeof(*row));
+      continue;
+    }
+    memset(row + width / 2, 0, width / 2 * sizeof(*row));
+    for (size_t x = y < cy ? cx : 0; x < width / 2; ++x) {
+      nzeros += row[x] != 0;
+    }
+  }
+  return nzeros;
+}
+
+// Same as QuantizeBlockAC followed by KeepLowestFrequencies, but only
+// quantizes the lowest quarter of the frequencies, whose thresholds are all
+// the first of QuantizeThresholds.
+int32_t QuantizeLowestFrequencies(const float* JXL_RESTRICT block_in, size_t c,
+                                  const float* JXL_RESTRICT qm, int32_t quant,
+                                  float scale, float qm_multiplier,
+                                  size_t xsize, size_t ysize,
+                                  int32_t* JXL_RESTRICT block_out) {
+  float thres[4];
+  QuantizeThresholds(c, xsize, ysize, thres);
+  const HWY_CAPPED(float, kBlockDim) df;
+  const HWY_CAPPED(int32_t, kBlockDim) di;
+  const auto quant_v = Set(df, scale * quant * qm_multiplier);
+  const auto thr = Set(df, thres[0]);
+  const size_t width = xsize * kBlockDim;
+  const size_t height = ysize * kBlockDim;
+  for (size_t y = 0; y < height / 2; ++y) {
+    const size_t off = y * width;
+    // For a single block, a whole row of the vector may be stored, and
+    // KeepLowestFrequencies zeroes its second half again.
+    for (size_t x = 0; x < width / 2; x += Lanes(df)) {
+      const auto q = Mul(Load(df, qm + off + x), quant_v);
+      const auto val = Mul(q, Load(df, block_in + off + x));
+      const auto v =
+          ConvertTo(di, IfThenElseZero(Ge(Abs(val), thr), Round(val)));
+      Store(v, di, block_out + off + x);
+    }
+  }
+  return KeepLowestFrequencies(xsize, ysize, block_out);
+}
+
+// Tokenizes the quantized coefficients of the first block of acs at bx of the
+// current block row, and writes the tokens of the whole block at once. The
+// numbers of nonzeros of the DCT8 blocks must already be in row_nzeros.
+template <class Writer>
+void WriteBlockTokens(const AcStrategy acs, size_t bx,
+                      const int32_t* JXL_RESTRICT quantized,
+                      uint8_t* JXL_RESTRICT const* row_nzeros,
+                      const uint8_t* JXL_RESTRICT const* row_nzeros_top,
+                      size_t nzeros_stride, const EntropyCode& ac_code,
+                      GroupProcessorMemory* mem, Writer* writer) {
+  size_t cx = acs.covered_blocks_x();
+  size_t cy = acs.covered_blocks_y();
+  if (cy > cx) std::swap(cx, cy);
+  const size_t covered_blocks = cx * cy;  // = #LLF coefficients
+  const size_t size = kDCTBlockSize * covered_blocks;
+  Token* tokens = mem->token_storage();
+  HWY_ALIGN int32_t scanned[kMaxCoeffArea];
+  HWY_ALIGN uint32_t contexts[kMaxCoeffArea];
+
+  size_t max_tokens = 3 * covered_blocks * kDCTBlockSize;
+  typename Writer::Allotment allotment(writer, kMaxBitsPerToken * max_tokens);
+  size_t num_tokens = 0;
+  const size_t log2_covered_blocks =
+      Num0BitsBelowLS1Bit_Nonzero(covered_blocks);
+  for (int c : {1, 0, 2}) {
+    const int32_t* JXL_RESTRICT block = quantized + c * size;
+
+    int32_t nzeros =
+        (covered_blocks == 1)
+            ? row_nzeros[c][bx]
+            : NumNonZeroExceptLLF(cx, cy, acs, covered_blocks,
+                                  log2_covered_blocks, block, nzeros_stride,
+                                  row_nzeros[c] + bx);
+
+    const coeff_order_t* JXL_RESTRICT order =
+        &kCoeffOrders[kCoeffOrderOffset[acs.RawStrategy()]];
+
+    int32_t predicted_nzeros =
+        PredictFromTopAndLeft(row_nzeros_top[c], row_nzeros[c], bx, 32);
+    const size_t block_ctx = BlockContext(c, acs.StrategyCode());
+    const size_t nzero_ctx = NonZeroContext(predicted_nzeros, block_ctx);
+    const size_t histo_offset = ZeroDensityContextsOffset(block_ctx);
+
+    tokens[num_tokens++] = Token(nzero_ctx, nzeros);
+    if (nzeros == 0) continue;
+    // Skip LLF, and stop after the last nonzero coefficient.
+    const size_t end =
+        ScanBlock(block, order, covered_blocks, size, nzeros,
+                  log2_covered_blocks, histo_offset, scanned, contexts);
+    for (size_t k = covered_blocks; k < end; ++k) {
+      tokens[num_tokens++] =
+          Token(contexts[k], static_cast<uint32_t>(scanned[k]));
+    }
+  }
+  WriteTokens(tokens, num_tokens, ac_code, writer);
+  if (mem->token_counts) {
+    for (size_t k = 0; k < num_tokens; ++k) {
+      ++mem->token_counts[tokens[k].context];
+    }
+  }
+  allotment.Reclaim(writer);
+}
+
+template <bool kChromaFromLuma, class Writer>
+void WriteACGroupT(const Image3F& opsin, const Rect& group_brect,
+                   const DequantMatrices& matrices, const float scale,
+                   const float scale_dc, const uint32_t x_qm_scale,
+                   DCGroupData* dc_data, const EntropyCode& ac_code,
+                   const CoefficientCache* cache, Image3B* num_nzeros,
+                   GroupProcessorMemory* mem, Writer* writer) {
   const size_t xsize_blocks = group_brect.xsize();
   const size_t ysize_blocks = group_brect.ysize();
-#if OPTIMIZE_CHROMA_FROM_LUMA
   const Rect cmap_rect(group_brect.x0() / kTileDimInBlocks,
                        group_brect.y0() / kTileDimInBlocks,
                        DivCeil(xsize_blocks, kTileDimInBlocks),
                        DivCeil(ysize_blocks, kTileDimInBlocks));
-#endif
 
   const size_t dc_stride =
       static_cast<size_t>(dc_data->quant_dc.PixelsPerRow());
   const size_t opsin_stride = static_cast<size_t>(opsin.PixelsPerRow());
+  const Image3F* half_chroma = mem->half_chroma;
+  const size_t half_stride =
+      half_chroma ? static_cast<size_t>(half_chroma->PixelsPerRow()) : 0;
 
   constexpr HWY_CAPPED(float, kDCTBlockSize) d;
   float* coeffs_in = mem->block_storage();
   float* scratch_space = mem->scratch_space();
   int32_t* quantized = mem->coeff_storage();
 
-  HWY_ALIGN float tmp_dc[4];
-  const size_t tmp_dc_stride = 2;
+  constexpr size_t tmp_dc_stride = kMaxCoeffDim / kBlockDim;
+  HWY_ALIGN float tmp_dc[tmp_dc_stride * tmp_dc_stride];
   float inv_factor[3];
   float cfl_factor[3] = {0.0f, 0.0f, kInvDCQuant[2] * kDCQuant[1]};
   for (size_t c = 0; c < 3; ++c) {
@@ -340,19 +680,23 @@ void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
   for (size_t by = 0; by < ysize_blocks; ++by) {
     const uint8_t* JXL_RESTRICT row_quant_ac =
         group_brect.ConstRow(dc_data->raw_quant_field, by);
-#if OPTIMIZE_CHROMA_FROM_LUMA
     size_t ty = by / kTileDimInBlocks;
     const int8_t* JXL_RESTRICT row_cmap[3] = {
         cmap_rect.ConstRow(dc_data->ytox_map, ty),
         nullptr,
         cmap_rect.ConstRow(dc_data->ytob_map, ty),
     };
-#endif
     const float* JXL_RESTRICT opsin_rows[3] = {
         opsin.ConstPlaneRow(0, by * kBlockDim),
         opsin.ConstPlaneRow(1, by * kBlockDim),
         opsin.ConstPlaneRow(2, by * kBlockDim),
     };
+    const float* JXL_RESTRICT half_rows[3] = {};
+    if (half_chroma) {
+      for (size_t c : {0, 2}) {
+        half_rows[c] = half_chroma->ConstPlaneRow(c, by * kBlockDim / 2);
+      }
+    }
     int16_t* JXL_RESTRICT dc_rows[3] = {
         group_brect.PlaneRow(&dc_data->quant_dc, 0, by),
         group_brect.PlaneRow(&dc_data->quant_dc, 1, by),
@@ -372,14 +716,15 @@ void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
         nzeros_by == 0 ? nullptr : num_nzeros->ConstPlaneRow(2, nzeros_by - 1),
     };
     for (size_t bx = 0; bx < xsize_blocks; ++bx) {
-#if OPTIMIZE_CHROMA_FROM_LUMA
-      size_t tx = bx / kTileDimInBlocks;
-      const auto x_factor = Set(d, YtoXRatio(row_cmap[0][tx]));
-      const auto b_factor = Set(d, YtoBRatio(row_cmap[2][tx]));
-#else
-      const auto x_factor = Set(d, 0.0f);
-      const auto b_factor = Set(d, 1.0f);
-#endif
+      // Without chroma from luma, the correlation is the same as that of the
+      // all-zero maps.
+      float x_ratio = YtoXRatio(0);
+      float b_ratio = YtoBRatio(0);
+      if (kChromaFromLuma) {
+        size_t tx = bx / kTileDimInBlocks;
+        x_ratio = YtoXRatio(row_cmap[0][tx]);
+        b_ratio = YtoBRatio(row_cmap[2][tx]);
+      }
       const AcStrategy acs = ac_strategy_row[bx];
       if (!acs.IsFirstBlock()) continue;
 
@@ -389,113 +734,295 @@ void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
       const size_t covered_blocks = cx * cy;  // = #LLF coefficients
       const size_t size = kDCTBlockSize * covered_blocks;
 
-      // DCT Y channel, roundtrip-quantize it and set DC.
+      // The heuristics may have already transformed this block.
+      const float* cached =
+          cache ? cache->Find(bx, by, acs, coeffs_in) : nullptr;
       const int32_t quant_ac = row_quant_ac[bx];
-      TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
-                          opsin_stride, coeffs_in + size, scratch_space);
-      DCFromLowestFrequencies(acs.Strategy(), coeffs_in + size, tmp_dc,
-                              tmp_dc_stride);
-      for (size_t iy = 0; iy < acs.covered_blocks_y(); ++iy) {
-        for (size_t ix = 0; ix < acs.covered_blocks_x(); ++ix) {
-          dc_rows[1][iy * dc_stride + bx + ix] =
-              std::round(inv_factor[1] * tmp_dc[iy * tmp_dc_stride + ix]);
+      if (acs.Strategy() == AcStrategy::Type::DCT) {
+        const float* coeffs = cached;
+        if (half_chroma) {
+          // Only the cached Y coefficients are those of the coded pixels.
+          if (cached == nullptr) {
+            TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
+                                opsin_stride, coeffs_in + size, scratch_space);
+          } else if (cached != coeffs_in) {
+            memcpy(coeffs_in + size, cached + size, size * sizeof(float));
+          }
+          for (size_t c : {0, 2}) {
+            TransformFromHalfPixels(
+                acs.Strategy(), half_rows[c] + bx * kBlockDim / 2, half_stride,
+                coeffs_in + c * size, scratch_space);
+          }
+          coeffs = coeffs_in;
+        } else if (coeffs == nullptr) {
+          for (size_t c = 0; c < 3; ++c) {
+            TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
+                                opsin_stride, coeffs_in + c * size,
+                                scratch_space);
+          }
+          coeffs = coeffs_in;
+        }
+        uint8_t nzeros[3];
+        QuantizeDCT8Block(coeffs, matrices, scale, quant_ac, x_qm_mul, x_ratio,
+                          b_ratio, quantized, nzeros);
+        if (half_chroma) {
+          for (size_t c : {0, 2}) {
+            nzeros[c] = KeepLowestFrequencies(1, 1, quantized + c * size);
+          }
+        }
+        dc_rows[1][bx] = std::round(inv_factor[1] * coeffs[size]);
+        for (size_t c : {0, 2}) {
+          dc_rows[c][bx] = std::round(coeffs[c * size] * inv_factor[c] -
+                                      dc_rows[1][bx] * cfl_factor[c]);
+        }
+        for (size_t c = 0; c < 3; ++c) {
+          row_nzeros[c][bx] = nzeros[c];
+        }
+      } else {
+        if (cached != nullptr && cached != coeffs_in) {
+          memcpy(coeffs_in, cached, 3 * size * sizeof(float));
         }
-      }
-      int kind = acs.RawStrategy();
-      const float* JXL_RESTRICT yqm = matrices.InvMatrix(kind, 1);
-      const float* JXL_RESTRICT ydqm = matrices.Matrix(kind, 1);
-      QuantizeRoundtripYBlockAC(yqm, ydqm, scale, quant_ac, cx, cy,
-                                coeffs_in + size, quantized + size);
-
-      // DCT X and B channels
-      for (size_t c : {0, 2}) {
-        TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
-                            opsin_stride, coeffs_in + c * size, scratch_space);
-      }
-
-      // Unapply color correlation
-      for (size_t k = 0; k < size; k += Lanes(d)) {
-        const auto in_x = Load(d, coeffs_in + k);
-        const auto in_y = Load(d, coeffs_in + size + k);
-        const auto in_b = Load(d, coeffs_in + 2 * size + k);
-        const auto out_x = NegMulAdd(x_factor, in_y, in_x);
-        const auto out_b = NegMulAdd(b_factor, in_y, in_b);
-        Store(out_x, d, coeffs_in + k);
-        Store(out_b, d, coeffs_in + 2 * size + k);
-      }
 
-      // Quantize X and B channels and set DC.
-      for (size_t c : {0, 2}) {
-        const float* JXL_RESTRICT qm = matrices.InvMatrix(kind, c);
-        QuantizeBlockAC(coeffs_in + c * size, c, qm, quant_ac, scale,
-                        c == 0 ? x_qm_mul : 1.0, cx, cy, quantized + c * size);
-        DCFromLowestFrequencies(acs.Strategy(), coeffs_in + c * size, tmp_dc,
+        // DCT Y channel, roundtrip-quantize it and set DC.
+        if (cached == nullptr) {
+          TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
+                              opsin_stride, coeffs_in + size, scratch_space);
+        }
+        DCFromLowestFrequencies(acs.Strategy(), coeffs_in + size, tmp_dc,
                                 tmp_dc_stride);
         for (size_t iy = 0; iy < acs.covered_blocks_y(); ++iy) {
           for (size_t ix = 0; ix < acs.covered_blocks_x(); ++ix) {
-            dc_rows[c][iy * dc_stride + bx + ix] = std::round(
-                tmp_dc[iy * tmp_dc_stride + ix] * inv_factor[c] -
-                dc_rows[1][iy * dc_stride + bx + ix] * cfl_factor[c]);
+            dc_rows[1][iy * dc_stride + bx + ix] =
+                std::round(inv_factor[1] * tmp_dc[iy * tmp_dc_stride + ix]);
+          }
+        }
+        int kind = acs.RawStrategy();
+        const float* JXL_RESTRICT yqm = matrices.InvMatrix(kind, 1);
+        const float* JXL_RESTRICT ydqm = matrices.Matrix(kind, 1);
+        QuantizeRoundtripYBlockAC(yqm, ydqm, scale, quant_ac, cx, cy,
+                                  coeffs_in + size, quantized + size);
+
+        // DCT X and B channels
+        if (half_chroma) {
+          for (size_t c : {0, 2}) {
+            TransformFromHalfPixels(
+                acs.Strategy(), half_rows[c] + bx * kBlockDim / 2, half_stride,
+                coeffs_in + c * size, scratch_space);
+          }
+        } else if (cached == nullptr) {
+          for (size_t c : {0, 2}) {
+            TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
+                                opsin_stride, coeffs_in + c * size,
+                                scratch_space);
+          }
+        }
+
+        // Unapply color correlation
+        const auto x_factor = Set(d, x_ratio);
+        const auto b_factor = Set(d, b_ratio);
+        for (size_t k = 0; k < size; k += Lanes(d)) {
+          const auto in_x = Load(d, coeffs_in + k);
+          const auto in_y = Load(d, coeffs_in + size + k);
+          const auto in_b = Load(d, coeffs_in + 2 * size + k);
+          const auto out_x = NegMulAdd(x_factor, in_y, in_x);
+          const auto out_b = NegMulAdd(b_factor, in_y, in_b);
+          Store(out_x, d, coeffs_in + k);
+          Store(out_b, d, coeffs_in + 2 * size + k);
+        }
+
+        // Quantize X and B channels and set DC.
+        for (size_t c : {0, 2}) {
+          const float* JXL_RESTRICT qm = matrices.InvMatrix(kind, c);
+          if (half_chroma) {
+            QuantizeLowestFrequencies(coeffs_in + c * size, c, qm, quant_ac,
+                                      scale, c == 0 ? x_qm_mul : 1.0, cx, cy,
+                                      quantized + c * size);
+          } else {
+            QuantizeBlockAC(coeffs_in + c * size, c, qm, quant_ac, scale,
+                            c == 0 ? x_qm_mul : 1.0, cx, cy,
+                            quantized + c * size);
+          }
+          DCFromLowestFrequencies(acs.Strategy(), coeffs_in + c * size, tmp_dc,
+                                  tmp_dc_stride);
+          for (size_t iy = 0; iy < acs.covered_blocks_y(); ++iy) {
+            for (size_t ix = 0; ix < acs.covered_blocks_x(); ++ix) {
+              dc_rows[c][iy * dc_stride + bx + ix] = std::round(
+                  tmp_dc[iy * tmp_dc_stride + ix] * inv_factor[c] -
+                  dc_rows[1][iy * dc_stride + bx + ix] * cfl_factor[c]);
+            }
           }
         }
       }
 
-      // Tokenize coefficients
-      size_t max_tokens = 3 * covered_blocks * kDCTBlockSize;
-      BitWriter::Allotment allotment(writer, kMaxBitsPerToken * max_tokens);
-      const size_t log2_covered_blocks =
-          Num0BitsBelowLS1Bit_Nonzero(covered_blocks);
-      for (int c : {1, 0, 2}) {
-        const int32_t* JXL_RESTRICT block = quantized + c * size;
-
-        int32_t nzeros =
-            (covered_blocks == 1)
-                ? NumNonZero8x8ExceptDC(block, row_nzeros[c] + bx)
-                : NumNonZeroExceptLLF(cx, cy, acs, covered_blocks,
-                                      log2_covered_blocks, block, nzeros_stride,
-                                      row_nzeros[c] + bx);
-
-        const coeff_order_t* JXL_RESTRICT order =
-            &kCoeffOrders[kCoeffOrderOffset[acs.RawStrategy()]];
-
-        int32_t predicted_nzeros =
-            PredictFromTopAndLeft(row_nzeros_top[c], row_nzeros[c], bx, 32);
-        const size_t block_ctx = BlockContext(c, acs.StrategyCode());
-        const size_t nzero_ctx = NonZeroContext(predicted_nzeros, block_ctx);
-        const size_t histo_offset = ZeroDensityContextsOffset(block_ctx);
-
-        Token token(nzero_ctx, nzeros);
-#if OPTIMIZE_CODE
-        writer->Write(8, ac_code.context_map[token.context]);
-        writer->Write(16, token.value);
-#else
-        WriteToken(token, ac_code, writer);
-#endif
-        // Skip LLF.
-        size_t prev = (nzeros > static_cast<ssize_t>(size / 16) ? 0 : 1);
-        for (size_t k = covered_blocks; k < size && nzeros != 0; ++k) {
-          int32_t coeff = block[order[k]];
-          size_t ctx =
-              histo_offset + ZeroDensityContext(nzeros, k, covered_blocks,
-                                                log2_covered_blocks, prev);
-          uint32_t u_coeff = PackSigned(coeff);
-          Token token(ctx, u_coeff);
-#if OPTIMIZE_CODE
-          writer->Write(8, ac_code.context_map[token.context]);
-          writer->Write(16, token.value);
-#else
-          WriteToken(token, ac_code, writer);
-#endif
-          prev = coeff != 0;
-          nzeros -= prev;
+      WriteBlockTokens(acs, bx, quantized, row_nzeros, row_nzeros_top,
+                       nzeros_stride, ac_code, mem, writer);
+    }
+  }
+}
+
+// Same as WriteACGroupT, but the DCT8 coefficients and the DC are those of the
+// JPEG blocks, which are already quantized with the quant tables of the frame.
+template <class Writer>
+void WriteJPEGACGroupT(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                       const Rect& group_brect, DCGroupData* dc_data,
+                       const EntropyCode& ac_code, Image3B* num_nzeros,
+                       GroupProcessorMemory* mem, Writer* writer) {
+  const AcStrategy acs = AcStrategy::FromRawStrategy(AcStrategy::Type::DCT);
+  int32_t* quantized = mem->coeff_storage();
+  const size_t nzeros_by0 = group_brect.y0() % kGroupDimInBlocks;
+  const size_t nzeros_stride = num_nzeros->PixelsPerRow();
+
+  for (size_t by = 0; by < group_brect.ysize(); ++by) {
+    uint8_t* JXL_RESTRICT row_quant_ac =
+        group_brect.Row(&dc_data->raw_quant_field, by);
+    int16_t* JXL_RESTRICT dc_rows[3] = {
+        group_brect.PlaneRow(&dc_data->quant_dc, 0, by),
+        group_brect.PlaneRow(&dc_data->quant_dc, 1, by),
+        group_brect.PlaneRow(&dc_data->quant_dc, 2, by),
+    };
+    size_t nzeros_by = nzeros_by0 + by;
+    uint8_t* JXL_RESTRICT row_nzeros[3] = {
+        num_nzeros->PlaneRow(0, nzeros_by),
+        num_nzeros->PlaneRow(1, nzeros_by),
+        num_nzeros->PlaneRow(2, nzeros_by),
+    };
+    const uint8_t* JXL_RESTRICT row_nzeros_top[3] = {
+        nzeros_by == 0 ? nullptr : num_nzeros->ConstPlaneRow(0, nzeros_by - 1),
+        nzeros_by == 0 ? nullptr : num_nzeros->ConstPlaneRow(1, nzeros_by - 1),
+        nzeros_by == 0 ? nullptr : num_nzeros->ConstPlaneRow(2, nzeros_by - 1),
+    };
+    for (size_t bx = 0; bx < group_brect.xsize(); ++bx) {
+      // The quant tables already hold the whole quantization step.
+      row_quant_ac[bx] = 1;
+      for (size_t c = 0; c < 3; ++c) {
+        const int16_t* JXL_RESTRICT block =
+            jpeg.ConstBlock(kJPEGComponentOfChannel[c], image_brect.x0() + bx,
+                            image_brect.y0() + by);
+        int32_t* JXL_RESTRICT out = quantized + c * kDCTBlockSize;
+        // JPEG XL transposes the DCT, JPEG does not.
+        for (size_t iy = 0; iy < kBlockDim; ++iy) {
+          for (size_t ix = 0; ix < kBlockDim; ++ix) {
+            out[ix * kBlockDim + iy] = block[iy * kBlockDim + ix];
+          }
+        }
+        dc_rows[c][bx] = out[0];
+        out[0] = 0;
+        uint8_t nzeros = 0;
+        for (size_t k = 1; k < kDCTBlockSize; ++k) {
+          nzeros += out[k] != 0;
         }
-        JXL_DASSERT(nzeros == 0);
+        row_nzeros[c][bx] = nzeros;
       }
-      allotment.Reclaim(writer);
+      WriteBlockTokens(acs, bx, quantized, row_nzeros, row_nzeros_top,
+                       nzeros_stride, ac_code, mem, writer);
     }
   }
 }
 
+template <class Writer>
+void WriteACGroupImpl(const Image3F& opsin, const Rect& group_brect,
+                      const DequantMatrices& matrices, const float scale,
+                      const float scale_dc, const uint32_t x_qm_scale,
+                      DCGroupData* dc_data, const EntropyCode& ac_code,
+                      bool chroma_from_luma, const CoefficientCache* cache,
+                      Image3B* num_nzeros, GroupProcessorMemory* mem,
+                      Writer* writer) {
+  if (chroma_from_luma) {
+    WriteACGroupT<true>(opsin, group_brect, matrices, scale, scale_dc,
+                        x_qm_scale, dc_data, ac_code, cache, num_nzeros, mem,
+                        writer);
+  } else {
+    WriteACGroupT<false>(opsin, group_brect, matrices, scale, scale_dc,
+                         x_qm_scale, dc_data, ac_code, cache, num_nzeros, mem,
+                         writer);
+  }
+}
+
+void WriteACGroupBits(const Image3F& opsin, const Rect& group_brect,
+                      const DequantMatrices& matrices, const float scale,
+                      const float scale_dc, const uint32_t x_qm_scale,
+                      DCGroupData* dc_data, const EntropyCode& ac_code,
+                      bool chroma_from_luma, const CoefficientCache* cache,
+                      Image3B* num_nzeros, GroupProcessorMemory* mem,
+                      BitWriter* writer) {
+  WriteACGroupImpl(opsin, group_brect, matrices, scale, scale_dc, x_qm_scale,
+                   dc_data, ac_code, chroma_from_luma, cache, num_nzeros, mem,
+                   writer);
+}
+
+void WriteACGroupTokens(const Image3F& opsin, const Rect& group_brect,
+                        const DequantMatrices& matrices, const float scale,
+                        const float scale_dc, const uint32_t x_qm_scale,
+                        DCGroupData* dc_data, const EntropyCode& ac_code,
+                        bool chroma_from_luma, const CoefficientCache* cache,
+                        Image3B* num_nzeros, GroupProcessorMemory* mem,
+                        TokenBuffer* tokens) {
+  WriteACGroupImpl(opsin, group_brect, matrices, scale, scale_dc, x_qm_scale,
+                   dc_data, ac_code, chroma_from_luma, cache, num_nzeros, mem,
+                   tokens);
+}
+
+void WriteACGroupHistograms(const Image3F& opsin, const Rect& group_brect,
+                            const DequantMatrices& matrices, const float scale,
+                            const float scale_dc, const uint32_t x_qm_scale,
+                            DCGroupData* dc_data, const EntropyCode& ac_code,
+                            bool chroma_from_luma,
+                            const CoefficientCache* cache, Image3B* num_nzeros,
+                            GroupProcessorMemory* mem,
+                            HistogramCollector* histograms) {
+  WriteACGroupImpl(opsin, group_brect, matrices, scale, scale_dc, x_qm_scale,
+                   dc_data, ac_code, chroma_from_luma, cache, num_nzeros, mem,
+                   histograms);
+}
+
+void WriteACGroupCosts(const Image3F& opsin, const Rect& group_brect,
+                       const DequantMatrices& matrices, const float scale,
+                       const float scale_dc, const uint32_t x_qm_scale,
+                       DCGroupData* dc_data, const EntropyCode& ac_code,
+                       bool chroma_from_luma, const CoefficientCache* cache,
+                       Image3B* num_nzeros, GroupProcessorMemory* mem,
+                       CodeCostCollector* costs) {
+  WriteACGroupImpl(opsin, group_brect, matrices, scale, scale_dc, x_qm_scale,
+                   dc_data, ac_code, chroma_from_luma, cache, num_nzeros, mem,
+                   costs);
+}
+
+void WriteJPEGACGroupBits(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                          const Rect& group_brect, DCGroupData* dc_data,
+                          const EntropyCode& ac_code, Image3B* num_nzeros,
+                          GroupProcessorMemory* mem, BitWriter* writer) {
+  WriteJPEGACGroupT(jpeg, image_brect, group_brect, dc_data, ac_code,
+                    num_nzeros, mem, writer);
+}
+
+void WriteJPEGACGroupTokens(const JPEGCoefficients& jpeg,
+                            const Rect& image_brect, const Rect& group_brect,
+                            DCGroupData* dc_data, const EntropyCode& ac_code,
+                            Image3B* num_nzeros, GroupProcessorMemory* mem,
+                            TokenBuffer* tokens) {
+  WriteJPEGACGroupT(jpeg, image_brect, group_brect, dc_data, ac_code,
+                    num_nzeros, mem, tokens);
+}
+
+void WriteJPEGACGroupHistograms(const JPEGCoefficients& jpeg,
+                                const Rect& image_brect,
+                                const Rect& group_brect, DCGroupData* dc_data,
+                                const EntropyCode& ac_code,
+                                Image3B* num_nzeros, GroupProcessorMemory* mem,
+                                HistogramCollector* histograms) {
+  WriteJPEGACGroupT(jpeg, image_brect, group_brect, dc_data, ac_code,
+                    num_nzeros, mem, histograms);
+}
+
+void WriteJPEGACGroupCosts(const JPEGCoefficients& jpeg,
+                           const Rect& image_brect, const Rect& group_brect,
+                           DCGroupData* dc_data, const EntropyCode& ac_code,
+                           Image3B* num_nzeros, GroupProcessorMemory* mem,
+                           CodeCostCollector* costs) {
+  WriteJPEGACGroupT(jpeg, image_brect, group_brect, dc_data, ac_code,
+                    num_nzeros, mem, costs);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -503,16 +1030,96 @@ HWY_AFTER_NAMESPACE();
 
 #if HWY_ONCE
 namespace jxl {
-HWY_EXPORT(WriteACGroup);
+HWY_EXPORT(WriteACGroupBits);
 void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
                   const DequantMatrices& matrices, const float scale,
                   const float scale_dc, const uint32_t x_qm_scale,
                   DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
                   Image3B* num_nzeros, GroupProcessorMemory* mem,
                   BitWriter* writer) {
-  return HWY_DYNAMIC_DISPATCH(WriteACGroup)(opsin, group_brect, matrices, scale,
-                                            scale_dc, x_qm_scale, dc_data,
-                                            ac_code, num_nzeros, mem, writer);
+  return HWY_DYNAMIC_DISPATCH(WriteACGroupBits)(
+      opsin, group_brect, matrices, scale, scale_dc, x_qm_scale, dc_data,
+      ac_code, chroma_from_luma, cache, num_nzeros, mem, writer);
+}
+
+HWY_EXPORT(WriteACGroupTokens);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  TokenBuffer* tokens) {
+  return HWY_DYNAMIC_DISPATCH(WriteACGroupTokens)(
+      opsin, group_brect, matrices, scale, scale_dc, x_qm_scale, dc_data,
+      ac_code, chroma_from_luma, cache, num_nzeros, mem, tokens);
+}
+
+HWY_EXPORT(WriteACGroupHistograms);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  HistogramCollector* histograms) {
+  return HWY_DYNAMIC_DISPATCH(WriteACGroupHistograms)(
+      opsin, group_brect, matrices, scale, scale_dc, x_qm_scale, dc_data,
+      ac_code, chroma_from_luma, cache, num_nzeros, mem, histograms);
+}
+
+HWY_EXPORT(WriteACGroupCosts);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  CodeCostCollector* costs) {
+  return HWY_DYNAMIC_DISPATCH(WriteACGroupCosts)(
+      opsin, group_brect, matrices, scale, scale_dc, x_qm_scale, dc_data,
+      ac_code, chroma_from_luma, cache, num_nzeros, mem, costs);
+}
+
+HWY_EXPORT(WriteJPEGACGroupBits);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, BitWriter* writer) {
+  return HWY_DYNAMIC_DISPATCH(WriteJPEGACGroupBits)(
+      jpeg, image_brect, group_brect, dc_data, ac_code, num_nzeros, mem,
+      writer);
+}
+
+HWY_EXPORT(WriteJPEGACGroupTokens);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, TokenBuffer* tokens) {
+  return HWY_DYNAMIC_DISPATCH(WriteJPEGACGroupTokens)(
+      jpeg, image_brect, group_brect, dc_data, ac_code, num_nzeros, mem,
+      tokens);
+}
+
+HWY_EXPORT(WriteJPEGACGroupHistograms);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, HistogramCollector* histograms) {
+  return HWY_DYNAMIC_DISPATCH(WriteJPEGACGroupHistograms)(
+      jpeg, image_brect, group_brect, dc_data, ac_code, num_nzeros, mem,
+      histograms);
+}
+
+HWY_EXPORT(WriteJPEGACGroupCosts);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, CodeCostCollector* costs) {
+  return HWY_DYNAMIC_DISPATCH(WriteJPEGACGroupCosts)(
+      jpeg, image_brect, group_brect, dc_data, ac_code, num_nzeros, mem,
+      costs);
 }
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -8,13 +8,20 @@
 #define ENCODER_ENC_GROUP_H_
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
 
 #include "encoder/ac_strategy.h"
+#include "encoder/coefficient_cache.h"
 #include "encoder/dc_group_data.h"
 #include "encoder/enc_bit_writer.h"
 #include "encoder/entropy_code.h"
 #include "encoder/image.h"
+#include "encoder/jpeg_coefficients.h"
 #include "encoder/quant_weights.h"
+#include "encoder/token.h"
+#include "encoder/token_buffer.h"
 
 namespace jxl {
 
@@ -22,20 +29,80 @@ struct GroupProcessorMemory {
   GroupProcessorMemory() {
     mem_dct = hwy::AllocateAligned<float>(kMaxCoeffArea * 4);
     mem_coeff = hwy::AllocateAligned<int32_t>(kMaxCoeffArea * 3);
+    mem_tokens.resize(kMaxCoeffArea * 3);
   }
   float* block_storage() { return mem_dct.get(); }
   float* scratch_space() { return mem_dct.get() + 3 * kMaxCoeffArea; }
   int32_t* coeff_storage() { return mem_coeff.get(); }
+  // The tokens of one block, at most one per coefficient and channel.
+  Token* token_storage() { return mem_tokens.data(); }
   hwy::AlignedFreeUniquePtr<float[]> mem_dct;
   hwy::AlignedFreeUniquePtr<int32_t[]> mem_coeff;
+  std::vector<Token> mem_tokens;
+  // If not null, the number of tokens of each of the kNumACContexts contexts
+  // is added here.
+  uint64_t* token_counts = nullptr;
+  // If not null, the X and B channels are subsampled, and the planes 0 and 2
+  // of this image hold their 2x2 averaged pixels of the current AC stripe,
+  // see EncoderOptions::subsample_chroma.
+  const Image3F* half_chroma = nullptr;
 };
 
+// Writes the AC tokens of the blocks of group_brect either directly to a
+// BitWriter, or buffered as tokens if the entropy code is not yet final, or
+// only adds them to the histograms of their prefix codes or to their costs
+// with a set of codes. If
+// chroma_from_luma is false, the color correlation maps are not used. If cache
+// is not null, it holds the already computed coefficients of some of the
+// blocks of the stripe of group_brect.
 void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
                   const DequantMatrices& matrices, const float scale,
                   const float scale_dc, const uint32_t x_qm_scale,
                   DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
                   Image3B* num_nzeros, GroupProcessorMemory* mem,
                   BitWriter* writer);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  TokenBuffer* tokens);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  HistogramCollector* histograms);
+void WriteACGroup(const Image3F& opsin, const Rect& group_brect,
+                  const DequantMatrices& matrices, const float scale,
+                  const float scale_dc, const uint32_t x_qm_scale,
+                  DCGroupData* dc_data, const EntropyCode& ac_code,
+                  bool chroma_from_luma, const CoefficientCache* cache,
+                  Image3B* num_nzeros, GroupProcessorMemory* mem,
+                  CodeCostCollector* costs);
+
+// Same as the above, but the blocks of group_brect are the DCT8 blocks of the
+// JPEG image at image_brect, whose quantized coefficients are written as they
+// are. Also fills in their quantized DC and quant field.
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, BitWriter* writer);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, TokenBuffer* tokens);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, HistogramCollector* histograms);
+void WriteACGroup(const JPEGCoefficients& jpeg, const Rect& image_brect,
+                  const Rect& group_brect, DCGroupData* dc_data,
+                  const EntropyCode& ac_code, Image3B* num_nzeros,
+                  GroupProcessorMemory* mem, CodeCostCollector* costs);
 
 }  // namespace jxl
 
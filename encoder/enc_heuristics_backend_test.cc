@@ -0,0 +1,76 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/config.h"
+#include "encoder/enc_file.h"
+#include "encoder/enc_frame.h"
+#include "encoder/image.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+std::vector<uint8_t> Encode(const Image3F& image,
+                            const EncoderOptions& options,
+                            HeuristicsBackend* backend) {
+  Encoder encoder(2);
+  encoder.SetOptions(options);
+  encoder.SetHeuristicsBackend(backend);
+  std::vector<uint8_t> output;
+  EXPECT_TRUE(encoder.Encode(image, 1.0f, &output));
+  return output;
+}
+
+// The reference backend computes the same heuristics as the encoder threads,
+// over two DC groups and with all of the transform search.
+TEST(HeuristicsBackendTest, SameAsWithoutBackend) {
+  const Image3F image = test::TestImage(2100, 300);
+  for (int effort = EncoderOptions::kMinEffort;
+       effort <= EncoderOptions::kMaxEffort; ++effort) {
+    for (bool large_block_sizes : {false, true}) {
+      EncoderOptions options = EncoderOptions::ForEffort(effort);
+      options.cache_coefficients = false;
+      options.large_block_sizes = large_block_sizes;
+      CPUHeuristicsBackend backend(image, options);
+      const std::vector<uint8_t> expected = Encode(image, options, nullptr);
+      ASSERT_FALSE(expected.empty());
+      EXPECT_EQ(expected, Encode(image, options, &backend))
+          << "effort " << effort << " large_block_sizes "
+          << large_block_sizes;
+    }
+  }
+}
+
+// With incremental frames, the backend is only called for the changed DC
+// groups, whose storage still holds the heuristics of the previous frame, here
+// with other transforms. That the frames decode to their input is checked by
+// EncFileTest.IncrementalAnimationRoundTrip.
+TEST(HeuristicsBackendTest, IncrementalAnimation) {
+  const std::vector<Image3F> frames =
+      test::TexturedFlatTexturedFrames(600, 400);
+  for (bool large_block_sizes : {false, true}) {
+    EncoderOptions options = EncoderOptions::ForEffort(4);
+    options.cache_coefficients = false;
+    options.incremental = true;
+    options.large_block_sizes = large_block_sizes;
+    const std::vector<uint8_t> expected =
+        test::EncodeAnimation(frames, 1.0f, options);
+    ASSERT_FALSE(expected.empty());
+    EXPECT_EQ(expected,
+              test::EncodeAnimation(frames, 1.0f, options, /*num_threads=*/2,
+                                    /*cpu_heuristics_backend=*/true))
+        << "large_block_sizes " << large_block_sizes;
+  }
+}
+
+}  // namespace
+}  // namespace jxl
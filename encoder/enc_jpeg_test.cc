@@ -0,0 +1,203 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Recompresses JPEGs made with libjpeg and checks that libjxl decodes them to
+// the pixels that libjpeg decodes them to.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// After stdio.h, which it needs for FILE.
+#include <jpeglib.h>
+
+#include "encoder/common.h"
+#include "encoder/enc_file.h"
+#include "encoder/jpeg_coefficients.h"
+#include "encoder/test_utils.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+using test::DecodedImage;
+
+// Smooth RGB image away from the ends of the sample range, so that neither
+// decoder clamps the ringing of the quantized blocks.
+std::vector<uint8_t> TestRGB(size_t xsize, size_t ysize) {
+  std::vector<uint8_t> rgb(xsize * ysize * 3);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        const float v = 128.0f + 50.0f * sinf(0.05f * (c + 1) * x) *
+                                     cosf(0.03f * (3 - c) * y) +
+                        20.0f * sinf(0.2f * (x + 2 * y + 7 * c));
+        rgb[(y * xsize + x) * 3 + c] = static_cast<uint8_t>(v + 0.5f);
+      }
+    }
+  }
+  return rgb;
+}
+
+// Compresses `rgb` without chroma subsampling, with the quant tables of
+// `quality` or, if `tables` is not null, with the luma and chroma tables in
+// natural order.
+std::vector<uint8_t> CompressJPEG(const std::vector<uint8_t>& rgb,
+                                  size_t xsize, size_t ysize, int quality,
+                                  const unsigned int (*tables)[64]) {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  unsigned char* buffer = nullptr;
+  unsigned long size = 0;  // NOLINT
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = xsize;
+  cinfo.image_height = ysize;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  if (tables) {
+    jpeg_add_quant_table(&cinfo, 0, tables[0], 100, TRUE);
+    jpeg_add_quant_table(&cinfo, 1, tables[1], 100, TRUE);
+  }
+  for (int c = 0; c < 3; ++c) {
+    cinfo.comp_info[c].h_samp_factor = 1;
+    cinfo.comp_info[c].v_samp_factor = 1;
+  }
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(rgb.data() +
+                                        cinfo.next_scanline * xsize * 3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  std::vector<uint8_t> jpeg(buffer, buffer + size);
+  free(buffer);
+  return jpeg;
+}
+
+// Reads the quantized coefficients and the quant tables of the JPEG.
+void ReadCoefficients(const std::vector<uint8_t>& jpeg,
+                      std::vector<int16_t> (*coeffs)[kNumJPEGComponents],
+                      JPEGCoefficients* result) {
+  jpeg_decompress_struct dinfo;
+  jpeg_error_mgr jerr;
+  dinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, jpeg.data(), jpeg.size());
+  jpeg_read_header(&dinfo, TRUE);
+  jvirt_barray_ptr* arrays = jpeg_read_coefficients(&dinfo);
+  ASSERT_EQ(3, dinfo.num_components);
+  result->xsize = dinfo.image_width;
+  result->ysize = dinfo.image_height;
+  for (size_t c = 0; c < kNumJPEGComponents; ++c) {
+    const jpeg_component_info* comp = &dinfo.comp_info[c];
+    ASSERT_EQ(1, comp->h_samp_factor);
+    ASSERT_EQ(1, comp->v_samp_factor);
+    for (size_t k = 0; k < kDCTBlockSize; ++k) {
+      result->quant[c][k] = comp->quant_table->quantval[k];
+    }
+    const size_t blocks_per_row = comp->width_in_blocks;
+    std::vector<int16_t>& blocks = (*coeffs)[c];
+    blocks.resize(comp->height_in_blocks * blocks_per_row * kDCTBlockSize);
+    for (size_t by = 0; by < comp->height_in_blocks; ++by) {
+      JBLOCKARRAY row = (*dinfo.mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(&dinfo), arrays[c], by, 1, FALSE);
+      memcpy(&blocks[by * blocks_per_row * kDCTBlockSize], row[0],
+             blocks_per_row * sizeof(JBLOCK));
+    }
+    result->coeffs[c] = blocks.data();
+    result->blocks_per_row[c] = blocks_per_row;
+  }
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+}
+
+// Decodes the JPEG to RGB with the floating point IDCT, which is the closest
+// to the one of libjxl.
+std::vector<uint8_t> DecompressJPEG(const std::vector<uint8_t>& jpeg) {
+  jpeg_decompress_struct dinfo;
+  jpeg_error_mgr jerr;
+  dinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, jpeg.data(), jpeg.size());
+  jpeg_read_header(&dinfo, TRUE);
+  dinfo.out_color_space = JCS_RGB;
+  dinfo.dct_method = JDCT_FLOAT;
+  jpeg_start_decompress(&dinfo);
+  const size_t stride = dinfo.output_width * 3;
+  std::vector<uint8_t> rgb(dinfo.output_height * stride);
+  while (dinfo.output_scanline < dinfo.output_height) {
+    JSAMPROW row = &rgb[dinfo.output_scanline * stride];
+    jpeg_read_scanlines(&dinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  return rgb;
+}
+
+void ExpectSamePixels(size_t xsize, size_t ysize, int quality,
+                      const unsigned int (*tables)[64] = nullptr) {
+  const std::vector<uint8_t> jpeg =
+      CompressJPEG(TestRGB(xsize, ysize), xsize, ysize, quality, tables);
+  std::vector<int16_t> coeffs[kNumJPEGComponents];
+  JPEGCoefficients coefficients;
+  ASSERT_NO_FATAL_FAILURE(ReadCoefficients(jpeg, &coeffs, &coefficients));
+  std::vector<uint8_t> codestream;
+  ASSERT_TRUE(EncodeFile(coefficients, &codestream));
+
+  DecodedImage decoded;
+  ASSERT_TRUE(test::DecodeToUint8(codestream, &decoded));
+  ASSERT_EQ(xsize, decoded.xsize);
+  ASSERT_EQ(ysize, decoded.ysize);
+  const std::vector<uint8_t> expected = DecompressJPEG(jpeg);
+  ASSERT_EQ(expected.size(), decoded.pixels8.size());
+  // The decoders only differ in the rounding of the IDCT and of the color
+  // conversion.
+  int max_diff = 0;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    max_diff = std::max(max_diff, abs(expected[i] - decoded.pixels8[i]));
+  }
+  EXPECT_LE(max_diff, 2) << "quality " << quality;
+}
+
+// The standard tables, which are not symmetric, so that a missing transpose
+// of the coefficients or of the raw quant table gives wrong pixels.
+TEST(EncJPEGTest, StandardTables) {
+  for (int quality : {75, 90, 100}) {
+    ExpectSamePixels(256, 192, quality);
+  }
+}
+
+// Sizes that are not a multiple of the block size, over several groups.
+TEST(EncJPEGTest, PartialBlocks) { ExpectSamePixels(301, 517, 85); }
+
+// Quant tables whose steps grow much faster along the rows than along the
+// columns, with DC steps that binary16 does not hold exactly relative to the
+// sample range.
+TEST(EncJPEGTest, AsymmetricTables) {
+  unsigned int tables[2][64];
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      tables[0][y * 8 + x] = 3 + 5 * x + y;
+      tables[1][y * 8 + x] = 7 + x + 4 * y;
+    }
+  }
+  tables[0][0] = 13;
+  tables[1][0] = 19;
+  ExpectSamePixels(200, 120, 100, tables);
+}
+
+}  // namespace
+}  // namespace jxl
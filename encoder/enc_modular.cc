@@ -0,0 +1,103 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_modular.h"
+
+#include <algorithm>
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "encoder/enc_modular.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "encoder/base/compiler_specific.h"
+#include "encoder/common.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::BitCast;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
+using hwy::HWY_NAMESPACE::PromoteTo;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::RebindToUnsigned;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Xor;
+
+void ComputeGradientResiduals(const int16_t* JXL_RESTRICT row,
+                              const int16_t* JXL_RESTRICT row_top,
+                              size_t xsize, int32_t property_offset,
+                              int32_t max_property,
+                              uint32_t* JXL_RESTRICT residuals,
+                              uint32_t* JXL_RESTRICT properties) {
+  if (xsize == 0) return;
+  // The samples are 16 bits, so the gradient does not overflow and the
+  // clamped gradient is simply clamped to the range of top and left.
+  const auto scalar_sample = [&](size_t x, int32_t top, int32_t left,
+                                 int32_t topleft) {
+    const int32_t grad = top + left - topleft;
+    const int32_t guess =
+        Clamp1(grad, std::min(top, left), std::max(top, left));
+    residuals[x] = PackSigned(row[x] - guess);
+    properties[x] = Clamp1(property_offset + grad, 0, max_property);
+  };
+  if (row_top == nullptr) {
+    // Only the left sample is known, or none for the first one.
+    scalar_sample(0, 0, 0, 0);
+    for (size_t x = 1; x < xsize; ++x) {
+      scalar_sample(x, row[x - 1], row[x - 1], row[x - 1]);
+    }
+    return;
+  }
+  scalar_sample(0, row_top[0], row_top[0], row_top[0]);
+  const HWY_FULL(int32_t) di;
+  const Rebind<int16_t, decltype(di)> ds;
+  const RebindToUnsigned<decltype(di)> du;
+  const auto offset = Set(di, property_offset);
+  const auto max_prop = Set(di, max_property);
+  size_t x = 1;
+  for (; x + Lanes(di) <= xsize; x += Lanes(di)) {
+    const auto top = PromoteTo(di, LoadU(ds, row_top + x));
+    const auto left = PromoteTo(di, LoadU(ds, row + x - 1));
+    const auto topleft = PromoteTo(di, LoadU(ds, row_top + x - 1));
+    const auto grad = Sub(Add(top, left), topleft);
+    const auto guess = Min(Max(grad, Min(top, left)), Max(top, left));
+    const auto residual = Sub(PromoteTo(di, LoadU(ds, row + x)), guess);
+    const auto packed =
+        Xor(ShiftLeft<1>(residual), ShiftRight<31>(residual));
+    StoreU(BitCast(du, packed), du, residuals + x);
+    const auto prop = Min(Max(Add(grad, offset), Zero(di)), max_prop);
+    StoreU(BitCast(du, prop), du, properties + x);
+  }
+  for (; x < xsize; ++x) {
+    scalar_sample(x, row_top[x], row[x - 1], row_top[x - 1]);
+  }
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+HWY_EXPORT(ComputeGradientResiduals);
+void ComputeGradientResiduals(const int16_t* row, const int16_t* row_top,
+                              size_t xsize, int32_t property_offset,
+                              int32_t max_property, uint32_t* residuals,
+                              uint32_t* properties) {
+  return HWY_DYNAMIC_DISPATCH(ComputeGradientResiduals)(
+      row, row_top, xsize, property_offset, max_property, residuals,
+      properties);
+}
+}  // namespace jxl
+#endif  // HWY_ONCE
@@ -0,0 +1,28 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_ENC_MODULAR_H_
+#define ENCODER_ENC_MODULAR_H_
+
+// Predictor of the modular channels of the DC groups.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace jxl {
+
+// Computes the residuals of the clamped gradient predictor of the xsize
+// samples of `row`, packed with PackSigned, and their gradient properties
+// top + left - topleft, offset by property_offset and clamped to
+// [0, max_property]. row_top is the row above, or null for the first row.
+void ComputeGradientResiduals(const int16_t* row, const int16_t* row_top,
+                              size_t xsize, int32_t property_offset,
+                              int32_t max_property, uint32_t* residuals,
+                              uint32_t* properties);
+
+}  // namespace jxl
+
+#endif  // ENCODER_ENC_MODULAR_H_
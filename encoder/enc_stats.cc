@@ -0,0 +1,28 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/enc_stats.h"
+
+#include "encoder/base/status.h"
+
+namespace jxl {
+
+const char* EncodeStageName(size_t stage) {
+  static const char* const kNames[kNumEncodeStages] = {
+      "ToXYB",
+      "AdaptiveQuantization",
+      "ChromaFromLuma",
+      "AcStrategy",
+      "WriteACGroup",
+      "WriteDCGroup",
+      "OptimizeSections",
+      "CombineSections",
+  };
+  JXL_ASSERT(stage < kNumEncodeStages);
+  return kNames[stage];
+}
+
+}  // namespace jxl
@@ -0,0 +1,118 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_ENC_STATS_H_
+#define ENCODER_ENC_STATS_H_
+
+// Statistics of an encoded frame, collected with EncoderOptions::collect_stats.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>  //NOLINT
+#include <vector>
+
+#include "encoder/ac_strategy.h"
+
+// If set to 0, the stage timers compile to nothing and the stage times of the
+// stats stay zero.
+#ifndef JXL_ENABLE_STAGE_TIMING
+#define JXL_ENABLE_STAGE_TIMING 1
+#endif  // JXL_ENABLE_STAGE_TIMING
+
+namespace jxl {
+
+// Parts of EncodeFrame whose time is measured.
+enum EncodeStage : uint32_t {
+  // Copying and padding of the input and conversion to XYB, which are done
+  // together for each AC stripe.
+  kStageToXYB,
+  kStageAdaptiveQuantization,  // ComputeAdaptiveQuantFieldTile
+  kStageChromaFromLuma,        // ComputeCmapTile
+  // FindBest16x16Transform and FindBest32x32Transform.
+  kStageAcStrategy,
+  kStageWriteACGroup,
+  kStageWriteDCGroup,
+  // Entropy code optimization and writing of the buffered tokens.
+  kStageOptimizeSections,
+  // Writing of the TOC and of the sections to the output.
+  kStageCombineSections,
+  kNumEncodeStages,
+};
+
+const char* EncodeStageName(size_t stage);
+
+// Time spent and number of calls of each stage.
+struct StageTimes {
+  double seconds[kNumEncodeStages] = {};
+  uint64_t calls[kNumEncodeStages] = {};
+
+  void Add(const StageTimes& other) {
+    for (size_t i = 0; i < kNumEncodeStages; ++i) {
+      seconds[i] += other.seconds[i];
+      calls[i] += other.calls[i];
+    }
+  }
+};
+
+// Adds the time until it goes out of scope to *times, if times is not null.
+// Each thread has its own StageTimes, so no synchronization is needed.
+class StageTimer {
+ public:
+#if JXL_ENABLE_STAGE_TIMING
+  StageTimer(StageTimes* times, EncodeStage stage)
+      : times_(times), stage_(stage) {
+    if (times_) start_ = std::chrono::steady_clock::now();
+  }
+  ~StageTimer() {
+    if (!times_) return;
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    times_->seconds[stage_] += elapsed.count();
+    ++times_->calls[stage_];
+  }
+#else
+  StageTimer(StageTimes* times, EncodeStage stage) {}
+#endif  // JXL_ENABLE_STAGE_TIMING
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+#if JXL_ENABLE_STAGE_TIMING
+  StageTimes* times_;
+  EncodeStage stage_;
+  std::chrono::steady_clock::time_point start_;
+#endif  // JXL_ENABLE_STAGE_TIMING
+};
+
+// Apart from the stage times, the stats are computed from data that the
+// encoder has anyway, once per token or per block, so that they can also be
+// collected in production.
+struct EncodeStats {
+  // Summed over all threads, so with several threads the total can exceed the
+  // wall time of the encode.
+  StageTimes stage_times;
+  // Size in bits of each section, in the order of the DC global, the
+  // num_dc_groups DC group, the AC global and the AC group sections, before
+  // they are padded to whole bytes.
+  std::vector<size_t> section_bits;
+  size_t num_dc_groups = 0;
+  // Number of tokens written with each context of the DC and the AC entropy
+  // code, before the context map is applied.
+  std::vector<uint64_t> dc_token_counts;
+  std::vector<uint64_t> ac_token_counts;
+  // Number of transforms of each AcStrategy::Type.
+  uint64_t strategy_counts[AcStrategy::kNumValidStrategies] = {};
+  // Number of blocks with each raw quant field value.
+  uint64_t quant_field_histogram[256] = {};
+  // Number of color tiles with each YtoX and YtoB value, offset by 128.
+  uint64_t ytox_histogram[256] = {};
+  uint64_t ytob_histogram[256] = {};
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_ENC_STATS_H_
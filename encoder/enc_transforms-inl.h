@@ -12,6 +12,7 @@
 #endif
 
 #include <stddef.h>
+#include <string.h>
 
 #include <hwy/highway.h>
 
@@ -568,6 +569,175 @@ struct ComputeScaledIDCT {
   }
 };
 
+#ifndef JXL_GENERIC_DCT8
+// If set to 1, the DCT8 of the blocks is computed by ComputeScaledDCT like the
+// other transforms, instead of by DCT8x8Codelet. Both give the same
+// coefficients up to rounding, the generic one is the reference.
+#define JXL_GENERIC_DCT8 0
+#endif  // JXL_GENERIC_DCT8
+
+// Fully unrolled DCT1DImpl<8, SZ> on the lanes of v0 to v7, without the
+// 1 / 8 scaling.
+template <class D, class V>
+HWY_INLINE void DCT8Vectors(D d, V& v0, V& v1, V& v2, V& v3, V& v4, V& v5,
+                            V& v6, V& v7) {
+  // Even part: DCT4 of the sums of mirrored inputs.
+  const V a0 = Add(v0, v7);
+  const V a1 = Add(v1, v6);
+  const V a2 = Add(v2, v5);
+  const V a3 = Add(v3, v4);
+  const V p0 = Add(a0, a3);
+  const V p1 = Add(a1, a2);
+  const V r0 = Mul(Sub(a0, a3), Set(d, WcMultipliers<4>::kMultipliers[0]));
+  const V r1 = Mul(Sub(a1, a2), Set(d, WcMultipliers<4>::kMultipliers[1]));
+  const V sqrt2 = Set(d, kSqrt2);
+  const V e0 = Add(p0, p1);
+  const V e2 = Sub(p0, p1);
+  const V e3 = Sub(r0, r1);
+  const V e1 = MulAdd(Add(r0, r1), sqrt2, e3);
+  // Odd part: DCT4 of the scaled differences of mirrored inputs.
+  const V b0 = Mul(Sub(v0, v7), Set(d, WcMultipliers<8>::kMultipliers[0]));
+  const V b1 = Mul(Sub(v1, v6), Set(d, WcMultipliers<8>::kMultipliers[1]));
+  const V b2 = Mul(Sub(v2, v5), Set(d, WcMultipliers<8>::kMultipliers[2]));
+  const V b3 = Mul(Sub(v3, v4), Set(d, WcMultipliers<8>::kMultipliers[3]));
+  const V q0 = Add(b0, b3);
+  const V q1 = Add(b1, b2);
+  const V s0 = Mul(Sub(b0, b3), Set(d, WcMultipliers<4>::kMultipliers[0]));
+  const V s1 = Mul(Sub(b1, b2), Set(d, WcMultipliers<4>::kMultipliers[1]));
+  const V f0 = Add(q0, q1);
+  const V f2 = Sub(q0, q1);
+  const V f3 = Sub(s0, s1);
+  const V f1 = MulAdd(Add(s0, s1), sqrt2, f3);
+  v0 = e0;
+  v1 = MulAdd(f0, sqrt2, f1);
+  v2 = e1;
+  v3 = Add(f1, f2);
+  v4 = e2;
+  v5 = Add(f2, f3);
+  v6 = e3;
+  v7 = f3;
+}
+
+#if HWY_TARGET != HWY_SCALAR
+// In-register transpose of the 4x4 block of rows v0 to v3.
+template <class D, class V>
+HWY_INLINE void Transpose4x4(D d, V& v0, V& v1, V& v2, V& v3) {
+  const V q0 = InterleaveLower(d, v0, v2);
+  const V q1 = InterleaveLower(d, v1, v3);
+  const V q2 = InterleaveUpper(d, v0, v2);
+  const V q3 = InterleaveUpper(d, v1, v3);
+  v0 = InterleaveLower(d, q0, q1);
+  v1 = InterleaveUpper(d, q0, q1);
+  v2 = InterleaveLower(d, q2, q3);
+  v3 = InterleaveUpper(d, q2, q3);
+}
+#endif
+
+#if HWY_CAP_GE256
+// Same as ComputeScaledDCT<8, 8>, with the whole block kept in one 8-lane
+// vector per row: the columns are transformed, transposed in registers and
+// transformed again, and both 1 / 8 scalings are applied at the store.
+template <class From>
+HWY_INLINE void DCT8x8Codelet(const From& from, float* JXL_RESTRICT to) {
+  const BlockDesc<8> d;
+  auto v0 = from.LoadPart(d, 0, 0);
+  auto v1 = from.LoadPart(d, 1, 0);
+  auto v2 = from.LoadPart(d, 2, 0);
+  auto v3 = from.LoadPart(d, 3, 0);
+  auto v4 = from.LoadPart(d, 4, 0);
+  auto v5 = from.LoadPart(d, 5, 0);
+  auto v6 = from.LoadPart(d, 6, 0);
+  auto v7 = from.LoadPart(d, 7, 0);
+  DCT8Vectors(d, v0, v1, v2, v3, v4, v5, v6, v7);
+  // Same shuffles as GenericTransposeBlock.
+  const auto q0 = InterleaveLower(d, v0, v2);
+  const auto q1 = InterleaveLower(d, v1, v3);
+  const auto q2 = InterleaveUpper(d, v0, v2);
+  const auto q3 = InterleaveUpper(d, v1, v3);
+  const auto q4 = InterleaveLower(d, v4, v6);
+  const auto q5 = InterleaveLower(d, v5, v7);
+  const auto q6 = InterleaveUpper(d, v4, v6);
+  const auto q7 = InterleaveUpper(d, v5, v7);
+  const auto r0 = InterleaveLower(d, q0, q1);
+  const auto r1 = InterleaveUpper(d, q0, q1);
+  const auto r2 = InterleaveLower(d, q2, q3);
+  const auto r3 = InterleaveUpper(d, q2, q3);
+  const auto r4 = InterleaveLower(d, q4, q5);
+  const auto r5 = InterleaveUpper(d, q4, q5);
+  const auto r6 = InterleaveLower(d, q6, q7);
+  const auto r7 = InterleaveUpper(d, q6, q7);
+  v0 = ConcatLowerLower(d, r4, r0);
+  v1 = ConcatLowerLower(d, r5, r1);
+  v2 = ConcatLowerLower(d, r6, r2);
+  v3 = ConcatLowerLower(d, r7, r3);
+  v4 = ConcatUpperUpper(d, r4, r0);
+  v5 = ConcatUpperUpper(d, r5, r1);
+  v6 = ConcatUpperUpper(d, r6, r2);
+  v7 = ConcatUpperUpper(d, r7, r3);
+  DCT8Vectors(d, v0, v1, v2, v3, v4, v5, v6, v7);
+  const auto scale = Set(d, 1.0f / kDCTBlockSize);
+  Store(Mul(v0, scale), d, to + 0 * kBlockDim);
+  Store(Mul(v1, scale), d, to + 1 * kBlockDim);
+  Store(Mul(v2, scale), d, to + 2 * kBlockDim);
+  Store(Mul(v3, scale), d, to + 3 * kBlockDim);
+  Store(Mul(v4, scale), d, to + 4 * kBlockDim);
+  Store(Mul(v5, scale), d, to + 5 * kBlockDim);
+  Store(Mul(v6, scale), d, to + 6 * kBlockDim);
+  Store(Mul(v7, scale), d, to + 7 * kBlockDim);
+}
+#elif HWY_TARGET != HWY_SCALAR
+// Same as above with 4-lane vectors, each row of the block is in a pair of
+// vectors, l for the left half and h for the right half.
+template <class From>
+HWY_INLINE void DCT8x8Codelet(const From& from, float* JXL_RESTRICT to) {
+  const BlockDesc<4> d;
+  auto l0 = from.LoadPart(d, 0, 0);
+  auto l1 = from.LoadPart(d, 1, 0);
+  auto l2 = from.LoadPart(d, 2, 0);
+  auto l3 = from.LoadPart(d, 3, 0);
+  auto l4 = from.LoadPart(d, 4, 0);
+  auto l5 = from.LoadPart(d, 5, 0);
+  auto l6 = from.LoadPart(d, 6, 0);
+  auto l7 = from.LoadPart(d, 7, 0);
+  auto h0 = from.LoadPart(d, 0, 4);
+  auto h1 = from.LoadPart(d, 1, 4);
+  auto h2 = from.LoadPart(d, 2, 4);
+  auto h3 = from.LoadPart(d, 3, 4);
+  auto h4 = from.LoadPart(d, 4, 4);
+  auto h5 = from.LoadPart(d, 5, 4);
+  auto h6 = from.LoadPart(d, 6, 4);
+  auto h7 = from.LoadPart(d, 7, 4);
+  DCT8Vectors(d, l0, l1, l2, l3, l4, l5, l6, l7);
+  DCT8Vectors(d, h0, h1, h2, h3, h4, h5, h6, h7);
+  // Transposes each 4x4 quarter, and swaps the top right and bottom left
+  // ones: the rows 0 to 3 of the result are the transposed l0 to l3 and
+  // l4 to l7, the rows 4 to 7 are the transposed h0 to h3 and h4 to h7.
+  Transpose4x4(d, l0, l1, l2, l3);
+  Transpose4x4(d, l4, l5, l6, l7);
+  Transpose4x4(d, h0, h1, h2, h3);
+  Transpose4x4(d, h4, h5, h6, h7);
+  DCT8Vectors(d, l0, l1, l2, l3, h0, h1, h2, h3);
+  DCT8Vectors(d, l4, l5, l6, l7, h4, h5, h6, h7);
+  const auto scale = Set(d, 1.0f / kDCTBlockSize);
+  Store(Mul(l0, scale), d, to + 0 * kBlockDim);
+  Store(Mul(l4, scale), d, to + 0 * kBlockDim + 4);
+  Store(Mul(l1, scale), d, to + 1 * kBlockDim);
+  Store(Mul(l5, scale), d, to + 1 * kBlockDim + 4);
+  Store(Mul(l2, scale), d, to + 2 * kBlockDim);
+  Store(Mul(l6, scale), d, to + 2 * kBlockDim + 4);
+  Store(Mul(l3, scale), d, to + 3 * kBlockDim);
+  Store(Mul(l7, scale), d, to + 3 * kBlockDim + 4);
+  Store(Mul(h0, scale), d, to + 4 * kBlockDim);
+  Store(Mul(h4, scale), d, to + 4 * kBlockDim + 4);
+  Store(Mul(h1, scale), d, to + 5 * kBlockDim);
+  Store(Mul(h5, scale), d, to + 5 * kBlockDim + 4);
+  Store(Mul(h2, scale), d, to + 6 * kBlockDim);
+  Store(Mul(h6, scale), d, to + 6 * kBlockDim + 4);
+  Store(Mul(h3, scale), d, to + 7 * kBlockDim);
+  Store(Mul(h7, scale), d, to + 7 * kBlockDim + 4);
+}
+#endif
+
 // Inverse of ReinterpretingDCT.
 template <size_t DCT_ROWS, size_t DCT_COLS, size_t LF_ROWS, size_t LF_COLS,
           size_t ROWS, size_t COLS>
@@ -617,10 +787,70 @@ HWY_MAYBE_UNUSED void TransformFromPixels(const AcStrategy::Type strategy,
       break;
     }
     case Type::DCT: {
+#if !JXL_GENERIC_DCT8 && HWY_TARGET != HWY_SCALAR
+      DCT8x8Codelet(DCTFrom(pixels, pixels_stride), coefficients);
+#else
       ComputeScaledDCT<8, 8>()(DCTFrom(pixels, pixels_stride), coefficients,
                                scratch_space);
+#endif
       break;
     }
+    case Type::DCT32X32: {
+      ComputeScaledDCT<32, 32>()(DCTFrom(pixels, pixels_stride), coefficients,
+                                 scratch_space);
+      break;
+    }
+    case Type::kNumValidStrategies:
+      JXL_ABORT("Invalid strategy");
+  }
+}
+
+// Computes the ROWS x COLS block of coefficients of TransformFromPixels from
+// the ROWS / 2 x COLS / 2 block of 2x downsampled pixels: the lowest quarter
+// of the frequencies are the rescaled coefficients of the half size DCT, and
+// the other coefficients are zero.
+template <size_t ROWS, size_t COLS>
+HWY_INLINE void HalfSizeDCT(const float* JXL_RESTRICT pixels,
+                            size_t pixels_stride,
+                            float* JXL_RESTRICT coefficients,
+                            float* JXL_RESTRICT scratch_space) {
+  // Both layouts have the smaller dimension as rows.
+  constexpr size_t kRows = ROWS < COLS ? ROWS : COLS;
+  constexpr size_t kCols = ROWS < COLS ? COLS : ROWS;
+  HWY_ALIGN float half[kRows * kCols / 4];
+  ComputeScaledDCT<ROWS / 2, COLS / 2>()(DCTFrom(pixels, pixels_stride), half,
+                                         scratch_space);
+  memset(coefficients, 0, kRows * kCols * sizeof(float));
+  for (size_t y = 0; y < kRows / 2; ++y) {
+    for (size_t x = 0; x < kCols / 2; ++x) {
+      coefficients[y * kCols + x] =
+          half[y * kCols / 2 + x] *
+          DCTTotalResampleScale<kRows / 2, kRows>(y) *
+          DCTTotalResampleScale<kCols / 2, kCols>(x);
+    }
+  }
+}
+
+// Same as TransformFromPixels, but from the 2x downsampled pixels of the
+// block, see HalfSizeDCT.
+HWY_MAYBE_UNUSED void TransformFromHalfPixels(
+    const AcStrategy::Type strategy, const float* JXL_RESTRICT pixels,
+    size_t pixels_stride, float* JXL_RESTRICT coefficients,
+    float* JXL_RESTRICT scratch_space) {
+  using Type = AcStrategy::Type;
+  switch (strategy) {
+    case Type::DCT16X8:
+      HalfSizeDCT<16, 8>(pixels, pixels_stride, coefficients, scratch_space);
+      break;
+    case Type::DCT8X16:
+      HalfSizeDCT<8, 16>(pixels, pixels_stride, coefficients, scratch_space);
+      break;
+    case Type::DCT:
+      HalfSizeDCT<8, 8>(pixels, pixels_stride, coefficients, scratch_space);
+      break;
+    case Type::DCT32X32:
+      HalfSizeDCT<32, 32>(pixels, pixels_stride, coefficients, scratch_space);
+      break;
     case Type::kNumValidStrategies:
       JXL_ABORT("Invalid strategy");
   }
@@ -646,6 +876,12 @@ HWY_MAYBE_UNUSED void DCFromLowestFrequencies(const AcStrategy::Type strategy,
     case Type::DCT:
       dc[0] = block[0];
       break;
+    case Type::DCT32X32: {
+      ReinterpretingIDCT</*DCT_ROWS=*/4 * kBlockDim, /*DCT_COLS=*/4 * kBlockDim,
+                         /*LF_ROWS=*/4, /*LF_COLS=*/4, /*ROWS=*/4,
+                         /*COLS=*/4>(block, 4 * kBlockDim, dc, dc_stride);
+      break;
+    }
     case Type::kNumValidStrategies:
       JXL_ABORT("Invalid strategy");
   }
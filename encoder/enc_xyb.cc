@@ -6,14 +6,20 @@
 
 #include "encoder/enc_xyb.h"
 
+#include <stdint.h>
+#include <string.h>
+
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "encoder/enc_xyb.cc"
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "encoder/base/byte_order.h"
 #include "encoder/base/compiler_specific.h"
+#include "encoder/common.h"
 #include "encoder/fast_math-inl.h"
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -21,9 +27,23 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::AndNot;
+using hwy::HWY_NAMESPACE::ConvertTo;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::LoadInterleaved3;
+using hwy::HWY_NAMESPACE::LoadInterleaved4;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Or;
+using hwy::HWY_NAMESPACE::PromoteTo;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::RebindToUnsigned;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Zero;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
 // Parameters for opsin absorbance.
@@ -39,23 +59,51 @@ static const float kM22 = 1.0f - kM20 - kM21;
 static const float kOpsinAbsorbanceBias = 0.0037930732552754493f;
 static constexpr float kNegBiasCbrt = -0.15595420054f;
 
+// Pre-broadcasted constants of the opsin transform.
+template <class D>
+struct OpsinConstants {
+  explicit OpsinConstants(D d)
+      : half(Set(d, 0.5f)),
+        bias(Set(d, kOpsinAbsorbanceBias)),
+        neg_bias_cbrt(Set(d, kNegBiasCbrt)),
+        m00(Set(d, kM00)),
+        m01(Set(d, kM01)),
+        m02(Set(d, kM02)),
+        m10(Set(d, kM10)),
+        m11(Set(d, kM11)),
+        m12(Set(d, kM12)),
+        m20(Set(d, kM20)),
+        m21(Set(d, kM21)),
+        m22(Set(d, kM22)) {}
+  using V = decltype(Zero(D()));
+  V half, bias, neg_bias_cbrt;
+  V m00, m01, m02, m10, m11, m12, m20, m21, m22;
+};
+
+template <class D, class V>
+HWY_INLINE void LinearToXYB(const OpsinConstants<D>& k, const V r, const V g,
+                            const V b, V* HWY_RESTRICT x, V* HWY_RESTRICT y,
+                            V* HWY_RESTRICT b_out) {
+  const auto mixed0 =
+      MulAdd(k.m00, r, MulAdd(k.m01, g, MulAdd(k.m02, b, k.bias)));
+  const auto mixed1 =
+      MulAdd(k.m10, r, MulAdd(k.m11, g, MulAdd(k.m12, b, k.bias)));
+  const auto mixed2 =
+      MulAdd(k.m20, r, MulAdd(k.m21, g, MulAdd(k.m22, b, k.bias)));
+  // mixed* should be non-negative even for wide-gamut, so clamp to zero.
+  const auto tm0 = CubeRootAndAdd(ZeroIfNegative(mixed0), k.neg_bias_cbrt);
+  const auto tm1 = CubeRootAndAdd(ZeroIfNegative(mixed1), k.neg_bias_cbrt);
+  const auto tm2 = CubeRootAndAdd(ZeroIfNegative(mixed2), k.neg_bias_cbrt);
+  *x = Mul(k.half, Sub(tm0, tm1));
+  *y = Mul(k.half, Add(tm0, tm1));
+  *b_out = tm2;
+}
+
 // This is different from Butteraugli's OpsinDynamicsImage() in the sense that
 // it does not contain a sensitivity multiplier based on the blurred image.
 void ToXYB(Image3F* image) {
   const HWY_FULL(float) d;
-  // Pre-broadcasted constants
-  const auto half = Set(d, 0.5f);
-  const auto bias = Set(d, kOpsinAbsorbanceBias);
-  const auto neg_bias_cbrt = Set(d, kNegBiasCbrt);
-  const auto m00 = Set(d, kM00);
-  const auto m01 = Set(d, kM01);
-  const auto m02 = Set(d, kM02);
-  const auto m10 = Set(d, kM10);
-  const auto m11 = Set(d, kM11);
-  const auto m12 = Set(d, kM12);
-  const auto m20 = Set(d, kM20);
-  const auto m21 = Set(d, kM21);
-  const auto m22 = Set(d, kM22);
+  const OpsinConstants<decltype(d)> k(d);
   const size_t xsize = image->xsize();
   const size_t ysize = image->ysize();
   for (size_t y = 0; y < ysize; ++y) {
@@ -66,16 +114,292 @@ void ToXYB(Image3F* image) {
       const auto r = Load(d, row0 + x);
       const auto g = Load(d, row1 + x);
       const auto b = Load(d, row2 + x);
-      const auto mixed0 = MulAdd(m00, r, MulAdd(m01, g, MulAdd(m02, b, bias)));
-      const auto mixed1 = MulAdd(m10, r, MulAdd(m11, g, MulAdd(m12, b, bias)));
-      const auto mixed2 = MulAdd(m20, r, MulAdd(m21, g, MulAdd(m22, b, bias)));
-      // mixed* should be non-negative even for wide-gamut, so clamp to zero.
-      const auto tm0 = CubeRootAndAdd(ZeroIfNegative(mixed0), neg_bias_cbrt);
-      const auto tm1 = CubeRootAndAdd(ZeroIfNegative(mixed1), neg_bias_cbrt);
-      const auto tm2 = CubeRootAndAdd(ZeroIfNegative(mixed2), neg_bias_cbrt);
-      Store(Mul(half, Sub(tm0, tm1)), d, row0 + x);
-      Store(Mul(half, Add(tm0, tm1)), d, row1 + x);
-      Store(tm2, d, row2 + x);
+      decltype(Zero(d)) out0, out1, out2;
+      LinearToXYB(k, r, g, b, &out0, &out1, &out2);
+      Store(out0, d, row0 + x);
+      Store(out1, d, row1 + x);
+      Store(out2, d, row2 + x);
+    }
+  }
+}
+
+// Inverse of ToXYB, except that the negative values of the opsin absorbance
+// that ToXYB clamps to zero are not restored.
+void XYBToLinear(Image3F* image) {
+  const HWY_FULL(float) d;
+  const OpsinConstants<decltype(d)> k(d);
+  // Inverse of the opsin absorbance matrix, by the cofactors.
+  const float m[9] = {kM00, kM01, kM02, kM10, kM11, kM12, kM20, kM21, kM22};
+  const float c00 = m[4] * m[8] - m[5] * m[7];
+  const float c01 = m[5] * m[6] - m[3] * m[8];
+  const float c02 = m[3] * m[7] - m[4] * m[6];
+  const float inv_det = 1.0f / (m[0] * c00 + m[1] * c01 + m[2] * c02);
+  const float inv[9] = {
+      c00 * inv_det,
+      (m[2] * m[7] - m[1] * m[8]) * inv_det,
+      (m[1] * m[5] - m[2] * m[4]) * inv_det,
+      c01 * inv_det,
+      (m[0] * m[8] - m[2] * m[6]) * inv_det,
+      (m[2] * m[3] - m[0] * m[5]) * inv_det,
+      c02 * inv_det,
+      (m[1] * m[6] - m[0] * m[7]) * inv_det,
+      (m[0] * m[4] - m[1] * m[3]) * inv_det,
+  };
+  const size_t xsize = image->xsize();
+  const size_t ysize = image->ysize();
+  for (size_t y = 0; y < ysize; ++y) {
+    float* JXL_RESTRICT row0 = image->PlaneRow(0, y);
+    float* JXL_RESTRICT row1 = image->PlaneRow(1, y);
+    float* JXL_RESTRICT row2 = image->PlaneRow(2, y);
+    for (size_t x = 0; x < xsize; x += Lanes(d)) {
+      const auto vx = Load(d, row0 + x);
+      const auto vy = Load(d, row1 + x);
+      const auto tm0 = Sub(Add(vy, vx), k.neg_bias_cbrt);
+      const auto tm1 = Sub(Sub(vy, vx), k.neg_bias_cbrt);
+      const auto tm2 = Sub(Load(d, row2 + x), k.neg_bias_cbrt);
+      const auto mixed0 = Sub(Mul(Mul(tm0, tm0), tm0), k.bias);
+      const auto mixed1 = Sub(Mul(Mul(tm1, tm1), tm1), k.bias);
+      const auto mixed2 = Sub(Mul(Mul(tm2, tm2), tm2), k.bias);
+      float* JXL_RESTRICT rows[3] = {row0, row1, row2};
+      for (size_t c = 0; c < 3; ++c) {
+        const auto out = MulAdd(
+            Set(d, inv[3 * c]), mixed0,
+            MulAdd(Set(d, inv[3 * c + 1]), mixed1,
+                   Mul(Set(d, inv[3 * c + 2]), mixed2)));
+        Store(out, d, rows[c] + x);
+      }
+    }
+  }
+}
+
+void CopyPadToXYB(const Image3F& linear, const Rect& rect, Image3F* xyb) {
+  const HWY_FULL(float) d;
+  const OpsinConstants<decltype(d)> k(d);
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
+  const size_t xsize_padded = DivCeil(xsize, kBlockDim) * kBlockDim;
+  const size_t ysize_padded = DivCeil(ysize, kBlockDim) * kBlockDim;
+  xyb->ShrinkTo(xsize_padded, ysize_padded);
+  for (size_t y = 0; y < ysize; ++y) {
+    const float* JXL_RESTRICT row_in0 = rect.ConstPlaneRow(linear, 0, y);
+    const float* JXL_RESTRICT row_in1 = rect.ConstPlaneRow(linear, 1, y);
+    const float* JXL_RESTRICT row_in2 = rect.ConstPlaneRow(linear, 2, y);
+    float* JXL_RESTRICT row0 = xyb->PlaneRow(0, y);
+    float* JXL_RESTRICT row1 = xyb->PlaneRow(1, y);
+    float* JXL_RESTRICT row2 = xyb->PlaneRow(2, y);
+    // The rows of the input may be read up to a vector past the last valid
+    // value, the extra lanes are overwritten by the padding below.
+    for (size_t x = 0; x < xsize; x += Lanes(d)) {
+      const auto r = LoadU(d, row_in0 + x);
+      const auto g = LoadU(d, row_in1 + x);
+      const auto b = LoadU(d, row_in2 + x);
+      decltype(Zero(d)) out0, out1, out2;
+      LinearToXYB(k, r, g, b, &out0, &out1, &out2);
+      Store(out0, d, row0 + x);
+      Store(out1, d, row1 + x);
+      Store(out2, d, row2 + x);
+    }
+    // The transform is pointwise, so replicating the last XYB value is the
+    // same as converting the replicated linear value.
+    float* rows[3] = {row0, row1, row2};
+    for (size_t c = 0; c < 3; ++c) {
+      const float last_val = rows[c][xsize - 1];
+      for (size_t x = xsize; x < xsize_padded; ++x) {
+        rows[c][x] = last_val;
+      }
+    }
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    const float* last_row = xyb->ConstPlaneRow(c, ysize - 1);
+    for (size_t y = ysize; y < ysize_padded; ++y) {
+      memcpy(xyb->PlaneRow(c, y), last_row, xsize_padded * sizeof(float));
+    }
+  }
+}
+
+// Inverse of the sRGB transfer function, extended to negative values by
+// symmetry. Max relative error of the rational polynomial is ~5E-7.
+template <class D, class V>
+HWY_INLINE V SRGBToLinear(const D d, V x) {
+  const Rebind<uint32_t, D> du;
+  const V kSign = BitCast(d, Set(du, 0x80000000u));
+  const V original_sign = And(x, kSign);
+  x = AndNot(kSign, x);  // abs
+  HWY_ALIGN const float p[(4 + 1) * 4] = {
+      HWY_REP4(2.200248328e-04f), HWY_REP4(1.043637593e-02f),
+      HWY_REP4(1.624820318e-01f), HWY_REP4(7.961564959e-01f),
+      HWY_REP4(8.210152774e-01f),
+  };
+  HWY_ALIGN const float q[(4 + 1) * 4] = {
+      HWY_REP4(2.631846970e-01f),  HWY_REP4(1.076976492e+00f),
+      HWY_REP4(4.987528350e-01f),  HWY_REP4(-5.512498495e-02f),
+      HWY_REP4(6.521209011e-03f),
+  };
+  const V linear = Mul(x, Set(d, 1.0f / 12.92f));
+  const V poly = EvalRationalPolynomial(d, x, p, q);
+  const V magnitude = IfThenElse(Gt(x, Set(d, 0.04045f)), poly, linear);
+  return Or(AndNot(kSign, magnitude), original_sign);
+}
+
+HWY_INLINE uint8_t BSwapSample(uint8_t v) { return v; }
+HWY_INLINE uint16_t BSwapSample(uint16_t v) { return JXL_BSWAP16(v); }
+HWY_INLINE float BSwapSample(float v) { return BSwapFloat(v); }
+
+// Loads Lanes(d) pixels of kChannels interleaved samples, without the alpha
+// channel, if any.
+template <size_t kChannels, class D, typename T, class V>
+HWY_INLINE void LoadPixels(D d, const T* JXL_RESTRICT in, V* v0, V* v1,
+                           V* v2) {
+  if (kChannels == 4) {
+    V alpha;
+    LoadInterleaved4(d, in, *v0, *v1, *v2, alpha);
+  } else {
+    LoadInterleaved3(d, in, *v0, *v1, *v2);
+  }
+}
+
+// Converts the samples of v, which has as many lanes as df, to float, after
+// swapping their bytes if kSwap.
+template <bool kSwap, class DF, class V>
+HWY_INLINE decltype(Zero(DF())) SamplesToFloat(DF df, const uint8_t* /*tag*/,
+                                               V v) {
+  const Rebind<int32_t, DF> di;
+  return ConvertTo(df, PromoteTo(di, v));
+}
+
+template <bool kSwap, class DF, class V>
+HWY_INLINE decltype(Zero(DF())) SamplesToFloat(DF df, const uint16_t* /*tag*/,
+                                               V v) {
+  const Rebind<int32_t, DF> di;
+  if (kSwap) v = Or(ShiftLeft<8>(v), ShiftRight<8>(v));
+  return ConvertTo(df, PromoteTo(di, v));
+}
+
+template <bool kSwap, class DF, class V>
+HWY_INLINE V SamplesToFloat(DF df, const float* /*tag*/, V v) {
+  if (!kSwap) return v;
+  const RebindToUnsigned<DF> du;
+  const auto u = BitCast(du, v);
+  const auto outer = Or(ShiftLeft<24>(u), ShiftRight<24>(u));
+  const auto inner = Or(And(ShiftLeft<8>(u), Set(du, 0xFF0000u)),
+                        And(ShiftRight<8>(u), Set(du, 0xFF00u)));
+  return BitCast(df, Or(outer, inner));
+}
+
+// Splits xsize pixels of kChannels interleaved samples of type T into the
+// first three planes, scaled by mul. The alpha channel, if any, is skipped.
+template <typename T, size_t kChannels, bool kSwap>
+void DeinterleaveRow(const uint8_t* JXL_RESTRICT row_in, size_t xsize,
+                     float mul, float* JXL_RESTRICT row0,
+                     float* JXL_RESTRICT row1, float* JXL_RESTRICT row2) {
+  const HWY_FULL(float) df;
+  const Rebind<T, decltype(df)> dt;
+  const auto vmul = Set(df, mul);
+  const T* JXL_RESTRICT in = reinterpret_cast<const T*>(row_in);
+  size_t x = 0;
+  // The vector loads need samples that are aligned to sizeof(T), which they
+  // are unless the caller passed an odd pointer or stride.
+  if (reinterpret_cast<uintptr_t>(row_in) % sizeof(T) == 0) {
+    for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+      decltype(Zero(dt)) v0, v1, v2;
+      LoadPixels<kChannels>(dt, in + x * kChannels, &v0, &v1, &v2);
+      Store(Mul(SamplesToFloat<kSwap>(df, in, v0), vmul), df, row0 + x);
+      Store(Mul(SamplesToFloat<kSwap>(df, in, v1), vmul), df, row1 + x);
+      Store(Mul(SamplesToFloat<kSwap>(df, in, v2), vmul), df, row2 + x);
+    }
+  }
+  for (; x < xsize; ++x) {
+    // The samples may not be aligned to sizeof(T).
+    T samples[3];
+    memcpy(samples, row_in + x * kChannels * sizeof(T), sizeof(samples));
+    if (kSwap) {
+      for (size_t c = 0; c < 3; ++c) samples[c] = BSwapSample(samples[c]);
+    }
+    row0[x] = samples[0] * mul;
+    row1[x] = samples[1] * mul;
+    row2[x] = samples[2] * mul;
+  }
+}
+
+template <typename T>
+void DeinterleaveRow(const InterleavedImage& image,
+                     const uint8_t* JXL_RESTRICT row_in, size_t xsize,
+                     float mul, float* JXL_RESTRICT row0,
+                     float* JXL_RESTRICT row1, float* JXL_RESTRICT row2) {
+  const bool swap = image.NeedsByteSwap();
+  if (image.num_channels == 4) {
+    if (swap) {
+      DeinterleaveRow<T, 4, true>(row_in, xsize, mul, row0, row1, row2);
+    } else {
+      DeinterleaveRow<T, 4, false>(row_in, xsize, mul, row0, row1, row2);
+    }
+  } else {
+    if (swap) {
+      DeinterleaveRow<T, 3, true>(row_in, xsize, mul, row0, row1, row2);
+    } else {
+      DeinterleaveRow<T, 3, false>(row_in, xsize, mul, row0, row1, row2);
+    }
+  }
+}
+
+void InterleavedToXYB(const InterleavedImage& image, const Rect& rect,
+                      Image3F* xyb) {
+  const HWY_FULL(float) d;
+  const OpsinConstants<decltype(d)> k(d);
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
+  const size_t xsize_padded = DivCeil(xsize, kBlockDim) * kBlockDim;
+  const size_t ysize_padded = DivCeil(ysize, kBlockDim) * kBlockDim;
+  xyb->ShrinkTo(xsize_padded, ysize_padded);
+  const size_t x_offset = rect.x0() * image.BytesPerPixel();
+  for (size_t y = 0; y < ysize; ++y) {
+    const uint8_t* row_in = image.ConstRow(rect.y0() + y) + x_offset;
+    float* JXL_RESTRICT row0 = xyb->PlaneRow(0, y);
+    float* JXL_RESTRICT row1 = xyb->PlaneRow(1, y);
+    float* JXL_RESTRICT row2 = xyb->PlaneRow(2, y);
+    // The samples are first converted to float planes in the output rows,
+    // then transformed in place while the row is still in L1.
+    switch (image.type) {
+      case SampleType::kUint8:
+        DeinterleaveRow<uint8_t>(image, row_in, xsize, 1.0f / 255, row0, row1,
+                                 row2);
+        break;
+      case SampleType::kUint16:
+        DeinterleaveRow<uint16_t>(image, row_in, xsize, 1.0f / 65535, row0,
+                                  row1, row2);
+        break;
+      case SampleType::kFloat:
+        DeinterleaveRow<float>(image, row_in, xsize, 1.0f, row0, row1, row2);
+        break;
+    }
+    // Padding the row before the transform makes it cover the whole vectors.
+    float* rows[3] = {row0, row1, row2};
+    for (size_t c = 0; c < 3; ++c) {
+      const float last_val = rows[c][xsize - 1];
+      for (size_t x = xsize; x < xsize_padded; ++x) {
+        rows[c][x] = last_val;
+      }
+    }
+    for (size_t x = 0; x < xsize_padded; x += Lanes(d)) {
+      auto r = Load(d, row0 + x);
+      auto g = Load(d, row1 + x);
+      auto b = Load(d, row2 + x);
+      if (image.is_srgb) {
+        r = SRGBToLinear(d, r);
+        g = SRGBToLinear(d, g);
+        b = SRGBToLinear(d, b);
+      }
+      decltype(Zero(d)) out0, out1, out2;
+      LinearToXYB(k, r, g, b, &out0, &out1, &out2);
+      Store(out0, d, row0 + x);
+      Store(out1, d, row1 + x);
+      Store(out2, d, row2 + x);
+    }
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    const float* last_row = xyb->ConstPlaneRow(c, ysize - 1);
+    for (size_t y = ysize; y < ysize_padded; ++y) {
+      memcpy(xyb->PlaneRow(c, y), last_row, xsize_padded * sizeof(float));
     }
   }
 }
@@ -89,5 +413,21 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 HWY_EXPORT(ToXYB);
 void ToXYB(Image3F* image) { return HWY_DYNAMIC_DISPATCH(ToXYB)(image); }
+
+HWY_EXPORT(XYBToLinear);
+void XYBToLinear(Image3F* image) {
+  return HWY_DYNAMIC_DISPATCH(XYBToLinear)(image);
+}
+
+HWY_EXPORT(CopyPadToXYB);
+void CopyPadToXYB(const Image3F& linear, const Rect& rect, Image3F* xyb) {
+  return HWY_DYNAMIC_DISPATCH(CopyPadToXYB)(linear, rect, xyb);
+}
+
+HWY_EXPORT(InterleavedToXYB);
+void InterleavedToXYB(const InterleavedImage& image, const Rect& rect,
+                      Image3F* xyb) {
+  return HWY_DYNAMIC_DISPATCH(InterleavedToXYB)(image, rect, xyb);
+}
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -8,12 +8,26 @@
 #define ENCODER_ENC_XYB_H_
 
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
 
 namespace jxl {
 
 // Converts linear SRGB to XYB in place.
 void ToXYB(Image3F* image);
 
+// Converts XYB back to linear SRGB in place.
+void XYBToLinear(Image3F* image);
+
+// Converts `rect` of the linear SRGB image to XYB into *xyb in one pass, and
+// pads it to whole blocks by replicating the last column and row. This is
+// equivalent to copying and padding the rect first and then calling ToXYB.
+void CopyPadToXYB(const Image3F& linear, const Rect& rect, Image3F* xyb);
+
+// Same as CopyPadToXYB, but `rect` is taken from an interleaved image, which
+// is deinterleaved and converted to linear float on the fly.
+void InterleavedToXYB(const InterleavedImage& image, const Rect& rect,
+                      Image3F* xyb);
+
 }  // namespace jxl
 
 #endif  // ENCODER_ENC_XYB_H_
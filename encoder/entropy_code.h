@@ -7,6 +7,7 @@
 #ifndef ENCODER_ENTROPY_CODE_H_
 #define ENCODER_ENTROPY_CODE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -38,6 +39,19 @@ struct EntropyCode {
   // Original context map, in case the contexts were clustered.
   const uint8_t* orig_context_map = nullptr;
   size_t orig_num_contexts = 0;
+  // The bits of each symbol of each prefix code in the low 16 bits and its
+  // depth above them, kAlphabetSize entries per prefix code, see
+  // PackPrefixCodes. Empty until the prefix codes are known.
+  std::vector<uint32_t> packed_codes;
+  // Whether the tokens are written with ANS instead of the prefix codes, which
+  // then only serve as an estimate of the token costs. The distributions of
+  // the prefix codes have kAlphabetSize counts each, summing to kANSTabSize,
+  // and for each symbol the start of its slots in the reverse map, which has
+  // kANSTabSize entries per prefix code, see BuildANSCodes.
+  bool use_ans = false;
+  std::vector<uint16_t> ans_counts;
+  std::vector<uint16_t> ans_slots;
+  std::vector<uint16_t> ans_reverse_map;
 };
 
 }  // namespace jxl
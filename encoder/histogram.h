@@ -7,6 +7,7 @@
 #ifndef ENCODER_HISTOGRAM_H_
 #define ENCODER_HISTOGRAM_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -14,6 +15,10 @@
 
 namespace jxl {
 
+// The counts are padded with zeros to a multiple of 16, so that they can be
+// processed with whole vectors.
+static constexpr size_t kPaddedAlphabetSize = (kAlphabetSize + 15) & ~15;
+
 struct Histogram {
   Histogram() { Clear(); }
   void Clear() {
@@ -30,9 +35,9 @@ struct Histogram {
     }
     total_count += other.total_count;
   }
-  uint32_t counts[kAlphabetSize];
+  uint32_t counts[kPaddedAlphabetSize];
   size_t total_count;
-  mutable size_t bit_cost;  // WARNING: not kept up-to-date.
+  mutable float entropy;  // WARNING: not kept up-to-date.
 };
 
 }  // namespace jxl
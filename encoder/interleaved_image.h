@@ -0,0 +1,68 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_INTERLEAVED_IMAGE_H_
+#define ENCODER_INTERLEAVED_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "encoder/base/byte_order.h"
+
+namespace jxl {
+
+// Type of the samples of an InterleavedImage.
+enum class SampleType {
+  kUint8,
+  kUint16,
+  kFloat,
+};
+
+// Byte order of the multi-byte samples of an InterleavedImage.
+enum class Endianness {
+  kNative,
+  kLittle,
+  kBig,
+};
+
+static inline size_t BytesPerSample(SampleType type) {
+  return type == SampleType::kUint8 ? 1 : type == SampleType::kUint16 ? 2 : 4;
+}
+
+// Non-owning view of an RGB or RGBA image with interleaved samples, as it is
+// typically produced by image decoders. Integer samples are scaled so that
+// their maximum value maps to 1.0, the alpha channel is ignored.
+struct InterleavedImage {
+  const void* pixels = nullptr;  // First sample of the top row.
+  size_t xsize = 0;
+  size_t ysize = 0;
+  // Distance in bytes between the start of two consecutive rows, can be
+  // negative for images that are stored bottom to top.
+  ptrdiff_t stride = 0;
+  size_t num_channels = 3;  // 3 (RGB) or 4 (RGBA)
+  SampleType type = SampleType::kUint8;
+  Endianness endianness = Endianness::kNative;
+  // Whether the samples are encoded with the sRGB transfer function, otherwise
+  // they are linear. Either way, the primaries and white point are sRGB.
+  bool is_srgb = true;
+
+  size_t BytesPerPixel() const { return num_channels * BytesPerSample(type); }
+
+  // Whether the samples have to be byte swapped while reading them.
+  bool NeedsByteSwap() const {
+    return endianness != Endianness::kNative && BytesPerSample(type) > 1 &&
+           (endianness == Endianness::kLittle) != IsLittleEndian();
+  }
+
+  const uint8_t* ConstRow(size_t y) const {
+    return static_cast<const uint8_t*>(pixels) +
+           static_cast<ptrdiff_t>(y) * stride;
+  }
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_INTERLEAVED_IMAGE_H_
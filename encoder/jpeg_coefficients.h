@@ -0,0 +1,49 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_JPEG_COEFFICIENTS_H_
+#define ENCODER_JPEG_COEFFICIENTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "encoder/common.h"
+
+namespace jxl {
+
+// Number of components of a JPEGCoefficients, which are Y, Cb and Cr in this
+// order.
+static constexpr size_t kNumJPEGComponents = 3;
+
+// Component of each of the X, Y and B channels of the frame, which hold Cb, Y
+// and Cr.
+static constexpr size_t kJPEGComponentOfChannel[3] = {1, 0, 2};
+
+// Non-owning view of the quantized DCT coefficients of a YCbCr JPEG image
+// without chroma subsampling, as they come out of the entropy decoder of the
+// JPEG, e.g. from libjpeg's jpeg_read_coefficients. The image is recompressed
+// from these without decoding its pixels, and without changing them.
+struct JPEGCoefficients {
+  size_t xsize = 0;
+  size_t ysize = 0;
+  // Quantization table of each component, in natural (row by row) order.
+  uint16_t quant[kNumJPEGComponents][kDCTBlockSize] = {};
+  // First block of each component. Each block is kDCTBlockSize coefficients
+  // in natural order, like libjpeg's JBLOCK, and there are at least
+  // DivCeil(xsize, kBlockDim) x DivCeil(ysize, kBlockDim) of them.
+  const int16_t* coeffs[kNumJPEGComponents] = {};
+  // Distance in blocks between the first blocks of two consecutive block
+  // rows of each component.
+  size_t blocks_per_row[kNumJPEGComponents] = {};
+
+  const int16_t* ConstBlock(size_t c, size_t bx, size_t by) const {
+    return coeffs[c] + (by * blocks_per_row[c] + bx) * kDCTBlockSize;
+  }
+};
+
+}  // namespace jxl
+
+#endif  // ENCODER_JPEG_COEFFICIENTS_H_
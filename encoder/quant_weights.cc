@@ -9,10 +9,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
 #include <hwy/aligned_allocator.h>
 
+#include "encoder/dct_scales.h"
+
 namespace jxl {
 
+// 15720 / 64, -1.025, -0.98, -0.901, -0.4, -0.488, -0.421, -0.27
+// 7304 / 64, -0.804, -0.763, -0.557, -0.498, -0.437, -0.402, -0.273
+// 3804 / 64, -3.061, -2.041, -2.023, -0.549, -0.4, -0.4, -0.3
+const uint16_t kDCT32DistanceBands[3][kNumDCT32DistanceBands] = {
+    {0x5bad, 0xbc1a, 0xbbd7, 0xbb36, 0xb666, 0xb7d0, 0xb6bd, 0xb452},
+    {0x5722, 0xba6f, 0xba1b, 0xb874, 0xb7f7, 0xb6fe, 0xb66e, 0xb45f},
+    {0x536e, 0xc21f, 0xc015, 0xc00c, 0xb865, 0xb666, 0xb666, 0xb4cd},
+};
+
 namespace {
 constexpr float kQuantWeights[] = {
     3.1746033e-04, 3.1746057e-04, 3.1854658e-04, 3.7755401e-04, 4.4749113e-04,
@@ -132,23 +147,79 @@ constexpr float kQuantWeights[] = {
     3.7175436e-02, 4.7613274e-02, 6.1909460e-02, 8.1609353e-02, 1.0892317e-01,
     1.4702357e-01,
 };
-constexpr size_t kTableSizeInBlocks[] = {1, 1, 1, 2, 2, 2, 2, 2, 2};
-constexpr size_t kTableOffsetInBlocks[] = {0, 1, 2, 3, 5, 7, 3, 5, 7};
-constexpr size_t kTotalTableSize = 9 * kDCTBlockSize;
+// The DCT32X32 tables are computed from kDCT32DistanceBands, after the
+// precomputed ones.
+constexpr size_t kTableOffsetInBlocks[] = {0, 1, 2, 3,  5,  7,
+                                          3, 5, 7, 9, 25, 41};
+constexpr size_t kTotalTableSize = 57 * kDCTBlockSize;
+
+// Only normal numbers are used.
+float F16ToFloat(uint16_t bits) {
+  const int biased_exp = (bits >> 10) & 0x1F;
+  const float mantissa = 1.0f + (bits & 0x3FF) * (1.0f / 1024);
+  const float value = std::ldexp(mantissa, biased_exp - 15);
+  return (bits >> 15) ? -value : value;
+}
+
+float BandMult(float v) { return v > 0.0f ? 1.0f + v : 1.0f / (1.0f - v); }
+
+// Computes the dequantization tables of the three channels of a rows x cols
+// DCT the same way as the decoder does for the DCT quant mode: the weight of
+// each coefficient is interpolated geometrically between the two distance
+// bands nearest to its distance from the top-left corner, where the bottom
+// right corner is at the last band. The table holds the reciprocals of the
+// weights.
+void ComputeDCTQuantTables(
+    size_t rows, size_t cols,
+    const uint16_t distance_bands[3][kNumDCT32DistanceBands], float* table) {
+  constexpr size_t kNumBands = kNumDCT32DistanceBands;
+  const float scale = (kNumBands - 1) / (kSqrt2 + 1e-6f);
+  const float rcprow = scale / (rows - 1);
+  const float rcpcol = scale / (cols - 1);
+  for (size_t c = 0; c < 3; ++c) {
+    float bands[kNumBands];
+    bands[0] = 64.0f * F16ToFloat(distance_bands[c][0]);
+    for (size_t i = 1; i < kNumBands; ++i) {
+      bands[i] = bands[i - 1] * BandMult(F16ToFloat(distance_bands[c][i]));
+    }
+    for (size_t y = 0; y < rows; ++y) {
+      const float dy = y * rcprow;
+      for (size_t x = 0; x < cols; ++x) {
+        const float dx = x * rcpcol;
+        const float pos = std::sqrt(dx * dx + dy * dy);
+        const size_t idx = std::min<size_t>(pos, kNumBands - 2);
+        const float weight =
+            bands[idx] * std::pow(bands[idx + 1] / bands[idx], pos - idx);
+        table[(c * rows + y) * cols + x] = 1.0f / weight;
+      }
+    }
+  }
+}
 }  // namespace
 
 DequantMatrices::DequantMatrices() {
   table_storage_ = hwy::AllocateAligned<float>(2 * kTotalTableSize);
-  memcpy(table_storage_.get(), kQuantWeights, sizeof(kQuantWeights));
-  float* inv_table = table_storage_.get() + kTotalTableSize;
+  float* table = table_storage_.get();
+  memcpy(table, kQuantWeights, sizeof(kQuantWeights));
+  ComputeDCTQuantTables(
+      4 * kBlockDim, 4 * kBlockDim, kDCT32DistanceBands,
+      table + kTableOffsetInBlocks[3 * AcStrategy::DCT32X32] * kDCTBlockSize);
+  float* inv_table = table + kTotalTableSize;
   for (size_t i = 0; i < kTotalTableSize; ++i) {
-    inv_table[i] = 1.0 / table_storage_[i];
+    inv_table[i] = 1.0 / table[i];
   }
   for (size_t i = 0, n = 0; i < AcStrategy::kNumValidStrategies; i++) {
+    const AcStrategy acs = AcStrategy::FromRawStrategy(i);
+    size_t cx = acs.covered_blocks_x();
+    size_t cy = acs.covered_blocks_y();
+    if (cy > cx) std::swap(cx, cy);
     for (size_t c = 0; c < 3; c++, n++) {
       table_offsets_[n] = kTableOffsetInBlocks[n] * kDCTBlockSize;
-      for (size_t b = 0; b < kTableSizeInBlocks[n]; ++b) {
-        inv_table[table_offsets_[n] + b] = 0.0f;
+      // The lowest frequencies are quantized as DC.
+      for (size_t y = 0; y < cy; ++y) {
+        for (size_t x = 0; x < cx; ++x) {
+          inv_table[table_offsets_[n] + y * cx * kBlockDim + x] = 0.0f;
+        }
       }
     }
   }
@@ -31,6 +31,13 @@ const float kDCQuant[3] = {
     1.0f / kInvDCQuant[2],
 };
 
+// The DCT32X32 weights are signalled in the AC global section with the DCT
+// quant mode, so that the decoder computes them from the same distance bands
+// as this encoder. These are written as binary16 values, the decoder
+// multiplies the first band of each channel by 64.
+static constexpr size_t kNumDCT32DistanceBands = 8;
+extern const uint16_t kDCT32DistanceBands[3][kNumDCT32DistanceBands];
+
 class DequantMatrices {
  public:
   DequantMatrices();
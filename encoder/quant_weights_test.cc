@@ -0,0 +1,96 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/quant_weights.h"
+
+#include <math.h>
+#include <stdint.h>
+
+#include "encoder/ac_strategy.h"
+#include "encoder/common.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+// Decodes a binary16 value as the decoder reads it from the bitstream.
+double DecodeF16(uint16_t bits) {
+  const int sign = bits >> 15;
+  const int biased_exp = (bits >> 10) & 0x1F;
+  const int mantissa = bits & 0x3FF;
+  EXPECT_NE(31, biased_exp);
+  const double value =
+      biased_exp == 0 ? ldexp(mantissa, -24)
+                      : ldexp(1024 + mantissa, biased_exp - 25);
+  return sign ? -value : value;
+}
+
+// The values the distance bands were rounded from, with the first band
+// before the decoder multiplies it by 64.
+constexpr double kExpectedBands[3][kNumDCT32DistanceBands] = {
+    {15720.0 / 64, -1.025, -0.98, -0.901, -0.4, -0.488, -0.421, -0.27},
+    {7304.0 / 64, -0.804, -0.763, -0.557, -0.498, -0.437, -0.402, -0.273},
+    {3804.0 / 64, -3.061, -2.041, -2.023, -0.549, -0.4, -0.4, -0.3},
+};
+
+TEST(QuantWeightsTest, DistanceBandsAreRoundedWeights) {
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t i = 0; i < kNumDCT32DistanceBands; ++i) {
+      const double expected = kExpectedBands[c][i];
+      EXPECT_NEAR(expected, DecodeF16(kDCT32DistanceBands[c][i]),
+                  fabs(expected) * 1e-3)
+          << "c=" << c << " i=" << i;
+    }
+  }
+}
+
+// Computes the weight of the coefficient x, y of a rows x cols DCT of channel
+// c in the DCT quant mode from the signalled distance bands, in double
+// precision and independently of the encoder, the way the decoder does.
+double ReferenceWeight(size_t c, size_t rows, size_t cols, size_t x,
+                       size_t y) {
+  constexpr size_t kNumBands = kNumDCT32DistanceBands;
+  double bands[kNumBands];
+  bands[0] = 64.0 * DecodeF16(kDCT32DistanceBands[c][0]);
+  for (size_t i = 1; i < kNumBands; ++i) {
+    const double v = DecodeF16(kDCT32DistanceBands[c][i]);
+    bands[i] = bands[i - 1] * (v > 0 ? 1.0 + v : 1.0 / (1.0 - v));
+  }
+  const double dx = x / (cols - 1.0);
+  const double dy = y / (rows - 1.0);
+  const double distance = sqrt(dx * dx + dy * dy);
+  const double pos = distance * (kNumBands - 1) / (sqrt(2.0) + 1e-6);
+  const size_t idx = static_cast<size_t>(pos);
+  return bands[idx] * pow(bands[idx + 1] / bands[idx], pos - idx);
+}
+
+// The encoder quantizes the DCT32X32 coefficients with the same table that
+// the decoder computes from the signalled bands.
+TEST(QuantWeightsTest, DCT32MatchesSignalledBands) {
+  const DequantMatrices matrices;
+  constexpr size_t kDim = 4 * kBlockDim;
+  for (size_t c = 0; c < 3; ++c) {
+    const float* dequant = matrices.Matrix(AcStrategy::DCT32X32, c);
+    const float* quant = matrices.InvMatrix(AcStrategy::DCT32X32, c);
+    for (size_t y = 0; y < kDim; ++y) {
+      for (size_t x = 0; x < kDim; ++x) {
+        const double weight = ReferenceWeight(c, kDim, kDim, x, y);
+        EXPECT_NEAR(1.0 / weight, dequant[y * kDim + x], 1e-5 / weight)
+            << "c=" << c << " x=" << x << " y=" << y;
+        // The lowest frequencies are quantized as DC.
+        if (x < 4 && y < 4) {
+          EXPECT_EQ(0.0f, quant[y * kDim + x]);
+        } else {
+          EXPECT_NEAR(weight, quant[y * kDim + x], 1e-5 * weight)
+              << "c=" << c << " x=" << x << " y=" << y;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace jxl
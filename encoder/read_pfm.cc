@@ -10,7 +10,18 @@
 
 #include <vector>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JXL_HAVE_MMAP 1
+#else
+#define JXL_HAVE_MMAP 0
+#endif
+
 #include "encoder/base/byte_order.h"
+#include "encoder/base/compiler_specific.h"
 
 namespace jxl {
 
@@ -172,8 +183,89 @@ bool ReadFile(const char* filename, std::vector<uint8_t>* out) {
   return readsize == static_cast<size_t>(size);
 }
 
+#if JXL_HAVE_MMAP
+bool MapFile(const char* filename, void** mapping, size_t* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  *size = static_cast<size_t>(st.st_size);
+  *mapping = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the file is closed.
+  close(fd);
+  if (*mapping == MAP_FAILED) {
+    *mapping = nullptr;
+    return false;
+  }
+  // The rows are read in stripes, mostly sequentially.
+  madvise(*mapping, *size, MADV_SEQUENTIAL);
+  return true;
+}
+#endif
+
 }  // namespace
 
+MappedPFM::~MappedPFM() {
+#if JXL_HAVE_MMAP
+  if (mapping_) munmap(mapping_, mapping_size_);
+#endif
+}
+
+bool MappedPFM::Open(const char* fn) {
+  const uint8_t* data;
+  size_t size;
+#if JXL_HAVE_MMAP
+  if (!MapFile(fn, &mapping_, &mapping_size_)) {
+    fprintf(stderr, "Could not map %s\n", fn);
+    return false;
+  }
+  data = static_cast<const uint8_t*>(mapping_);
+  size = mapping_size_;
+#else
+  if (!ReadFile(fn, &data_)) {
+    fprintf(stderr, "Could not read %s\n", fn);
+    return false;
+  }
+  data = data_.data();
+  size = data_.size();
+#endif
+  if (size < 2) {
+    fprintf(stderr, "PFM file too small.\n");
+    return false;
+  }
+
+  Parser parser(data, size);
+  size_t xsize, ysize;
+  bool big_endian;
+  const uint8_t* pos = nullptr;
+  if (!parser.ParseHeaderPFM(&pos, &xsize, &ysize, &big_endian)) {
+    return false;
+  }
+  const size_t row_size = xsize * 3 * sizeof(float);
+  const size_t pixels_size = static_cast<size_t>(data + size - pos);
+  if (xsize == 0 || ysize == 0 || row_size / xsize != 3 * sizeof(float) ||
+      pixels_size / row_size < ysize) {
+    fprintf(stderr, "PFM file too small.\n");
+    return false;
+  }
+
+  // PFM rows are stored bottom to top.
+  image_.pixels = pos + (ysize - 1) * row_size;
+  image_.xsize = xsize;
+  image_.ysize = ysize;
+  image_.stride = -static_cast<ptrdiff_t>(row_size);
+  image_.num_channels = 3;
+  image_.type = SampleType::kFloat;
+  image_.endianness = big_endian ? Endianness::kBig : Endianness::kLittle;
+  image_.is_srgb = false;
+  return true;
+}
+
 bool ReadPFM(const char* fn, Image3F* image) {
   std::vector<uint8_t> data;
   if (!ReadFile(fn, &data)) {
@@ -199,11 +291,23 @@ bool ReadPFM(const char* fn, Image3F* image) {
   for (size_t y = 0; y < ysize; ++y) {
     size_t y_in = ysize - 1 - y;
     const float* row_in = &input[y_in * stride];
-    for (size_t c = 0; c < 3; ++c) {
-      float* row_out = img.PlaneRow(c, y);
-      for (size_t x = 0; x < xsize; ++x) {
-        memcpy(&row_out[x], &row_in[x * 3 + c], sizeof(*row_out));
-        if (big_endian) row_out[x] = BSwapFloat(row_out[x]);
+    float* JXL_RESTRICT row0 = img.PlaneRow(0, y);
+    float* JXL_RESTRICT row1 = img.PlaneRow(1, y);
+    float* JXL_RESTRICT row2 = img.PlaneRow(2, y);
+    // Deinterleave all three channels in one pass over the input row.
+    for (size_t x = 0; x < xsize; ++x) {
+      float samples[3];
+      memcpy(samples, &row_in[x * 3], sizeof(samples));
+      row0[x] = samples[0];
+      row1[x] = samples[1];
+      row2[x] = samples[2];
+    }
+    if (big_endian) {
+      for (size_t c = 0; c < 3; ++c) {
+        float* JXL_RESTRICT row_out = img.PlaneRow(c, y);
+        for (size_t x = 0; x < xsize; ++x) {
+          row_out[x] = BSwapFloat(row_out[x]);
+        }
       }
     }
   }
@@ -7,12 +7,42 @@
 #ifndef ENCODER_READ_PFM_H_
 #define ENCODER_READ_PFM_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
 #include "encoder/image.h"
+#include "encoder/interleaved_image.h"
 
 namespace jxl {
 
 bool ReadPFM(const char* fn, jxl::Image3F* image);
 
+// PFM file that is mapped into memory instead of being read, so that its
+// pixels are paged in from the page cache only when the encoder loads them.
+// The bottom-up row order and the byte order of the file are described by
+// image(), which can be passed directly to the encoder.
+class MappedPFM {
+ public:
+  MappedPFM() = default;
+  ~MappedPFM();
+  MappedPFM(const MappedPFM&) = delete;
+  MappedPFM& operator=(const MappedPFM&) = delete;
+
+  bool Open(const char* fn);
+
+  // Valid until the object is destroyed.
+  const InterleavedImage& image() const { return image_; }
+
+ private:
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  // File contents where memory mapping is not available.
+  std::vector<uint8_t> data_;
+  InterleavedImage image_;
+};
+
 }  // namespace jxl
 
 #endif  // ENCODER_READ_PFM_H_
@@ -0,0 +1,92 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/simd_targets.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <hwy/targets.h>
+
+namespace jxl {
+
+namespace {
+
+// Targets disabled by the last LimitSimdTargets or ForceSimdTarget.
+int64_t disabled_targets = 0;
+
+bool IsAvailable(int64_t target) {
+  const std::vector<int64_t> targets = AvailableSimdTargets();
+  return std::find(targets.begin(), targets.end(), target) != targets.end();
+}
+
+}  // namespace
+
+std::vector<int64_t> AvailableSimdTargets() {
+  // The supported targets are masked by the disabled ones, so these are
+  // re-enabled while they are queried.
+  hwy::DisableTargets(0);
+  const int64_t supported = hwy::SupportedTargets();
+  hwy::DisableTargets(disabled_targets);
+  std::vector<int64_t> targets;
+  // Better targets have lower bits.
+  for (int64_t targets_left = HWY_TARGETS & supported; targets_left != 0;
+       targets_left &= targets_left - 1) {
+    targets.push_back(targets_left & -targets_left);
+  }
+  return targets;
+}
+
+const char* SimdTargetName(int64_t target) {
+  return hwy::TargetName(target);
+}
+
+int64_t SimdTargetFromName(const char* name) {
+  for (int64_t target : AvailableSimdTargets()) {
+    const char* target_name = hwy::TargetName(target);
+    if (strlen(target_name) != strlen(name)) continue;
+    bool equal = true;
+    for (size_t i = 0; name[i] != '\0'; ++i) {
+      if (tolower(name[i]) != tolower(target_name[i])) equal = false;
+    }
+    if (equal) return target;
+  }
+  return 0;
+}
+
+int64_t CurrentSimdTarget() {
+  const int64_t targets = HWY_TARGETS & hwy::SupportedTargets();
+  return targets & -targets;
+}
+
+Status LimitSimdTargets(int64_t max_target) {
+  if (!IsAvailable(max_target)) {
+    return JXL_FAILURE("SIMD target %s is not available",
+                       hwy::TargetName(max_target));
+  }
+  disabled_targets = max_target - 1;
+  hwy::DisableTargets(disabled_targets);
+  return true;
+}
+
+Status ForceSimdTarget(int64_t target) {
+  if (!IsAvailable(target)) {
+    return JXL_FAILURE("SIMD target %s is not available",
+                       hwy::TargetName(target));
+  }
+  disabled_targets = ~target;
+  hwy::DisableTargets(disabled_targets);
+  return true;
+}
+
+void ResetSimdTargets() {
+  disabled_targets = 0;
+  hwy::DisableTargets(0);
+}
+
+}  // namespace jxl
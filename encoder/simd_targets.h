@@ -0,0 +1,51 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_SIMD_TARGETS_H_
+#define ENCODER_SIMD_TARGETS_H_
+
+// Control over the SIMD target (AVX-512, AVX2, NEON, ...) that the dynamic
+// dispatch of the encoder picks. By default it is the best target that is both
+// compiled in and supported by the CPU, which is not always the fastest one,
+// e.g. when wide vectors lower the clock frequency. The settings are global to
+// the process and must not be changed while images are being encoded.
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/status.h"
+
+namespace jxl {
+
+// Returns the targets that are compiled in and supported by the CPU, the best
+// one first, regardless of the limits set by the functions below.
+std::vector<int64_t> AvailableSimdTargets();
+
+// Returns the Highway name of the target, e.g. "AVX2".
+const char* SimdTargetName(int64_t target);
+
+// Returns the available target with the given name, ignoring case, or 0 if
+// there is none.
+int64_t SimdTargetFromName(const char* name);
+
+// Returns the target that the subsequent encodes use.
+int64_t CurrentSimdTarget();
+
+// Makes the encoder use the best available target that is not better than
+// max_target, which must be one of AvailableSimdTargets().
+Status LimitSimdTargets(int64_t max_target);
+
+// Makes the encoder use exactly target, which must be one of
+// AvailableSimdTargets().
+Status ForceSimdTarget(int64_t target);
+
+// Undoes LimitSimdTargets and ForceSimdTarget.
+void ResetSimdTargets();
+
+}  // namespace jxl
+
+#endif  // ENCODER_SIMD_TARGETS_H_
@@ -7,22 +7,24 @@
 #ifndef ENCODER_STATIC_ENTROPY_CODES_H_
 #define ENCODER_STATIC_ENTROPY_CODES_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-#include "encoder/config.h"
 #include "encoder/entropy_code.h"
 
 namespace jxl {
 
-#if OPTIMIZE_CODE
-static constexpr size_t kNumDCPrefixCodes = 45;
-static constexpr const PrefixCode* kDCPrefixCodes = nullptr;
-static constexpr uint8_t kDCContextMap[] = {
+// Initial context maps of the codes that are optimized for each frame, with
+// one prefix code per cluster of contexts. The prefix codes themselves are
+// computed from the histograms of the frame.
+static constexpr size_t kNumOptimizedDCPrefixCodes = 45;
+static constexpr uint8_t kOptimizedDCContextMap[] = {
     0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,
     15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
     30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44,
 };
-#else
+
+// Static codes that are used when the codes are not optimized.
 static constexpr uint8_t kDCContextMap[] = {
     0, 1, 2, 2, 1, 1, 3, 0, 3, 0, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7, 6, 6, 6,
     6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 6, 7, 6, 7, 6, 6, 5, 5,
@@ -158,14 +160,11 @@ static constexpr PrefixCode kDCPrefixCodes[kNumDCPrefixCodes] = {
          0x2fff, 0x1fff, 0x5fff, 0x3fff, 0x7fff,
      }},
 };
-#endif
 
-#if OPTIMIZE_CODE
-static constexpr size_t kNumACPrefixCodes = 64;
-static constexpr const PrefixCode* kACPrefixCodes = nullptr;
+static constexpr size_t kNumOptimizedACPrefixCodes = 64;
 // TODO(szabadka) Make the context map dependent on the distance setting.
 /* clang-format off */
-static constexpr uint8_t kACContextMap[] = {
+static constexpr uint8_t kOptimizedACContextMap[] = {
     // Context map for number of nonzeros
     //   8x8   8x16  8x8   8x16
     //    Y     Y    X,B   X,B
@@ -500,7 +499,7 @@ static constexpr uint8_t kACContextMap[] = {
      0,  0,    0,  0,    0,  0,    0,  0,  // k: 24 - 31
 };
 /* clang-format on */
-#else
+
 /* clang-format off */
 static constexpr uint8_t kACContextMap[] = {
     // Context map for number of nonzeros
@@ -968,7 +967,22 @@ static constexpr PrefixCode kACPrefixCodes[kNumACPrefixCodes] = {
          0x6fff, 0x1fff, 0x5fff, 0x3fff, 0x7fff,
      }},
 };
-#endif
+
+// Sets of static codes that are trained on different kinds of images, see
+// EncoderOptions::select_static_code. The first one is the default.
+struct StaticCodeSet {
+  const uint8_t* dc_context_map;
+  const PrefixCode* dc_prefix_codes;
+  size_t num_dc_prefix_codes;
+  const uint8_t* ac_context_map;
+  const PrefixCode* ac_prefix_codes;
+  size_t num_ac_prefix_codes;
+};
+static constexpr size_t kNumStaticCodeSets = 1;
+static constexpr StaticCodeSet kStaticCodeSets[kNumStaticCodeSets] = {
+    {kDCContextMap, kDCPrefixCodes, kNumDCPrefixCodes, kACContextMap,
+     kACPrefixCodes, kNumACPrefixCodes},
+};
 
 }  // namespace jxl
 
@@ -0,0 +1,143 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/test_utils.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "encoder/base/span.h"
+#include "encoder/enc_file.h"
+#include "encoder/enc_frame.h"
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace test {
+
+Image3F TestImage(size_t xsize, size_t ysize, uint32_t seed) {
+  Image3F image(xsize, ysize);
+  uint32_t state = seed * 2654435761u + 12345u;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        state = state * 1103515245u + 12345u;
+        const float noise = ((state >> 16) & 0xff) * (0.05f / 255);
+        const float gradient = c == 0   ? x * 1.0f / xsize
+                               : c == 1 ? y * 1.0f / ysize
+                                        : (x + y) * 1.0f / (xsize + ysize);
+        // A disc with a sharp edge, for the larger transforms and the edges.
+        const float dx = x - 0.4f * xsize;
+        const float dy = y - 0.6f * ysize;
+        const float r = 0.25f * std::min(xsize, ysize);
+        const float disc = dx * dx + dy * dy < r * r ? 0.3f : 0.0f;
+        row[x] = 0.6f * gradient + disc + noise;
+      }
+    }
+  }
+  return image;
+}
+
+Image3F FlatImage(size_t xsize, size_t ysize, float r, float g, float b) {
+  Image3F image(xsize, ysize);
+  const float values[3] = {r, g, b};
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      std::fill(image.PlaneRow(c, y), image.PlaneRow(c, y) + xsize,
+                values[c]);
+    }
+  }
+  return image;
+}
+
+std::vector<Image3F> TexturedFlatTexturedFrames(size_t xsize, size_t ysize) {
+  const Image3F textured = TestImage(xsize, ysize);
+  std::vector<Image3F> frames;
+  for (size_t i = 0; i < 3; ++i) {
+    Image3F frame(xsize, ysize);
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < ysize; ++y) {
+        const float* JXL_RESTRICT row_in = textured.ConstPlaneRow(c, y);
+        float* JXL_RESTRICT row = frame.PlaneRow(c, y);
+        for (size_t x = 0; x < xsize; ++x) {
+          const bool flat = i == 1 && x < xsize / 2 && y < ysize * 3 / 4;
+          row[x] = flat ? 0.3f : row_in[x];
+        }
+      }
+    }
+    frames.push_back(std::move(frame));
+  }
+  return frames;
+}
+
+std::vector<uint8_t> EncodeWithOptions(const Image3F& image, float distance,
+                                       const EncoderOptions& options,
+                                       int num_threads) {
+  Encoder encoder(num_threads);
+  encoder.SetOptions(options);
+  std::vector<uint8_t> output;
+  EXPECT_TRUE(encoder.Encode(image, distance, &output));
+  return output;
+}
+
+std::vector<uint8_t> EncodeAnimation(const std::vector<Image3F>& frames,
+                                     float distance,
+                                     const EncoderOptions& options,
+                                     int num_threads,
+                                     bool cpu_heuristics_backend) {
+  const size_t xsize = frames.front().xsize();
+  const size_t ysize = frames.front().ysize();
+  // The backend reads the pixels of the current frame from here.
+  Image3F frame(xsize, ysize);
+  CPUHeuristicsBackend backend(frame, options);
+  Encoder encoder(num_threads);
+  encoder.SetOptions(options);
+  if (cpu_heuristics_backend) encoder.SetHeuristicsBackend(&backend);
+  std::vector<uint8_t> output;
+  const OutputSink sink = [&output](Span<const uint8_t> bytes) {
+    output.insert(output.end(), bytes.data(), bytes.data() + bytes.size());
+    return true;
+  };
+  if (!encoder.StartAnimation(xsize, ysize, AnimationParams(), sink)) {
+    ADD_FAILURE() << "StartAnimation failed";
+    return std::vector<uint8_t>();
+  }
+  for (size_t i = 0; i < frames.size(); ++i) {
+    for (size_t c = 0; c < 3; ++c) {
+      CopyImageTo(frames[i].Plane(c), &frame.Plane(c));
+    }
+    if (!encoder.AddFrame(frame, distance, 1, i + 1 == frames.size())) {
+      ADD_FAILURE() << "AddFrame failed for frame " << i;
+      return std::vector<uint8_t>();
+    }
+  }
+  return output;
+}
+
+float MaxAbsDifference(const Image3F& image, const DecodedImage& decoded) {
+  if (decoded.xsize != image.xsize() || decoded.ysize != image.ysize() ||
+      decoded.pixels.size() != image.xsize() * image.ysize() * 3) {
+    return std::numeric_limits<float>::infinity();
+  }
+  float max_diff = 0;
+  for (size_t y = 0; y < image.ysize(); ++y) {
+    for (size_t x = 0; x < image.xsize(); ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        const float diff =
+            fabsf(image.ConstPlaneRow(c, y)[x] -
+                  decoded.pixels[(y * image.xsize() + x) * 3 + c]);
+        max_diff = std::max(max_diff, diff);
+      }
+    }
+  }
+  return max_diff;
+}
+
+}  // namespace test
+}  // namespace jxl
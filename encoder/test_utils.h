@@ -0,0 +1,77 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_TEST_UTILS_H_
+#define ENCODER_TEST_UTILS_H_
+
+// Test images and libjxl decoding of the codestreams, used by the tests only.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/config.h"
+#include "encoder/image.h"
+
+namespace jxl {
+namespace test {
+
+// Linear sRGB image with smooth gradients, edges and some noise, roughly like
+// a photograph, generated deterministically from its size and seed.
+Image3F TestImage(size_t xsize, size_t ysize, uint32_t seed = 1);
+
+// Image where each channel has the same value everywhere.
+Image3F FlatImage(size_t xsize, size_t ysize, float r, float g, float b);
+
+// Consecutive frames whose top left corner goes from a TestImage to flat and
+// back, so that in incremental encodes the dirty groups change their
+// transforms between the frames while the others keep those of the first one.
+std::vector<Image3F> TexturedFlatTexturedFrames(size_t xsize, size_t ysize);
+
+// Returns the codestream of `image` with the given options, or an empty one
+// after a test failure.
+std::vector<uint8_t> EncodeWithOptions(const Image3F& image, float distance,
+                                       const EncoderOptions& options,
+                                       int num_threads = 2);
+
+// Returns the codestream of an animation of `frames`, each shown for one tick,
+// or an empty one after a test failure. With cpu_heuristics_backend, the
+// heuristics are computed by a CPUHeuristicsBackend.
+std::vector<uint8_t> EncodeAnimation(const std::vector<Image3F>& frames,
+                                     float distance,
+                                     const EncoderOptions& options,
+                                     int num_threads = 2,
+                                     bool cpu_heuristics_backend = false);
+
+// Interleaved RGB pixels of a decoded frame.
+struct DecodedImage {
+  size_t xsize = 0;
+  size_t ysize = 0;
+  // Linear sRGB floats, with DecodeToLinear.
+  std::vector<float> pixels;
+  // 8-bit samples in the color space of the image, with DecodeToUint8.
+  std::vector<uint8_t> pixels8;
+};
+
+// Decodes the last frame of `codestream` with libjxl. Returns false if libjxl
+// rejects it.
+bool DecodeToLinear(const std::vector<uint8_t>& codestream,
+                    DecodedImage* image);
+bool DecodeToUint8(const std::vector<uint8_t>& codestream,
+                   DecodedImage* image);
+// Same as DecodeToLinear, but returns every frame of an animation.
+bool DecodeFramesToLinear(const std::vector<uint8_t>& codestream,
+                          std::vector<DecodedImage>* frames);
+
+// Largest absolute difference between the samples of `image` and `decoded`,
+// or infinity if their sizes differ.
+float MaxAbsDifference(const Image3F& image, const DecodedImage& decoded);
+
+}  // namespace test
+}  // namespace jxl
+
+#endif  // ENCODER_TEST_UTILS_H_
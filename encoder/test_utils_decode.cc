@@ -0,0 +1,111 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Decoding of the codestreams with libjxl, only linked into the tests that
+// check them against the reference decoder.
+
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+
+#include <utility>
+
+#include "encoder/test_utils.h"
+
+namespace jxl {
+namespace test {
+namespace {
+
+// Appends the frames of `codestream` to `frames`.
+bool Decode(const std::vector<uint8_t>& codestream, bool linear,
+            std::vector<DecodedImage>* frames) {
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                               JXL_DEC_COLOR_ENCODING |
+                                               JXL_DEC_FULL_IMAGE) !=
+      JXL_DEC_SUCCESS) {
+    return false;
+  }
+  if (JxlDecoderSetInput(dec.get(), codestream.data(), codestream.size()) !=
+      JXL_DEC_SUCCESS) {
+    return false;
+  }
+  JxlDecoderCloseInput(dec.get());
+  const JxlPixelFormat format = {
+      3, linear ? JXL_TYPE_FLOAT : JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  JxlBasicInfo info = {};
+  for (;;) {
+    const JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_ERROR || status == JXL_DEC_NEED_MORE_INPUT) {
+      return false;
+    } else if (status == JXL_DEC_BASIC_INFO) {
+      if (JxlDecoderGetBasicInfo(dec.get(), &info) != JXL_DEC_SUCCESS) {
+        return false;
+      }
+    } else if (status == JXL_DEC_COLOR_ENCODING) {
+      if (!linear) continue;
+      JxlColorEncoding color;
+      JxlColorEncodingSetToLinearSRGB(&color, /*is_gray=*/JXL_FALSE);
+      if (JxlDecoderSetPreferredColorProfile(dec.get(), &color) !=
+          JXL_DEC_SUCCESS) {
+        return false;
+      }
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t size;
+      if (JxlDecoderImageOutBufferSize(dec.get(), &format, &size) !=
+          JXL_DEC_SUCCESS) {
+        return false;
+      }
+      frames->emplace_back();
+      DecodedImage* image = &frames->back();
+      image->xsize = info.xsize;
+      image->ysize = info.ysize;
+      void* buffer;
+      if (linear) {
+        image->pixels.resize(size / sizeof(float));
+        buffer = image->pixels.data();
+      } else {
+        image->pixels8.resize(size);
+        buffer = image->pixels8.data();
+      }
+      if (JxlDecoderSetImageOutBuffer(dec.get(), &format, buffer, size) !=
+          JXL_DEC_SUCCESS) {
+        return false;
+      }
+    } else if (status == JXL_DEC_SUCCESS) {
+      return true;
+    }
+    // JXL_DEC_FULL_IMAGE: the next frame, if any, gets a new buffer.
+  }
+}
+
+bool DecodeLastFrame(const std::vector<uint8_t>& codestream, bool linear,
+                     DecodedImage* image) {
+  std::vector<DecodedImage> frames;
+  if (!Decode(codestream, linear, &frames) || frames.empty()) return false;
+  *image = std::move(frames.back());
+  return true;
+}
+
+}  // namespace
+
+bool DecodeToLinear(const std::vector<uint8_t>& codestream,
+                    DecodedImage* image) {
+  return DecodeLastFrame(codestream, /*linear=*/true, image);
+}
+
+bool DecodeToUint8(const std::vector<uint8_t>& codestream,
+                   DecodedImage* image) {
+  return DecodeLastFrame(codestream, /*linear=*/false, image);
+}
+
+bool DecodeFramesToLinear(const std::vector<uint8_t>& codestream,
+                          std::vector<DecodedImage>* frames) {
+  frames->clear();
+  return Decode(codestream, /*linear=*/true, frames);
+}
+
+}  // namespace test
+}  // namespace jxl
@@ -0,0 +1,71 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "encoder/token_buffer.h"
+
+#include "encoder/enc_ans.h"
+#include "encoder/enc_entropy_code.h"
+
+namespace jxl {
+
+Status TokenBuffer::AddToHistograms(
+    std::vector<Histogram>* histograms) const {
+  if (overflow_) return JXL_FAILURE("Token value out of range");
+  for (const Entry& entry : entries_) {
+    if (entry.context >= kMaxContexts) continue;
+    JXL_ASSERT(entry.context < histograms->size());
+    uint32_t tok, nbits, bits;
+    UintCoder().Encode(entry.value, &tok, &nbits, &bits);
+    JXL_ASSERT(tok < kAlphabetSize);
+    (*histograms)[entry.context].Add(tok);
+  }
+  return true;
+}
+
+Status TokenBuffer::WriteTo(const EntropyCode& code, BitWriter* writer) const {
+  if (overflow_) return JXL_FAILURE("Token value out of range");
+  if (code.use_ans) {
+    WriteANSTo(code, writer);
+    return true;
+  }
+  BitWriter::Allotment allotment(writer, kMaxBitsPerToken * entries_.size());
+  BufferedBitWriter buffered(writer);
+  for (const Entry& entry : entries_) {
+    if (entry.context >= kMaxContexts) {
+      buffered.Write(entry.context - kMaxContexts, entry.value);
+    } else {
+      WriteToken(Token(entry.context, entry.value), code, &buffered);
+    }
+  }
+  buffered.Flush();
+  allotment.Reclaim(writer);
+  return true;
+}
+
+void TokenBuffer::WriteANSTo(const EntropyCode& code, BitWriter* writer) const {
+  ANSEncoder encoder(code);
+  size_t i = 0;
+  while (i < entries_.size()) {
+    if (entries_[i].context >= kMaxContexts) {
+      BitWriter::Allotment allotment(writer, 16);
+      writer->Write(entries_[i].context - kMaxContexts, entries_[i].value);
+      allotment.Reclaim(writer);
+      ++i;
+      continue;
+    }
+    size_t end = i;
+    while (end < entries_.size() && entries_[end].context < kMaxContexts) {
+      ++end;
+    }
+    for (size_t j = end; j > i; --j) {
+      encoder.PutToken(entries_[j - 1].context, entries_[j - 1].value);
+    }
+    encoder.WriteTo(writer);
+    i = end;
+  }
+}
+
+}  // namespace jxl
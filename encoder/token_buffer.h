@@ -0,0 +1,192 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef ENCODER_TOKEN_BUFFER_H_
+#define ENCODER_TOKEN_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "encoder/base/compiler_specific.h"
+#include "encoder/base/status.h"
+#include "encoder/enc_bit_writer.h"
+#include "encoder/entropy_code.h"
+#include "encoder/histogram.h"
+#include "encoder/token.h"
+
+namespace jxl {
+
+// Compact buffer of the tokens and raw bits of a section, collected while the
+// entropy code is not yet known. Tokens are stored with their context already
+// mapped by the context map of the entropy code. The raw bits interface is the
+// same as that of BitWriter, so that the section writers work with both.
+class TokenBuffer {
+ public:
+  // Allotments are not needed, the buffer grows as necessary.
+  class Allotment {
+   public:
+    Allotment(TokenBuffer* /* buffer */, size_t /* max_bits */) {}
+    void Reclaim(TokenBuffer* /* buffer */) {}
+  };
+
+  // Largest token value that the buffer can hold.
+  static constexpr uint32_t kMaxValue = (1u << 24) - 1;
+
+  void Reset() {
+    entries_.clear();
+    overflow_ = false;
+  }
+  size_t size() const { return entries_.size(); }
+
+  // Adds a token of the prefix code with index `histo`. A value above
+  // kMaxValue makes AddToHistograms and WriteTo fail.
+  void AddToken(uint8_t histo, uint32_t value) {
+    JXL_DASSERT(histo < kMaxContexts);
+    if (JXL_UNLIKELY(value > kMaxValue)) overflow_ = true;
+    entries_.push_back(Entry{histo, value & kMaxValue});
+  }
+
+  // Adds n_bits raw bits, at most 16 at a time.
+  void Write(size_t n_bits, uint64_t bits) {
+    JXL_DASSERT(n_bits <= 16);
+    entries_.push_back(Entry{static_cast<uint32_t>(kMaxContexts + n_bits),
+                             static_cast<uint32_t>(bits & 0xFFFF)});
+  }
+
+  // Adds the tokens and raw bits of `other` after those of this buffer.
+  void Append(const TokenBuffer& other) {
+    entries_.insert(entries_.end(), other.entries_.begin(),
+                    other.entries_.end());
+    overflow_ |= other.overflow_;
+  }
+
+  // Adds the symbols of the tokens to the histograms of their prefix codes.
+  Status AddToHistograms(std::vector<Histogram>* histograms) const;
+
+  // Writes the tokens with the prefix codes of `code`, or with its ANS
+  // distributions if it has them, and the raw bits.
+  Status WriteTo(const EntropyCode& code, BitWriter* writer) const;
+
+ private:
+  // Each run of tokens between raw bits is a separate ANS stream.
+  void WriteANSTo(const EntropyCode& code, BitWriter* writer) const;
+
+  struct Entry {
+    uint32_t context : 8;  // prefix code index, or kMaxContexts + n_bits
+    uint32_t value : 24;
+  };
+  static_assert(sizeof(Entry) == 4, "Entry must be packed into 32 bits");
+  std::vector<Entry> entries_;
+  // Whether a token value did not fit in Entry::value.
+  bool overflow_ = false;
+};
+
+static inline void WriteToken(const Token& token, const EntropyCode& code,
+                              TokenBuffer* tokens) {
+  tokens->AddToken(code.context_map[token.context], token.value);
+}
+
+static inline void WriteTokens(const Token* tokens, size_t num,
+                               const EntropyCode& code, TokenBuffer* buffer) {
+  for (size_t i = 0; i < num; ++i) {
+    WriteToken(tokens[i], code, buffer);
+  }
+}
+
+// Section writer that only adds the tokens to the histograms of their prefix
+// codes and drops the raw bits, used to collect the statistics of a frame
+// before its sections are written. With raw_contexts, there is one histogram
+// per context instead, the context map of the code is not used.
+class HistogramCollector {
+ public:
+  class Allotment {
+   public:
+    Allotment(HistogramCollector* /* collector */, size_t /* max_bits */) {}
+    void Reclaim(HistogramCollector* /* collector */) {}
+  };
+
+  explicit HistogramCollector(size_t num_histograms, bool raw_contexts = false)
+      : histograms(num_histograms), raw_contexts(raw_contexts) {}
+
+  void AddToken(uint32_t histo, uint32_t value) {
+    JXL_DASSERT(histo < histograms.size());
+    uint32_t tok, nbits, bits;
+    UintCoder().Encode(value, &tok, &nbits, &bits);
+    histograms[histo].Add(tok);
+  }
+
+  void Write(size_t /* n_bits */, uint64_t /* bits */) {}
+
+  std::vector<Histogram> histograms;
+  bool raw_contexts;
+};
+
+static inline void WriteToken(const Token& token, const EntropyCode& code,
+                              HistogramCollector* collector) {
+  collector->AddToken(collector->raw_contexts
+                          ? token.context
+                          : code.context_map[token.context],
+                      token.value);
+}
+
+static inline void WriteTokens(const Token* tokens, size_t num,
+                               const EntropyCode& code,
+                               HistogramCollector* collector) {
+  for (size_t i = 0; i < num; ++i) {
+    WriteToken(tokens[i], code, collector);
+  }
+}
+
+// Section writer that only adds up how many bits the tokens would take with
+// each of a set of alternative codes, whose context maps have the same
+// contexts. The raw bits are the same with all codes and are not counted.
+class CodeCostCollector {
+ public:
+  class Allotment {
+   public:
+    Allotment(CodeCostCollector* /* collector */, size_t /* max_bits */) {}
+    void Reclaim(CodeCostCollector* /* collector */) {}
+  };
+
+  explicit CodeCostCollector(const std::vector<EntropyCode>* codes)
+      : costs(codes->size()), codes_(codes) {}
+
+  void AddToken(uint32_t context, uint32_t value) {
+    uint32_t tok, nbits, bits;
+    UintCoder().Encode(value, &tok, &nbits, &bits);
+    for (size_t i = 0; i < costs.size(); ++i) {
+      const EntropyCode& code = (*codes_)[i];
+      JXL_DASSERT(context < code.num_contexts);
+      costs[i] += code.prefix_codes[code.context_map[context]].depths[tok];
+    }
+  }
+
+  void Write(size_t /* n_bits */, uint64_t /* bits */) {}
+
+  std::vector<size_t> costs;
+
+ private:
+  const std::vector<EntropyCode>* codes_;
+};
+
+static inline void WriteToken(const Token& token, const EntropyCode& code,
+                              CodeCostCollector* collector) {
+  collector->AddToken(token.context, token.value);
+}
+
+static inline void WriteTokens(const Token* tokens, size_t num,
+                               const EntropyCode& code,
+                               CodeCostCollector* collector) {
+  for (size_t i = 0; i < num; ++i) {
+    WriteToken(tokens[i], code, collector);
+  }
+}
+
+}  // namespace jxl
+
+#endif  // ENCODER_TOKEN_BUFFER_H_
@@ -4,17 +4,25 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include "encoder/base/data_parallel.h"
 #include "encoder/base/printf_macros.h"
+#include "encoder/config.h"
+#include "encoder/enc_cluster.h"
 #include "encoder/enc_entropy_code.h"
+#include "encoder/enc_frame.h"
 #include "encoder/enc_huffman_tree.h"
 #include "encoder/entropy_code.h"
+#include "encoder/histogram.h"
+#include "encoder/read_pfm.h"
 #include "encoder/static_entropy_codes.h"
 
 namespace jxl {
@@ -122,17 +130,321 @@ bool GenerateNewPrefixCodes(PrefixCodeType type, size_t new_alphabet_size) {
   return true;
 }
 
+// Static code of one kind of tokens trained on a set of images.
+struct TrainedCode {
+  std::vector<uint8_t> context_map;
+  std::vector<DynamicPrefixCode> prefix_codes;
+};
+
+// Clusters the contexts by their histograms and builds a prefix code for each
+// cluster. Every symbol gets a code, so that the static code can write every
+// token, also those that the training images did not have.
+TrainedCode TrainCode(const std::vector<Histogram>& histograms) {
+  static const int kTreeLimit = 15;
+  TrainedCode code;
+  std::vector<Histogram> clusters(histograms);
+  ClusterHistograms(&clusters, &code.context_map);
+  for (const Histogram& histo : clusters) {
+    std::vector<uint32_t> counts(kAlphabetSize);
+    for (size_t i = 0; i < kAlphabetSize; ++i) {
+      counts[i] = std::max<uint32_t>(1, histo.counts[i]);
+    }
+    DynamicPrefixCode prefix_code;
+    prefix_code.depths.resize(kAlphabetSize);
+    prefix_code.bits.resize(kAlphabetSize);
+    CreateHuffmanTree(&counts[0], kAlphabetSize, kTreeLimit,
+                      &prefix_code.depths[0]);
+    ConvertBitDepthsToSymbols(&prefix_code.depths[0], kAlphabetSize,
+                              &prefix_code.bits[0]);
+    code.prefix_codes.emplace_back(std::move(prefix_code));
+  }
+  return code;
+}
+
+// Returns the number of bits of the tokens of the histograms with the code.
+size_t CodeCost(const std::vector<Histogram>& histograms,
+                const TrainedCode& code) {
+  size_t cost = 0;
+  for (size_t ctx = 0; ctx < histograms.size(); ++ctx) {
+    const DynamicPrefixCode& prefix_code =
+        code.prefix_codes[code.context_map[ctx]];
+    for (size_t i = 0; i < kAlphabetSize; ++i) {
+      cost += static_cast<size_t>(histograms[ctx].counts[i]) *
+              prefix_code.depths[i];
+    }
+  }
+  return cost;
+}
+
+struct ImageHistograms {
+  std::vector<Histogram> dc;
+  std::vector<Histogram> ac;
+};
+
+struct TrainedCodeSet {
+  TrainedCode dc;
+  TrainedCode ac;
+
+  size_t Cost(const ImageHistograms& image) const {
+    return CodeCost(image.dc, dc) + CodeCost(image.ac, ac);
+  }
+};
+
+TrainedCodeSet TrainCodeSet(const std::vector<const ImageHistograms*>& images) {
+  ImageHistograms sum;
+  for (const ImageHistograms* image : images) {
+    sum.dc.resize(image->dc.size());
+    sum.ac.resize(image->ac.size());
+    for (size_t i = 0; i < sum.dc.size(); ++i) {
+      sum.dc[i].AddHistogram(image->dc[i]);
+    }
+    for (size_t i = 0; i < sum.ac.size(); ++i) {
+      sum.ac[i].AddHistogram(image->ac[i]);
+    }
+  }
+  return {TrainCode(sum.dc), TrainCode(sum.ac)};
+}
+
+// Partitions the images into at most `num_sets` classes with a k-means
+// clustering, where the distance of an image from a class is the size of its
+// tokens with the codes trained on the class, and returns the codes of each
+// class.
+std::vector<TrainedCodeSet> TrainCodeSets(
+    const std::vector<ImageHistograms>& images, size_t num_sets) {
+  static const size_t kMaxIterations = 16;
+  // Consecutive images are often similar, so the initial classes are ranges of
+  // the input.
+  std::vector<size_t> assignment(images.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    assignment[i] = i * num_sets / images.size();
+  }
+  std::vector<TrainedCodeSet> sets;
+  for (size_t iter = 0; iter < kMaxIterations; ++iter) {
+    sets.clear();
+    std::vector<size_t> set_of_class(num_sets, num_sets);
+    for (size_t k = 0; k < num_sets; ++k) {
+      std::vector<const ImageHistograms*> members;
+      for (size_t i = 0; i < images.size(); ++i) {
+        if (assignment[i] == k) members.push_back(&images[i]);
+      }
+      if (members.empty()) continue;
+      set_of_class[k] = sets.size();
+      sets.push_back(TrainCodeSet(members));
+    }
+    size_t total_cost = 0;
+    bool changed = false;
+    for (size_t i = 0; i < images.size(); ++i) {
+      size_t best = set_of_class[assignment[i]];
+      size_t best_cost = sets[best].Cost(images[i]);
+      for (size_t j = 0; j < sets.size(); ++j) {
+        size_t cost = sets[j].Cost(images[i]);
+        if (cost < best_cost) {
+          best = j;
+          best_cost = cost;
+        }
+      }
+      total_cost += best_cost;
+      changed |= best != set_of_class[assignment[i]];
+      assignment[i] = best;
+    }
+    fprintf(stderr, "Iteration %" PRIuS ": %" PRIuS " code sets, %" PRIuS
+            " bytes of tokens\n", iter, sets.size(), total_cost / 8);
+    if (!changed) break;
+    num_sets = sets.size();
+  }
+  return sets;
+}
+
+void OutputContextMap(const char* type, const std::vector<uint8_t>& map) {
+  printf("static constexpr uint8_t k%sContextMap[] = {\n", type);
+  for (size_t i = 0; i < map.size(); ++i) {
+    printf("%s%d,%s", i % 16 == 0 ? "    " : " ", map[i],
+           (i % 16 == 15 || i + 1 == map.size()) ? "\n" : "");
+  }
+  printf("};\n");
+}
+
+// Returns the files of `paths`, with each directory replaced by the .pfm
+// files in it, in name order.
+std::vector<std::string> ListInputFiles(
+    const std::vector<const char*>& paths) {
+  std::vector<std::string> files;
+  for (const char* path : paths) {
+    DIR* dir = opendir(path);
+    if (dir == nullptr) {
+      files.emplace_back(path);
+      continue;
+    }
+    std::vector<std::string> dir_files;
+    while (const struct dirent* entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".pfm") == 0) {
+        dir_files.push_back(std::string(path) + "/" + name);
+      }
+    }
+    closedir(dir);
+    std::sort(dir_files.begin(), dir_files.end());
+    files.insert(files.end(), dir_files.begin(), dir_files.end());
+  }
+  return files;
+}
+
+// Tokenizes the images of the corpus. With a single set, only the sum of their
+// histograms is kept, so that the size of the corpus is not limited by the
+// memory of the per-image histograms.
+bool TokenizeCorpus(const std::vector<std::string>& files, float distance,
+                    bool keep_images, std::vector<ImageHistograms>* images) {
+  const EncoderOptions options;
+  ThreadPool pool;
+  for (size_t i = 0; i < files.size(); ++i) {
+    MappedPFM pfm;
+    if (!pfm.Open(files[i].c_str())) {
+      fprintf(stderr, "Could not read %s\n", files[i].c_str());
+      return false;
+    }
+    if (keep_images || images->empty()) images->emplace_back();
+    ImageHistograms* image = &images->back();
+    if (!CollectContextHistograms(distance, options, pfm.image(), &pool,
+                                  &image->dc, &image->ac)) {
+      fprintf(stderr, "Could not tokenize %s\n", files[i].c_str());
+      return false;
+    }
+    fprintf(stderr, "Tokenized %" PRIuS "/%" PRIuS ": %s\n", i + 1,
+            files.size(), files[i].c_str());
+  }
+  return !images->empty();
+}
+
+void OutputIndexedContextMap(const char* name, const uint8_t* map,
+                             size_t size) {
+  OutputContextMap(name, std::vector<uint8_t>(map, map + size));
+}
+
+// Prints the tables of the code sets and kStaticCodeSets. The first set
+// replaces the current kDCContextMap, kDCPrefixCodes, kACContextMap and
+// kACPrefixCodes.
+void OutputCodeSets(const std::vector<TrainedCodeSet>& sets) {
+  std::vector<std::string> names;
+  for (size_t k = 0; k < sets.size(); ++k) {
+    const std::string suffix = k == 0 ? "" : std::to_string(k);
+    const std::string dc_name = "DC" + suffix;
+    const std::string ac_name = "AC" + suffix;
+    OutputContextMap(dc_name.c_str(), sets[k].dc.context_map);
+    OutputCodes(dc_name.c_str(), sets[k].dc.prefix_codes);
+    OutputContextMap(ac_name.c_str(), sets[k].ac.context_map);
+    OutputCodes(ac_name.c_str(), sets[k].ac.prefix_codes);
+    names.push_back(suffix);
+  }
+  printf("\n// Sets of static codes that are trained on different kinds of "
+         "images, see\n// EncoderOptions::select_static_code. The first one "
+         "is the default.\n"
+         "struct StaticCodeSet {\n"
+         "  const uint8_t* dc_context_map;\n"
+         "  const PrefixCode* dc_prefix_codes;\n"
+         "  size_t num_dc_prefix_codes;\n"
+         "  const uint8_t* ac_context_map;\n"
+         "  const PrefixCode* ac_prefix_codes;\n"
+         "  size_t num_ac_prefix_codes;\n"
+         "};\n");
+  printf("static constexpr size_t kNumStaticCodeSets = %" PRIuS ";\n",
+         sets.size());
+  printf("static constexpr StaticCodeSet "
+         "kStaticCodeSets[kNumStaticCodeSets] = {\n");
+  for (const std::string& n : names) {
+    printf("    {kDC%sContextMap, kDC%sPrefixCodes, kNumDC%sPrefixCodes,\n"
+           "     kAC%sContextMap, kAC%sPrefixCodes, kNumAC%sPrefixCodes},\n",
+           n.c_str(), n.c_str(), n.c_str(), n.c_str(), n.c_str(), n.c_str());
+  }
+  printf("};\n");
+}
+
+// Prints a complete static_entropy_codes.h with the code sets. The initial
+// context maps of the optimized codes are kept.
+void OutputHeader(const std::vector<TrainedCodeSet>& sets) {
+  printf("// Copyright (c) the JPEG XL Project Authors.\n"
+         "//\n"
+         "// Use of this source code is governed by a BSD-style\n"
+         "// license that can be found in the LICENSE file or at\n"
+         "// https://developers.google.com/open-source/licenses/bsd\n\n"
+         "// Generated by update_static_entropy_codes train.\n\n"
+         "#ifndef ENCODER_STATIC_ENTROPY_CODES_H_\n"
+         "#define ENCODER_STATIC_ENTROPY_CODES_H_\n\n"
+         "#include <stddef.h>\n"
+         "#include <stdint.h>\n\n"
+         "#include \"encoder/entropy_code.h\"\n\n"
+         "namespace jxl {\n\n"
+         "// Initial context maps of the codes that are optimized for each "
+         "frame, with\n// one prefix code per cluster of contexts. The prefix "
+         "codes themselves are\n// computed from the histograms of the "
+         "frame.\n");
+  printf("static constexpr size_t kNumOptimizedDCPrefixCodes = %" PRIuS
+         ";\n", kNumOptimizedDCPrefixCodes);
+  OutputIndexedContextMap("OptimizedDC", kOptimizedDCContextMap,
+                          sets[0].dc.context_map.size());
+  printf("static constexpr size_t kNumOptimizedACPrefixCodes = %" PRIuS
+         ";\n", kNumOptimizedACPrefixCodes);
+  OutputIndexedContextMap("OptimizedAC", kOptimizedACContextMap,
+                          sets[0].ac.context_map.size());
+  printf("\n// Static codes that are used when the codes are not "
+         "optimized.\n");
+  OutputCodeSets(sets);
+  printf("\n}  // namespace jxl\n\n"
+         "#endif  // ENCODER_STATIC_ENTROPY_CODES_H_\n");
+}
+
+// Trains up to `num_sets` static code sets on the PFM images of `paths`, and
+// prints either their tables or a whole new static_entropy_codes.h to stdout.
+bool TrainStaticCodeSets(size_t num_sets, float distance, bool full_header,
+                         const std::vector<const char*>& paths) {
+  const std::vector<std::string> files = ListInputFiles(paths);
+  std::vector<ImageHistograms> images;
+  if (!TokenizeCorpus(files, distance, num_sets > 1, &images)) return false;
+  const std::vector<TrainedCodeSet> sets = TrainCodeSets(images, num_sets);
+  if (full_header) {
+    OutputHeader(sets);
+  } else {
+    OutputCodeSets(sets);
+  }
+  return true;
+}
+
 }  // namespace jxl
 
 void PrintHelp(char* arg0) {
   fprintf(stderr,
-          "Usage: %s <type> <new alphabet size>\n\n"
+          "Usage: %s <type> <new alphabet size>\n"
+          "       %s train [--header] <num sets> <distance> <path>...\n\n"
           "Prints the updated entropy codes of the given type to stdout.\n"
-          "  <type> can be either 'DC' or 'AC'\n",
-          arg0);
+          "  <type> can be either 'DC' or 'AC'\n\n"
+          "With 'train', prints up to <num sets> sets of static codes trained "
+          "on the\n.pfm files in linear SRGB colorspace to stdout. Each "
+          "<path> is a .pfm file or\na directory of them. With --header, "
+          "prints a whole static_entropy_codes.h.\n",
+          arg0, arg0);
 };
 
 int main(int argc, char** argv) {
+  if (argc >= 2 && strcmp(argv[1], "train") == 0) {
+    int arg = 2;
+    const bool full_header = arg < argc && strcmp(argv[arg], "--header") == 0;
+    if (full_header) ++arg;
+    if (argc < arg + 3) {
+      PrintHelp(argv[0]);
+      return EXIT_FAILURE;
+    }
+    long num_sets = strtol(argv[arg], nullptr, 10);
+    float distance = static_cast<float>(strtod(argv[arg + 1], nullptr));
+    if (num_sets < 1 || distance <= 0.0f) {
+      PrintHelp(argv[0]);
+      return EXIT_FAILURE;
+    }
+    std::vector<const char*> paths(argv + arg + 2, argv + argc);
+    if (!jxl::TrainStaticCodeSets(num_sets, distance, full_header, paths)) {
+      fprintf(stderr, "Failed to train static codes\n");
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
   if (argc != 3) {
     PrintHelp(argv[0]);
     return EXIT_FAILURE;